@@ -23,6 +23,27 @@ LOCAL_SRC_FILES := \
     backstore.c \
     themes.c \
     format.c \
+    tw_sink.c \
+    tw_archive.c \
+    tw_extract.c \
+    tw_compress.c \
+    tw_lz4.c \
+    tw_digest.c \
+    tw_sparse.c \
+    tw_chunk.c \
+    tw_delta.c \
+    tw_remove.c \
+    tw_usage.c \
+    tw_progress.c \
+    tw_index.c \
+    tw_verify.c \
+    tw_segment.c \
+    tw_estimate.c \
+    tw_event.c \
+    tw_io.c \
+    tw_checkpoint.c \
+    tw_mtd.c \
+    tw_catalog.c \
     data.cpp
 
 ifeq ($(TARGET_RECOVERY_REBOOT_SRC),)
@@ -74,7 +95,7 @@ LOCAL_SHARED_LIBRARIES :=
 LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt libstlport_static
 LOCAL_STATIC_LIBRARIES += libminui libpixelflinger_static libpng
 
-LOCAL_SHARED_LIBRARIES += libjpeg libz libmtdutils libc libcutils libstdc++
+LOCAL_SHARED_LIBRARIES += libjpeg libz libmtdutils libc libm libcutils libstdc++
 
 ifeq ($(TARGET_RECOVERY_UI_LIB),)
   LOCAL_SRC_FILES += default_recovery_ui.c
@@ -22,6 +22,9 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <time.h>
 #include <sys/vfs.h>
 #include <sys/mount.h>
@@ -33,6 +36,25 @@
 #include "roots.h"
 #include "format.h"
 #include "data.h"
+#include "tw_archive.h"
+#include "tw_compress.h"
+#include "tw_digest.h"
+#include "tw_sparse.h"
+#include "tw_chunk.h"
+#include "tw_delta.h"
+#include "tw_extract.h"
+#include "tw_index.h"
+#include "tw_remove.h"
+#include "tw_progress.h"
+#include "tw_verify.h"
+#include "tw_segment.h"
+#include "tw_io.h"
+#include "tw_estimate.h"
+#include "tw_usage.h"
+#include "tw_event.h"
+#include "tw_checkpoint.h"
+#include "tw_catalog.h"
+#include "tw_mtd.h"
 
 int getWordFromString(int word, const char* string, char* buffer, int bufferLen)
 {
@@ -133,6 +155,7 @@ nandroid_menu()
 #define ITEM_NAN_ANDSEC     9
 #define ITEM_NAN_SDEXT      10
 #define ITEM_NAN_COMPRESS   11
+#define ITEM_NAN_VERIFY     11      // same slot as compress, on the restore menu
 #define ITEM_NAN_BACK       12
 
 char* nan_compress()
@@ -269,16 +292,33 @@ set_restore_files()
     int tw_restore_sp2 = -1;
     int tw_restore_sp3 = -1;
 
-    DIR* d;
-    d = opendir(nan_dir);
-    if (d == NULL)
+    // The files of the backup come from the catalog of the device folder it's in
+    char device_dir[512];
+    char* folder;
+    TwCatalog catalog;
+    const TwCatalogBackup* backup = NULL;
+    int i;
+
+    strcpy(device_dir, nan_dir);
+    while (strlen(device_dir) > 1 && device_dir[strlen(device_dir) - 1] == '/')
+        device_dir[strlen(device_dir) - 1] = '\0';
+    folder = strrchr(device_dir, '/');
+    if (folder)
+    {
+        *folder++ = '\0';
+        if (tw_catalog_open(device_dir, &catalog) == 0)
+        {
+            backup = tw_catalog_find(&catalog, folder);
+            if (!backup)    tw_catalog_free(&catalog);
+        }
+    }
+    if (backup == NULL)
     {
         LOGE("error opening %s\n", nan_dir);
         return;
     }
 
-    struct dirent* de;
-    while ((de = readdir(d)) != NULL)
+    for (i = 0; i < backup->count; i++)
     {
         // Strip off three components
         char str[256];
@@ -288,7 +328,7 @@ set_restore_files()
         char* ptr;
         struct dInfo* dev = NULL;
 
-        strcpy(str, de->d_name);
+        strcpy(str, backup->files[i].name);
         label = str;
         ptr = label;
         while (*ptr && *ptr != '.')     ptr++;
@@ -315,7 +355,7 @@ set_restore_files()
             continue;
         }
 
-        strncpy(dev->fnm, de->d_name, 256);
+        strncpy(dev->fnm, backup->files[i].name, 256);
         dev->fnm[255] = '\0';
 
         // Now, we just need to find the correct label
@@ -330,7 +370,7 @@ set_restore_files()
         if (dev == &sp3)        tw_restore_sp3 = 1;
         if (dev == &ase)        tw_restore_andsec = 1;
     }
-    closedir(d);
+    tw_catalog_free(&catalog);
 
     // Set the final values
     DataManager_SetIntValue(TW_RESTORE_SYSTEM_VAR, tw_restore_system);
@@ -365,6 +405,7 @@ nan_restore_menu(int pIdx)
                             nan_img_set(ITEM_NAN_SP3,1),
 			 	 	 	 	nan_img_set(ITEM_NAN_ANDSEC,1),
 			 	 	 	 	nan_img_set(ITEM_NAN_SDEXT,1),
+                            "--> Verify Backup",
 							"<-- Back To Nandroid Menu",
 							 NULL };
 
@@ -436,7 +477,10 @@ nan_restore_menu(int pIdx)
             if (DataManager_GetIntValue(TW_RESTORE_SDEXT_VAR) >= 0)
                 DataManager_ToggleIntValue(TW_RESTORE_SDEXT_VAR);
 			break;
-		case ITEM_NAN_BACK - 1:
+		case ITEM_NAN_VERIFY:
+            nandroid_verify_exe();
+            break;
+		case ITEM_NAN_BACK:
         	dec_menu_loc();
 			return;
 		}
@@ -630,6 +674,7 @@ int tw_unmount(struct dInfo uMnt)
     if (!tw_isMounted(uMnt))    return 0;
 
     sprintf(target, "/%s", uMnt.mnt);
+    ensure_settings_flushed(target);
     if (umount(target) != 0)
     {
         LOGE("Unable to unmount %s\n", target);
@@ -638,718 +683,2625 @@ int tw_unmount(struct dInfo uMnt)
 	return ret;
 }
 
-/* New backup function
-** Condensed all partitions into one function
+// Read size used when copying emmc partitions into an image
+#define IMAGE_COPY_SIZE     (1024 * 1024)
+
+// Bytes fed through the compressor and the time it took, for this backup run
+static unsigned long long comp_bytes;
+static unsigned long comp_msec;
+
+// Upper bound for the tw_backup_jobs setting
+#define MAX_BACKUP_JOBS     4
+
+enum backupJobState { JOB_WAITING, JOB_RUNNING, JOB_DONE, JOB_FINISHED };
+
+/* One partition of a backup run. The backup itself runs on a thread of its own,
+** everything touching mounts, DataManager or the summary output stays on the
+** thread running the scheduler.
+*/
+struct backupJob {
+    struct dInfo mnt;
+    const char* dir;
+    char image[50];
+    char mount[50];
+    char upper[20];
+    char lane[32];              // physical device the partition lives on
+    unsigned long long size;
+    unsigned long long need;    // space the backup is expected to take on the sdcard
+    float weight;               // share of the estimated time of the whole run
+    unsigned long est_time;     // msec, from the throughput history
+    char rate_key[40];          // "partition.kind" in the throughput history
+
+    // Settings are read up front, DataManager can't be used from the job threads
+    TwCodec codec;
+    TwDigestType digest_type;   // TW_DIGEST_NONE when it's skipped
+    int sparse;
+    unsigned long long sparse_skipped;
+    int incremental;
+    char store[255];
+    TwChunkStats chunk_stats;
+    int blockmap;               // keeps a block map, so the next backup can be a delta
+    TwDeltaInfo delta;          // base of a differential image, delta.base is empty for a full one
+    TwBlockMap base_map;
+    unsigned long long delta_blocks;
+    TwIndexWriter* index;       // members of a file system backup, while it's written
+    unsigned long long segment_size;    // file system backups are split in segments of this size, 0 for one file
+    TwSegmentStats segments;
+    TwCheckpoint* checkpoint;   // of the whole run, NULL if it couldn't be written
+    const TwCheckpointEntry* resume;    // what an interrupted run left of the file, NULL to start it over
+    char mode[64];              // the way it's written, a resumed file has to be written the same way
+    unsigned char digest[TW_DIGEST_MAX_SIZE];
+
+    enum backupJobState state;
+    volatile unsigned long long done_bytes;
+    unsigned long long files;
+    TwCompressStats stats;
+    struct timeval start;
+    unsigned long msec;
+    int result;
+    pthread_t thread;
+    TwIoJob* io;                // of the whole run, shared by every job in it
+};
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+/* Starts the I/O job of a backup or restore run, as the settings have it,
+** and moves the calling thread into its class. Returns what to hand to
+** tw_stop_io.
 */
-int tw_backup(struct dInfo bMnt, const char *bDir)
+static int tw_start_io(TwIoJob* io)
 {
-    // set compression or not
-	char bTarArg[32];
-	if (DataManager_GetIntValue(TW_USE_COMPRESSION_VAR)) {
-		strcpy(bTarArg,"-czv");
-	} else {
-		strcpy(bTarArg,"-cv");
-	}
-    FILE *bFp;
+    int limit = DataManager_GetIntValue(TW_IO_LIMIT_VAR);
 
-#ifdef RECOVERY_SDCARD_ON_DATA
-    strcat(bTarArg, " -X /tmp/excludes.lst");
+    tw_io_job_begin(io, DataManager_GetIntValue(TW_IO_PRIORITY_VAR), limit > 0 ? (unsigned long) limit * 1024 * 1024 : 0);
+    if (limit > 0)  ui_print(" * Holding I/O to %d MB/sec.\n", limit);
+    return tw_io_enter(io);
+}
 
-    bFp = fopen("/tmp/excludes.lst", "wt");
-    if (bFp)
-    {
-        fprintf(bFp, "/data/media\n");
-        fprintf(bFp, "./media\n");
-        fprintf(bFp, "media\n");
-        fclose(bFp);
-    }
-#endif
+static void tw_stop_io(TwIoJob* io, int prio)
+{
+    tw_io_leave(prio);
+    tw_io_job_end(io);
 
-    char str[512];
-	unsigned long long bPartSize;
-	char *bImage = malloc(sizeof(char)*50);
-	char *bMount = malloc(sizeof(char)*50);
-	char *bCommand = malloc(sizeof(char)*255);
+    // Nothing is paused any more, the GUI mustn't say otherwise
+    if (DataManager_GetIntValue(TW_OPERATION_PAUSED_VAR))
+        DataManager_SetIntValue(TW_OPERATION_PAUSED_VAR, 0);
+}
 
-    if (bMnt.backup == files)
-    {
-        // detect mountable partitions
-		if (strcmp(bMnt.mnt,".android_secure") == 0) { // if it's android secure, add sdcard to prefix
-			strcpy(bMount,"/sdcard/");
-			strcat(bMount,bMnt.mnt);
-			sprintf(bImage,"and-sec.%s.win",bMnt.fst); // set image name based on filesystem, should always be vfat for android_secure
-		} else {
-			strcpy(bMount,"/");
-			strcat(bMount,bMnt.mnt);
-			sprintf(bImage,"%s.%s.win",bMnt.mnt,bMnt.fst); // anything else that is mountable, will be partition.filesystem.win
-            SetDataState("Mounting", bMnt.mnt, 0, 0);
-			if (tw_mount(bMnt))
-            {
-				ui_print("-- Could not mount: %s\n-- Aborting.\n",bMount);
-				free(bCommand);
-				free(bMount);
-				free(bImage);
-				return 1;
-			}
-		}
-		bPartSize = bMnt.used;
-		sprintf(bCommand,"cd %s && tar %s -f %s%s ./*",bMount,bTarArg,bDir,bImage); // form backup command
-	} else if (bMnt.backup == image) {
-		strcpy(bMount,bMnt.mnt);
-		bPartSize = bMnt.sze;
-		sprintf(bImage,"%s.%s.win",bMnt.mnt,bMnt.fst); // non-mountable partitions such as boot/sp1/recovery
-		if (strcmp(bMnt.fst,"mtd") == 0) {
-			sprintf(bCommand,"dump_image %s %s%s",bMnt.mnt,bDir,bImage); // if it's mtd, we use dump image
-		} else {
-			sprintf(bCommand,"dd bs=%s if=%s of=%s%s",bs_size,bMnt.blk,bDir,bImage); // if it's emmc, use dd
-		}
-		ui_print("\n");
-	}
-    else
-    {
-        LOGE("Unknown backup method for mount %s\n", bMnt.mnt);
-        return 1;
-    }
+static void tw_backup_progress(unsigned long long bytes, void* cookie)
+{
+    struct backupJob* job = (struct backupJob*) cookie;
 
-	LOGI("=> Filename: %s\n",bImage);
-	LOGI("=> Size of %s is %lu KB.\n\n", bMount, (unsigned long) (bPartSize / 1024));
-	int i;
-	char bUppr[20];
-	strcpy(bUppr,bMnt.mnt);
-	for (i = 0; i < (int) strlen(bUppr); i++) { // make uppercase of mount name
-		bUppr[i] = toupper(bUppr[i]);
-	}
-	ui_print("[%s (%lu MB)]\n", bUppr, (unsigned long) (bPartSize / (1024 * 1024))); // show size in MB
-
-    SetDataState("Backup", bMnt.mnt, 0, 0);
-	int bProgTime;
-	time_t bStart, bStop;
-	char bOutput[1024];
-
-    time(&bStart); // start timer
-    ui_print("...Backing up %s partition.\n",bMount);
-    bFp = __popen(bCommand, "r"); // sending backup command formed earlier above
-    if(DataManager_GetIntValue(TW_SHOW_SPAM_VAR) == 2) { // if twrp spam is on, show all lines
-        while (fgets(bOutput,sizeof(bOutput),bFp) != NULL) {
-            ui_print_overwrite("%s",bOutput);
-        }
-    } else { // else just show single line
-        while (fscanf(bFp,"%s",bOutput) == 1) {
-            if(DataManager_GetIntValue(TW_SHOW_SPAM_VAR) == 1) ui_print_overwrite("%s",bOutput);
-        }
-    }
-    ui_print_overwrite(" * Done.\n");
-    __pclose(bFp);
+    job->done_bytes = bytes;
+}
 
-    ui_print(" * Verifying backup size.\n");
-    SetDataState("Verifying", bMnt.mnt, 0, 0);
+// The screen shows the latest file now and then, the backup never waits for it
+static void tw_backup_file(const char* name, void* cookie)
+{
+    struct backupJob* job = (struct backupJob*) cookie;
 
-    sprintf(bCommand, "%s%s", bDir, bImage);
-    struct stat st;
-    if (stat(bCommand, &st) != 0 || st.st_size == 0)
-    {
-        ui_print("E: File size is zero bytes. Aborting...\n\n"); // oh noes! file size is 0, abort! abort!
-        tw_unmount(bMnt);
-        free(bCommand);
-        free(bMount);
-        free(bImage);
-        return 1;
-    }
+    tw_event_publish(name, job->done_bytes, ++job->files);
+}
 
-    ui_print(" * File size: %llu bytes.\n", st.st_size); // file size
+static void tw_backup_member(const TwArchiveMember* member, void* cookie)
+{
+    struct backupJob* job = (struct backupJob*) cookie;
 
-    // Only verify image sizes
-    if (bMnt.backup == image)
+    tw_index_add_member(member, job->index);
+}
+
+static void tw_backup_segment(int index, const TwSegmentInfo* info, void* cookie)
+{
+    struct backupJob* job = (struct backupJob*) cookie;
+
+    tw_checkpoint_segment(job->checkpoint, job->image, index, info);
+}
+
+/* Opens bDir/bImage for writing. Unless type is TW_DIGEST_NONE, the digest of
+** everything that lands in the file is computed on the way and stored in
+** digest on close.
+*/
+static TwSink* tw_backup_open(const char* filename, TwDigestType type, unsigned char* digest)
+{
+    TwSink* file;
+    TwSink* out;
+
+    file = tw_file_sink_open(filename);
+    if (!file || type == TW_DIGEST_NONE)    return file;
+
+    out = tw_digest_sink_open(file, type, digest);
+    if (!out)
     {
-        LOGI(" * Expected size: %llu Got: %lld\n", bMnt.sze, st.st_size);
-        if (bMnt.sze != (unsigned long long) st.st_size)
-        {
-            ui_print("E: File size is incorrect. Aborting.\n\n"); // they dont :(
-            free(bCommand);
-            free(bMount);
-            free(bImage);
-            return 1;
-        }
+        LOGE("Unable to start %s for %s\n", tw_digest_name(type), filename);
+        tw_sink_close(file);
     }
+    return out;
+}
 
-    ui_print(" * Generating md5...\n");
-    SetDataState("Generating MD5", bMnt.mnt, 0, 0);
-    makeMD5(bDir, bImage); // make md5 file
-    time(&bStop); // stop timer
-    ui_print("[%s DONE (%d SECONDS)]\n\n",bUppr,(int)difftime(bStop,bStart)); // done, finally. How long did it take?
-    tw_unmount(bMnt); // unmount partition we just restored to (if it's not a mountable partition, it will just bypass)
+#ifdef RECOVERY_SDCARD_ON_DATA
+static const char* dataExcludes[] = { "media", NULL };
+#endif
 
-    free(bCommand);
-	free(bMount);
-	free(bImage);
-	return 0;
+// Folders of the partition that stay out of its backup
+static const char** tw_backup_excludes(const struct backupJob* job)
+{
+#ifdef RECOVERY_SDCARD_ON_DATA
+    // The sdcard lives in /data/media, it must not end up in the data backup
+    if (strcmp(job->mnt.mnt, "data") == 0)     return dataExcludes;
+#else
+    (void) job;
+#endif
+    return NULL;
 }
 
-unsigned long long get_backup_size(struct dInfo* mnt)
+/* Archives a mounted file system into bDir/bImage with the built-in tar writer
+*/
+static int tw_backup_files(struct backupJob* job)
 {
-    if (!mnt)
+    TwArchiveOptions opts;
+    TwIndexWriter* index = NULL;
+    TwSink* out;
+    TwSink* file;
+    TwSink* throttled;
+    char filename[512];
+    char indexname[512];
+    int ret;
+
+    sprintf(filename, "%s%s", job->dir, job->image);
+    // A vfat sdcard can't hold a file over 4GB, so the archive goes in segments.
+    // Each one is in the checkpoint once it's on disk, a resumed backup only hashes those again.
+    file = tw_segment_sink_resume(filename, job->segment_size, job->digest_type, job->resume ? &job->resume->segments : NULL,
+                                  job->checkpoint ? tw_backup_segment : NULL, job, &job->segments);
+    if (!file)      return 1;
+
+    // A manifest has no offsets to seek to, anything else gets an index for restoring single folders
+    sprintf(indexname, "%s%s", filename, TW_INDEX_EXT);
+    unlink(indexname);
+    if (!job->incremental)
     {
-        LOGE("Invalid call to get_backup_size with NULL parameter\n");
-        return 0;
+        index = tw_index_open(indexname, job->codec);
+        if (!index)     LOGW("Continuing without an index for %s\n", filename);
     }
 
-    switch (mnt->backup)
+    out = file;
+    if (job->incremental)
     {
-    case files:
-        return mnt->used;
-    case image:
-        return (unsigned long long) mnt->sze;
-    case none:
-        LOGW("Request backup details for partition '%s' which has no backup method.", mnt->mnt);
-        break;
+        // Compressed data would hide the chunks that haven't changed
+        out = tw_chunk_sink_open(file, job->store, &job->chunk_stats);
+        if (!out)
+        {
+            tw_sink_close(file);
+            return 1;
+        }
+    }
+    else if (job->codec != TW_CODEC_NONE)
+    {
+        out = tw_compress_sink_open_indexed(file, job->codec, 6, 0, &job->stats,
+                                            index ? tw_index_add_block : NULL, index);
+        if (!out)
+        {
+            tw_sink_close(file);
+            if (index)  tw_index_close(index, 0);
+            return 1;
+        }
+    }
 
-    default:
-        LOGE("Backup type unknown for partition '%s'\n", mnt->mnt);
-        break;
+    // The cap goes by what's read from the partition, however well it compresses
+    throttled = tw_io_sink_open(out, job->io);
+    if (!throttled)
+    {
+        tw_sink_close(out);
+        if (index)  tw_index_close(index, 0);
+        return 1;
+    }
+    out = throttled;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.root = job->mount;
+    opts.excludes = tw_backup_excludes(job);
+    opts.progress = tw_backup_progress;
+    opts.file_cb = tw_backup_file;
+    if (index)      opts.member_cb = tw_backup_member;
+    opts.cookie = job;
+
+    job->index = index;
+    ret = tw_archive_create(&opts, out);
+    if (tw_sink_close(out) != 0)    ret = -1;
+    // The backup stands without its index, only single folder restores need it
+    if (index && tw_index_close(index, ret == 0) != 0 && ret == 0)
+        LOGW("Unable to write the index for %s\n", filename);
+    job->index = NULL;
+
+    if (ret != 0)
+    {
+        LOGE("Unable to write %s\n", filename);
+        return 1;
     }
     return 0;
 }
 
-int CalculateBackupDetails(int* total_partitions, unsigned long long* total_img_bytes, unsigned long long* total_file_bytes)
+/* Copies an emmc block device into bDir/bImage
+*/
+static int tw_backup_image(struct backupJob* job)
 {
-    *total_partitions = 0;
-
-    if (DataManager_GetIntValue(TW_BACKUP_SYSTEM_VAR) == 1)
+    char filename[512];
+    char mapname[512];
+    char* buffer;
+    TwSink* out;
+    int fd, ret = 0;
+
+    sprintf(filename, "%s%s", job->dir, job->image);
+    fd = open(job->mnt.blk, O_RDONLY);
+    if (fd < 0)
     {
-        *total_partitions = *total_partitions + 1;
-        if (sys.backup == image)    *total_img_bytes += get_backup_size(&sys);
-        else                        *total_file_bytes += get_backup_size(&sys);
+        LOGE("Unable to open %s (errno=%d)\n", job->mnt.blk, errno);
+        return 1;
     }
 
-    if (DataManager_GetIntValue(TW_BACKUP_DATA_VAR) == 1)
+    buffer = malloc(IMAGE_COPY_SIZE);
+    out = buffer ? tw_backup_open(filename, job->digest_type, job->digest) : NULL;
+    if (out && job->delta.base[0])
     {
-        *total_partitions = *total_partitions + 1;
-        if (dat.backup == image)    *total_img_bytes += get_backup_size(&dat);
-        else                        *total_file_bytes += get_backup_size(&dat);
+        TwSink* file = out;
+
+        // A delta takes the place of the sparse and chunked forms, unchanged blocks are left out already
+        sprintf(mapname, "%s%s", filename, TW_BLOCKMAP_EXT);
+        out = tw_delta_sink_open(file, mapname, &job->base_map, &job->delta, &job->delta_blocks);
+        if (!out)   tw_sink_close(file);
     }
-    if (DataManager_GetIntValue(TW_BACKUP_CACHE_VAR) == 1)
+    if (out && job->incremental)
     {
-        *total_partitions = *total_partitions + 1;
-        if (cac.backup == image)    *total_img_bytes += get_backup_size(&cac);
-        else                        *total_file_bytes += get_backup_size(&cac);
+        TwSink* file = out;
+
+        out = tw_chunk_sink_open(file, job->store, &job->chunk_stats);
+        if (!out)   tw_sink_close(file);
     }
-    if (DataManager_GetIntValue(TW_BACKUP_RECOVERY_VAR) == 1)
+    if (out && job->sparse)
     {
-        *total_partitions = *total_partitions + 1;
-        if (rec.backup == image)    *total_img_bytes += get_backup_size(&rec);
-        else                        *total_file_bytes += get_backup_size(&rec);
+        TwSink* file = out;
+
+        out = tw_sparse_sink_open(file, job->mnt.sze, &job->sparse_skipped);
+        if (!out)   tw_sink_close(file);
     }
-    if (DataManager_GetIntValue(TW_BACKUP_SP1_VAR) == 1)
+    if (out && job->blockmap && !job->delta.base[0])
     {
-        *total_partitions = *total_partitions + 1;
-        if (sp1.backup == image)    *total_img_bytes += get_backup_size(&sp1);
-        else                        *total_file_bytes += get_backup_size(&sp1);
+        TwSink* file = out;
+
+        sprintf(mapname, "%s%s", filename, TW_BLOCKMAP_EXT);
+        out = tw_blockmap_sink_open(file, mapname);
+        if (!out)   tw_sink_close(file);
     }
-    if (DataManager_GetIntValue(TW_BACKUP_SP2_VAR) == 1)
+    if (!out)
     {
-        *total_partitions = *total_partitions + 1;
-        if (sp2.backup == image)    *total_img_bytes += get_backup_size(&sp2);
-        else                        *total_file_bytes += get_backup_size(&sp2);
+        free(buffer);
+        close(fd);
+        return 1;
     }
-    if (DataManager_GetIntValue(TW_BACKUP_SP3_VAR) == 1)
+
+    for (;;)
     {
-        *total_partitions = *total_partitions + 1;
-        if (sp3.backup == image)    *total_img_bytes += get_backup_size(&sp3);
-        else                        *total_file_bytes += get_backup_size(&sp3);
+        ssize_t len = read(fd, buffer, IMAGE_COPY_SIZE);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len < 0)
+        {
+            LOGE("Unable to read %s (errno=%d)\n", job->mnt.blk, errno);
+            ret = -1;
+            break;
+        }
+        if (len == 0)   break;
+
+        tw_io_throttle(job->io, len);
+        if (tw_sink_write(out, buffer, len) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        job->done_bytes += len;
     }
-    if (DataManager_GetIntValue(TW_BACKUP_BOOT_VAR) == 1)
+
+    if (tw_sink_close(out) != 0)    ret = -1;
+    free(buffer);
+    close(fd);
+
+    if (ret != 0)
     {
-        *total_partitions = *total_partitions + 1;
-        if (boo.backup == image)    *total_img_bytes += get_backup_size(&boo);
-        else                        *total_file_bytes += get_backup_size(&boo);
+        LOGE("Unable to write %s\n", filename);
+        return 1;
     }
-    if (DataManager_GetIntValue(TW_BACKUP_ANDSEC_VAR) == 1)
+    return 0;
+}
+
+/* Reads an MTD partition into bDir/bImage. The blocks go through the codec
+** and the digest as they are read, so the image is done in a single pass.
+*/
+static int tw_backup_mtd(struct backupJob* job)
+{
+    char filename[512];
+    TwSink* out;
+    int ret;
+
+    sprintf(filename, "%s%s", job->dir, job->image);
+    out = tw_backup_open(filename, job->digest_type, job->digest);
+    if (out && job->codec != TW_CODEC_NONE)
     {
-        *total_partitions = *total_partitions + 1;
-        if (ase.backup == image)    *total_img_bytes += get_backup_size(&ase);
-        else                        *total_file_bytes += get_backup_size(&ase);
+        TwSink* file = out;
+
+        out = tw_compress_sink_open(file, job->codec, 6, 0, &job->stats);
+        if (!out)   tw_sink_close(file);
     }
-    if (DataManager_GetIntValue(TW_BACKUP_SDEXT_VAR) == 1)
+    if (out)
     {
-        *total_partitions = *total_partitions + 1;
-        if (sde.backup == image)    *total_img_bytes += get_backup_size(&sde);
-        else                        *total_file_bytes += get_backup_size(&sde);
+        TwSink* file = out;
+
+        out = tw_io_sink_open(file, job->io);
+        if (!out)   tw_sink_close(file);
+    }
+    if (!out)       return 1;
+
+    ret = tw_mtd_read(job->mnt.mnt, out, tw_backup_progress, job);
+    if (tw_sink_close(out) != 0)    ret = -1;
+
+    if (ret != 0)
+    {
+        LOGE("Unable to write %s\n", filename);
+        return 1;
     }
     return 0;
 }
 
-int recursive_mkdir(const char* path)
+static void* tw_backup_thread(void* cookie)
 {
-    char pathCpy[512];
-    char wholePath[512];
-    strcpy(pathCpy, path);
-    strcpy(wholePath, "/");
+    struct backupJob* job = (struct backupJob*) cookie;
+    int ret;
 
-    char* tok = strtok(pathCpy, "/");
-    while (tok)
+    // Threads the backup starts inherit the class as well
+    tw_io_enter(job->io);
+    if (job->mnt.backup == files)
     {
-        strcat(wholePath, tok);
-        if (mkdir(wholePath, 0777) && errno != EEXIST)
+        ret = tw_backup_files(job);
+        if (ret != 0 && job->segments.changed)
         {
-            LOGE("Unable to create folder: %s  (errno=%d)\n", wholePath, errno);
-            return -1;
+            // The partition isn't what it was when the backup was interrupted, so it starts over
+            LOGI("%s changed since the interrupted backup, starting it over\n", job->mnt.mnt);
+            free(job->segments.segments);
+            memset(&job->segments, 0, sizeof(job->segments));
+            memset(&job->stats, 0, sizeof(job->stats));
+            memset(&job->chunk_stats, 0, sizeof(job->chunk_stats));
+            job->done_bytes = 0;
+            job->files = 0;
+            job->resume = NULL;
+            tw_checkpoint_start(job->checkpoint, job->image, job->mode);
+            ret = tw_backup_files(job);
         }
-        strcat(wholePath, "/");
+    }
+    else if (strcmp(job->mnt.fst, "mtd") != 0)  ret = tw_backup_image(job);
+    else                                        ret = tw_backup_mtd(job);
+
+    pthread_mutex_lock(&job_lock);
+    job->result = ret;
+    job->msec = tw_msec_since(&job->start);
+    job->state = JOB_DONE;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+    return NULL;
+}
 
-        tok = strtok(NULL, "/");
+/* Works out which physical device a partition lives on, so that jobs
+** reading the same device can be kept from competing with each other.
+*/
+static void tw_backup_lane(const struct dInfo* mnt, char* lane, int laneLen)
+{
+    const char* blk = mnt->blk;
+    const char* name;
+    int len;
+
+    // android_secure is a folder on the sdcard
+    if (strcmp(mnt->mnt, ".android_secure") == 0)   blk = sdcext.blk;
+    if (strcmp(mnt->fst, "mtd") == 0 || strstr(blk, "mtd"))
+    {
+        strcpy(lane, "mtd");
+        return;
+    }
+
+    name = strrchr(blk, '/');
+    name = name ? name + 1 : blk;
+    if (*name == '\0')      name = mnt->mnt;
+    snprintf(lane, laneLen, "%s", name);
+
+    // mmcblk0p12 -> mmcblk0, sda1 -> sda
+    len = strlen(lane);
+    while (len > 0 && isdigit(lane[len - 1]))   len--;
+    if (len > 1 && lane[len - 1] == 'p' && isdigit(lane[len - 2]))  len--;
+    if (len > 0)    lane[len] = '\0';
+}
+
+/* Two jobs reading the same device in the same way only slow each other down.
+** A lane runs one image dump and one file system archive at a time: the dump
+** streams the device while the archive mostly waits on metadata and the compressor.
+** Called with job_lock held, the jobs set their own state when they're done.
+*/
+static int tw_backup_lane_free(struct backupJob* jobs, int count, struct backupJob* job)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (jobs[i].state != JOB_RUNNING)       continue;
+        if (strcmp(jobs[i].lane, job->lane) == 0 && jobs[i].mnt.backup == job->mnt.backup)
+            return 0;
+    }
+    return 1;
+}
+
+/* Reads the digest recorded in the sidecar of a backup file, .md5 or any other kind
+*/
+static int tw_read_digest(const char *rFilename, TwDigest *digest)
+{
+    switch (tw_digest_read(rFilename, digest))
+    {
+    case 0:
+        return 0;
+    case -1:
+        ui_print("....Digest Error: no .md5 or other digest for %s\n", rFilename);
+        return 1;
+    default:
+        ui_print("....Digest Error: invalid digest file for %s\n", rFilename);
+        return 1;
     }
-    if (mkdir(wholePath, 0777) && errno != EEXIST)      return -1;
-    return 0;
 }
 
-int tw_do_backup(const char* enableVar, struct dInfo* mnt, const char* tw_image_dir, unsigned long long img_bytes, unsigned long long file_bytes, unsigned long long* img_bytes_remaining, unsigned long long* file_bytes_remaining, unsigned long* img_byte_time, unsigned long* file_byte_time)
+/* Picks the newest earlier backup of the partition that has a block map and
+** a digest, for a differential image to build on. Chains that have grown too
+** long, or a partition that changed size, get a full image instead.
+*/
+static void tw_backup_find_base(struct backupJob* job)
 {
-    // Check if this partition is being backed up...
-	if (!DataManager_GetIntValue(enableVar))    return 0;
+    char device_dir[255];
+    char current[255];
+    char best[255];
+    char filename[512];
+    unsigned char header[TW_DELTA_HEADER_SIZE];
+    TwDeltaInfo info;
+    TwDigest base;
+    struct dirent* de;
+    struct stat st;
+    char* slash;
+    DIR* d;
+    int fd;
 
-    // Let's calculate the percentage of the bar this section is expected to take
-    unsigned long int img_bps = DataManager_GetIntValue(TW_BACKUP_AVG_IMG_RATE);
-    unsigned long int file_bps;
+    // dir is backup_folder/device_id/timestamp/
+    strcpy(device_dir, job->dir);
+    device_dir[strlen(device_dir) - 1] = '\0';
+    slash = strrchr(device_dir, '/');
+    if (!slash)     return;
+    strcpy(current, slash + 1);
+    *slash = '\0';
 
-    if (DataManager_GetIntValue(TW_USE_COMPRESSION_VAR))    file_bps = DataManager_GetIntValue(TW_BACKUP_AVG_FILE_COMP_RATE);
-    else                                                    file_bps = DataManager_GetIntValue(TW_BACKUP_AVG_FILE_RATE);
+    d = opendir(device_dir);
+    if (!d)         return;
 
-    if (DataManager_GetIntValue(TW_SKIP_MD5_GENERATE_VAR) == 1)
+    best[0] = '\0';
+    while ((de = readdir(d)) != NULL)
+    {
+        // Timestamps sort by name, anything starting with a dot isn't a backup
+        if (de->d_name[0] == '.' || strcmp(de->d_name, current) >= 0)    continue;
+        if (best[0] && strcmp(de->d_name, best) <= 0)                    continue;
+
+        sprintf(filename, "%s/%s/%s%s", device_dir, de->d_name, job->image, TW_BLOCKMAP_EXT);
+        if (stat(filename, &st) != 0)   continue;
+        sprintf(filename, "%s/%s/%s", device_dir, de->d_name, job->image);
+        if (tw_digest_read(filename, &base) != 0)   continue;
+        strcpy(best, de->d_name);
+    }
+    closedir(d);
+    if (!best[0])   return;
+
+    memset(&job->delta, 0, sizeof(job->delta));
+    sprintf(filename, "%s/%s/%s", device_dir, best, job->image);
+    if (tw_digest_read(filename, &base) != 0)     return;
+    memcpy(job->delta.base_digest, base.digest, MD5_DIGEST_SIZE);
+
+    // A delta on top of a delta adds one to the chain
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)     return;
+    if (read(fd, header, sizeof(header)) == sizeof(header) && tw_delta_read_info(header, sizeof(header), &info) == 0)
+        job->delta.depth = info.depth;
+    close(fd);
+    if (++job->delta.depth > TW_DELTA_MAX_CHAIN)
     {
-        // If we're skipping MD5 generation, our BPS is faster by about 1.65
-        file_bps = (unsigned long) (file_bps * 1.65);
-        img_bps = (unsigned long) (img_bps * 1.65);
+        LOGI("=> Delta chain of %s is %d long, making a full image\n", job->image, TW_DELTA_MAX_CHAIN);
+        return;
     }
 
-    // We know the speed for both, how far into the whole backup are we, based on time
-    unsigned long total_time = (img_bytes / img_bps) + (file_bytes / file_bps);
-    unsigned long remain_time = (*img_bytes_remaining / img_bps) + (*file_bytes_remaining / file_bps);
+    sprintf(filename, "%s/%s/%s%s", device_dir, best, job->image, TW_BLOCKMAP_EXT);
+    if (tw_blockmap_load(filename, &job->base_map) != 0)  return;
+    if (job->base_map.total != job->mnt.sze)
+    {
+        LOGI("=> %s changed size since %s, making a full image\n", job->mnt.mnt, best);
+        tw_blockmap_free(&job->base_map);
+        return;
+    }
 
-    float pos = (total_time - remain_time) / (float) total_time;
-    ui_set_progress(pos);
+    job->delta.total = job->mnt.sze;
+    snprintf(job->delta.base, sizeof(job->delta.base), "%s/%s", best, job->image);
+}
 
-    LOGI("Estimated Total time: %lu  Estimated remaining time: %lu\n", total_time, remain_time);
+/* Picks the codec for a file system backup or an MTD image. With
+** compression on, each partition gets tw_compression_codec unless
+** tw_compression_policy names it, as in "data=lz4,.android_secure=none".
+*/
+static TwCodec tw_backup_codec(const struct dInfo* mnt)
+{
+    char policy[256];
+    char* entry;
+    char* save = NULL;
+    int codec;
 
-    // Determine how much we're about to process
-    unsigned long long blocksize = get_backup_size(mnt);
+    if ((mnt->backup != files && strcmp(mnt->fst, "mtd") != 0) || !DataManager_GetIntValue(TW_USE_COMPRESSION_VAR))
+        return TW_CODEC_NONE;
 
-    // And get the time
-    unsigned long section_time;
-    if (mnt->backup == image)       section_time = blocksize / img_bps;
-    else                            section_time = blocksize / file_bps;
+    codec = tw_codec_from_name(DataManager_GetStrValue(TW_COMPRESSION_CODEC_VAR));
+    if (codec < 0)      codec = TW_CODEC_GZIP;
 
-    // Set the position
-    pos = section_time / (float) total_time;
-    ui_show_progress(pos, section_time);
+    strncpy(policy, DataManager_GetStrValue(TW_COMPRESSION_POLICY_VAR), sizeof(policy) - 1);
+    policy[sizeof(policy) - 1] = '\0';
+    for (entry = strtok_r(policy, ",", &save); entry; entry = strtok_r(NULL, ",", &save))
+    {
+        char* value = strchr(entry, '=');
+
+        if (!value)     continue;
+        *value++ = '\0';
+        if (strcmp(entry, mnt->mnt) != 0)   continue;
+        if (tw_codec_from_name(value) >= 0)
+            codec = tw_codec_from_name(value);
+        else
+            LOGW("Unknown codec '%s' for %s in the compression policy\n", value, mnt->mnt);
+    }
+    return (TwCodec) codec;
+}
 
-    time_t start, stop;
-    time(&start);
+/* The digest backups are written with, as the tw_backup_digest setting has it
+*/
+static TwDigestType tw_backup_digest(void)
+{
+    const char* name = DataManager_GetStrValue(TW_BACKUP_DIGEST_VAR);
+    TwDigestType type;
 
-    if (tw_backup(*mnt, tw_image_dir) == 1) { // did the backup process return an error ? 0 = no error
-        SetDataState("Backup failed", mnt->mnt, 1, 1);
-        ui_print("-- Error occured, check recovery.log. Aborting.\n"); //oh noes! abort abort!
-        return 1;
+    if (DataManager_GetIntValue(TW_SKIP_MD5_GENERATE_VAR) == 1)    return TW_DIGEST_NONE;
+    type = tw_digest_type(name);
+    if (type == TW_DIGEST_NONE)
+    {
+        LOGW("Unknown digest '%s', using md5\n", name);
+        type = TW_DIGEST_MD5;
     }
-    time(&stop);
+    return type;
+}
 
-    LOGI("Partition Backup time: %d\n", (int) difftime(stop, start));
+static void tw_backup_job_init(struct backupJob* job, struct dInfo* mnt, const char* dir)
+{
+    int i;
 
-    // Now, decrement out byte counts
-    if (mnt->backup == image)
+    memset(job, 0, sizeof(*job));
+    job->mnt = *mnt;
+    job->dir = dir;
+    job->codec = tw_backup_codec(mnt);
+    // The digest is computed while writing unless we're asked to skip it
+    job->digest_type = tw_backup_digest();
+    // emmc images leave their empty blocks out
+    job->sparse = mnt->backup == image && strcmp(mnt->fst, "mtd") != 0 && DataManager_GetIntValue(TW_USE_SPARSE_IMAGES_VAR);
+    // Incremental backups share chunks with every earlier backup of this device, MTD images are flashed whole
+    job->incremental = DataManager_GetIntValue(TW_USE_INCREMENTAL_VAR) && !(mnt->backup == image && strcmp(mnt->fst, "mtd") == 0);
+    sprintf(job->store, "%s/%s/%s", backup_folder, device_id, TW_CHUNK_STORE);
+
+    if (mnt->backup == files)
     {
-        *img_bytes_remaining -= blocksize;
-        *img_byte_time += (int) difftime(stop, start);
+        // detect mountable partitions
+        if (strcmp(mnt->mnt,".android_secure") == 0) { // if it's android secure, add sdcard to prefix
+            sprintf(job->mount,"/sdcard/%s",mnt->mnt);
+            sprintf(job->image,"and-sec.%s.win",mnt->fst); // set image name based on filesystem, should always be vfat for android_secure
+        } else {
+            sprintf(job->mount,"/%s",mnt->mnt);
+            sprintf(job->image,"%s.%s.win",mnt->mnt,mnt->fst); // anything else that is mountable, will be partition.filesystem.win
+        }
+        job->size = mnt->used;
+        job->segment_size = (unsigned long long) DataManager_GetIntValue(TW_BACKUP_SEGMENT_SIZE_VAR) * 1024 * 1024;
     }
     else
     {
-        *file_bytes_remaining -= blocksize;
-        *file_byte_time += (int) difftime(stop, start);
+        strcpy(job->mount,mnt->mnt);
+        sprintf(job->image,"%s.%s.win",mnt->mnt,mnt->fst); // non-mountable partitions such as boot/sp1/recovery
+        job->size = mnt->sze;
+
+        // Differential images store only the blocks changed since the last backup of the partition
+        job->blockmap = strcmp(mnt->fst, "mtd") != 0 && DataManager_GetIntValue(TW_USE_DIFFERENTIAL_VAR);
+        if (job->blockmap)      tw_backup_find_base(job);
+        if (job->delta.base[0])
+        {
+            job->sparse = 0;
+            job->incremental = 0;
+        }
     }
 
-    return 0;
+    strcpy(job->upper,mnt->mnt);
+    for (i = 0; i < (int) strlen(job->upper); i++) { // make uppercase of mount name
+        job->upper[i] = toupper(job->upper[i]);
+    }
+    tw_backup_lane(mnt, job->lane, sizeof(job->lane));
+
+    // Each way of backing up a partition runs at a speed of its own
+    if (mnt->backup == files)
+        sprintf(job->rate_key, "%s.%s", mnt->mnt, job->incremental ? "chunk" : tw_codec_name(job->codec));
+    else if (job->delta.base[0])    sprintf(job->rate_key, "%s.delta", mnt->mnt);
+    else if (job->sparse)           sprintf(job->rate_key, "%s.sparse", mnt->mnt);
+    else if (job->incremental)      sprintf(job->rate_key, "%s.chunk", mnt->mnt);
+    else if (job->codec != TW_CODEC_NONE)   sprintf(job->rate_key, "%s.%s", mnt->mnt, tw_codec_name(job->codec));
+    else                            sprintf(job->rate_key, "%s.image", mnt->mnt);
+    sprintf(job->mode, "%s:%llu:%s", job->rate_key, job->segment_size, tw_digest_name(job->digest_type));
 }
 
-int
-nandroid_back_exe()
+static int tw_backup_start(struct backupJob* job)
 {
-    SetDataState("Starting", "backup", 0, 0);
+    LOGI("=> Filename: %s, codec %s\n",job->image,tw_codec_name(job->codec));
+    LOGI("=> Size of %s is %lu KB, lane %s.\n\n", job->mount, (unsigned long) (job->size / 1024), job->lane);
+    ui_print("[%s (%lu MB)]\n", job->upper, (unsigned long) (job->size / (1024 * 1024))); // show size in MB
 
-    if (ensure_path_mounted(SDCARD_ROOT) != 0) {
-		ui_print("-- Could not mount: %s.\n-- Aborting.\n",SDCARD_ROOT);
-        SetDataState("Unable to mount", "/sdcard", 1, 1);
-		return 1;
-	}
+    if (job->mnt.backup == files && strcmp(job->mnt.mnt,".android_secure") != 0)
+    {
+        SetDataState("Mounting", job->mnt.mnt, 0, 0);
+        if (tw_mount(job->mnt))
+        {
+            ui_print("-- Could not mount: %s\n-- Aborting.\n",job->mount);
+            return 1;
+        }
+    }
 
-    // Create backup folder
-    struct tm *t;
-    char timestamp[64];
-	char tw_image_dir[255];
-	char exe[255];
-	time_t start, stop;
-	time_t seconds;
-	seconds = time(0);
-    t = localtime(&seconds);
-    sprintf(timestamp,"%04d-%02d-%02d--%02d-%02d-%02d",t->tm_year+1900,t->tm_mon+1,t->tm_mday,t->tm_hour,t->tm_min,t->tm_sec); // make time stamp
-	sprintf(tw_image_dir,"%s/%s/%s/", backup_folder, device_id, timestamp); // for backup folder
+    SetDataState("Backup", job->mnt.mnt, 0, 0);
+    ui_print("...Backing up %s partition.\n",job->mount);
+    if (job->resume)
+        ui_print(" * Going on after %d segments already written.\n", job->resume->segments.count);
+    else if (job->checkpoint)
+        tw_checkpoint_start(job->checkpoint, job->image, job->mode);
 
-    if (recursive_mkdir(tw_image_dir))
+    gettimeofday(&job->start, NULL);
+    job->state = JOB_RUNNING;
+    if (pthread_create(&job->thread, NULL, tw_backup_thread, job) != 0)
     {
-        LOGE("Unable to create folder: '%s'\n", backup_folder);
-        SetDataState("Backup failed", tw_image_dir, 1, 1);
-        return -1;
+        LOGE("Unable to start backup of %s\n", job->mnt.mnt);
+        job->state = JOB_WAITING;
+        tw_unmount(job->mnt);
+        return 1;
     }
+    return 0;
+}
 
-    // Record the start time
-    time(&start);
+/* Writes the digest of every segment of a file system backup, each next to its segment
+*/
+static int tw_backup_segments_digest(struct backupJob* job)
+{
+    char name[512];
+    int i;
+    int ret = 0;
 
-    // Prepare operation
-    ui_print("\n[BACKUP STARTED]\n");
-    ui_print(" * Backup Folder: %s\n", backup_folder);
-    ui_print(" * Verifying filesystems...\n");
-    verifyFst();
-    createFstab();
-    ui_print(" * Verifying partition sizes...\n");
-    updateUsedSized();
-    unsigned long long sdc_free = sdcext.sze - sdcext.used; 
+    for (i = 0; i < job->segments.count; i++)
+    {
+        tw_segment_name(job->image, i, name, sizeof(name));
+        ret |= writeDigest(job->dir, name, job->digest_type, job->segments.segments[i].digest);
+    }
+    return ret;
+}
 
-    // Compute totals
-    int tw_total = 0;
-    unsigned long long total_img_bytes = 0, total_file_bytes = 0;
-    CalculateBackupDetails(&tw_total, &total_img_bytes, &total_file_bytes);
-    unsigned long long total_bytes = total_img_bytes + total_file_bytes;
+/* Checks the output of a job that has run and writes its digest
+*/
+static int tw_backup_finish(struct backupJob* job)
+{
+    char filename[512];
+    struct stat st;
 
-    if (tw_total == 0 || total_bytes == 0)
+    if (job->result != 0)
     {
-        LOGE("Unable to compute target usage (%d partitions, %llu bytes)\n", tw_total, total_bytes);
-        SetDataState("Backup failed", tw_image_dir, 1, 1);
-        return -1;
+        tw_unmount(job->mnt);
+        return 1;
     }
+    ui_print(" * Done with %s.\n", job->mnt.mnt);
 
-    ui_print(" * Total number of partition to back up: %d\n", tw_total);
-    ui_print(" * Total size of all data, in KB: %llu\n", total_bytes / 1024);
-    ui_print(" * Available space on the SD card, in KB: %llu\n", sdc_free / 1024);
+    if (job->stats.msec)
+    {
+        comp_bytes += job->stats.bytes_in;
+        comp_msec += job->stats.msec;
+        LOGI("Compressed %llu bytes to %llu in %lu ms\n", job->stats.bytes_in, job->stats.bytes_out, job->stats.msec);
+    }
+
+    ui_print(" * Verifying backup size of %s.\n", job->mnt.mnt);
+    SetDataState("Verifying", job->mnt.mnt, 0, 0);
 
-    // We can't verify sufficient space on devices where sdcard is a portion of the data partition
-#ifndef RECOVERY_SDCARD_ON_DATA
-    // Verify space
-    if (sdc_free < (total_bytes + 0x2000000))       // We require at least 32MB of additional space
+    sprintf(filename, "%s%s", job->dir, job->image);
+    if (stat(filename, &st) != 0 || st.st_size == 0)
     {
-        LOGE("Insufficient space on SDCARD. Required space is %lluKB, available %lluKB\n", (total_bytes + 0x2000000) / 1024, sdc_free / 1024);
-        SetDataState("Backup failed", tw_image_dir, 1, 1);
-        return -1;
+        ui_print("E: File size is zero bytes. Aborting...\n\n"); // oh noes! file size is 0, abort! abort!
+        tw_unmount(job->mnt);
+        return 1;
     }
-#else
-    ui_print(" * This device does not support verifying available free space.\n");
-#endif
 
-    // Prepare progress bar...
-    unsigned long long img_bytes_remaining = total_img_bytes;
-    unsigned long long file_bytes_remaining = total_file_bytes;
-    unsigned long img_byte_time = 0, file_byte_time = 0;
-	struct stat st;
+    if (job->segments.count > 1)
+        ui_print(" * File size: %llu bytes in %d segments.\n", tw_segments_total(filename), job->segments.count);
+    else
+        ui_print(" * File size: %llu bytes.\n", st.st_size); // file size
+
+    // Only verify image sizes
+    if (job->mnt.backup == image)
+    {
+        // Sparse images, deltas, manifests and compressed MTD images are smaller than the partition, so check what was read instead
+        int mtd = strcmp(job->mnt.fst, "mtd") == 0;
+        unsigned long long got = (job->sparse || job->incremental || job->delta.base[0] || mtd) ? job->done_bytes : (unsigned long long) st.st_size;
+
+        LOGI(" * Expected size: %llu Got: %llu\n", job->mnt.sze, got);
+        // Bad blocks are left out of an MTD image
+        if (mtd && got && got < job->mnt.sze)
+            ui_print(" * Left out %llu KB of bad blocks.\n", (job->mnt.sze - got) / 1024);
+        else if (job->mnt.sze != got)
+        {
+            ui_print("E: File size is incorrect. Aborting.\n\n"); // they dont :(
+            return 1;
+        }
+        if (job->sparse)
+            ui_print(" * Left out %llu MB of empty blocks.\n", job->sparse_skipped / (1024 * 1024));
+    }
+
+    if (job->delta.base[0])
+        ui_print(" * Stored %llu changed blocks on top of %s.\n", job->delta_blocks, job->delta.base);
+    if (job->incremental)
+        ui_print(" * Stored %llu of %llu chunks, %llu MB new.\n", job->chunk_stats.new_chunks, job->chunk_stats.chunks, job->chunk_stats.new_bytes / (1024 * 1024));
+
+    // The digest was computed while writing, it only has to be stored
+    if (job->digest_type != TW_DIGEST_NONE)
+    {
+        ui_print(" * Generating %s...\n", tw_digest_name(job->digest_type));
+        SetDataState("Generating MD5", job->mnt.mnt, 0, 0);
+        if (job->segments.count)    tw_backup_segments_digest(job); // one for each segment
+        else                        writeDigest(job->dir, job->image, job->digest_type, job->digest);
+    }
+    if (job->checkpoint)        tw_checkpoint_done(job->checkpoint, job->image);
+    ui_print("[%s DONE (%lu SECONDS)]\n\n", job->upper, job->msec / 1000); // done, finally. How long did it take?
+    tw_unmount(job->mnt); // unmount partition we just backed up (if it's not a mountable partition, it will just bypass)
+    return 0;
+}
+
+// Overall progress of the run, from each job's share of the estimated time
+static float tw_backup_jobs_progress(struct backupJob* jobs, int count)
+{
+    float pos = 0.0;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        float done;
+
+        if (jobs[i].state == JOB_WAITING)       continue;
+        if (jobs[i].state != JOB_RUNNING)       done = 1.0;
+        else if (jobs[i].done_bytes && jobs[i].size)
+            done = jobs[i].done_bytes / (float) jobs[i].size;
+        else if (jobs[i].est_time)
+            // Nothing read yet, so go by time instead
+            done = tw_msec_since(&jobs[i].start) / (float) jobs[i].est_time;
+        else
+            done = 0.0;
+
+        if (done > 1.0)     done = 1.0;
+        pos += jobs[i].weight * done;
+    }
+    return pos;
+}
+
+/* Seconds left in the run. A running job goes by its own measured speed once
+** it has a second of data behind it, the others by the throughput history.
+*/
+static unsigned long tw_backup_jobs_eta(struct backupJob* jobs, int count, int parallel)
+{
+    unsigned long long total = 0, longest = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        unsigned long long left;
+
+        if (jobs[i].state == JOB_WAITING)
+            left = jobs[i].est_time;
+        else if (jobs[i].state == JOB_RUNNING)
+        {
+            unsigned long long done = jobs[i].done_bytes;
+            unsigned long elapsed = tw_msec_since(&jobs[i].start);
+
+            if (done && done < jobs[i].size && elapsed >= 1000)
+                left = (unsigned long long) elapsed * (jobs[i].size - done) / done;
+            else
+                left = jobs[i].est_time > elapsed ? jobs[i].est_time - elapsed : 0;
+            if (left > longest)     longest = left;
+        }
+        else
+            continue;
+        total += left;
+    }
+
+    // Jobs overlap, but the run can't end before its slowest running job
+    total /= parallel;
+    if (longest > total)    total = longest;
+    return (unsigned long) ((total + 999) / 1000);
+}
+
+static void tw_set_eta(unsigned long seconds)
+{
+    char eta[16];
+
+    tw_eta_format(seconds, eta, sizeof(eta));
+    if (strcmp(eta, DataManager_GetStrValue(TW_OPERATION_ETA_VAR)) != 0)
+        DataManager_SetStrValue(TW_OPERATION_ETA_VAR, eta);
+}
+
+/* Runs the jobs, up to parallel at a time, and keeps the progress bar current.
+** Jobs are started in order, but one that has to wait for its lane doesn't
+** hold back the jobs after it.
+*/
+static int tw_run_backup_jobs(struct backupJob* jobs, int count, int parallel)
+{
+    int running = 0, remaining = 0, failed = 0, i;
+    unsigned long eta;
+    float progress;
+
+    // Partitions a resumed backup has already are finished before it starts
+    for (i = 0; i < count; i++)
+    {
+        if (jobs[i].state != JOB_FINISHED)  remaining++;
+    }
 
+    ui_show_progress(1.0, 0);
     ui_set_progress(0.0);
 
-	// SYSTEM
-    if (tw_do_backup(TW_BACKUP_SYSTEM_VAR, &sys, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))       return 1;
+    while (remaining > 0)
+    {
+        int done = 0;
+
+        // Wrap up finished jobs first, so their digest and unmount never overlap the next start
+        for (i = 0; i < count; i++)
+        {
+            pthread_mutex_lock(&job_lock);
+            done = (jobs[i].state == JOB_DONE);
+            pthread_mutex_unlock(&job_lock);
+            if (!done)      continue;
+
+            pthread_join(jobs[i].thread, NULL);
+            jobs[i].state = JOB_FINISHED;
+            running--;
+            remaining--;
+            if (tw_backup_finish(&jobs[i]) != 0)
+            {
+                SetDataState("Backup failed", jobs[i].mnt.mnt, 1, 1);
+                ui_print("-- Error occured, check recovery.log. Aborting.\n"); //oh noes! abort abort!
+                failed = 1;
+            }
+            free(jobs[i].segments.segments);
+            jobs[i].segments.segments = NULL;
+        }
+
+        // After an error, let the running jobs end but don't start any more
+        for (i = 0; i < count && !failed && running < parallel; i++)
+        {
+            int startable;
+
+            pthread_mutex_lock(&job_lock);
+            startable = jobs[i].state == JOB_WAITING && tw_backup_lane_free(jobs, count, &jobs[i]);
+            pthread_mutex_unlock(&job_lock);
+            if (!startable)     continue;
+
+            if (tw_backup_start(&jobs[i]) != 0)
+            {
+                SetDataState("Backup failed", jobs[i].mnt.mnt, 1, 1);
+                failed = 1;
+                break;
+            }
+            running++;
+        }
+        if (running == 0 && (failed || remaining == 0))
+            break;
+
+        pthread_mutex_lock(&job_lock);
+        progress = tw_backup_jobs_progress(jobs, count);
+        eta = tw_backup_jobs_eta(jobs, count, parallel);
+        pthread_mutex_unlock(&job_lock);
+        ui_set_progress(progress);
+        tw_set_eta(eta);
+
+        // Sleep until a job is done, or it's time to move the progress bar
+        pthread_mutex_lock(&job_lock);
+        for (i = 0; i < count && jobs[i].state != JOB_DONE; i++);
+        if (i == count)
+        {
+            struct timespec ts;
+            struct timeval now;
+
+            gettimeofday(&now, NULL);
+            ts.tv_sec = now.tv_sec;
+            ts.tv_nsec = (now.tv_usec + 100000) * 1000;
+            if (ts.tv_nsec >= 1000000000)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&job_cond, &job_lock, &ts);
+        }
+        pthread_mutex_unlock(&job_lock);
+    }
+    DataManager_SetStrValue(TW_OPERATION_ETA_VAR, "");
+    return failed;
+}
+
+unsigned long long get_backup_size(struct dInfo* mnt)
+{
+    if (!mnt)
+    {
+        LOGE("Invalid call to get_backup_size with NULL parameter\n");
+        return 0;
+    }
+
+    switch (mnt->backup)
+    {
+    case files:
+        return mnt->used;
+    case image:
+        return (unsigned long long) mnt->sze;
+    case none:
+        LOGW("Request backup details for partition '%s' which has no backup method.", mnt->mnt);
+        break;
+
+    default:
+        LOGE("Backup type unknown for partition '%s'\n", mnt->mnt);
+        break;
+    }
+    return 0;
+}
+
+int CalculateBackupDetails(int* total_partitions, unsigned long long* total_img_bytes, unsigned long long* total_file_bytes)
+{
+    *total_partitions = 0;
+
+    if (DataManager_GetIntValue(TW_BACKUP_SYSTEM_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (sys.backup == image)    *total_img_bytes += get_backup_size(&sys);
+        else                        *total_file_bytes += get_backup_size(&sys);
+    }
+
+    if (DataManager_GetIntValue(TW_BACKUP_DATA_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (dat.backup == image)    *total_img_bytes += get_backup_size(&dat);
+        else                        *total_file_bytes += get_backup_size(&dat);
+    }
+    if (DataManager_GetIntValue(TW_BACKUP_CACHE_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (cac.backup == image)    *total_img_bytes += get_backup_size(&cac);
+        else                        *total_file_bytes += get_backup_size(&cac);
+    }
+    if (DataManager_GetIntValue(TW_BACKUP_RECOVERY_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (rec.backup == image)    *total_img_bytes += get_backup_size(&rec);
+        else                        *total_file_bytes += get_backup_size(&rec);
+    }
+    if (DataManager_GetIntValue(TW_BACKUP_SP1_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (sp1.backup == image)    *total_img_bytes += get_backup_size(&sp1);
+        else                        *total_file_bytes += get_backup_size(&sp1);
+    }
+    if (DataManager_GetIntValue(TW_BACKUP_SP2_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (sp2.backup == image)    *total_img_bytes += get_backup_size(&sp2);
+        else                        *total_file_bytes += get_backup_size(&sp2);
+    }
+    if (DataManager_GetIntValue(TW_BACKUP_SP3_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (sp3.backup == image)    *total_img_bytes += get_backup_size(&sp3);
+        else                        *total_file_bytes += get_backup_size(&sp3);
+    }
+    if (DataManager_GetIntValue(TW_BACKUP_BOOT_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (boo.backup == image)    *total_img_bytes += get_backup_size(&boo);
+        else                        *total_file_bytes += get_backup_size(&boo);
+    }
+    if (DataManager_GetIntValue(TW_BACKUP_ANDSEC_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (ase.backup == image)    *total_img_bytes += get_backup_size(&ase);
+        else                        *total_file_bytes += get_backup_size(&ase);
+    }
+    if (DataManager_GetIntValue(TW_BACKUP_SDEXT_VAR) == 1)
+    {
+        *total_partitions = *total_partitions + 1;
+        if (sde.backup == image)    *total_img_bytes += get_backup_size(&sde);
+        else                        *total_file_bytes += get_backup_size(&sde);
+    }
+    return 0;
+}
+
+static void* tw_estimate_thread(void* cookie)
+{
+    struct backupJob* job = (struct backupJob*) cookie;
+    TwEstimate est;
+
+    if (tw_estimate_archive(job->mount, tw_backup_excludes(job), job->codec, &est) == 0)
+        job->need = est.projected;
+    return NULL;
+}
+
+/* Works out how much space each job will take. Compressed file systems are
+** sampled, each on a thread of its own as they mostly sit on different
+** devices. The rest count at full size, which is the most an image, a delta
+** or an incremental backup can take.
+*/
+static unsigned long long tw_backup_space_needed(struct backupJob* jobs, int count)
+{
+    pthread_t threads[12];
+    int started[12], mounted[12];
+    unsigned long long total = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        struct backupJob* job = &jobs[i];
+
+        job->need = job->state == JOB_FINISHED ? 0 : job->size;
+        started[i] = mounted[i] = 0;
+        if (job->state == JOB_FINISHED || job->mnt.backup != files || job->codec == TW_CODEC_NONE || job->incremental)
+            continue;
+
+        // Mounts stay on this thread, like they do for the backup itself
+        if (strcmp(job->mnt.mnt, ".android_secure") != 0 && !tw_isMounted(job->mnt))
+        {
+            if (tw_mount(job->mnt))     continue;
+            mounted[i] = 1;
+        }
+        started[i] = pthread_create(&threads[i], NULL, tw_estimate_thread, job) == 0;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (started[i])     pthread_join(threads[i], NULL);
+        if (mounted[i])     tw_unmount(jobs[i].mnt);
+#ifdef RECOVERY_SDCARD_ON_DATA
+        // Only sampling leaves the sdcard out by itself
+        if (!started[i] && jobs[i].mnt.backup == files && strcmp(jobs[i].mnt.mnt, "data") == 0)
+        {
+            unsigned long long media = tw_usage_tree("/data/media");
+            jobs[i].need -= media < jobs[i].need ? media : jobs[i].need;
+        }
+#endif
+        if (jobs[i].need != jobs[i].size && jobs[i].state != JOB_FINISHED)
+            LOGI("%s: %llu bytes, expected to take %llu\n", jobs[i].mnt.mnt, jobs[i].size, jobs[i].need);
+        total += jobs[i].need;
+    }
+    return total;
+}
+
+/* Picks up an interrupted backup from its checkpoint. Files it completed are
+** checked like a verify would, and those that pass are left as they are. A
+** file system it was in the middle of goes on after its last segment, as
+** long as it's written the same way. Returns the number of partitions that
+** are backed up already.
+*/
+static int tw_backup_resume(struct backupJob* jobs, int count, TwCheckpoint* cp)
+{
+    const char* only[13];
+    TwVerifyOptions opts;
+    TwVerifyResult* results;
+    int i, j, checked, listed = 0, skipped = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        const TwCheckpointEntry* entry = tw_checkpoint_get(cp, jobs[i].image);
+
+        jobs[i].checkpoint = cp;
+        if (!entry || strcmp(entry->mode, jobs[i].mode) != 0)  continue;
+        if (entry->done)
+            only[listed++] = jobs[i].image;
+        else if (jobs[i].mnt.backup == files && entry->segments.count)
+            jobs[i].resume = entry;
+    }
+    if (!listed)    return 0;
+    only[listed] = NULL;
+
+    ui_print(" * Checking the %d partitions backed up before the interruption...\n", listed);
+    memset(&opts, 0, sizeof(opts));
+    opts.dir = jobs[0].dir;
+    opts.store = jobs[0].store;
+    opts.only = only;
+    checked = tw_verify_folder(&opts, &results);
+    for (i = 0; i < checked; i++)
+    {
+        for (j = 0; j < count && strcmp(jobs[j].image, results[i].name) != 0; j++);
+        if (j == count)     continue;
+
+        if (results[i].status == TW_VERIFY_OK || (results[i].status == TW_VERIFY_NO_DIGEST && jobs[j].digest_type == TW_DIGEST_NONE))
+        {
+            ui_print(" * %s is backed up already.\n", jobs[j].mnt.mnt);
+            jobs[j].state = JOB_FINISHED;
+            skipped++;
+        }
+        else
+            ui_print(" * %s has to be backed up again (%s).\n", jobs[j].mnt.mnt, tw_verify_status_name(results[i].status));
+    }
+    if (checked > 0)    free(results);
+    return skipped;
+}
+
+int recursive_mkdir(const char* path)
+{
+    char pathCpy[512];
+    char wholePath[512];
+    strcpy(pathCpy, path);
+    strcpy(wholePath, "/");
+
+    char* tok = strtok(pathCpy, "/");
+    while (tok)
+    {
+        strcat(wholePath, tok);
+        if (mkdir(wholePath, 0777) && errno != EEXIST)
+        {
+            LOGE("Unable to create folder: %s  (errno=%d)\n", wholePath, errno);
+            return -1;
+        }
+        strcat(wholePath, "/");
+
+        tok = strtok(NULL, "/");
+    }
+    if (mkdir(wholePath, 0777) && errno != EEXIST)      return -1;
+    return 0;
+}
+
+int
+nandroid_back_exe()
+{
+    SetDataState("Starting", "backup", 0, 0);
+
+    if (ensure_path_mounted(SDCARD_ROOT) != 0) {
+		ui_print("-- Could not mount: %s.\n-- Aborting.\n",SDCARD_ROOT);
+        SetDataState("Unable to mount", "/sdcard", 1, 1);
+		return 1;
+	}
+
+    // Create backup folder
+    struct tm *t;
+    char timestamp[64];
+	char tw_image_dir[255];
+	char exe[255];
+	struct timeval start;
+	time_t seconds;
+	seconds = time(0);
+    t = localtime(&seconds);
+    sprintf(timestamp,"%04d-%02d-%02d--%02d-%02d-%02d",t->tm_year+1900,t->tm_mon+1,t->tm_mday,t->tm_hour,t->tm_min,t->tm_sec); // make time stamp
+	sprintf(tw_image_dir,"%s/%s/%s/", backup_folder, device_id, timestamp); // for backup folder
+
+    // A backup that was interrupted is finished in its own folder rather than started over
+    char device_dir[255];
+    int resumed = 0;
+    sprintf(device_dir, "%s/%s", backup_folder, device_id);
+    if (DataManager_GetIntValue(TW_BACKUP_RESUME_VAR) && tw_checkpoint_find(device_dir, tw_image_dir, sizeof(tw_image_dir)) == 0)
+        resumed = 1;
+
+    if (recursive_mkdir(tw_image_dir))
+    {
+        LOGE("Unable to create folder: '%s'\n", backup_folder);
+        SetDataState("Backup failed", tw_image_dir, 1, 1);
+        return -1;
+    }
+
+    // Record the start time
+    gettimeofday(&start, NULL);
+
+    // Prepare operation
+    ui_print("\n[BACKUP STARTED]\n");
+    ui_print(" * Backup Folder: %s\n", backup_folder);
+    if (resumed)    ui_print(" * Resuming the interrupted backup in %s\n", tw_image_dir);
+    ui_print(" * Verifying filesystems...\n");
+    verifyFst();
+    createFstab();
+    ui_print(" * Verifying partition sizes...\n");
+    updateUsedSized();
+    unsigned long long sdc_free = sdcext.sze - sdcext.used; 
+
+    // Free space where the backup goes, which is /data on devices with the sdcard on it
+    struct statfs fs;
+    unsigned long long backup_free = sdc_free;
+    if (statfs(tw_image_dir, &fs) == 0)     backup_free = (unsigned long long) fs.f_bavail * fs.f_bsize;
+
+    // Compute totals
+    int tw_total = 0;
+    unsigned long long total_img_bytes = 0, total_file_bytes = 0;
+    CalculateBackupDetails(&tw_total, &total_img_bytes, &total_file_bytes);
+    unsigned long long total_bytes = total_img_bytes + total_file_bytes;
+
+    if (tw_total == 0 || total_bytes == 0)
+    {
+        LOGE("Unable to compute target usage (%d partitions, %llu bytes)\n", tw_total, total_bytes);
+        SetDataState("Backup failed", tw_image_dir, 1, 1);
+        return -1;
+    }
+
+    ui_print(" * Total number of partition to back up: %d\n", tw_total);
+    ui_print(" * Total size of all data, in KB: %llu\n", total_bytes / 1024);
+    ui_print(" * Available space on the SD card, in KB: %llu\n", backup_free / 1024);
+
+    comp_bytes = 0;
+    comp_msec = 0;
+
+    // Queue up the partitions, in the order they used to be backed up in
+    struct backupJob jobs[12];
+    int job_count = 0, i;
+	struct stat st;
+
+    if (DataManager_GetIntValue(TW_BACKUP_SYSTEM_VAR))  tw_backup_job_init(&jobs[job_count++], &sys, tw_image_dir);
+    if (DataManager_GetIntValue(TW_BACKUP_DATA_VAR))    tw_backup_job_init(&jobs[job_count++], &dat, tw_image_dir);
+    if (DataManager_GetIntValue(TW_BACKUP_BOOT_VAR))    tw_backup_job_init(&jobs[job_count++], &boo, tw_image_dir);
+    if (DataManager_GetIntValue(TW_BACKUP_RECOVERY_VAR))    tw_backup_job_init(&jobs[job_count++], &rec, tw_image_dir);
+    if (DataManager_GetIntValue(TW_BACKUP_CACHE_VAR))   tw_backup_job_init(&jobs[job_count++], &cac, tw_image_dir);
+    if (DataManager_GetIntValue(TW_BACKUP_SP1_VAR))     tw_backup_job_init(&jobs[job_count++], &sp1, tw_image_dir);
+    if (DataManager_GetIntValue(TW_BACKUP_SP2_VAR))     tw_backup_job_init(&jobs[job_count++], &sp2, tw_image_dir);
+    if (DataManager_GetIntValue(TW_BACKUP_SP3_VAR))     tw_backup_job_init(&jobs[job_count++], &sp3, tw_image_dir);
+	if (DataManager_GetIntValue(TW_BACKUP_ANDSEC_VAR) && stat(ase.dev, &st) == 0)
+        tw_backup_job_init(&jobs[job_count++], &ase, tw_image_dir);
+	if (DataManager_GetIntValue(TW_BACKUP_SDEXT_VAR) && stat(sde.dev, &st) == 0)
+        tw_backup_job_init(&jobs[job_count++], &sde, tw_image_dir);
+
+    // From here on the backup gives way to the GUI, its sampling included
+    TwIoJob io;
+    int prio = tw_start_io(&io);
+    for (i = 0; i < job_count; i++)
+        jobs[i].io = &io;
+
+    // The checkpoint lets a backup that's cut short be resumed, the backup goes on without one if need be
+    TwCheckpoint checkpoint;
+    TwCheckpoint* cp = tw_checkpoint_open(tw_image_dir, &checkpoint) == 0 ? &checkpoint : NULL;
+    if (cp && tw_backup_resume(jobs, job_count, cp) == job_count)
+        ui_print(" * Every partition is backed up already.\n");
+
+    // What's left of the files that are written again doesn't need any more room
+    for (i = 0; resumed && i < job_count; i++)
+    {
+        char filename[512];
+
+        if (jobs[i].state == JOB_FINISHED)  continue;
+        sprintf(filename, "%s%s", tw_image_dir, jobs[i].image);
+        backup_free += tw_segments_total(filename);
+    }
+
+    // Verify space, with compression going by a sample of the data rather than its full size
+    ui_print(" * Estimating the size of the backup...\n");
+    unsigned long long need_bytes = tw_backup_space_needed(jobs, job_count);
+    ui_print(" * Expected size of the backup, in KB: %llu\n", need_bytes / 1024);
+    if (backup_free < (need_bytes + 0x2000000))     // We require at least 32MB of additional space
+    {
+        LOGE("Insufficient space on SDCARD. Required space is %lluKB, available %lluKB\n", (need_bytes + 0x2000000) / 1024, backup_free / 1024);
+        SetDataState("Backup failed", tw_image_dir, 1, 1);
+        for (i = 0; i < job_count; i++)
+            tw_blockmap_free(&jobs[i].base_map);
+        if (cp)     tw_checkpoint_close(cp, 0);
+        tw_stop_io(&io, prio);
+        return -1;
+    }
+
+    // Let's calculate the share of the bar each partition is expected to take
+    char rates[TW_RATE_HISTORY_SIZE];
+    unsigned long img_est_bps = DataManager_GetIntValue(TW_BACKUP_AVG_IMG_RATE);
+    unsigned long file_est_bps;
+    unsigned long long est_total = 0;
+
+    if (DataManager_GetIntValue(TW_USE_COMPRESSION_VAR))    file_est_bps = DataManager_GetIntValue(TW_BACKUP_AVG_FILE_COMP_RATE);
+    else                                                    file_est_bps = DataManager_GetIntValue(TW_BACKUP_AVG_FILE_RATE);
+    if (img_est_bps == 0)       img_est_bps = 1;
+    if (file_est_bps == 0)      file_est_bps = 1;
+
+    // Partitions backed up the same way before go by their own speed, the rest by the overall averages
+    strncpy(rates, DataManager_GetStrValue(TW_BACKUP_RATES_VAR), sizeof(rates) - 1);
+    rates[sizeof(rates) - 1] = '\0';
+    for (i = 0; i < job_count; i++)
+    {
+        unsigned long bps = tw_rate_get(rates, jobs[i].rate_key);
+
+        if (jobs[i].state == JOB_FINISHED)  continue;
+        if (!bps)   bps = jobs[i].mnt.backup == image ? img_est_bps : file_est_bps;
+        jobs[i].est_time = tw_rate_msec(jobs[i].size, bps);
+        est_total += jobs[i].est_time;
+        LOGI("%s: %llu bytes at %lu bytes/sec\n", jobs[i].rate_key, jobs[i].size, bps);
+    }
+    for (i = 0; i < job_count; i++)
+    {
+        if (est_total)      jobs[i].weight = jobs[i].est_time / (float) est_total;
+        else                jobs[i].weight = 1.0 / job_count;
+    }
+    LOGI("Estimated Total time: %llu ms\n", est_total);
+
+    int parallel = DataManager_GetIntValue(TW_BACKUP_JOBS_VAR);
+    if (parallel < 1)                   parallel = 1;
+    if (parallel > MAX_BACKUP_JOBS)     parallel = MAX_BACKUP_JOBS;
+    ui_print(" * Running up to %d partition backups at a time.\n", parallel);
+
+    tw_event_display_start(DataManager_GetIntValue(TW_SHOW_SPAM_VAR));
+    int failed = tw_run_backup_jobs(jobs, job_count, parallel);
+    tw_event_display_stop();
+    tw_stop_io(&io, prio);
+    for (i = 0; i < job_count; i++)
+        tw_blockmap_free(&jobs[i].base_map);
+    if (cp)     tw_checkpoint_close(cp, !failed);
+
+    // The new backup goes in the catalog now, so the restore menu doesn't have to read it
+    TwCatalog catalog;
+    if (tw_catalog_open(device_dir, &catalog) == 0)
+        tw_catalog_free(&catalog);
+    if (failed)
+        return 1;
+
+    // What each partition took goes into the history, measured in bytes actually read.
+    // A capped run says nothing about how fast the device is, nor does a resumed one.
+    for (i = 0; i < job_count && !io.bps && !resumed; i++)
+    {
+        unsigned long long bytes = jobs[i].done_bytes ? jobs[i].done_bytes : jobs[i].size;
+        unsigned long bps = tw_rate_of(bytes, jobs[i].msec);
+
+        LOGI("%s: %llu bytes in %lu ms, %lu bytes/sec\n", jobs[i].rate_key, bytes, jobs[i].msec, bps);
+        tw_rate_put(rates, sizeof(rates), jobs[i].rate_key, bps);
+    }
+    DataManager_SetStrValue(TW_BACKUP_RATES_VAR, rates);
+
+    // Time spent on each kind of backup, counting every job on its own
+    unsigned long img_byte_time = 0, file_byte_time = 0;
+    for (i = 0; i < job_count; i++)
+    {
+        if (jobs[i].mnt.backup == image)    img_byte_time += jobs[i].msec;
+        else                                file_byte_time += jobs[i].msec;
+    }
+
+    ui_print(" * Verifying filesystems...\n");
+    verifyFst();
+    createFstab();
+    ui_print(" * Verifying partition sizes...\n");
+    updateUsedSized();
+
+    // Average BPS, keeping the old average for kinds of partition that weren't backed up
+    unsigned long int img_bps = img_est_bps;
+    unsigned long int file_bps = file_est_bps;
+    if (img_byte_time)      img_bps = (unsigned long) (total_img_bytes * 1000 / img_byte_time);
+    if (file_byte_time)     file_bps = (unsigned long) (total_file_bytes * 1000 / file_byte_time);
+
+    LOGI("img_bps = %lu  total_img_bytes = %llu  img_byte_time = %lu\n", img_bps, total_img_bytes, img_byte_time);
+    ui_print("Average backup rate for file systems: %lu MB/sec\n", (file_bps / (1024 * 1024)));
+    ui_print("Average backup rate for imaged drives: %lu MB/sec\n", (img_bps / (1024 * 1024)));
+
+    // The compressed rate comes straight from the compressor's own timing
+    if (DataManager_GetIntValue(TW_USE_COMPRESSION_VAR) && comp_msec > 0)
+        file_bps = (unsigned long) (comp_bytes * 1000 / comp_msec);
+
+    img_bps += (DataManager_GetIntValue(TW_BACKUP_AVG_IMG_RATE) * 4);
+    img_bps /= 5;
+
+    if (DataManager_GetIntValue(TW_USE_COMPRESSION_VAR))    file_bps += (DataManager_GetIntValue(TW_BACKUP_AVG_FILE_COMP_RATE) * 4);
+    else                                                    file_bps += (DataManager_GetIntValue(TW_BACKUP_AVG_FILE_RATE) * 4);
+    file_bps /= 5;
+
+    if (!io.bps && !resumed)
+    {
+        DataManager_SetIntValue(TW_BACKUP_AVG_IMG_RATE, img_bps);
+        if (DataManager_GetIntValue(TW_USE_COMPRESSION_VAR))    DataManager_SetIntValue(TW_BACKUP_AVG_FILE_COMP_RATE, file_bps);
+        else                                                    DataManager_SetIntValue(TW_BACKUP_AVG_FILE_RATE, file_bps);
+    }
+
+    int total_time = (int) (tw_msec_since(&start) / 1000);
+    unsigned long long new_sdc_free = (sdcext.sze - sdcext.used) / (1024 * 1024);
+    sdc_free /= (1024 * 1024);
+
+	ui_print("[%lu MB TOTAL BACKED UP TO SDCARD]\n",(unsigned long) (sdc_free - new_sdc_free));
+	ui_print("[BACKUP COMPLETED IN %d SECONDS]\n\n", total_time); // the end
+    SetDataState("Backup Succeeded", "", 0, 1);
+	return 0;
+}
+
+// Images up to this size are staged in memory and verified before being written
+#define RESTORE_STAGE_SIZE      (64 * 1024 * 1024)
+
+// Timing of the restore run, for its ETA
+static struct timeval rest_start;       // of the partition being restored
+static unsigned long rest_est;          // msec expected for it
+static unsigned long long rest_later;   // msec expected for the partitions after it
+static TwIoJob* rest_io;                // of the restore run, NULL outside one
+static unsigned long long rest_unchanged;   // bytes of the partition that matched the backup already
+
+/* Moves the progress bar to fraction of the current partition and updates the ETA,
+** from how fast the partition has gone so far once there's enough of it to tell.
+*/
+static void tw_restore_progress(float fraction)
+{
+    unsigned long elapsed = tw_msec_since(&rest_start);
+    unsigned long long left;
+
+    ui_set_progress(fraction);
+    if (fraction >= 0.01 && elapsed >= 1000)
+        left = (unsigned long long) (elapsed * (1.0 - fraction) / fraction);
+    else
+        left = rest_est > elapsed ? rest_est - elapsed : 0;
+    tw_set_eta((unsigned long) ((left + rest_later + 999) / 1000));
+}
+
+/* Starts hashing the way expected was made, a NULL expected hashes nothing
+*/
+static void tw_start_digest(TwDigestContext *ctx, const TwDigest *expected)
+{
+    tw_digest_init(ctx, expected ? expected->type : TW_DIGEST_NONE);
+}
+
+static int tw_check_digest(TwDigestContext *ctx, const TwDigest *expected)
+{
+    unsigned char digest[TW_DIGEST_MAX_SIZE];
+
+    if (!expected)      return 0;
+
+    tw_digest_final(ctx, digest);
+    if (memcmp(digest, expected->digest, TW_DIGEST_MAX_SIZE) != 0)
+    {
+        ui_print("....Digest Error: backup doesn't match its %s file\n", tw_digest_name(expected->type));
+        return 1;
+    }
+    ui_print("....Digest Check (%s): OK\n", tw_digest_name(expected->type));
+    return 0;
+}
+
+/* Wipes a partition ahead of a restore, either with rm -rf or a format
+*/
+static void tw_restore_wipe(struct dInfo rMnt, const char *rFilesystem)
+{
+#ifdef RECOVERY_SDCARD_ON_DATA
+    static const char* wipeExcludes[] = { TW_DATA_MEDIA, NULL };
+#endif
+    const char* const* excludes = NULL;
+    char rPath[255];
+
+    if ((DataManager_GetIntValue(TW_RM_RF_VAR) == 1 && (strcmp(rMnt.mnt,"system") == 0 || strcmp(rMnt.mnt,"data") == 0 || strcmp(rMnt.mnt,"cache") == 0)) || strcmp(rMnt.mnt,".android_secure") == 0) { // we'll use rm -rf instead of formatting for system, data and cache if the option is set, always use rm -rf for android secure
+        ui_print("...using rm -rf to wipe %s\n", rMnt.mnt);
+        if (strcmp(rMnt.mnt,".android_secure") == 0) {
+            tw_mount(sdcext); // for android secure we must make sure that the sdcard is mounted
+            strcpy(rPath, rMnt.dev);
+        } else {
+            tw_mount(rMnt); // mount the partition first
+            sprintf(rPath, "/%s", rMnt.mnt);
+#ifdef RECOVERY_SDCARD_ON_DATA
+            // The sdcard isn't part of the data backup, so it has to survive the wipe
+            if (strcmp(rMnt.mnt, "data") == 0)     excludes = wipeExcludes;
+#endif
+        }
+        SetDataState("Wiping", rMnt.mnt, 0, 0);
+        if (tw_remove_contents(rPath, excludes) != 0)
+            ui_print("....some files could not be wiped.\n");
+        ui_print("....done wiping.\n");
+    } else {
+        ui_print("...Formatting %s\n",rMnt.mnt);
+        SetDataState("Formatting", rMnt.mnt, 0, 0);
+        tw_format(rFilesystem,rMnt.blk); // let's format block, based on filesystem from filename above
+        ui_print("....done formatting.\n");
+    }
+}
+
+/* The chunk store sits next to the timestamp folders of the backup
+*/
+static void tw_chunk_store_for(const char *rFilename, char *store)
+{
+    char *slash;
+
+    strcpy(store, rFilename);
+    slash = strrchr(store, '/');
+    if (slash)  *slash = '\0';
+    strcat(store, "/../" TW_CHUNK_STORE);
+}
+
+static char* tw_load_file(int fd, size_t size)
+{
+    size_t done = 0;
+    char *data = malloc(size ? size : 1);
+
+    if (!data)      return NULL;
+    while (done < size)
+    {
+        ssize_t len = pread(fd, data + done, size - done, done);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len <= 0)
+        {
+            free(data);
+            return NULL;
+        }
+        done += len;
+    }
+    return data;
+}
+
+struct restoreProgress {
+    unsigned long long bytes;       // of the archive read so far
+    unsigned long long files;
+};
+
+static void tw_restore_file(const char *name, void *cookie)
+{
+    struct restoreProgress *rp = (struct restoreProgress *) cookie;
+
+    tw_event_publish(name, rp->bytes, ++rp->files);
+}
+
+/* Extracts an archive in process, hashing it on the way so the file is only read once.
+** Compressed archives are decoded here, whatever the codec, before the tar stream is parsed.
+** Incremental backups are rebuilt from their chunks, each one checked as it's read.
+** A split archive is read as one stream, each segment checked against its own digest.
+** With only set, just the members under those paths (relative to rMount) are
+** restored, the rest is read through.
+** Returns 0 on success, 1 on error and 2 if the data didn't match the expected digest.
+*/
+static int tw_restore_files(const char *rMount, const char *rFilename, const TwDigest *expected, const char *const *only)
+{
+    struct restoreProgress progress;
+    unsigned long long size;
+    unsigned char magic[16];
+    char store[512];
+    TwSegments segs;
+    TwDigestContext ctx;
+    TwExtractOptions options;
+    TwExtractStats stats;
+    TwSink *extract;
+    TwSink *out;
+    TwCodec codec;
+    char *buffer = NULL;
+    char *manifest = NULL;
+    int i, chunked, ret = 0;
+
+    if (tw_segments_open(rFilename, &segs) != 0)    return 1;
+    size = tw_segments_size(&segs);
+
+    memset(magic, 0, sizeof(magic));
+    if (tw_segments_pread(&segs, magic, sizeof(magic), 0) < 0)  memset(magic, 0, sizeof(magic));
+
+    // A manifest is small, so it's read and checked before anything is extracted
+    chunked = tw_chunk_check(magic, sizeof(magic));
+    if (chunked)
+    {
+        manifest = segs.count == 1 ? tw_load_file(segs.fds[0], size) : NULL;
+        if (!manifest)
+        {
+            LOGE("Unable to read %s (errno=%d)\n", rFilename, errno);
+            tw_segments_close(&segs);
+            return 1;
+        }
+        tw_start_digest(&ctx, expected);
+        tw_digest_update(&ctx, manifest, size);
+        if (tw_check_digest(&ctx, expected) != 0)
+        {
+            free(manifest);
+            tw_segments_close(&segs);
+            return 2;
+        }
+        tw_chunk_store_for(rFilename, store);
+    }
+
+    // The codec is told by the magic at the start of the archive
+    codec = chunked ? TW_CODEC_NONE : tw_codec_detect(magic, sizeof(magic));
+    LOGI("=> Extracting %s to %s (%s)\n", rFilename, rMount, tw_codec_name(codec));
+
+    memset(&options, 0, sizeof(options));
+    memset(&stats, 0, sizeof(stats));
+    memset(&progress, 0, sizeof(progress));
+    options.root = rMount;
+    options.only = only;
+    options.file_cb = tw_restore_file;
+    options.cookie = &progress;
+    if (!chunked)   buffer = malloc(IMAGE_COPY_SIZE);
+    extract = (chunked || buffer) ? tw_extract_sink_open(&options, &stats) : NULL;
+    if (!extract)
+    {
+        LOGE("Unable to start extracting %s\n", rFilename);
+        free(manifest);
+        free(buffer);
+        tw_segments_close(&segs);
+        return 1;
+    }
+
+    out = extract;
+    if (codec != TW_CODEC_NONE)
+    {
+        out = tw_decompress_sink_open(extract, codec);
+        if (!out)
+        {
+            LOGE("Unable to start %s decoder for %s\n", tw_codec_name(codec), rFilename);
+            out = extract;
+            ret = 1;
+        }
+    }
+
+    if (chunked)
+        ret = tw_chunk_restore(store, manifest, size, out);
+    for (i = 0; !chunked && ret == 0 && i < segs.count; i++)
+    {
+        TwDigest digest;
+        const TwDigest *want;
+        char segname[512];
+
+        tw_segment_name(rFilename, i, segname, sizeof(segname));
+        // The segments after the first have a digest of their own
+        want = expected;
+        if (i > 0 && expected)
+        {
+            want = &digest;
+            if (tw_read_digest(segname, &digest) != 0)
+            {
+                ret = 2;
+                break;
+            }
+        }
+        tw_start_digest(&ctx, want);
+        for (;;)
+        {
+            ssize_t len = read(segs.fds[i], buffer, IMAGE_COPY_SIZE);
+            if (len < 0 && errno == EINTR)  continue;
+            if (len < 0)
+            {
+                LOGE("Unable to read %s (errno=%d)\n", segname, errno);
+                ret = 1;
+                break;
+            }
+            if (len == 0)   break;
+
+            tw_io_throttle(rest_io, len);
+            tw_digest_update(&ctx, buffer, len);
+            if (tw_sink_write(out, buffer, len) != 0)
+            {
+                LOGE("Unable to extract %s\n", segname);
+                ret = 1;
+                break;
+            }
+            progress.bytes += len;
+            if (size)       tw_restore_progress(progress.bytes / (float) size);
+        }
+
+        if (ret != 0)       break;
+        if (tw_check_digest(&ctx, want) != 0)
+            ret = 2;
+    }
+
+    // Closing waits for the last files and catches an archive that was cut short
+    if (tw_sink_close(out) != 0 && ret == 0)
+        ret = 1;
+    LOGI("Restored %llu files, %llu bytes to %s\n", stats.files, stats.bytes, rMount);
+    free(manifest);
+    free(buffer);
+    tw_segments_close(&segs);
+    return ret;
+}
+
+/* Reads a whole image into memory and verifies it, so nothing is written
+** to the partition unless the digest matches. Returns NULL on failure.
+*/
+static char* tw_stage_image(const char *rFilename, size_t size, const TwDigest *expected)
+{
+    TwDigestContext ctx;
+    size_t done = 0;
+    char *data;
+    int fd;
+
+    fd = open(rFilename, O_RDONLY);
+    data = malloc(size ? size : 1);
+    if (fd < 0 || !data)
+    {
+        LOGE("Unable to stage %s\n", rFilename);
+        if (fd >= 0)    close(fd);
+        free(data);
+        return NULL;
+    }
+
+    while (done < size)
+    {
+        ssize_t len = read(fd, data + done, size - done);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len <= 0)   break;
+        done += len;
+    }
+    close(fd);
+
+    tw_start_digest(&ctx, expected);
+    tw_digest_update(&ctx, data, done);
+    if (done != size || tw_check_digest(&ctx, expected) != 0)
+    {
+        if (done != size)   LOGE("Unable to read %s (errno=%d)\n", rFilename, errno);
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/* Opens the partition for an image, sparse or not. With tw_restore_changed_only
+** set, only the blocks that differ from the backup are written.
+*/
+static TwSink *tw_restore_sink_open(const char *rDevice, unsigned long long *zeroed)
+{
+    if (DataManager_GetIntValue(TW_RESTORE_CHANGED_ONLY_VAR))
+        return tw_image_sink_open_changed(rDevice, zeroed, &rest_unchanged);
+    return tw_image_sink_open(rDevice, zeroed);
+}
+
+/* Feeds a sparse image to a block device, a piece at a time for the progress bar
+*/
+static int tw_write_sparse(const char *rDevice, const char *data, size_t size, int fd)
+{
+    unsigned long long zeroed = 0, total = 0;
+    char *buffer = NULL;
+    TwSink *out;
+    int ret = 0;
+
+    out = tw_restore_sink_open(rDevice, &zeroed);
+    if (!out)       return 1;
+
+    if (!data)
+    {
+        buffer = malloc(IMAGE_COPY_SIZE);
+        if (!buffer)    ret = -1;
+    }
+
+    while (ret == 0)
+    {
+        ssize_t len;
+
+        if (data)
+        {
+            len = size - total;
+            if (len > IMAGE_COPY_SIZE)  len = IMAGE_COPY_SIZE;
+        }
+        else
+        {
+            len = read(fd, buffer, IMAGE_COPY_SIZE);
+            if (len < 0 && errno == EINTR)  continue;
+            if (len < 0)
+            {
+                LOGE("Unable to read backup (errno=%d)\n", errno);
+                ret = -1;
+                break;
+            }
+        }
+        if (len == 0)   break;
+
+        tw_io_throttle(rest_io, len);
+        if (tw_sink_write(out, data ? data + total : buffer, len) != 0)
+            ret = -1;
+        total += len;
+        if (size)   tw_restore_progress(total / (float) size);
+    }
+
+    if (tw_sink_close(out) != 0)    ret = -1;
+    free(buffer);
+
+    if (ret != 0)
+    {
+        LOGE("Unable to restore sparse image to %s\n", rDevice);
+        return 1;
+    }
+    ui_print("....Cleared %llu MB of empty blocks without writing them.\n", zeroed / (1024 * 1024));
+    return 0;
+}
+
+static int tw_is_sparse_file(const char *rFilename)
+{
+    char header[32];
+    int fd, ret = 0;
+
+    fd = open(rFilename, O_RDONLY);
+    if (fd < 0)     return 0;
+    if (read(fd, header, sizeof(header)) == sizeof(header))
+        ret = tw_sparse_check(header, sizeof(header));
+    close(fd);
+    return ret;
+}
+
+/* Rebuilds an incremental image from its chunks. The chunks are all checked
+** before the first write, an image can't be taken back once it's half written.
+*/
+static int tw_write_chunked(const char *rDevice, const char *manifest, size_t size, const char *rFilename)
+{
+    unsigned long long zeroed = 0;
+    char store[512];
+    TwSink *out;
+    TwSink *throttled;
+    int ret;
+
+    tw_chunk_store_for(rFilename, store);
+    if (tw_chunk_restore(store, manifest, size, NULL) != 0)
+    {
+        ui_print("....Digest Error: backup chunks are missing or damaged\n");
+        return 1;
+    }
+
+    out = tw_restore_sink_open(rDevice, &zeroed);
+    throttled = out ? tw_io_sink_open(out, rest_io) : NULL;
+    if (!throttled)
+    {
+        tw_sink_close(out);
+        return 1;
+    }
+    out = throttled;
+    ret = tw_chunk_restore(store, manifest, size, out);
+    if (tw_sink_close(out) != 0)    ret = 1;
+
+    if (ret != 0)
+    {
+        LOGE("Unable to restore %s\n", rDevice);
+        return 1;
+    }
+    return 0;
+}
+
+/* Hashes a whole backup file and compares it with expected
+*/
+static int tw_check_file(const char *rFilename, const TwDigest *expected)
+{
+    TwDigestContext ctx;
+    char *buffer;
+    int fd, ret = 0;
+
+    fd = open(rFilename, O_RDONLY);
+    buffer = malloc(IMAGE_COPY_SIZE);
+    if (fd < 0 || !buffer)
+    {
+        LOGE("Unable to read %s\n", rFilename);
+        if (fd >= 0)    close(fd);
+        free(buffer);
+        return 1;
+    }
+
+    tw_start_digest(&ctx, expected);
+    for (;;)
+    {
+        ssize_t len = read(fd, buffer, IMAGE_COPY_SIZE);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len < 0)
+        {
+            LOGE("Unable to read %s (errno=%d)\n", rFilename, errno);
+            ret = 1;
+            break;
+        }
+        if (len == 0)   break;
+        tw_digest_update(&ctx, buffer, len);
+    }
+    close(fd);
+    free(buffer);
+
+    if (ret == 0)   ret = tw_check_digest(&ctx, expected);
+    return ret;
+}
+
+static int tw_read_header(const char *rFilename, void *header, size_t len)
+{
+    int fd, ret = -1;
+
+    fd = open(rFilename, O_RDONLY);
+    if (fd < 0)     return -1;
+    if (read(fd, header, len) == (ssize_t) len)     ret = 0;
+    close(fd);
+    return ret;
+}
+
+static int tw_is_delta_file(const char *rFilename)
+{
+    char header[TW_DELTA_HEADER_SIZE];
+
+    return tw_read_header(rFilename, header, sizeof(header)) == 0 && tw_delta_check(header, sizeof(header));
+}
+
+/* Writes a full backup file to a block device, whether it is a plain image,
+** a sparse one or a chunk manifest
+*/
+static int tw_write_image_file(const char *rDevice, const char *rFilename)
+{
+    unsigned long long zeroed = 0, total = 0;
+    char *buffer;
+    struct stat st;
+    TwSink *out;
+    int fd, ret = 0;
+
+    fd = open(rFilename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        LOGE("Unable to open %s (errno=%d)\n", rFilename, errno);
+        if (fd >= 0)    close(fd);
+        return 1;
+    }
+
+    buffer = malloc(IMAGE_COPY_SIZE);
+    if (buffer && pread(fd, buffer, 16, 0) == 16 && tw_chunk_check(buffer, 16))
+    {
+        char *manifest = tw_load_file(fd, st.st_size);
+
+        ret = manifest ? tw_write_chunked(rDevice, manifest, st.st_size, rFilename) : 1;
+        free(manifest);
+        free(buffer);
+        close(fd);
+        return ret;
+    }
+
+    out = buffer ? tw_restore_sink_open(rDevice, &zeroed) : NULL;
+    if (!out)
+    {
+        free(buffer);
+        close(fd);
+        return 1;
+    }
+
+    for (;;)
+    {
+        ssize_t len = read(fd, buffer, IMAGE_COPY_SIZE);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len < 0)
+        {
+            LOGE("Unable to read %s (errno=%d)\n", rFilename, errno);
+            ret = -1;
+            break;
+        }
+        if (len == 0)   break;
+
+        tw_io_throttle(rest_io, len);
+        if (tw_sink_write(out, buffer, len) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        total += len;
+        if (st.st_size)     tw_restore_progress(total / (float) st.st_size);
+    }
+
+    if (tw_sink_close(out) != 0)    ret = -1;
+    free(buffer);
+    close(fd);
+
+    if (ret != 0)
+    {
+        LOGE("Unable to restore %s to %s\n", rFilename, rDevice);
+        return 1;
+    }
+    return 0;
+}
+
+/* Writes the changed blocks of a delta over the partition. data holds the
+** delta when it was staged, otherwise it is read from rFilename.
+*/
+static int tw_apply_delta(const char *rDevice, const char *data, size_t size, const char *rFilename)
+{
+    char *buffer = NULL;
+    TwSink *out;
+    int fd = -1, ret = 0;
+
+    out = tw_undelta_sink_open(rDevice);
+    if (!out)       return 1;
+
+    if (data)
+    {
+        tw_io_throttle(rest_io, size);
+        ret = tw_sink_write(out, data, size);
+    }
+    else
+    {
+        fd = open(rFilename, O_RDONLY);
+        buffer = malloc(IMAGE_COPY_SIZE);
+        if (fd < 0 || !buffer)      ret = -1;
+    }
+
+    while (!data && ret == 0)
+    {
+        ssize_t len = read(fd, buffer, IMAGE_COPY_SIZE);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len < 0)
+        {
+            LOGE("Unable to read %s (errno=%d)\n", rFilename, errno);
+            ret = -1;
+        }
+        if (len <= 0)   break;
+        tw_io_throttle(rest_io, len);
+        ret = tw_sink_write(out, buffer, len);
+    }
+
+    if (tw_sink_close(out) != 0)    ret = -1;
+    if (fd >= 0)    close(fd);
+    free(buffer);
+
+    if (ret != 0)
+    {
+        LOGE("Unable to apply %s to %s\n", rFilename, rDevice);
+        return 1;
+    }
+    return 0;
+}
+
+/* Restores a differential image: the full backup the chain starts from goes
+** first, then each delta on top of it, oldest first. Every backup in the
+** chain is checked before the first write, as the partition can't be put
+** back once it has been half written.
+*/
+static int tw_write_delta(const char *rDevice, const char *data, size_t size, const char *rFilename)
+{
+    char chain[TW_DELTA_MAX_CHAIN + 1][512];
+    char device_dir[512];
+    unsigned char header[TW_DELTA_HEADER_SIZE];
+    TwDigest digest;
+    int verify = DataManager_GetIntValue(TW_SKIP_MD5_CHECK_VAR) != 1;
+    int count = 0, i;
+    TwDeltaInfo info;
+    struct stat st;
+    char *slash;
+
+    // Backups sit in device_dir/timestamp/, which is what the base names are relative to
+    strcpy(device_dir, rFilename);
+    for (i = 0; i < 2; i++)
+    {
+        slash = strrchr(device_dir, '/');
+        if (slash)  *slash = '\0';
+    }
+
+    strcpy(chain[0], rFilename);
+    if (data)   memcpy(header, data, sizeof(header));
+    else if (tw_read_header(rFilename, header, sizeof(header)) != 0)
+    {
+        LOGE("Unable to read %s\n", rFilename);
+        return 1;
+    }
+
+    while (tw_delta_read_info(header, sizeof(header), &info) == 0)
+    {
+        if (count == TW_DELTA_MAX_CHAIN)
+        {
+            LOGE("Delta chain of %s is too long\n", rFilename);
+            return 1;
+        }
+        count++;
+        snprintf(chain[count], sizeof(chain[count]), "%s/%s", device_dir, info.base);
+
+        if (stat(chain[count], &st) != 0)
+        {
+            ui_print("...Base backup %s is missing.\n", info.base);
+            return 1;
+        }
+        // Anything too short for a delta header is a full backup
+        if (tw_read_header(chain[count], header, sizeof(header)) != 0)
+            memset(header, 0, sizeof(header));
+        if (verify)
+        {
+            ui_print("...Verifying base backup %s\n", info.base);
+            if (tw_read_digest(chain[count], &digest) != 0)     return 1;
+            if (memcmp(digest.digest, info.base_digest, MD5_DIGEST_SIZE) != 0)
+            {
+                ui_print("....Digest Error: base backup changed since the delta was made\n");
+                return 1;
+            }
+            if (tw_check_file(chain[count], &digest) != 0)      return 1;
+        }
+    }
+    if (count == 0 || tw_delta_check(header, sizeof(header)))
+    {
+        LOGE("Invalid delta %s\n", chain[count]);
+        return 1;
+    }
+
+    ui_print("...Writing base image and %d delta(s).\n", count);
+    if (tw_write_image_file(rDevice, chain[count]) != 0)
+        return 1;
+    for (i = count - 1; i >= 0; i--)
+    {
+        if (tw_apply_delta(rDevice, i == 0 ? data : NULL, size, chain[i]) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int tw_write_image(const char *rDevice, const char *data, size_t size, const char *rFilename)
+{
+    unsigned long long zeroed = 0;
+    size_t done = 0;
+    TwSink *out;
+    int ret = 0;
 
-	// DATA
-    if (tw_do_backup(TW_BACKUP_DATA_VAR, &dat, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))         return 1;
+    if (tw_delta_check(data, size))
+        return tw_write_delta(rDevice, data, size, rFilename);
 
-    // BOOT
-    if (tw_do_backup(TW_BACKUP_BOOT_VAR, &boo, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))         return 1;
+    if (tw_chunk_check(data, size))
+        return tw_write_chunked(rDevice, data, size, rFilename);
+    if (tw_sparse_check(data, size))
+        return tw_write_sparse(rDevice, data, size, -1);
 
-    // RECOVERY
-    if (tw_do_backup(TW_BACKUP_RECOVERY_VAR, &rec, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))     return 1;
+    out = tw_restore_sink_open(rDevice, &zeroed);
+    if (!out)       return 1;
 
-    // CACHE
-    if (tw_do_backup(TW_BACKUP_CACHE_VAR, &cac, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))        return 1;
+    while (done < size && ret == 0)
+    {
+        size_t count = size - done > IMAGE_COPY_SIZE ? IMAGE_COPY_SIZE : size - done;
 
-    // SP1
-    if (tw_do_backup(TW_BACKUP_SP1_VAR, &sp1, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))          return 1;
+        // In pieces, so the cap and a pause can get a word in
+        tw_io_throttle(rest_io, count);
+        ret = tw_sink_write(out, data + done, count);
+        done += count;
+        tw_restore_progress(done / (float) size);
+    }
 
-    // SP2
-    if (tw_do_backup(TW_BACKUP_SP2_VAR, &sp2, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))          return 1;
+    if (tw_sink_close(out) != 0)    ret = -1;
+    if (ret != 0)
+    {
+        LOGE("Unable to write %s\n", rDevice);
+        return 1;
+    }
+    return 0;
+}
 
-    // SP3
-    if (tw_do_backup(TW_BACKUP_SP3_VAR, &sp3, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))          return 1;
+/* Flashes an MTD image in-process, decompressing it on the way if it was
+** backed up compressed. Bad blocks are stepped over as flash_image did.
+*/
+static int tw_write_mtd(const char *rName, const char *rFilename)
+{
+    unsigned long long done = 0;
+    TwSink *flash = NULL;
+    TwSink *out = NULL;
+    struct stat st;
+    char *buffer;
+    int fd, ret = 0;
 
-    // ANDROID-SECURE
-	if (stat(ase.dev, &st) ==0)
-		if (tw_do_backup(TW_BACKUP_ANDSEC_VAR, &ase, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))       return 1;
+    fd = open(rFilename, O_RDONLY);
+    buffer = malloc(IMAGE_COPY_SIZE);
+    if (fd < 0 || !buffer || fstat(fd, &st) != 0)
+    {
+        LOGE("Unable to read %s\n", rFilename);
+        if (fd >= 0)    close(fd);
+        free(buffer);
+        return 1;
+    }
 
-    // SD-EXT
-	if (stat(sde.dev, &st) ==0)
-		if (tw_do_backup(TW_BACKUP_SDEXT_VAR, &sde, tw_image_dir, total_img_bytes, total_file_bytes, &img_bytes_remaining, &file_bytes_remaining, &img_byte_time, &file_byte_time))        return 1;
+    for (;;)
+    {
+        ssize_t len = read(fd, buffer, IMAGE_COPY_SIZE);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len < 0)
+        {
+            LOGE("Unable to read %s (errno=%d)\n", rFilename, errno);
+            ret = -1;
+            break;
+        }
+        if (len == 0)   break;
 
-    ui_print(" * Verifying filesystems...\n");
-    verifyFst();
-    createFstab();
-    ui_print(" * Verifying partition sizes...\n");
-    updateUsedSized();
+        // The codec is told by the first bytes, like everywhere else
+        if (!out)
+        {
+            TwCodec codec = tw_codec_detect(buffer, len);
 
-    time(&stop);
+            flash = tw_mtd_sink_open(rName);
+            out = flash;
+            if (flash && codec != TW_CODEC_NONE)
+            {
+                out = tw_decompress_sink_open(flash, codec);
+                if (!out)   tw_sink_close(flash);
+            }
+            if (!out)
+            {
+                ret = -1;
+                break;
+            }
+        }
 
-    // Average BPS
-    unsigned long int img_bps = total_img_bytes / img_byte_time;
-    unsigned long int file_bps = total_file_bytes / file_byte_time;
+        tw_io_throttle(rest_io, len);
+        if (tw_sink_write(out, buffer, len) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        done += len;
+        tw_restore_progress(done / (float) st.st_size);
+    }
 
-    LOGI("img_bps = %lu  total_img_bytes = %llu  img_byte_time = %lu\n", img_bps, total_img_bytes, img_byte_time);
-    ui_print("Average backup rate for file systems: %lu MB/sec\n", (file_bps / (1024 * 1024)));
-    ui_print("Average backup rate for imaged drives: %lu MB/sec\n", (img_bps / (1024 * 1024)));
+    // A partition that's only half written mustn't get its header
+    if (out && ret != 0)    tw_mtd_sink_abort(flash);
+    if (out && tw_sink_close(out) != 0)     ret = -1;
+    if (!out && ret == 0)   ret = -1;   // nothing to flash
+    close(fd);
+    free(buffer);
 
-    if (DataManager_GetIntValue(TW_SKIP_MD5_GENERATE_VAR) == 1)
+    if (ret != 0)
     {
-        // If we're skipping MD5 generation, our BPS is faster by about 1.65
-        file_bps = (unsigned long) (file_bps / 1.65);
-        img_bps = (unsigned long) (img_bps / 1.65);
+        LOGE("Unable to flash %s to %s\n", rFilename, rName);
+        return 1;
     }
+    return 0;
+}
 
-    img_bps += (DataManager_GetIntValue(TW_BACKUP_AVG_IMG_RATE) * 4);
-    img_bps /= 5;
-
-    if (DataManager_GetIntValue(TW_USE_COMPRESSION_VAR))    file_bps += (DataManager_GetIntValue(TW_BACKUP_AVG_FILE_COMP_RATE) * 4);
-    else                                                    file_bps += (DataManager_GetIntValue(TW_BACKUP_AVG_FILE_RATE) * 4);
-    file_bps /= 5;
-
-    DataManager_SetIntValue(TW_BACKUP_AVG_IMG_RATE, img_bps);
-    if (DataManager_GetIntValue(TW_USE_COMPRESSION_VAR))    DataManager_SetIntValue(TW_BACKUP_AVG_FILE_COMP_RATE, file_bps);
-    else                                                    DataManager_SetIntValue(TW_BACKUP_AVG_FILE_RATE, file_bps);
-
-    int total_time = (int) difftime(stop, start);
-    unsigned long long new_sdc_free = (sdcext.sze - sdcext.used) / (1024 * 1024);
-    sdc_free /= (1024 * 1024);
+// partition.filesystem.win -> filesystem
+static void tw_restore_fstype(const char *rName, char *rFilesystem, int len)
+{
+    const char *start = strchr(rName, '.');
+    const char *end = start ? strchr(start + 1, '.') : NULL;
 
-	ui_print("[%lu MB TOTAL BACKED UP TO SDCARD]\n",(unsigned long) (sdc_free - new_sdc_free));
-	ui_print("[BACKUP COMPLETED IN %d SECONDS]\n\n", total_time); // the end
-    SetDataState("Backup Succeeded", "", 0, 1);
-	return 0;
+    rFilesystem[0] = '\0';
+    if (start && end && end - start - 1 < len)
+    {
+        memcpy(rFilesystem, start + 1, end - start - 1);
+        rFilesystem[end - start - 1] = '\0';
+    }
 }
 
 int tw_restore(struct dInfo rMnt, const char *rDir)
 {
 	int i;
-	FILE *reFp;
 	char rUppr[20];
 	char rMount[30];
 	char rFilesystem[10];
 	char rFilename[255];
-	char rCommand[255];
-	char rOutput[255];
-	time_t rStart, rStop;
 	strcpy(rUppr,rMnt.mnt);
 	for (i = 0; i < (int) strlen(rUppr); i++) {
 		rUppr[i] = toupper(rUppr[i]);
 	}
 	ui_print("[%s]\n",rUppr);
-	time(&rStart);
-    int md5_result;
-	if (DataManager_GetIntValue(TW_SKIP_MD5_CHECK_VAR)) {
+
+	strcpy(rFilename,rDir);
+    if (rFilename[strlen(rFilename)-1] != '/')
+    {
+        strcat(rFilename, "/");
+    }
+	strcat(rFilename,rMnt.fnm);
+
+    // The digest is checked while the backup is read for the restore itself
+    TwDigest rDigest;
+    TwDigest *expected = NULL;
+	if (DataManager_GetIntValue(TW_SKIP_MD5_CHECK_VAR) != 1) {
 		SetDataState("Verifying MD5", rMnt.mnt, 0, 0);
-		ui_print("...Verifying md5 hash for %s.\n",rMnt.mnt);
-		md5_result = checkMD5(rDir, rMnt.fnm); // verify md5, check if no error; 0 = no error.
+		if (tw_read_digest(rFilename, &rDigest) != 0) {
+			ui_print("...Failed digest check. Aborted.\n\n");
+			return 1;
+		}
+		ui_print("...Verifying %s hash for %s while restoring.\n",tw_digest_name(rDigest.type),rMnt.mnt);
+		expected = &rDigest;
 	} else {
-		md5_result = 0;
 		ui_print("Skipping MD5 check based on user setting.\n");
 	}
-	if(md5_result == 0)
-	{
-		strcpy(rFilename,rDir);
-        if (rFilename[strlen(rFilename)-1] != '/')
-        {
-            strcat(rFilename, "/");
-        }
-		strcat(rFilename,rMnt.fnm);
-		sprintf(rCommand,"ls -l %s | awk -F'.' '{ print $2 }'",rFilename); // let's get the filesystem type from filename
-        reFp = __popen(rCommand, "r");
-		LOGI("=> Filename is: %s\n",rMnt.fnm);
-		while (fscanf(reFp,"%s",rFilesystem) == 1) { // if we get a match, store filesystem type
-			LOGI("=> Filesystem is: %s\n",rFilesystem); // show it off to the world!
-		}
-		__pclose(reFp);
-
-		if ((DataManager_GetIntValue(TW_RM_RF_VAR) == 1 && (strcmp(rMnt.mnt,"system") == 0 || strcmp(rMnt.mnt,"data") == 0 || strcmp(rMnt.mnt,"cache") == 0)) || strcmp(rMnt.mnt,".android_secure") == 0) { // we'll use rm -rf instead of formatting for system, data and cache if the option is set, always use rm -rf for android secure
-			char rCommand2[255];
-			ui_print("...using rm -rf to wipe %s\n", rMnt.mnt);
-			if (strcmp(rMnt.mnt,".android_secure") == 0) {
-				tw_mount(sdcext); // for android secure we must make sure that the sdcard is mounted
-				sprintf(rCommand, "rm -rf %s/*", rMnt.dev);
-				sprintf(rCommand2, "rm -rf %s/.*", rMnt.dev);
-			} else {
-				tw_mount(rMnt); // mount the partition first
-				sprintf(rCommand,"rm -rf %s%s/*", "/", rMnt.mnt);
-				sprintf(rCommand2,"rm -rf %s%s/.*", "/", rMnt.mnt);
-			}
-            SetDataState("Wiping", rMnt.mnt, 0, 0);
-			__system(rCommand);
-			__system(rCommand2);
-			ui_print("....done wiping.\n");
-		} else {
-			ui_print("...Formatting %s\n",rMnt.mnt);
-            SetDataState("Formatting", rMnt.mnt, 0, 0);
-			tw_format(rFilesystem,rMnt.blk); // let's format block, based on filesystem from filename above
-			ui_print("....done formatting.\n");
-		}
 
-        if (rMnt.backup == files)
-        {
-            tw_mount(rMnt);
-            strcpy(rMount,"/");
-            if (strcmp(rMnt.mnt,".android_secure") == 0) { // if it's android_secure, we have add prefix
-                strcat(rMount,"sdcard/");
-            }
-            strcat(rMount,rMnt.mnt);
-            sprintf(rCommand,"cd %s && tar -xvf %s",rMount,rFilename); // formulate shell command to restore
-        } else if (rMnt.backup == image) {
-            if (strcmp(rFilesystem,"mtd") == 0) { // if filesystem is mtd, we use flash image
-    			sprintf(rCommand,"flash_image %s %s",rMnt.mnt,rFilename);
-    			strcpy(rMount,rMnt.mnt);
-    		} else { // if filesystem is emmc, we use dd
-    			sprintf(rCommand,"dd bs=%s if=%s of=%s",bs_size,rFilename,rMnt.dev);
-    			strcpy(rMount,rMnt.mnt);
-    		}
-        } else {
-            LOGE("Unknown backup method for mount %s\n", rMnt.mnt);
+    // The file is named partition.filesystem.win, the compression is told by its contents
+	LOGI("=> Filename is: %s\n",rMnt.fnm);
+    tw_restore_fstype(rMnt.fnm, rFilesystem, sizeof(rFilesystem));
+    LOGI("=> Filesystem is: %s\n",rFilesystem);
+
+    // Small images are verified in memory first, so a bad one never touches the partition
+    char *rStaged = NULL;
+    struct stat st;
+    int rStream = 0, rSparse = 0, rDelta = 0, rMtd = 0;
+    rest_unchanged = 0;
+    memset(&st, 0, sizeof(st));
+    if (rMnt.backup == image && strcmp(rFilesystem,"mtd") != 0 && stat(rFilename, &st) == 0 && st.st_size <= RESTORE_STAGE_SIZE) {
+        SetDataState("Verifying MD5", rMnt.mnt, 0, 0);
+        rStaged = tw_stage_image(rFilename, st.st_size, expected);
+        if (!rStaged) {
+            ui_print("...Failed digest check. Aborted.\n\n");
+            return 1;
+        }
+    } else if (rMnt.backup == image && expected) {
+        // Large or MTD images can't be undone, so they are still checked up front
+        if (tw_check_file(rFilename, expected) != 0) {
+            ui_print("...Failed digest check. Aborted.\n\n");
             return 1;
         }
+    }
 
-		ui_print("...Restoring %s\n\n",rMount);
-        SetDataState("Restoring", rMnt.mnt, 0, 0);
-		reFp = __popen(rCommand, "r");
-		if(DataManager_GetIntValue(TW_SHOW_SPAM_VAR) == 2) { // twrp spam
-			while (fgets(rOutput,sizeof(rOutput),reFp) != NULL) {
-				ui_print_overwrite("%s",rOutput);
-			}
+    tw_restore_wipe(rMnt, rFilesystem);
+
+    if (rMnt.backup == files)
+    {
+        tw_mount(rMnt);
+        strcpy(rMount,"/");
+        if (strcmp(rMnt.mnt,".android_secure") == 0) { // if it's android_secure, we have add prefix
+            strcat(rMount,"sdcard/");
+        }
+        strcat(rMount,rMnt.mnt);
+        rStream = 1;
+    } else if (rMnt.backup == image) {
+        if (strcmp(rFilesystem,"mtd") == 0) { // mtd images are flashed in-process
+			rMtd = 1;
+			strcpy(rMount,rMnt.mnt);
+		} else if (!rStaged && tw_is_delta_file(rFilename)) { // deltas are applied on top of their base
+			rDelta = 1;
+			strcpy(rMount,rMnt.mnt);
+		} else if (!rStaged && tw_is_sparse_file(rFilename)) { // sparse images are expanded in-process
+			rSparse = 1;
+			strcpy(rMount,rMnt.mnt);
+		} else if (!rStaged) { // large emmc images are streamed from the file
+			strcpy(rMount,rMnt.mnt);
 		} else {
-			while (fscanf(reFp,"%s",rOutput) == 1) {
-				if(DataManager_GetIntValue(TW_SHOW_SPAM_VAR) == 1) ui_print_overwrite("%s",rOutput);
-			}
-		}
-		__pclose(reFp);
-		ui_print_overwrite("....done restoring.\n");
-		if (strcmp(rMnt.mnt,".android_secure") != 0) { // any partition other than android secure,
-			tw_unmount(rMnt); // let's unmount (unmountable partitions won't matter)
+			strcpy(rMount,rMnt.mnt);
 		}
-	} else {
-		ui_print("...Failed md5 check. Aborted.\n\n");
-		return 1;
+    } else {
+        LOGE("Unknown backup method for mount %s\n", rMnt.mnt);
+        free(rStaged);
+        return 1;
+    }
+
+	ui_print("...Restoring %s\n\n",rMount);
+    SetDataState("Restoring", rMnt.mnt, 0, 0);
+    tw_event_display_start(DataManager_GetIntValue(TW_SHOW_SPAM_VAR));
+    int ret = 0;
+    if (rStream) {
+        ret = tw_restore_files(rMount, rFilename, expected, NULL);
+        if (ret == 2) {
+            // Don't leave a partially matching restore behind
+            ui_print("...Failed digest check. Wiping %s again.\n", rMnt.mnt);
+            tw_restore_wipe(rMnt, rFilesystem);
+        }
+        if (ret != 0 && strcmp(rMnt.mnt,".android_secure") != 0)    tw_unmount(rMnt);
+    } else if (rStaged) {
+        ret = tw_write_image(rMnt.dev, rStaged, st.st_size, rFilename);
+        free(rStaged);
+    } else if (rMtd) {
+        ret = tw_write_mtd(rMnt.mnt, rFilename);
+    } else if (rDelta) {
+        ret = tw_write_delta(rMnt.dev, NULL, st.st_size, rFilename);
+    } else if (rSparse) {
+        int fd = open(rFilename, O_RDONLY);
+        ret = fd < 0 ? 1 : tw_write_sparse(rMnt.dev, NULL, st.st_size, fd);
+        if (fd >= 0)    close(fd);
+    } else {
+        ret = tw_write_image_file(rMnt.dev, rFilename);
+    }
+    if (ret != 0)
+        goto restore_failed;
+    tw_event_display_stop(); // so nothing lands after the line below
+	ui_print_overwrite("....done restoring.\n");
+	if (rest_unchanged)
+		ui_print("....Left %llu MB that matched the backup already unwritten.\n", rest_unchanged / (1024 * 1024));
+	if (strcmp(rMnt.mnt,".android_secure") != 0) { // any partition other than android secure,
+		tw_unmount(rMnt); // let's unmount (unmountable partitions won't matter)
 	}
-	time(&rStop);
-	ui_print("[%s DONE (%d SECONDS)]\n\n",rUppr,(int)difftime(rStop,rStart));
+	ui_print("[%s DONE (%lu SECONDS)]\n\n",rUppr,tw_msec_since(&rest_start) / 1000);
 	return 0;
+
+restore_failed:
+    // Every failure once the progress display runs ends here, so it's always stopped
+    tw_event_display_stop();
+    ui_print("...Restore of %s failed. Aborted.\n\n", rMnt.mnt);
+    return 1;
 }
 
-int 
-nandroid_rest_exe()
+#define MAX_RESTORE_PATHS   16
+
+/* Restores some folders of a file system backup, eg. "data/com.foo" of the data
+** partition, on top of what's there. The index takes us straight to them, a
+** backup without one is read through from the start.
+*/
+static int tw_restore_subset(struct dInfo rMnt, const char *rDir, const char *const *paths)
 {
-    SetDataState("", "", 0, 0);
+    char rMount[30];
+    char rFilename[512];
+    char rIndex[512];
+    TwDigest rDigest;
+    TwDigest *expected = NULL;
+    TwExtractStats stats;
+    TwIndex index;
+    int ret;
+
+    sprintf(rFilename, "%s/%s", rDir, rMnt.fnm);
+    sprintf(rIndex, "%s%s", rFilename, TW_INDEX_EXT);
+    if (strcmp(rMnt.mnt,".android_secure") == 0)    sprintf(rMount, "/sdcard/%s", rMnt.mnt);
+    else                                            sprintf(rMount, "/%s", rMnt.mnt);
+
+    SetDataState("Restoring", rMnt.mnt, 0, 0);
+    if (strcmp(rMnt.mnt,".android_secure") != 0 && tw_mount(rMnt)) {
+        ui_print("-- Could not mount: %s\n-- Aborting.\n", rMount);
+        return 1;
+    }
 
-    const char* nan_dir = DataManager_GetStrValue("tw_restore");
+    memset(&stats, 0, sizeof(stats));
+    tw_event_display_start(DataManager_GetIntValue(TW_SHOW_SPAM_VAR));
+    if (tw_index_load(rIndex, &index) == 0) {
+        ui_print("...Restoring from %s using its index\n", rMnt.fnm);
+        ret = tw_index_extract(&index, rFilename, rMount, paths, &stats) == 0 ? 0 : 1;
+        tw_index_free(&index);
+    } else {
+        // The whole archive goes by anyway, so its digest can still be checked
+        if (DataManager_GetIntValue(TW_SKIP_MD5_CHECK_VAR) != 1 && tw_read_digest(rFilename, &rDigest) == 0)
+            expected = &rDigest;
+        ui_print("...No index for %s, reading all of it\n", rMnt.fnm);
+        ret = tw_restore_files(rMount, rFilename, expected, paths);
+        if (ret == 2)   ui_print("...Failed digest check, the restored files may be damaged.\n");
+    }
+    tw_event_display_stop();
+    tw_restore_progress(1.0);
 
-	if (ensure_path_mounted(SDCARD_ROOT) != 0) {
-		ui_print("-- Could not mount: %s.\n-- Aborting.\n",SDCARD_ROOT);
-		return 1;
-	}
+    LOGI("Restored %llu files, %llu bytes from %s\n", stats.files, stats.bytes, rFilename);
+    if (strcmp(rMnt.mnt,".android_secure") != 0)    tw_unmount(rMnt);
+    return ret != 0;
+}
 
-    int tw_total = 0;
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_SYSTEM_VAR) == 1 ? 1 : 0);
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_DATA_VAR) == 1 ? 1 : 0);
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_CACHE_VAR) == 1 ? 1 : 0);
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_RECOVERY_VAR) == 1 ? 1 : 0);
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_SP1_VAR) == 1 ? 1 : 0);
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_SP2_VAR) == 1 ? 1 : 0);
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_SP3_VAR) == 1 ? 1 : 0);
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_BOOT_VAR) == 1 ? 1 : 0);
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_ANDSEC_VAR) == 1 ? 1 : 0);
-    tw_total += (DataManager_GetIntValue(TW_RESTORE_SDEXT_VAR) == 1 ? 1 : 0);
-
-    float sections = 1.0 / tw_total;
-
-	time_t rStart, rStop;
-	time(&rStart);
-	ui_print("\n[RESTORE STARTED]\n\n");
-	if (DataManager_GetIntValue(TW_RESTORE_SYSTEM_VAR) == 1) {
-        ui_show_progress(sections, 150);
-		if (tw_restore(sys,nan_dir) == 1) {
-			ui_print("-- Error occured, check recovery.log. Aborting.\n");
-            SetDataState("Restore failed", "", 1, 1);
-			return 1;
-		}
-	}
-    if (DataManager_GetIntValue(TW_RESTORE_DATA_VAR) == 1) {
-        ui_show_progress(sections, 150);
-		if (tw_restore(dat,nan_dir) == 1) {
-			ui_print("-- Error occured, check recovery.log. Aborting.\n");
-            SetDataState("Restore failed", "", 1, 1);
-			return 1;
-		}
-	}
-    if (DataManager_GetIntValue(TW_RESTORE_BOOT_VAR) == 1) {
-        ui_show_progress(sections, 150);
-		if (tw_restore(boo,nan_dir) == 1) {
-			ui_print("-- Error occured, check recovery.log. Aborting.\n");
-            SetDataState("Restore failed", "", 1, 1);
-			return 1;
-		}
-	}
-    if (DataManager_GetIntValue(TW_RESTORE_RECOVERY_VAR) == 1) {
-        ui_show_progress(sections, 150);
-		if (tw_restore(rec,nan_dir) == 1) {
-			ui_print("-- Error occured, check recovery.log. Aborting.\n");
-            SetDataState("Restore failed", "", 1, 1);
-			return 1;
-		}
-	}
-    if (DataManager_GetIntValue(TW_RESTORE_CACHE_VAR) == 1) {
-        ui_show_progress(sections, 150);
-		if (tw_restore(cac,nan_dir) == 1) {
-			ui_print("-- Error occured, check recovery.log. Aborting.\n");
-            SetDataState("Restore failed", "", 1, 1);
-			return 1;
-		}
-	}
-    if (DataManager_GetIntValue(TW_RESTORE_SP1_VAR) == 1) {
-        ui_show_progress(sections, 150);
-		if (tw_restore(sp1,nan_dir) == 1) {
-			ui_print("-- Error occured, check recovery.log. Aborting.\n");
-            SetDataState("Restore failed", "", 1, 1);
-			return 1;
-		}
-	}
-    if (DataManager_GetIntValue(TW_RESTORE_SP2_VAR) == 1) {
-        ui_show_progress(sections, 150);
-        if (tw_restore(sp2,nan_dir) == 1) {
-            ui_print("-- Error occured, check recovery.log. Aborting.\n");
-            SetDataState("Restore failed", "", 1, 1);
-            return 1;
-        }
+/* Names the kind of restore a backup file needs, which is what its speed
+** depends on, as the key for the throughput history
+*/
+static void tw_restore_rate_key(const struct dInfo* mnt, const char* filename, char* key)
+{
+    unsigned char magic[16];
+    const char* kind = "image";
+    int fd;
+
+    memset(magic, 0, sizeof(magic));
+    fd = open(filename, O_RDONLY);
+    if (fd >= 0)
+    {
+        if (read(fd, magic, sizeof(magic)) < 0)     memset(magic, 0, sizeof(magic));
+        close(fd);
     }
-    if (DataManager_GetIntValue(TW_RESTORE_SP3_VAR) == 1) {
-        ui_show_progress(sections, 150);
-        if (tw_restore(sp3,nan_dir) == 1) {
+
+    if (tw_chunk_check(magic, sizeof(magic)))   kind = "chunk";
+    else if (mnt->backup == files)              kind = tw_codec_name(tw_codec_detect(magic, sizeof(magic)));
+    else if (tw_is_delta_file(filename))        kind = "delta";
+    else if (tw_is_sparse_file(filename))       kind = "sparse";
+    else if (strcmp(mnt->fst, "mtd") == 0)      kind = "mtd";
+    sprintf(key, "%s.%s", mnt->mnt, kind);
+}
+
+// Partitions in the order they are restored in
+static const struct {
+    const char* var;
+    struct dInfo* mnt;
+} rest_parts[] = {
+    { TW_RESTORE_SYSTEM_VAR, &sys },
+    { TW_RESTORE_DATA_VAR, &dat },
+    { TW_RESTORE_BOOT_VAR, &boo },
+    { TW_RESTORE_RECOVERY_VAR, &rec },
+    { TW_RESTORE_CACHE_VAR, &cac },
+    { TW_RESTORE_SP1_VAR, &sp1 },
+    { TW_RESTORE_SP2_VAR, &sp2 },
+    { TW_RESTORE_SP3_VAR, &sp3 },
+    { TW_RESTORE_ANDSEC_VAR, &ase },
+    { TW_RESTORE_SDEXT_VAR, &sde },
+};
+#define REST_PART_COUNT     (int) (sizeof(rest_parts) / sizeof(rest_parts[0]))
+
+/* Restores the folders listed in TW_RESTORE_PATHS_VAR, separated by ';' and
+** given as full paths (eg. "/data/data/com.foo"), each from the backup of the
+** partition it lives on. Nothing else is touched.
+*/
+static int nandroid_rest_paths(const char* nan_dir, const char* list)
+{
+    char buffer[512];
+    char* paths[MAX_RESTORE_PATHS];
+    int i, j, count = 0, done = 0;
+    char* save = NULL;
+    char* path;
+
+    strncpy(buffer, list, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    for (path = strtok_r(buffer, ";", &save); path && count < MAX_RESTORE_PATHS; path = strtok_r(NULL, ";", &save))
+        paths[count++] = path;
+
+    ui_print("\n[RESTORE STARTED]\n\n");
+    ui_show_progress(1.0, 0);
+    gettimeofday(&rest_start, NULL);
+    rest_est = 0;
+    rest_later = 0;
+    for (i = 0; i < REST_PART_COUNT; i++) {
+        struct dInfo* mnt = rest_parts[i].mnt;
+        const char* rel[MAX_RESTORE_PATHS + 1];
+        char mount[30];
+        int n = 0;
+
+        if (mnt->backup != files)   continue;
+        if (strcmp(mnt->mnt,".android_secure") == 0)    sprintf(mount, "/sdcard/%s/", mnt->mnt);
+        else                                            sprintf(mount, "/%s/", mnt->mnt);
+
+        // A path belongs to the partition mounted at the start of it
+        for (j = 0; j < count; j++) {
+            if (strncmp(paths[j], mount, strlen(mount)) == 0 && paths[j][strlen(mount)])
+                rel[n++] = paths[j] + strlen(mount);
+        }
+        if (n == 0)     continue;
+        rel[n] = NULL;
+
+        if (tw_restore_subset(*mnt, nan_dir, rel) != 0) {
             ui_print("-- Error occured, check recovery.log. Aborting.\n");
             SetDataState("Restore failed", "", 1, 1);
             return 1;
         }
+        done += n;
     }
-    if (DataManager_GetIntValue(TW_RESTORE_ANDSEC_VAR) == 1) {
-        ui_show_progress(sections, 150);
-		if (tw_restore(ase,nan_dir) == 1) {
-			ui_print("-- Error occured, check recovery.log. Aborting.\n");
-            SetDataState("Restore failed", "", 1, 1);
-			return 1;
-		}
-	}
-    if (DataManager_GetIntValue(TW_RESTORE_SDEXT_VAR) == 1) {
-        ui_show_progress(sections, 150);
-		if (tw_restore(sde,nan_dir) == 1) {
+
+    if (done < count) {
+        ui_print("-- %d of the folders asked for aren't in a file system backup.\n", count - done);
+        SetDataState("Restore failed", "", 1, 1);
+        return 1;
+    }
+    ui_print("[RESTORE COMPLETED IN %lu SECONDS]\n\n", tw_msec_since(&rest_start) / 1000);
+    __system("sync");
+    SetDataState("Restore Succeeded", "", 0, 1);
+    return 0;
+}
+
+/* Restores the partitions picked in the restore menu
+*/
+static int nandroid_rest_parts(const char* nan_dir)
+{
+    // Each partition's share of the bar is its expected time, from the size of its backup
+    // and how fast the same kind of restore went before
+    char rates[TW_RATE_HISTORY_SIZE];
+    char keys[REST_PART_COUNT][40];
+    unsigned long long bytes[REST_PART_COUNT];
+    unsigned long est[REST_PART_COUNT];
+    unsigned long long est_total = 0;
+    int i, tw_total = 0;
+
+    strncpy(rates, DataManager_GetStrValue(TW_RESTORE_RATES_VAR), sizeof(rates) - 1);
+    rates[sizeof(rates) - 1] = '\0';
+    for (i = 0; i < REST_PART_COUNT; i++)
+    {
+        const struct dInfo* mnt = rest_parts[i].mnt;
+        char filename[512];
+        unsigned long bps;
+
+        est[i] = 0;
+        bytes[i] = 0;
+        if (DataManager_GetIntValue(rest_parts[i].var) != 1)    continue;
+
+        sprintf(filename, "%s/%s", nan_dir, mnt->fnm);
+        bytes[i] = tw_segments_total(filename);
+        tw_restore_rate_key(mnt, filename, keys[i]);
+
+        bps = tw_rate_get(rates, keys[i]);
+        if (!bps && mnt->backup == image)   bps = DataManager_GetIntValue(TW_RESTORE_AVG_IMG_RATE);
+        else if (!bps && strstr(keys[i], ".none"))  bps = DataManager_GetIntValue(TW_RESTORE_AVG_FILE_RATE);
+        else if (!bps)                      bps = DataManager_GetIntValue(TW_RESTORE_AVG_FILE_COMP_RATE);
+        if (!bps)   bps = 1;
+
+        est[i] = tw_rate_msec(bytes[i], bps);
+        est_total += est[i];
+        tw_total++;
+    }
+	struct timeval rStart;
+	gettimeofday(&rStart, NULL);
+	ui_print("\n[RESTORE STARTED]\n\n");
+    rest_later = est_total;
+    for (i = 0; i < REST_PART_COUNT; i++) {
+        struct dInfo* mnt = rest_parts[i].mnt;
+        float section;
+
+        if (DataManager_GetIntValue(rest_parts[i].var) != 1)    continue;
+
+        section = est_total ? est[i] / (float) est_total : 1.0 / tw_total;
+        ui_show_progress(section, 0);
+        rest_later -= est[i];
+        rest_est = est[i];
+        gettimeofday(&rest_start, NULL);
+        tw_restore_progress(0.0);
+
+		if (tw_restore(*mnt,nan_dir) == 1) {
+            tw_event_display_stop();
 			ui_print("-- Error occured, check recovery.log. Aborting.\n");
+            DataManager_SetStrValue(TW_OPERATION_ETA_VAR, "");
             SetDataState("Restore failed", "", 1, 1);
 			return 1;
 		}
-	}
-	time(&rStop);
-	ui_print("[RESTORE COMPLETED IN %d SECONDS]\n\n",(int)difftime(rStop,rStart));
+
+        // The measured speed goes into the history, and into the averages used for anything new,
+        // unless the cap held it back
+        unsigned long msec = tw_msec_since(&rest_start);
+        unsigned long bps = rest_io->bps ? 0 : tw_rate_of(bytes[i], msec);
+        LOGI("%s: %llu bytes in %lu ms, %lu bytes/sec\n", keys[i], bytes[i], msec, bps);
+        tw_rate_put(rates, sizeof(rates), keys[i], bps);
+        if (bps) {
+            const char* avg = mnt->backup == image ? TW_RESTORE_AVG_IMG_RATE :
+                              strstr(keys[i], ".none") ? TW_RESTORE_AVG_FILE_RATE : TW_RESTORE_AVG_FILE_COMP_RATE;
+            DataManager_SetIntValue(avg, (int) (((unsigned long long) DataManager_GetIntValue(avg) * 3 + bps) / 4));
+        }
+    }
+    DataManager_SetStrValue(TW_RESTORE_RATES_VAR, rates);
+    DataManager_SetStrValue(TW_OPERATION_ETA_VAR, "");
+
+	ui_print("[RESTORE COMPLETED IN %lu SECONDS]\n\n",tw_msec_since(&rStart) / 1000);
 	__system("sync");
 	LOGI("=> Let's update filesystem types.\n");
 	verifyFst();
@@ -1359,8 +3311,106 @@ nandroid_rest_exe()
 	return 0;
 }
 
-static int compare_string(const void* a, const void* b) {
-    return strcmp(*(const char**)a, *(const char**)b);
+int 
+nandroid_rest_exe()
+{
+    SetDataState("", "", 0, 0);
+
+    const char* nan_dir = DataManager_GetStrValue("tw_restore");
+
+	if (ensure_path_mounted(SDCARD_ROOT) != 0) {
+		ui_print("-- Could not mount: %s.\n-- Aborting.\n",SDCARD_ROOT);
+		return 1;
+	}
+
+    // The restore gives way to the GUI, and can be held to a cap or paused
+    TwIoJob io;
+    int prio = tw_start_io(&io), ret;
+    rest_io = &io;
+
+    // Single folders are restored on top of what's there, without wiping any partition
+    const char* rest_paths = DataManager_GetStrValue(TW_RESTORE_PATHS_VAR);
+    if (rest_paths[0])
+        ret = nandroid_rest_paths(nan_dir, rest_paths);
+    else
+        ret = nandroid_rest_parts(nan_dir);
+
+    rest_io = NULL;
+    tw_stop_io(&io, prio);
+    return ret;
+}
+
+static void tw_verify_progress(unsigned long long done, unsigned long long total, void* cookie)
+{
+    struct timeval* start = (struct timeval*) cookie;
+    unsigned long elapsed = tw_msec_since(start);
+
+    if (!total)     return;
+    ui_set_progress(done / (float) total);
+    if (done && elapsed >= 1000)
+        tw_set_eta((unsigned long) ((total - done) * (elapsed / 1000.0) / done));
+}
+
+/* Checks every backup in the folder chosen for restore, all at once: the digest
+** of each file and whether its data holds together. Nothing is mounted or
+** written apart from the sdcard being read.
+*/
+int
+nandroid_verify_exe()
+{
+    const char* nan_dir = DataManager_GetStrValue("tw_restore");
+    TwVerifyOptions opts;
+    TwVerifyResult* results;
+    struct timeval start;
+    char probe[512];
+    char store[512];
+    int i, count, failed = 0;
+
+    SetDataState("Verifying", "", 0, 0);
+    if (ensure_path_mounted(SDCARD_ROOT) != 0) {
+        ui_print("-- Could not mount: %s.\n-- Aborting.\n",SDCARD_ROOT);
+        SetDataState("Verify failed", "", 1, 1);
+        return 1;
+    }
+
+    // The chunk store sits next to the backup folders of the device, as seen from any file in one
+    sprintf(probe, "%s/%s", nan_dir, TW_CHUNK_STORE);
+    tw_chunk_store_for(probe, store);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.dir = nan_dir;
+    opts.store = store;
+    opts.progress = tw_verify_progress;
+    opts.cookie = &start;
+
+    ui_print("\n[VERIFY STARTED]\n\n");
+    ui_show_progress(1.0, 0);
+    gettimeofday(&start, NULL);
+    count = tw_verify_folder(&opts, &results);
+    DataManager_SetStrValue(TW_OPERATION_ETA_VAR, "");
+    if (count < 0) {
+        ui_print("-- Unable to read %s.\n", nan_dir);
+        SetDataState("Verify failed", "", 1, 1);
+        return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        ui_print("%s: %s (%s)\n", results[i].name, tw_verify_status_name(results[i].status),
+                 results[i].kind[0] ? results[i].kind : "-");
+        if (results[i].status != TW_VERIFY_OK && results[i].status != TW_VERIFY_NO_DIGEST)
+            failed++;
+    }
+    free(results);
+
+    if (count == 0)     ui_print("-- No backups found in %s.\n", nan_dir);
+    ui_print("[VERIFY COMPLETED IN %lu SECONDS]\n\n", tw_msec_since(&start) / 1000);
+    if (failed || count == 0) {
+        ui_print("-- %d of %d backup files failed verification.\n", failed, count);
+        SetDataState("Verify failed", "", 1, 1);
+        return 1;
+    }
+    SetDataState("Verify Succeeded", "", 0, 1);
+    return 0;
 }
 
 void choose_backup_folder() 
@@ -1390,145 +3440,64 @@ void choose_backup_folder()
                                    NULL };
     
     char** headers = prepend_title((const char**) MENU_HEADERS);
-    
-    DIR* d;
-    struct dirent* de;
-    d = opendir(tw_dir);
-    if (d == NULL) {
-        LOGE("error opening %s: %s\n", tw_dir, strerror(errno));
+
+    // The catalog only reads the backup folders that changed since it was made
+    TwCatalog catalog;
+    if (tw_catalog_open(tw_dir, &catalog) != 0)
         return;
-    }
 
-    int d_size = 0;
-    int d_alloc = 10;
-    char** dirs = malloc(d_alloc * sizeof(char*));
-    int z_size = 1;
-    int z_alloc = 10;
-    char** zips = malloc(z_alloc * sizeof(char*));
+    int z_size = catalog.count + 1;
+    char** zips = malloc((z_size + 1) * sizeof(char*));
     zips[0] = strdup("../");
-    
-    inc_menu_loc(0);
-    while ((de = readdir(d)) != NULL) {
-        int name_len = strlen(de->d_name);
-
-        if (de->d_type == DT_DIR) {
-            if (name_len == 1 && de->d_name[0] == '.') continue;
-            if (name_len == 2 && de->d_name[0] == '.' &&
-                de->d_name[1] == '.') continue;
-
-            if (d_size >= d_alloc) {
-                d_alloc *= 2;
-                dirs = realloc(dirs, d_alloc * sizeof(char*));
-            }
-            dirs[d_size] = malloc(name_len + 2);
-            strcpy(dirs[d_size], de->d_name);
-            dirs[d_size][name_len] = '/';
-            dirs[d_size][name_len+1] = '\0';
-            ++d_size;
-        }
-    }
-    closedir(d);
 
-    qsort(dirs, d_size, sizeof(char*), compare_string);
-    qsort(zips, z_size, sizeof(char*), compare_string);
+    inc_menu_loc(0);
+    int i;
+    for (i = 0; i < catalog.count; i++) {
+        const TwCatalogBackup* backup = &catalog.backups[i];
+        char item[320];
 
-    if (d_size + z_size + 1 > z_alloc) {
-        z_alloc = d_size + z_size + 1;
-        zips = realloc(zips, z_alloc * sizeof(char*));
+        if (backup->partial)    sprintf(item, "%s/ (interrupted)", backup->name);
+        else                    sprintf(item, "%s/ (%llu MB)", backup->name, tw_catalog_size(backup) / (1024 * 1024));
+        zips[i + 1] = strdup(item);
     }
-    memcpy(zips + z_size, dirs, d_size * sizeof(char*));
-    free(dirs);
-    z_size += d_size;
     zips[z_size] = NULL;
 
-    int chosen_item = 0;
-    for (;;) {
-        chosen_item = get_menu_selection(headers, zips, 1, chosen_item);
-
-        char* item = zips[chosen_item];
-        int item_len = strlen(item);
-
-        if (chosen_item == 0) {
-            break;
-        } else if (item[item_len-1] == '/') {
-            char nan_dir[512];
+    int chosen_item = get_menu_selection(headers, zips, 1, 0);
+    if (chosen_item > 0) {
+        char nan_dir[512];
 
-            strcpy(nan_dir, tw_dir);
-            strcat(nan_dir, item);
+        sprintf(nan_dir, "%s%s/", tw_dir, catalog.backups[chosen_item - 1].name);
 
-            DataManager_SetStrValue("tw_restore", nan_dir);
+        DataManager_SetStrValue("tw_restore", nan_dir);
 
-            set_restore_files();
-            nan_restore_menu(0);
-            break;
-        }
+        set_restore_files();
+        nan_restore_menu(0);
     }
 
-    int i;
     for (i = 0; i < z_size; ++i) free(zips[i]);
     free(zips);
+    tw_catalog_free(&catalog);
 
     dec_menu_loc();
 }
 
-int makeMD5(const char *imgDir, const char *imgFile)
-{
-	int bool = 1;
-
-    if (DataManager_GetIntValue(TW_SKIP_MD5_GENERATE_VAR) == 1) {
-        // When skipping the generate, we return success
-        return 0;
-    }
-
-	if (ensure_path_mounted("/sdcard") != 0) {
-		LOGI("=> Can not mount sdcard.\n");
-		return bool;
-	} else {
-		FILE *fp;
-		char tmpString[255];
-		char tmpAnswer[15];
-		sprintf(tmpString,"cd %s && md5sum %s > %s.md5",imgDir,imgFile,imgFile);
-		fp = __popen(tmpString, "r");
-		fgets(tmpString, 255, fp);
-		getWordFromString(1, tmpString, tmpAnswer, sizeof(tmpAnswer));
-		if (strcmp(tmpAnswer,"md5sum:") == 0) {
-            ui_print("....MD5 Error: %s (%s)", tmpString, tmpAnswer);
-		} else {
-			ui_print("....MD5 Created.\n");
-			bool = 0;
-		}
-		__pclose(fp);
-	}
-	return bool;
-}
-
-int checkMD5(const char *imgDir, const char *imgFile)
+/* Writes the sidecar for a digest computed while the backup was written,
+** eg. imgFile.md5. Uses the same format as md5sum, so an MD5 can still be
+** checked with it.
+*/
+int writeDigest(const char *imgDir, const char *imgFile, TwDigestType type, const unsigned char *digest)
 {
-	int bool = 1;
+    char filename[512];
+    TwDigest sidecar;
 
-    if (DataManager_GetIntValue(TW_SKIP_MD5_CHECK_VAR) == 1) {
-        // When skipping the test, we return success
-        return 0;
+    sprintf(filename, "%s%s", imgDir, imgFile);
+    sidecar.type = type;
+    memcpy(sidecar.digest, digest, TW_DIGEST_MAX_SIZE);
+    if (tw_digest_write(filename, &sidecar) != 0)
+    {
+        ui_print("....Digest Error: unable to write %s.%s\n", filename, tw_digest_name(type));
+        return 1;
     }
-
-	if (ensure_path_mounted("/sdcard") != 0) {
-		LOGI("=> Can not mount sdcard.\n");
-		return bool;
-	} else {
-		FILE *fp;
-		char tmpString[255];
-		char tmpAnswer[15];
-		sprintf(tmpString,"cd %s && md5sum -c %s.md5",imgDir,imgFile);
-		fp = __popen(tmpString, "r");
-		fgets(tmpString, 255, fp);
-		getWordFromString(2, tmpString, tmpAnswer, sizeof(tmpAnswer));
-		if (strcmp(tmpAnswer,"OK") == 0) {
-			ui_print("....MD5 Check: %s\n", tmpAnswer);
-			bool = 0;
-		} else {
-			ui_print("....MD5 Error: %s (%s)", tmpString, tmpAnswer);
-		}
-		__pclose(fp);
-	}
-	return bool;
+    ui_print("....%s Created.\n", tw_digest_name(type));
+    return 0;
 }
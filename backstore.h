@@ -1,6 +1,7 @@
 // Header goes here
 
 #include "ddftw.h"
+#include "tw_digest.h"
 
 #ifndef _BACKSTORE_HEADER
 #define _BACKSTORE_HEADER
@@ -15,6 +16,7 @@ void nandroid_menu();
 void nan_backup_menu(int pIdx);
 int nandroid_back_exe();
 int nandroid_rest_exe();
+int nandroid_verify_exe();
 
 void choose_backup_folder();
 void set_restore_files();
@@ -23,8 +25,7 @@ char* nan_compress();
 
 int sdSpace;
 
-int makeMD5(const char *imgDir, const char *imgFile);
-int checkMD5(const char *imgDir, const char *imgFile);
+int writeDigest(const char *imgDir, const char *imgFile, TwDigestType type, const unsigned char *digest);
 
 int tw_isMounted(struct dInfo mMnt);
 int tw_mount(struct dInfo mMnt);
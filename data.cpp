@@ -44,6 +44,7 @@ extern "C"
     #include "data.h"
 	#include "ddftw.h"
     #include "tw_reboot.h"
+    #include "tw_io.h"
 
     int get_battery_level(void);
     void get_device_id(void);
@@ -55,6 +56,10 @@ extern "C"
 
 #define FILE_VERSION    0x00010001
 
+// Seconds a change to a persisted value waits before it's written, so a
+// burst of them is written once
+#define SAVE_DELAY      2
+
 using namespace std;
 
 DataManager::TValueMap  DataManager::mValues;
@@ -62,11 +67,20 @@ DataManager::TArrayMap  DataManager::mArrays;
 DataManager::TStrMap    DataManager::mConstValues;
 string                  DataManager::mBackingFile;
 int                     DataManager::mInitialized = 0;
+int                     DataManager::mDirty = 0;
+time_t                  DataManager::mDirtySince = 0;
+pthread_t               DataManager::mSaveThread;
+int                     DataManager::mSaveStarted = 0;
+pthread_mutex_t         DataManager::mLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t         DataManager::mSaveLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t          DataManager::mSaveCond = PTHREAD_COND_INITIALIZER;
 
 int DataManager::ResetDefaults()
 {
+    pthread_mutex_lock(&mLock);
     mValues.clear();
     mConstValues.clear();
+    pthread_mutex_unlock(&mLock);
     SetDefaultValues();
     return 0;
 }
@@ -77,7 +91,9 @@ int DataManager::LoadValues(const string filename)
         SetDefaultValues();
 
     // Save off the backing file for set operations
+    pthread_mutex_lock(&mLock);
     mBackingFile = filename;
+    pthread_mutex_unlock(&mLock);
 
     // Read in the file, if possible
     FILE* in = fopen(filename.c_str(), "rb");
@@ -106,6 +122,7 @@ int DataManager::LoadValues(const string filename)
 
         TValueMap::iterator pos;
 
+        pthread_mutex_lock(&mLock);
         pos = mValues.find(Name);
         if (pos != mValues.end())
         {
@@ -114,6 +131,7 @@ int DataManager::LoadValues(const string filename)
         }
         else
             mValues.insert(TNameValuePair(Name, TStrIntPair(Value, 1)));
+        pthread_mutex_unlock(&mLock);
     }
     fclose(in);
     return 0;
@@ -126,18 +144,41 @@ error:
 
 int DataManager::Flush()
 {
-    return SaveValues();
+    // The file may be gone, as after partitioning, so it's written dirty or not
+    return SaveValues(0);
 }
 
-int DataManager::SaveValues()
+// Writes only what's waiting to be written. Saves go one at a time, so when
+// several threads get here at once the first writes and the rest find
+// nothing left to do.
+int DataManager::FlushPending()
 {
-    if (mBackingFile.empty())       return -1;
+    return SaveValues(1);
+}
 
-    FILE* out = fopen(mBackingFile.c_str(), "wb");
-    if (!out)                       return -1;
+int DataManager::SaveValues(int onlyDirty /* = 0 */)
+{
+    string data, file, temp;
+    int fd, ret = 0;
+
+    // One save at a time, from the copy to the rename, so an older copy can
+    // never land on top of a newer one
+    pthread_mutex_lock(&mSaveLock);
+
+    // Copy the persisted values while nothing changes them, and write them
+    // once they're let go. Changes after the copy make it dirty again.
+    pthread_mutex_lock(&mLock);
+    if (onlyDirty && !mDirty)
+    {
+        pthread_mutex_unlock(&mLock);
+        pthread_mutex_unlock(&mSaveLock);
+        return 0;
+    }
+    mDirty = 0;
+    file = mBackingFile;
 
     int file_version = FILE_VERSION;
-    fwrite(&file_version, 1, sizeof(int), out);
+    data.append((const char*) &file_version, sizeof(int));
 
     TValueMap::iterator iter;
     for (iter = mValues.begin(); iter != mValues.end(); ++iter)
@@ -146,15 +187,90 @@ int DataManager::SaveValues()
         if (iter->second.second != 0)
         {
             unsigned short length = (unsigned short) iter->first.length() + 1;
-            fwrite(&length, 1, sizeof(unsigned short), out);
-            fwrite(iter->first.c_str(), 1, length, out);
+            data.append((const char*) &length, sizeof(unsigned short));
+            data.append(iter->first.c_str(), length);
             length = (unsigned short) iter->second.first.length() + 1;
-            fwrite(&length, 1, sizeof(unsigned short), out);
-            fwrite(iter->second.first.c_str(), 1, length, out);
+            data.append((const char*) &length, sizeof(unsigned short));
+            data.append(iter->second.first.c_str(), length);
         }
     }
-    fclose(out);
-    return 0;
+    pthread_mutex_unlock(&mLock);
+
+    if (file.empty())
+    {
+        pthread_mutex_unlock(&mSaveLock);
+        return -1;
+    }
+
+    // A new file takes the place of the old one whole, so a reboot halfway
+    // through leaves the settings as they were
+    temp = file + ".tmp";
+    fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)                     ret = -1;
+    else
+    {
+        if (write(fd, data.data(), data.length()) != (ssize_t) data.length())  ret = -1;
+        if (fsync(fd) != 0)         ret = -1;
+        if (close(fd) != 0)         ret = -1;
+        if (ret == 0 && rename(temp.c_str(), file.c_str()) != 0)    ret = -1;
+        if (ret != 0)               unlink(temp.c_str());
+    }
+    pthread_mutex_unlock(&mSaveLock);
+    return ret;
+}
+
+void* DataManager::SaveThread(void* cookie)
+{
+    pthread_mutex_lock(&mLock);
+    for (;;)
+    {
+        struct timespec until;
+
+        while (!mDirty)
+            pthread_cond_wait(&mSaveCond, &mLock);
+
+        // Flush may get to it first
+        until.tv_sec = mDirtySince + SAVE_DELAY;
+        until.tv_nsec = 0;
+        while (mDirty && time(NULL) < until.tv_sec)
+            pthread_cond_timedwait(&mSaveCond, &mLock, &until);
+        if (!mDirty)    continue;
+
+        pthread_mutex_unlock(&mLock);
+        if (SaveValues(1) != 0)
+        {
+            pthread_mutex_lock(&mLock);
+            string file = mBackingFile;
+            pthread_mutex_unlock(&mLock);
+            LOGE("Unable to save settings to %s\n", file.c_str());
+        }
+        pthread_mutex_lock(&mLock);
+    }
+    return NULL;
+}
+
+// Called with mLock held
+void DataManager::MarkDirty()
+{
+    if (!mSaveStarted)
+    {
+        if (pthread_create(&mSaveThread, NULL, SaveThread, NULL) != 0)
+        {
+            // Without the thread, it's written right away as it used to be
+            pthread_mutex_unlock(&mLock);
+            SaveValues(0);
+            pthread_mutex_lock(&mLock);
+            return;
+        }
+        pthread_detach(mSaveThread);
+        mSaveStarted = 1;
+    }
+    if (!mDirty)
+    {
+        mDirty = 1;
+        mDirtySince = time(NULL);
+        pthread_cond_signal(&mSaveCond);
+    }
 }
 
 int DataManager::GetValue(const string varName, string& value)
@@ -174,21 +290,23 @@ int DataManager::GetValue(const string varName, string& value)
     // Handle magic values
     if (GetMagicValue(localStr, value) == 0)     return 0;
 
+    int ret = 0;
+    pthread_mutex_lock(&mLock);
     TStrMap::iterator constPos;
     constPos = mConstValues.find(localStr);
     if (constPos != mConstValues.end())
-    {
         value = constPos->second;
-        return 0;
+    else
+    {
+        TValueMap::iterator pos;
+        pos = mValues.find(localStr);
+        if (pos == mValues.end())
+            ret = -1;
+        else
+            value = pos->second.first;
     }
-
-    TValueMap::iterator pos;
-    pos = mValues.find(localStr);
-    if (pos == mValues.end())
-        return -1;
-
-    value = pos->second.first;
-    return 0;
+    pthread_mutex_unlock(&mLock);
+    return ret;
 }
 
 int DataManager::GetValue(const string varName, int& value)
@@ -208,15 +326,21 @@ string& DataManager::GetValueRef(const string varName)
     if (!mInitialized)
         SetDefaultValues();
 
+    // The reference outlives the lock, only ResetDefaults ever drops a value
+    pthread_mutex_lock(&mLock);
     TStrMap::iterator constPos;
     constPos = mConstValues.find(varName);
     if (constPos != mConstValues.end())
+    {
+        pthread_mutex_unlock(&mLock);
         return constPos->second;
+    }
 
     TValueMap::iterator pos;
     pos = mValues.find(varName);
     if (pos == mValues.end())
         pos = (mValues.insert(TNameValuePair(varName, TStrIntPair("", 0)))).first;
+    pthread_mutex_unlock(&mLock);
 
     return pos->second.first;
 }
@@ -249,20 +373,38 @@ int DataManager::SetValue(const string varName, string value, int persist /* = 0
     if (varName.empty() || (varName[0] >= '0' && varName[0] <= '9'))
         return -1;
 
+    pthread_mutex_lock(&mLock);
     TStrMap::iterator constChk;
     constChk = mConstValues.find(varName);
     if (constChk != mConstValues.end())
+    {
+        pthread_mutex_unlock(&mLock);
         return -1;
+    }
 
     TValueMap::iterator pos;
     pos = mValues.find(varName);
     if (pos == mValues.end())
+    {
         pos = (mValues.insert(TNameValuePair(varName, TStrIntPair(value, persist)))).first;
-    else
+        if (persist)
+            MarkDirty();
+    }
+    else if (pos->second.first != value)
+    {
+        // Setting what's there already is nothing to save
         pos->second.first = value;
+        if (pos->second.second != 0)
+            MarkDirty();
+    }
+    pthread_mutex_unlock(&mLock);
 
-    if (pos->second.second != 0)
-        SaveValues();
+    // The GUI pauses whatever is running through this one
+    if (varName == TW_OPERATION_PAUSED_VAR)
+    {
+        if (atoi(value.c_str()))    tw_io_pause(NULL);
+        else                        tw_io_resume(NULL);
+    }
 
     gui_notifyVarChange(varName.c_str(), value.c_str());
     return 0;
@@ -285,8 +427,15 @@ int DataManager::SetValue(const string varName, float value, int persist /* = 0
 void DataManager::DumpValues()
 {
     TValueMap::iterator iter;
+    TValueMap values;
+
+    // Printed from a copy, the GUI may want values of its own while it prints
+    pthread_mutex_lock(&mLock);
+    values = mValues;
+    pthread_mutex_unlock(&mLock);
+
     ui_print("Data Manager dump - Values with leading X are persisted.\n");
-    for (iter = mValues.begin(); iter != mValues.end(); ++iter)
+    for (iter = values.begin(); iter != values.end(); ++iter)
     {
         ui_print("%c %s=%s\n", iter->second.second ? 'X' : ' ', iter->first.c_str(), iter->second.first.c_str());
     }
@@ -301,6 +450,7 @@ void DataManager::SetDefaultValues()
     str = "/sdcard/TWRP/BACKUPS/";
     str += device_id;
 
+    pthread_mutex_lock(&mLock);
     mInitialized = 1;
 
     mConstValues.insert(make_pair("true", "1"));
@@ -339,6 +489,11 @@ void DataManager::SetDefaultValues()
     mValues.insert(make_pair(TW_FORCE_MD5_CHECK_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(TW_COLOR_THEME_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(TW_USE_COMPRESSION_VAR, make_pair("0", 1)));
+    mValues.insert(make_pair(TW_COMPRESSION_CODEC_VAR, make_pair("gzip", 1)));
+    mValues.insert(make_pair(TW_COMPRESSION_POLICY_VAR, make_pair("data=lz4,.android_secure=none", 1)));
+    mValues.insert(make_pair(TW_USE_SPARSE_IMAGES_VAR, make_pair("1", 1)));
+    mValues.insert(make_pair(TW_USE_INCREMENTAL_VAR, make_pair("0", 1)));
+    mValues.insert(make_pair(TW_USE_DIFFERENTIAL_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(TW_SHOW_SPAM_VAR, make_pair("0", 1)));
     mValues.insert(make_pair(TW_TIME_ZONE_VAR, make_pair("CST6CDT", 1)));
     mValues.insert(make_pair(TW_ZIP_LOCATION_VAR, make_pair("/sdcard", 1)));
@@ -357,9 +512,22 @@ void DataManager::SetDefaultValues()
     mValues.insert(make_pair(TW_BACKUP_AVG_IMG_RATE, make_pair("15000000", 1)));
     mValues.insert(make_pair(TW_BACKUP_AVG_FILE_RATE, make_pair("3000000", 1)));
     mValues.insert(make_pair(TW_BACKUP_AVG_FILE_COMP_RATE, make_pair("2000000", 1)));
+    mValues.insert(make_pair(TW_BACKUP_JOBS_VAR, make_pair("2", 1)));
+    mValues.insert(make_pair(TW_BACKUP_RATES_VAR, make_pair("", 1)));
+    mValues.insert(make_pair(TW_BACKUP_SEGMENT_SIZE_VAR, make_pair("4095", 1)));
+    mValues.insert(make_pair(TW_BACKUP_RESUME_VAR, make_pair("1", 1)));
+    mValues.insert(make_pair(TW_BACKUP_DIGEST_VAR, make_pair("md5", 1)));
     mValues.insert(make_pair(TW_RESTORE_AVG_IMG_RATE, make_pair("15000000", 1)));
     mValues.insert(make_pair(TW_RESTORE_AVG_FILE_RATE, make_pair("3000000", 1)));
     mValues.insert(make_pair(TW_RESTORE_AVG_FILE_COMP_RATE, make_pair("2000000", 1)));
+    mValues.insert(make_pair(TW_RESTORE_RATES_VAR, make_pair("", 1)));
+    mValues.insert(make_pair(TW_RESTORE_PATHS_VAR, make_pair("", 0)));
+    mValues.insert(make_pair(TW_RESTORE_CHANGED_ONLY_VAR, make_pair("1", 1)));
+    mValues.insert(make_pair(TW_OPERATION_ETA_VAR, make_pair("", 0)));
+    mValues.insert(make_pair(TW_OPERATION_PAUSED_VAR, make_pair("0", 0)));
+    mValues.insert(make_pair(TW_IO_PRIORITY_VAR, make_pair("1", 1)));
+    mValues.insert(make_pair(TW_IO_LIMIT_VAR, make_pair("0", 1)));
+    pthread_mutex_unlock(&mLock);
 }
 
 // Magic Values
@@ -471,6 +639,11 @@ extern "C" int DataManager_Flush()
     return DataManager::Flush();
 }
 
+extern "C" int DataManager_FlushPending()
+{
+    return DataManager::FlushPending();
+}
+
 extern "C" int DataManager_GetValue(const char* varName, char* value)
 {
     int ret;
@@ -20,6 +20,7 @@
 int DataManager_ResetDefaults();
 int DataManager_LoadValues(const char* filename);
 int DataManager_Flush();
+int DataManager_FlushPending();
 const char* DataManager_GetStrValue(const char* varName);
 int DataManager_GetIntValue(const char* varName);
 
@@ -21,6 +21,8 @@
 #include <utility>
 #include <vector>
 #include <map>
+#include <pthread.h>
+#include <time.h>
 
 using namespace std;
 
@@ -39,6 +41,7 @@ public:
     static int ResetDefaults();
     static int LoadValues(const string filename);
     static int Flush();
+    static int FlushPending();
 
     // Core get routines
     static int GetValue(const string varName, string& value);
@@ -68,9 +71,20 @@ protected:
     static string mBackingFile;
     static int mInitialized;
 
+    // Persisted values are written behind, shortly after they change
+    static int mDirty;
+    static time_t mDirtySince;
+    static pthread_t mSaveThread;
+    static int mSaveStarted;
+    static pthread_mutex_t mLock;
+    static pthread_mutex_t mSaveLock;
+    static pthread_cond_t mSaveCond;
+
 
 protected:
-    static int SaveValues();
+    static int SaveValues(int onlyDirty = 0);
+    static void* SaveThread(void* cookie);
+    static void MarkDirty();
     static void SetDefaultValues();
 
     static int GetMagicValue(string varName, string& value);
@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <unistd.h>
@@ -26,6 +27,7 @@
 #include "bootloader.h"
 #include "backstore.h"
 #include "data.h"
+#include "tw_usage.h"
 
 struct dInfo tmp, sys, dat, boo, rec, cac, sdcext, sdcint, ase, sde, sp1, sp2, sp3;
 char tw_device_name[20];
@@ -281,24 +283,6 @@ int getLocationsViaProc(const char* fstype)
     return getLocationsViafstab();
 }
 
-unsigned long long getUsedSizeViaDu(const char* path)
-{
-    char cmd[512];
-    sprintf(cmd, "du %s | awk '{ print $1 }'", path);
-
-    FILE *fp;
-    fp = __popen(cmd, "r");
-    
-    char str[512];
-    fgets(str, sizeof(str), fp);
-    __pclose(fp);
-
-    unsigned long long size = atol(str);
-    size *= 1024;
-
-    return size;
-}
-
 void updateMntUsedSize(struct dInfo* mMnt)
 {
 #ifdef RECOVERY_SDCARD_ON_DATA
@@ -314,12 +298,12 @@ void updateMntUsedSize(struct dInfo* mMnt)
 
 	if (strcmp(mMnt->mnt, ".android_secure") == 0)
     {
-		// android_secure is a little different - we mount sdcard and use du to figure out how much space is being taken up by android_secure
+		// android_secure is a little different - we mount sdcard and add up how much space is being taken up by android_secure
         
         // We can ignore any error from this, it doesn't matter
         tw_mount(sdcext);
 
-        mMnt->used = getUsedSizeViaDu("/sdcard/.android_secure");
+        mMnt->used = tw_usage_tree("/sdcard/.android_secure");
         mMnt->sze = mMnt->used;
         return;
 	}
@@ -356,20 +340,42 @@ void updateMntUsedSize(struct dInfo* mMnt)
     return;
 }
 
+static void* updateUsedSizeThread(void* cookie)
+{
+    struct dInfo** mnts = (struct dInfo**) cookie;
+
+    for (; *mnts; mnts++)
+        updateMntUsedSize(*mnts);
+    return NULL;
+}
+
 void updateUsedSized()
 {
-    updateMntUsedSize(&boo);
-    updateMntUsedSize(&sys);
-    updateMntUsedSize(&dat);
-    updateMntUsedSize(&cac);
-    updateMntUsedSize(&rec);
-    updateMntUsedSize(&sdcext);
-    updateMntUsedSize(&sdcint);
-    updateMntUsedSize(&sde);
-	updateMntUsedSize(&ase);
-    updateMntUsedSize(&sp1);
-    updateMntUsedSize(&sp2);
-    updateMntUsedSize(&sp3);
+    // Most of the time goes into mounting, so every partition gets a thread. .android_secure
+    // lives on the sdcard and shares its thread, so one can't unmount it under the other.
+    static struct dInfo* groups[][3] = {
+        { &boo, NULL }, { &sys, NULL }, { &dat, NULL }, { &cac, NULL },
+        { &rec, NULL }, { &sdcext, &ase, NULL }, { &sdcint, NULL }, { &sde, NULL },
+        { &sp1, NULL }, { &sp2, NULL }, { &sp3, NULL },
+    };
+    const int count = sizeof(groups) / sizeof(groups[0]);
+    pthread_t threads[sizeof(groups) / sizeof(groups[0])];
+    int started[sizeof(groups) / sizeof(groups[0])];
+    int i;
+
+    // USB storage, adb or the file manager may have changed anything since
+    // the last pass, and only this pass and the backup it's for reuse sizes
+    tw_usage_invalidate(NULL);
+
+    for (i = 0; i < count; i++)
+    {
+        // Unmountable partitions only copy their size, that's not worth a thread
+        started[i] = groups[i][0]->mountable && pthread_create(&threads[i], NULL, updateUsedSizeThread, groups[i]) == 0;
+        if (!started[i])
+            updateUsedSizeThread(groups[i]);
+    }
+    for (i = 0; i < count; i++)
+        if (started[i])     pthread_join(threads[i], NULL);
 
     dumpPartitionTable();
     return;
@@ -52,6 +52,8 @@
 #include "ddftw.h"
 #include "backstore.h"
 #include "themes.h"
+#include "tw_remove.h"
+#include "tw_digest.h"
 
 //kang system() from bionic/libc/unistd and rename it __system() so we can be even more hackish :)
 #undef _PATH_BSHELL
@@ -420,6 +422,9 @@ int usb_storage_enable(void)
         return -1;
     }
 
+    // The computer gets the sdcard to itself, settings waiting to be written go first
+    DataManager_Flush();
+
     if ((fd = open(CUSTOM_LUN_FILE"0/file", O_WRONLY)) < 0)
     {
         LOGE("Unable to open ums lunfile: (%s)", strerror(errno));
@@ -665,11 +670,11 @@ void wipe_dalvik_cache()
         ensure_path_mounted("/data");
         ensure_path_mounted("/cache");
         ui_print("\n-- Wiping Dalvik Cache Directories...\n");
-        __system("rm -rf /data/dalvik-cache");
+        tw_remove_tree("/data/dalvik-cache");
         ui_print("Cleaned: /data/dalvik-cache...\n");
-        __system("rm -rf /cache/dalvik-cache");
+        tw_remove_tree("/cache/dalvik-cache");
         ui_print("Cleaned: /cache/dalvik-cache...\n");
-        __system("rm -rf /cache/dc");
+        tw_remove_tree("/cache/dc");
         ui_print("Cleaned: /cache/dc\n");
 
         struct stat st;
@@ -681,7 +686,7 @@ void wipe_dalvik_cache()
     	    LOGI("Mounting /sd-ext\n");
     	    if (stat("/sd-ext/dalvik-cache",&st) == 0)
     	    {
-                __system("rm -rf /sd-ext/dalvik-cache");
+                tw_remove_tree("/sd-ext/dalvik-cache");
         	    ui_print("Cleaned: /sd-ext/dalvik-cache...\n");
     	    }
         }
@@ -1597,6 +1602,7 @@ void mount_menu(int pIdx)
 				__system("mount /data");
 				ui_print("/data has been mounted.\n");
 			} else if (datIsMounted == 1) {
+				ensure_settings_flushed("/data");
 				__system("umount /data");
 				ui_print("/data has been unmounted.\n");
 			}
@@ -1617,6 +1623,7 @@ void mount_menu(int pIdx)
 				__system("mount /sdcard");
 				ui_print("/sdcard has been mounted.\n");
 			} else if (sdcIsMounted == 1) {
+				ensure_settings_flushed("/sdcard");
 				__system("umount /sdcard");
 				ui_print("/sdcard has been unmounted.\n");
 			}
@@ -1853,33 +1860,48 @@ void all_settings_menu(int pIdx)
         1 : Success
 */
 int check_md5(char* path) {
-    char cmd[PATH_MAX + 30];
-    sprintf(cmd, "/sbin/md5check.sh \"%s\"", path);
-    
-    //ui_print("\nMD5 Command: %s", cmd);
-    
-    FILE * cs = __popen(cmd, "r");
-    char cs_s[7];
-    fgets(cs_s, 7, cs);
-
-    //ui_print("\nMD5 Message: %s", cs_);
-    __pclose(cs);
-    
-    int o = -99;
-    if (strncmp(cs_s, "OK", 2) == 0)
-        o = 1;
-    else if (strncmp(cs_s, "FAILURE", 7) == 0)
-        o = 0;
-    else if (strncmp(cs_s, "NO5", 3) == 0)
-        o = -1;
-    else if (strncmp(cs_s, "NOZ", 3) == 0)
-        o = -2;
-    else if (strncmp(cs_s, "DF", 2) == 0)
-        o = -3;
-    else // Unknown error
-        o = -99;
-
-    return o;
+    unsigned char expected[MD5_DIGEST_SIZE];
+    unsigned char digest[TW_DIGEST_MAX_SIZE];
+    char filename[PATH_MAX];
+    char line[PATH_MAX + 64];
+    const char* zipname;
+    char* name;
+    char* end;
+    FILE* fp;
+
+    zipname = strrchr(path, '/');
+    zipname = zipname ? zipname + 1 : path;
+
+    // Same answers md5check.sh gave, without starting a shell and md5sum
+    snprintf(filename, sizeof(filename), "%s.md5", path);
+    fp = fopen(filename, "r");
+    if (!fp)
+        return -1;
+    if (!fgets(line, sizeof(line), fp))
+        line[0] = '\0';
+    fclose(fp);
+
+    // "<md5>  <name>", md5sum puts a * before the name in binary mode
+    name = line;
+    while (*name && !isspace((unsigned char) *name))
+        name++;
+    while (isspace((unsigned char) *name))
+        name++;
+    if (*name == '*')
+        name++;
+    end = name + strlen(name);
+    while (end > name && isspace((unsigned char) end[-1]))
+        *--end = '\0';
+    if (strcmp(name, zipname) != 0)
+        return -3;
+
+    if (access(path, F_OK) != 0)
+        return -2;
+    if (tw_digest_from_hex(line, expected, MD5_DIGEST_SIZE) != 0 ||
+        tw_digest_file(path, TW_DIGEST_MD5, digest) != 0 ||
+        memcmp(digest, expected, MD5_DIGEST_SIZE) != 0)
+        return 0;
+    return 1;
 }
 
 static void
@@ -1931,6 +1953,7 @@ show_menu_partition()
 
 				char es[64];
 				sprintf(es, "/sbin/sdparted -es %dM -ss %dM -efs ext%i -s > /cache/part.log",ext,swap,ext_format);
+				DataManager_Flush(); // nothing may be written to the sdcard while it's partitioned
 				LOGI("\nrunning script: %s\n", es);
 				run_script("\nContinue partitioning?",
 					   "\nPartitioning sdcard : ",
@@ -25,6 +25,10 @@
 #include "mtdutils/mtdutils.h"
 #include "mtdutils/mounts.h"
 #include "ddftw.h"
+#include "tw_remove.h"
+#include "tw_usage.h"
+#include "tw_io.h"
+#include "data.h"
 
 static int file_exists(const char* file)
 {
@@ -72,7 +76,11 @@ static int tw_format_mtd(const char* device)
 
 static int tw_format_rmfr(const char* device)
 {
-    char cmd[256];
+#ifdef RECOVERY_SDCARD_ON_DATA
+    static const char* dataExcludes[] = { TW_DATA_MEDIA, NULL };
+#endif
+    const char* const* excludes = NULL;
+    int ret;
 
     Volume* v = volume_for_device(device);
     if (!v)
@@ -87,8 +95,11 @@ static int tw_format_rmfr(const char* device)
         return -1;
     }
     
-    sprintf(cmd, "rm -rf %s/* && rm -rf %s/.*", v->mount_point, v->mount_point);
-    __system(cmd);
+#ifdef RECOVERY_SDCARD_ON_DATA
+    // The internal sdcard is in /data/media, wiping data mustn't take it along
+    if (strcmp(v->mount_point, "/data") == 0)   excludes = dataExcludes;
+#endif
+    ret = tw_remove_contents(v->mount_point, excludes);
 
     if (ensure_path_unmounted(v->mount_point) != 0)
     {
@@ -96,7 +107,7 @@ static int tw_format_rmfr(const char* device)
         LOGW("%s: failed to umount \"%s\"\n", __FUNCTION__, v->mount_point);
     }
 
-    return 0;
+    return ret;
 }
 
 static int tw_format_vfat(const char* device)
@@ -143,7 +154,25 @@ static int tw_format_ext4(const char* device)
     return tw_format_ext23("ext4", device);
 }
 
+static int tw_format_fs(const char *fstype, const char *fsblock);
+
+/* Formats fsblock as fstype in the background I/O class, so the GUI, and
+** mkfs or rm started from here, don't fight over the flash.
+*/
 int tw_format(const char *fstype, const char *fsblock)
+{
+    TwIoJob io;
+    int prio, result;
+
+    tw_io_job_begin(&io, DataManager_GetIntValue(TW_IO_PRIORITY_VAR), 0);
+    prio = tw_io_enter(&io);
+    result = tw_format_fs(fstype, fsblock);
+    tw_io_leave(prio);
+    tw_io_job_end(&io);
+    return result;
+}
+
+static int tw_format_fs(const char *fstype, const char *fsblock)
 {
     int result = -1;
 
@@ -202,5 +231,7 @@ int tw_format(const char *fstype, const char *fsblock)
         }
     }
 
+    // A new file system starts out empty, whatever was cached for it is gone
+    if (v)  tw_usage_invalidate(v->mount_point);
     return result;
 }
@@ -32,6 +32,8 @@
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
 #include "verifier.h"
+#include "tw_usage.h"
+#include "tw_io.h"
 
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
 #define PUBLIC_KEYS_FILE "/res/keys"
@@ -110,6 +112,12 @@ try_update_binary(const char *path, ZipArchive *zip) {
     args[3] = (char*)path;
     args[4] = NULL;
 
+    // The installer runs in the background I/O class, and is stopped while
+    // the install is paused
+    TwIoJob io;
+    tw_io_job_begin(&io, DataManager_GetIntValue(TW_IO_PRIORITY_VAR), 0);
+    int prio = tw_io_enter(&io);
+
     pid_t pid = fork();
     if (pid == 0) {
         close(pipefd[0]);
@@ -117,6 +125,8 @@ try_update_binary(const char *path, ZipArchive *zip) {
         fprintf(stdout, "E:Can't run %s (%s)\n", binary, strerror(errno));
         _exit(-1);
     }
+    tw_io_leave(prio);
+    tw_io_set_child(&io, pid);
     close(pipefd[1]);
 
     char buffer[1024];
@@ -153,6 +163,9 @@ try_update_binary(const char *path, ZipArchive *zip) {
 
     int status;
     waitpid(pid, &status, 0);
+    tw_io_job_end(&io);
+    if (DataManager_GetIntValue(TW_OPERATION_PAUSED_VAR))
+        DataManager_SetIntValue(TW_OPERATION_PAUSED_VAR, 0);
     if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
         LOGE("Error in %s\n(Status %d)\n", path, WEXITSTATUS(status));
         return INSTALL_ERROR;
@@ -288,5 +301,9 @@ install_package(const char *path)
     /* Verify and install the contents of the package.
      */
     ui_print("Installing update...\n");
-    return try_update_binary(path, &zip);
+    err = try_update_binary(path, &zip);
+
+    // The package may have written anywhere, sizes have to be taken again
+    tw_usage_invalidate(NULL);
+    return err;
 }
@@ -7,13 +7,17 @@
 #include <sys/vfs.h>
 #include <sys/mount.h>
 #include <unistd.h>
-#include <dirent.h>
 
 #include <map>
 
 #include "utility.hpp"
 #include "../data.hpp"
 
+extern "C"
+{
+    #include "../tw_remove.h"
+}
+
 string Utility::getFsTypeStr(eFSType type)
 {
     switch (type)
@@ -102,63 +106,29 @@ bool Utility::fileExists(string filename)
     return false;
 }
 
-int Utility::rm_folder(string path)
+// Wiping is best effort, as it always was: a missing folder has nothing to
+// wipe, and anything that can't be removed is logged by tw_remove
+static int wipe_folder(string path, const char* const* excludes)
 {
-    DIR* d;
-    d = opendir(path.c_str());
-    if (d != NULL)
-    {
-        struct dirent* de;
-        while ((de = readdir(d)) != NULL)
-        {
-            // Ignore . and ..
-            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)    continue;
+    struct stat st;
 
-            string fullName = path + "/" + de->d_name;
+    if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))  return 0;
 
-            if (de->d_type == DT_DIR)
-            {
-                rm_folder_safe(fullName);
-                rmdir(fullName.c_str());
-            }
-            else
-                unlink(fullName.c_str());
-        }
-        closedir(d);
-    }
+    tw_remove_contents(path.c_str(), excludes);
     return 0;
 }
 
+int Utility::rm_folder(string path)
+{
+    return wipe_folder(path, NULL);
+}
+
 int Utility::rm_folder_safe(string path)
 {
     // The reason for "safe" is that we won't erase '/data/media'
-    DIR* d;
-    d = opendir(path.c_str());
-    if (d != NULL)
-    {
-        struct dirent* de;
-        while ((de = readdir(d)) != NULL)
-        {
-            // Ignore . and ..
-            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)    continue;
-
-            string fullName = path + "/" + de->d_name;
+    static const char* excludes[] = { TW_DATA_MEDIA, NULL };
 
-            if (de->d_type == DT_DIR)
-            {
-                // Make sure this isn't /data/media
-                if (fullName != "/data/media")
-                {
-                    rm_folder_safe(fullName);
-                    rmdir(fullName.c_str());
-                }
-            }
-            else
-                unlink(fullName.c_str());
-        }
-        closedir(d);
-    }
-    return 0;
+    return wipe_folder(path, excludes);
 }
 
 int Utility::format_ext(eFSType fstype, string device)
@@ -6,6 +6,7 @@
 
 #include "tw_reboot.h"
 #include "recovery_ui.h"
+#include "data.h"
 
 // isRebootCommandSupported: Return 1 if command is supported, 0 if the command is not supported, -1 on error
 int tw_isRebootCommandSupported(RebootCommand command)
@@ -33,6 +34,9 @@ int tw_setRebootMode(RebootCommand command)
 // reboot: Reboot the system. Return -1 on error, no return on success
 int tw_reboot(RebootCommand command)
 {
+    // Settings still waiting to be written go out before /sdcard does
+    DataManager_Flush();
+
     // Always force a sync before we reboot
     sync();
     ensure_path_unmounted("/sdcard");
@@ -47,6 +47,7 @@
 #include "data.h"
 #include "ddftw.h"
 #include "backstore.h"
+#include "tw_remove.h"
 
 int notError;
 
@@ -776,25 +777,10 @@ wipe_data(int confirm) {
 
     // For the Tuna boards, we can't do this! The sdcard is actually /data/media
 #ifdef RECOVERY_SDCARD_ON_DATA
-    tw_mount(dat);
-    __system("rm -f /data/*");
-    __system("rm -f /data/.*");
-
-    DIR* d;
-    d = opendir("/data");
-    if (d != NULL)
-    {
-        struct dirent* de;
-        while ((de = readdir(d)) != NULL)
-        {
-            if (strcmp(de->d_name, "media") == 0)   continue;
+    static const char* dataExcludes[] = { TW_DATA_MEDIA, NULL };
 
-            char cmd[256];
-            sprintf(cmd, "rm -fr /data/%s", de->d_name);
-            __system(cmd);
-        }
-        closedir(d);
-    }
+    tw_mount(dat);
+    tw_remove_contents("/data", dataExcludes);
     tw_unmount(dat);
 #else
     erase_volume("/data");
@@ -808,7 +794,7 @@ wipe_data(int confirm) {
     }
     if (stat("/sdcard/.android_secure", &st) == 0) {
         ui_print("Formatting /sdcard/.android_secure...\n");
-        __system("rm -rf /sdcard/.android_secure/* && rm -rf /sdcard/.android_secure/.*");
+        tw_remove_contents("/sdcard/.android_secure", NULL);
     }
 	ui_reset_progress();
     ui_print("-- Factory reset complete.\n");
@@ -1039,6 +1025,7 @@ main(int argc, char **argv) {
     // Otherwise, get ready to boot the main system...
     finish_recovery(send_intent);
     ui_print("Rebooting...\n");
+    DataManager_Flush();
     sync();
     reboot(RB_AUTOBOOT);
     return EXIT_SUCCESS;
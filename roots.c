@@ -29,6 +29,7 @@
 #include "common.h"
 #include "ddftw.h"
 #include "format.h"
+#include "data.h"
 
 static int num_volumes = 0;
 static Volume* device_volumes = NULL;
@@ -189,6 +190,17 @@ int ensure_path_mounted(const char* path)
     return -1;
 }
 
+void ensure_settings_flushed(const char* mount_point) {
+    // The settings are written behind, in /sdcard/TWRP
+    if (strcmp(mount_point, "/sdcard") == 0
+#ifdef RECOVERY_SDCARD_ON_DATA
+        || strcmp(mount_point, "/data") == 0
+#endif
+       ) {
+        DataManager_FlushPending();
+    }
+}
+
 int ensure_path_unmounted(const char* path) {
     // This is an old, common method for ensuring a flush
     sync();
@@ -218,6 +230,7 @@ int ensure_path_unmounted(const char* path) {
         return 0;
     }
 
+    ensure_settings_flushed(v->mount_point);
     return unmount_mounted_volume(mv);
 }
 
@@ -36,6 +36,10 @@ int ensure_path_mounted(const char* path);
 // success (volume is unmounted);
 int ensure_path_unmounted(const char* path);
 
+// Writes settings that are still waiting to go out if the volume at
+// mount_point (eg "/sdcard") holds them, before it's unmounted or wiped.
+void ensure_settings_flushed(const char* mount_point);
+
 // Reformat the given volume (must be the mount point only, eg
 // "/cache"), no paths permitted.  Attempts to unmount the volume if
 // it is mounted.
@@ -0,0 +1,800 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* In-process tar writer used by the nandroid backup.
+**
+** A lister thread walks the tree, every folder in name order, and turns each
+** entry into a tar header. The members go through a queue bounded by size to
+** the calling thread, which is the only one writing to the output sink. A few
+** reader threads load the data of small files into the queue ahead of the
+** writer. Larger files are only referenced in the queue and get streamed by
+** the writer itself so the queue stays small.
+**
+** Members come out depth first, every folder ahead of its contents and in the
+** same order on every run, so an unchanged tree makes the same archive. Both
+** resuming a backup and the chunk store rely on that. The output is a GNU
+** format tar (the same flavour busybox creates) which "tar -x" reads.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <zlib.h>
+
+#include "common.h"
+#include "tw_archive.h"
+
+#define TAR_BLOCK_SIZE      512
+#define TAR_NAME_SIZE       100
+#define INLINE_FILE_MAX     (256 * 1024)
+#define QUEUE_MAX_BYTES     (8 * 1024 * 1024)
+#define STREAM_BUFFER       (256 * 1024)
+#define PROGRESS_INTERVAL   (1024 * 1024)
+#define MAX_READERS         4
+#define LINK_BUCKETS        256
+
+typedef struct ArchiveEntry {
+    struct ArchiveEntry* next;
+    struct ArchiveEntry* next_read;     // Next one waiting for a reader
+    char* name;                 // Member name, for the file callback
+    char* header;               // One or more 512 byte blocks
+    size_t header_len;
+    char* data;                 // Padded file data, or NULL
+    size_t data_len;            // What data takes once it's read
+    char* path;                 // File read into data when it's small, otherwise streamed by the writer
+    unsigned long long size;
+    unsigned int mode;
+    unsigned long mtime;
+    unsigned int crc;           // Of the inline data, streamed files get theirs when written
+    int ready;                  // Nothing left to read ahead of the writer
+    int failed;                 // Unreadable, the writer leaves it out
+} ArchiveEntry;
+
+// A file with more than one name, as the first of them went into the archive
+typedef struct ArchiveLink {
+    struct ArchiveLink* next;
+    dev_t dev;
+    ino_t ino;
+    char* name;
+} ArchiveLink;
+
+typedef struct {
+    const TwArchiveOptions* opts;
+
+    pthread_mutex_t lock;
+    pthread_cond_t read_cond;
+    pthread_cond_t queue_cond;
+
+    ArchiveEntry* head;
+    ArchiveEntry* tail;
+    size_t queued_bytes;
+    ArchiveEntry* read_head;
+    ArchiveEntry* read_tail;
+    int readers;
+    int listed;                 // The lister is done, nothing more gets queued
+
+    int abort;
+    int skipped;
+
+    // Only the lister uses these
+    char rel[PATH_MAX];
+    char path[PATH_MAX];
+    ArchiveLink* links[LINK_BUCKETS];
+} ArchiveState;
+
+int tw_get_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1)      count = 1;
+    return (int) count;
+}
+
+static void note_skipped(ArchiveState* as)
+{
+    pthread_mutex_lock(&as->lock);
+    as->skipped++;
+    pthread_mutex_unlock(&as->lock);
+}
+
+static void build_path(const ArchiveState* as, const char* rel, char* path)
+{
+    if (*rel)   snprintf(path, PATH_MAX, "%s/%s", as->opts->root, rel);
+    else        snprintf(path, PATH_MAX, "%s", as->opts->root);
+}
+
+static int is_excluded(const ArchiveState* as, const char* rel)
+{
+    const char** ex = as->opts->excludes;
+
+    if (!ex)    return 0;
+    for (; *ex; ex++)
+    {
+        if (strcmp(*ex, rel) == 0)  return 1;
+    }
+    return 0;
+}
+
+// Stores value as octal, or as GNU base-256 when it doesn't fit
+static void tar_number(char* field, size_t len, unsigned long long value)
+{
+    if (value < (1ULL << (3 * (len - 1))))
+    {
+        char tmp[32];
+        snprintf(tmp, sizeof(tmp), "%0*llo", (int) (len - 1), value);
+        memcpy(field, tmp, len - 1);
+        field[len - 1] = '\0';
+    }
+    else
+    {
+        size_t i;
+        for (i = len - 1; i > 0; i--)
+        {
+            field[i] = (char) (value & 0xff);
+            value >>= 8;
+        }
+        field[0] = (char) 0x80;
+    }
+}
+
+static void tar_fill_header(char* block, const char* name, const struct stat* st, char type, unsigned long long size, const char* linkname)
+{
+    unsigned int sum = 0;
+    int i;
+
+    strncpy(block, name, TAR_NAME_SIZE);
+    tar_number(block + 100, 8, st ? (st->st_mode & 07777) : 0);
+    tar_number(block + 108, 8, st ? st->st_uid : 0);
+    tar_number(block + 116, 8, st ? st->st_gid : 0);
+    tar_number(block + 124, 12, size);
+    tar_number(block + 136, 12, st ? (unsigned long long) st->st_mtime : 0);
+    block[156] = type;
+    if (linkname)   strncpy(block + 157, linkname, TAR_NAME_SIZE);
+    memcpy(block + 257, "ustar  ", 8);
+    if (st && (type == '3' || type == '4'))
+    {
+        tar_number(block + 329, 8, major(st->st_rdev));
+        tar_number(block + 337, 8, minor(st->st_rdev));
+    }
+
+    memset(block + 148, ' ', 8);
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += (unsigned char) block[i];
+    snprintf(block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+}
+
+static size_t tar_long_blocks(const char* str)
+{
+    size_t len = strlen(str);
+
+    if (len < TAR_NAME_SIZE)    return 0;
+    return 1 + (len + TAR_BLOCK_SIZE) / TAR_BLOCK_SIZE;
+}
+
+// Emits a GNU long name ('L') or long link ('K') record, returns the next free block
+static char* tar_fill_long(char* block, const char* str, char type)
+{
+    size_t len = strlen(str) + 1;
+
+    tar_fill_header(block, "././@LongLink", NULL, type, len, NULL);
+    memcpy(block + TAR_BLOCK_SIZE, str, len);
+    return block + tar_long_blocks(str) * TAR_BLOCK_SIZE;
+}
+
+static int tar_build_header(ArchiveEntry* entry, const struct stat* st, char type, const char* linkname)
+{
+    size_t blocks = 1 + tar_long_blocks(entry->name);
+    char* block;
+
+    if (linkname)   blocks += tar_long_blocks(linkname);
+
+    entry->header_len = blocks * TAR_BLOCK_SIZE;
+    entry->header = (char*) calloc(1, entry->header_len);
+    if (!entry->header)     return -1;
+
+    block = entry->header;
+    if (linkname && tar_long_blocks(linkname))
+        block = tar_fill_long(block, linkname, 'K');
+    if (tar_long_blocks(entry->name))
+        block = tar_fill_long(block, entry->name, 'L');
+
+    tar_fill_header(block, entry->name, st, type, entry->size, linkname);
+    return 0;
+}
+
+static void free_entry(ArchiveEntry* entry)
+{
+    free(entry->name);
+    free(entry->header);
+    free(entry->data);
+    free(entry->path);
+    free(entry);
+}
+
+static size_t entry_cost(const ArchiveEntry* entry)
+{
+    return sizeof(ArchiveEntry) + entry->header_len + entry->data_len;
+}
+
+static int read_file_data(int fd, char* buffer, size_t len)
+{
+    size_t total = 0;
+
+    while (total < len)
+    {
+        ssize_t ret = read(fd, buffer + total, len - total);
+        if (ret < 0 && errno == EINTR)  continue;
+        if (ret <= 0)                   break;
+        total += ret;
+    }
+
+    // A file that shrank since the stat is padded out with zeros
+    if (total < len)
+    {
+        memset(buffer + total, 0, len - total);
+        return -1;
+    }
+    return 0;
+}
+
+// Builds the member for one tree entry, all but the data of a small file.
+// With hardlink set, the entry is a link to that earlier member instead.
+// Returns NULL for entries we skip.
+static ArchiveEntry* make_entry(const char* rel, const char* path, const struct stat* st, const char* hardlink)
+{
+    ArchiveEntry* entry;
+    char linkname[PATH_MAX];
+    char* link = NULL;
+    char type;
+
+    if (hardlink)                       type = '1';
+    else if (S_ISREG(st->st_mode))      type = '0';
+    else if (S_ISDIR(st->st_mode))      type = '5';
+    else if (S_ISLNK(st->st_mode))      type = '2';
+    else if (S_ISCHR(st->st_mode))      type = '3';
+    else if (S_ISBLK(st->st_mode))      type = '4';
+    else if (S_ISFIFO(st->st_mode))     type = '6';
+    else                                return NULL;    // Sockets aren't archived
+
+    entry = (ArchiveEntry*) calloc(1, sizeof(ArchiveEntry));
+    if (!entry)                         return NULL;
+
+    entry->name = (char*) malloc(strlen(rel) + 4);
+    if (!entry->name)
+    {
+        free(entry);
+        return NULL;
+    }
+    sprintf(entry->name, "./%s%s", rel, type == '5' ? "/" : "");
+    entry->mode = st->st_mode;
+    entry->mtime = st->st_mtime;
+
+    // Links have no data of their own, and no type for the index to check them as
+    if (type == '1')
+    {
+        entry->mode &= ~S_IFMT;
+        link = (char*) hardlink;
+    }
+    else if (type == '2')
+    {
+        ssize_t len = readlink(path, linkname, sizeof(linkname) - 1);
+        if (len < 0)
+        {
+            LOGW("Unable to read link %s (errno=%d)\n", path, errno);
+            free_entry(entry);
+            return NULL;
+        }
+        linkname[len] = '\0';
+        link = linkname;
+    }
+
+    if (type == '0')
+        entry->size = st->st_size;
+
+    if (entry->size > 0)
+    {
+        entry->path = strdup(path);
+        if (!entry->path)
+        {
+            free_entry(entry);
+            return NULL;
+        }
+        if (entry->size <= INLINE_FILE_MAX)
+            entry->data_len = (entry->size + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1);
+    }
+    entry->ready = !entry->data_len;
+
+    if (tar_build_header(entry, st, type, link) != 0)
+    {
+        free_entry(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+// Loads the data of a small file, the entry fails when it can't be opened
+static void read_entry(ArchiveState* as, ArchiveEntry* entry)
+{
+    int fd = open(entry->path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        LOGW("Unable to open %s (errno=%d)\n", entry->path, errno);
+        entry->failed = 1;
+        return;
+    }
+
+    entry->data = (char*) malloc(entry->data_len);
+    if (entry->data)
+    {
+        if (read_file_data(fd, entry->data, entry->size) != 0)
+            LOGW("%s changed while reading it\n", entry->path);
+        memset(entry->data + entry->size, 0, entry->data_len - entry->size);
+        if (as->opts->member_cb)
+            entry->crc = crc32(0L, (const Bytef*) entry->data, (uInt) entry->size);
+    }
+    else
+        entry->failed = 1;
+    close(fd);
+}
+
+static void enqueue_entry(ArchiveState* as, ArchiveEntry* entry)
+{
+    size_t cost = entry_cost(entry);
+
+    // Without readers, the lister reads small files itself
+    if (!entry->ready && !as->readers)
+    {
+        read_entry(as, entry);
+        entry->ready = 1;
+    }
+
+    pthread_mutex_lock(&as->lock);
+    while (!as->abort && as->queued_bytes > 0 && as->queued_bytes + cost > QUEUE_MAX_BYTES)
+        pthread_cond_wait(&as->queue_cond, &as->lock);
+
+    if (as->abort)
+    {
+        pthread_mutex_unlock(&as->lock);
+        free_entry(entry);
+        return;
+    }
+
+    if (as->tail)   as->tail->next = entry;
+    else            as->head = entry;
+    as->tail = entry;
+    as->queued_bytes += cost;
+
+    if (!entry->ready)
+    {
+        if (as->read_tail)  as->read_tail->next_read = entry;
+        else                as->read_head = entry;
+        as->read_tail = entry;
+        pthread_cond_signal(&as->read_cond);
+    }
+    pthread_cond_broadcast(&as->queue_cond);
+    pthread_mutex_unlock(&as->lock);
+}
+
+// Returns NULL once the lister is finished and the queue is drained
+static ArchiveEntry* dequeue_entry(ArchiveState* as)
+{
+    ArchiveEntry* entry;
+
+    pthread_mutex_lock(&as->lock);
+    while (as->head ? !as->head->ready : !as->listed)
+        pthread_cond_wait(&as->queue_cond, &as->lock);
+
+    entry = as->head;
+    if (entry)
+    {
+        as->head = entry->next;
+        if (!as->head)  as->tail = NULL;
+        as->queued_bytes -= entry_cost(entry);
+        pthread_cond_broadcast(&as->queue_cond);
+    }
+    pthread_mutex_unlock(&as->lock);
+    return entry;
+}
+
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+// Reads the names in a folder, sorted so the archive doesn't depend on the
+// order the file system keeps them in. Returns the count, -1 on error.
+static int read_names(const char* path, char*** names)
+{
+    struct dirent* de;
+    char** list = NULL;
+    int count = 0, size = 0;
+    DIR* d = opendir(path);
+
+    if (!d)     return -1;
+    while ((de = readdir(d)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)     continue;
+
+        if (count == size)
+        {
+            char** grown = (char**) realloc(list, (size ? size * 2 : 64) * sizeof(char*));
+            if (!grown)     break;
+            list = grown;
+            size = size ? size * 2 : 64;
+        }
+        list[count] = strdup(de->d_name);
+        if (!list[count])   break;
+        count++;
+    }
+    closedir(d);
+
+    if (de)
+    {
+        while (count > 0)
+            free(list[--count]);
+        free(list);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (count)  qsort(list, count, sizeof(char*), compare_names);
+    *names = list;
+    return count;
+}
+
+static ArchiveLink** link_bucket(ArchiveState* as, const struct stat* st)
+{
+    return &as->links[(unsigned int) (st->st_ino ^ st->st_dev) % LINK_BUCKETS];
+}
+
+// The member an earlier name of this file went in as, or NULL
+static const char* find_link(ArchiveState* as, const struct stat* st)
+{
+    ArchiveLink* link;
+
+    for (link = *link_bucket(as, st); link; link = link->next)
+    {
+        if (link->ino == st->st_ino && link->dev == st->st_dev)
+            return link->name;
+    }
+    return NULL;
+}
+
+// Remembers the member a file went in as, for the names of it still to come
+static void add_link(ArchiveState* as, const struct stat* st, const char* name)
+{
+    ArchiveLink** bucket = link_bucket(as, st);
+    ArchiveLink* link = (ArchiveLink*) malloc(sizeof(ArchiveLink));
+
+    // Without it, the other names are just archived as copies
+    if (!link)  return;
+    link->name = strdup(name);
+    if (!link->name)
+    {
+        free(link);
+        return;
+    }
+    link->dev = st->st_dev;
+    link->ino = st->st_ino;
+    link->next = *bucket;
+    *bucket = link;
+}
+
+static void free_links(ArchiveState* as)
+{
+    int i;
+
+    for (i = 0; i < LINK_BUCKETS; i++)
+    {
+        while (as->links[i])
+        {
+            ArchiveLink* link = as->links[i];
+            as->links[i] = link->next;
+            free(link->name);
+            free(link);
+        }
+    }
+}
+
+// Queues the contents of the folder in as->rel, rel_len long, and everything below it
+static void list_dir(ArchiveState* as, size_t rel_len)
+{
+    char** names = NULL;
+    struct stat st;
+    int i, count;
+
+    build_path(as, as->rel, as->path);
+    count = read_names(as->path, &names);
+    if (count < 0)
+    {
+        LOGW("Unable to open folder %s (errno=%d)\n", as->path, errno);
+        note_skipped(as);
+        return;
+    }
+
+    for (i = 0; i < count && !as->abort; i++)
+    {
+        ArchiveEntry* entry;
+        const char* hardlink = NULL;
+        size_t len;
+
+        // Like the "./*" that tar was given, dot files at the top are left out
+        if (!rel_len && names[i][0] == '.')     continue;
+
+        if (rel_len)    len = snprintf(as->rel + rel_len, sizeof(as->rel) - rel_len, "/%s", names[i]);
+        else            len = snprintf(as->rel, sizeof(as->rel), "%s", names[i]);
+        if (rel_len + len >= sizeof(as->rel))
+        {
+            as->rel[rel_len] = '\0';
+            LOGW("Path too long under %s/%s\n", as->opts->root, as->rel);
+            note_skipped(as);
+            continue;
+        }
+        len += rel_len;
+        if (is_excluded(as, as->rel))   continue;
+
+        build_path(as, as->rel, as->path);
+        if (lstat(as->path, &st) != 0)
+        {
+            LOGW("Unable to stat %s (errno=%d)\n", as->path, errno);
+            note_skipped(as);
+            continue;
+        }
+
+        // Every name of a file after the first becomes a link to it, as tar does
+        if (!S_ISDIR(st.st_mode) && st.st_nlink > 1)
+            hardlink = find_link(as, &st);
+
+        entry = make_entry(as->rel, as->path, &st, hardlink);
+        if (!entry)
+        {
+            if (!S_ISSOCK(st.st_mode))  note_skipped(as);
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode) && st.st_nlink > 1 && !hardlink)
+            add_link(as, &st, entry->name);
+
+        enqueue_entry(as, entry);
+        if (S_ISDIR(st.st_mode))
+            list_dir(as, len);
+    }
+    as->rel[rel_len] = '\0';
+
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+}
+
+static void* lister_thread(void* cookie)
+{
+    ArchiveState* as = (ArchiveState*) cookie;
+
+    list_dir(as, 0);
+    free_links(as);
+
+    pthread_mutex_lock(&as->lock);
+    as->listed = 1;
+    pthread_cond_broadcast(&as->read_cond);
+    pthread_cond_broadcast(&as->queue_cond);
+    pthread_mutex_unlock(&as->lock);
+    return NULL;
+}
+
+static void* reader_thread(void* cookie)
+{
+    ArchiveState* as = (ArchiveState*) cookie;
+
+    pthread_mutex_lock(&as->lock);
+    for (;;)
+    {
+        ArchiveEntry* entry;
+
+        while (!as->abort && !as->read_head && !as->listed)
+            pthread_cond_wait(&as->read_cond, &as->lock);
+        if (as->abort || !as->read_head)
+            break;
+
+        entry = as->read_head;
+        as->read_head = entry->next_read;
+        if (!as->read_head)     as->read_tail = NULL;
+        pthread_mutex_unlock(&as->lock);
+
+        read_entry(as, entry);
+
+        pthread_mutex_lock(&as->lock);
+        entry->ready = 1;
+        pthread_cond_broadcast(&as->queue_cond);
+    }
+    pthread_mutex_unlock(&as->lock);
+    return NULL;
+}
+
+// crc, when given, is updated with the data exactly as it went out
+static int stream_file(const ArchiveEntry* entry, char* buffer, TwSink* out, unsigned int* crc)
+{
+    unsigned long long remain = entry->size;
+    int fd = open(entry->path, O_RDONLY);
+    int changed = 0;
+
+    if (fd < 0)
+        LOGW("Unable to open %s (errno=%d)\n", entry->path, errno);
+
+    // The header is already out, so whatever happens we emit exactly entry->size bytes
+    while (remain > 0)
+    {
+        size_t len = remain > STREAM_BUFFER ? STREAM_BUFFER : (size_t) remain;
+        size_t padded = (len + TAR_BLOCK_SIZE - 1) & ~(TAR_BLOCK_SIZE - 1);
+
+        if (fd < 0 || read_file_data(fd, buffer, len) != 0)
+        {
+            if (fd >= 0)    memset(buffer, 0, len);
+            changed = 1;
+        }
+        memset(buffer + len, 0, padded - len);
+        if (crc)    *crc = crc32(*crc, (const Bytef*) buffer, (uInt) len);
+
+        if (tw_sink_write(out, buffer, padded) != 0)
+        {
+            if (fd >= 0)    close(fd);
+            return -1;
+        }
+        remain -= len;
+    }
+
+    if (changed && fd >= 0)
+        LOGW("%s changed while reading it\n", entry->path);
+    if (fd >= 0)    close(fd);
+    return 0;
+}
+
+int tw_archive_create(const TwArchiveOptions* opts, TwSink* out)
+{
+    ArchiveState as;
+    pthread_t lister;
+    pthread_t readers[MAX_READERS];
+    unsigned long long start_bytes = out->bytes;
+    unsigned long long last_progress = 0;
+    char* buffer;
+    int i, wanted;
+    int ret = 0;
+
+    memset(&as, 0, sizeof(as));
+    as.opts = opts;
+    wanted = opts->threads > 0 ? opts->threads : tw_get_cpu_count();
+    // Reading is mostly waiting on the flash, so always use at least two
+    if (wanted < 2)             wanted = 2;
+    if (wanted > MAX_READERS)   wanted = MAX_READERS;
+
+    buffer = (char*) malloc(STREAM_BUFFER);
+    if (!buffer)    return -1;
+
+    pthread_mutex_init(&as.lock, NULL);
+    pthread_cond_init(&as.read_cond, NULL);
+    pthread_cond_init(&as.queue_cond, NULL);
+
+    // Readers first, the lister reads for itself if none could be started
+    for (i = 0; i < wanted; i++)
+    {
+        if (pthread_create(&readers[i], NULL, reader_thread, &as) != 0)
+            break;
+        as.readers++;
+    }
+    if (pthread_create(&lister, NULL, lister_thread, &as) != 0)
+    {
+        LOGE("Unable to start archive threads\n");
+        pthread_mutex_lock(&as.lock);
+        as.abort = 1;
+        pthread_cond_broadcast(&as.read_cond);
+        pthread_mutex_unlock(&as.lock);
+        for (i = 0; i < as.readers; i++)
+            pthread_join(readers[i], NULL);
+        pthread_cond_destroy(&as.queue_cond);
+        pthread_cond_destroy(&as.read_cond);
+        pthread_mutex_destroy(&as.lock);
+        free(buffer);
+        return -1;
+    }
+
+    for (;;)
+    {
+        TwArchiveMember member;
+        ArchiveEntry* entry = dequeue_entry(&as);
+        if (!entry)     break;
+
+        if (entry->failed)
+        {
+            note_skipped(&as);
+            free_entry(entry);
+            continue;
+        }
+
+        if (opts->file_cb)      opts->file_cb(entry->name, opts->cookie);
+
+        member.offset = out->bytes - start_bytes;
+        member.crc = entry->crc;
+        if (tw_sink_write(out, entry->header, entry->header_len) != 0)
+            ret = -1;
+        else if (entry->data && tw_sink_write(out, entry->data, entry->data_len) != 0)
+            ret = -1;
+        else if (!entry->data && entry->path && stream_file(entry, buffer, out, opts->member_cb ? &member.crc : NULL) != 0)
+            ret = -1;
+        else if (opts->member_cb)
+        {
+            member.name = entry->name;
+            member.header_len = (unsigned int) entry->header_len;
+            member.size = entry->size;
+            member.mode = entry->mode;
+            member.mtime = entry->mtime;
+            opts->member_cb(&member, opts->cookie);
+        }
+        free_entry(entry);
+
+        if (ret != 0)
+        {
+            // Stop the other threads, what they've queued is freed once they're gone
+            pthread_mutex_lock(&as.lock);
+            as.abort = 1;
+            pthread_cond_broadcast(&as.read_cond);
+            pthread_cond_broadcast(&as.queue_cond);
+            pthread_mutex_unlock(&as.lock);
+            break;
+        }
+        if (opts->progress && out->bytes - start_bytes - last_progress >= PROGRESS_INTERVAL)
+        {
+            last_progress = out->bytes - start_bytes;
+            opts->progress(last_progress, opts->cookie);
+        }
+    }
+
+    pthread_join(lister, NULL);
+    for (i = 0; i < as.readers; i++)
+        pthread_join(readers[i], NULL);
+
+    while (as.head)
+    {
+        ArchiveEntry* entry = as.head;
+        as.head = entry->next;
+        free_entry(entry);
+    }
+
+    if (ret == 0)
+    {
+        // End of archive is marked by two zero blocks
+        memset(buffer, 0, TAR_BLOCK_SIZE * 2);
+        ret = tw_sink_write(out, buffer, TAR_BLOCK_SIZE * 2);
+    }
+    if (ret == 0 && opts->progress)
+        opts->progress(out->bytes - start_bytes, opts->cookie);
+
+    if (as.skipped)
+        LOGW("%d entries under %s could not be archived\n", as.skipped, opts->root);
+
+    pthread_cond_destroy(&as.queue_cond);
+    pthread_cond_destroy(&as.read_cond);
+    pthread_mutex_destroy(&as.lock);
+    free(buffer);
+    return ret;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_ARCHIVE_HEADER
+#define _TW_ARCHIVE_HEADER
+
+#include "tw_sink.h"
+
+// Called on the calling thread with the archive bytes emitted so far
+typedef void (*TwArchiveProgressFn)(unsigned long long bytes, void* cookie);
+
+// Called on the calling thread for each member, with its archive name
+typedef void (*TwArchiveFileFn)(const char* name, void* cookie);
+
+// Where a member ended up in the archive, for the .win index
+typedef struct {
+    const char* name;
+    unsigned long long offset;      // First header block, from the start of the archive
+    unsigned int header_len;        // Header bytes, long name records included
+    unsigned long long size;        // File data, not counting the padding
+    unsigned int mode;              // st_mode, type bits included but for hard links
+    unsigned long mtime;
+    unsigned int crc;               // CRC-32 of the file data, 0 for other types
+} TwArchiveMember;
+
+// Called on the calling thread once a member has been written
+typedef void (*TwArchiveMemberFn)(const TwArchiveMember* member, void* cookie);
+
+typedef struct {
+    const char* root;               // Folder to archive, eg. "/data"
+    const char** excludes;          // NULL terminated, relative to root (eg. "media")
+    int threads;                    // Threads reading small files ahead, 0 for one per CPU
+    TwArchiveProgressFn progress;
+    TwArchiveFileFn file_cb;
+    TwArchiveMemberFn member_cb;    // Also makes the readers checksum file data
+    void* cookie;
+} TwArchiveOptions;
+
+// Writes the contents of opts->root as a tar stream into out, with members
+// named "./<path>" just like "cd root && tar -c ./*" would. The sink is not
+// closed. Returns 0 on success, -1 on error.
+int tw_archive_create(const TwArchiveOptions* opts, TwSink* out);
+
+int tw_get_cpu_count(void);
+
+#endif  // _TW_ARCHIVE_HEADER
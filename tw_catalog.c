@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Catalog of the backups of a device, so browsing them doesn't mean
+** reading every backup folder and every file in it.
+**
+** The catalog is a text file of tab separated lines:
+**
+**   catalog 1 <mtime of the device folder>
+**   backup <name> <mtime> <created> <partial>
+**   file <name> <size> <kind> <digest>
+**   end
+**
+** with the files of a backup following it. A folder is read again when its
+** mtime isn't what the catalog has, which is the case for any file added
+** to or removed from it. The catalog is only a cache: one that doesn't
+** parse to the end is thrown away and made again.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "tw_catalog.h"
+#include "tw_checkpoint.h"
+#include "tw_chunk.h"
+#include "tw_compress.h"
+#include "tw_delta.h"
+#include "tw_digest.h"
+#include "tw_segment.h"
+#include "tw_sparse.h"
+
+#define CATALOG_VERSION     1
+
+static void free_backup(TwCatalogBackup* backup)
+{
+    free(backup->files);
+    backup->files = NULL;
+    backup->count = 0;
+}
+
+void tw_catalog_free(TwCatalog* cat)
+{
+    int i;
+
+    for (i = 0; i < cat->count; i++)
+        free_backup(&cat->backups[i]);
+    free(cat->backups);
+    cat->backups = NULL;
+    cat->count = 0;
+}
+
+static TwCatalogBackup* add_backup(TwCatalog* cat, const char* name)
+{
+    TwCatalogBackup* backups = (TwCatalogBackup*) realloc(cat->backups, (cat->count + 1) * sizeof(TwCatalogBackup));
+
+    if (!backups)       return NULL;
+    cat->backups = backups;
+    memset(&backups[cat->count], 0, sizeof(TwCatalogBackup));
+    snprintf(backups[cat->count].name, sizeof(backups[cat->count].name), "%s", name);
+    return &backups[cat->count++];
+}
+
+static TwCatalogFile* add_file(TwCatalogBackup* backup, const char* name)
+{
+    TwCatalogFile* files = (TwCatalogFile*) realloc(backup->files, (backup->count + 1) * sizeof(TwCatalogFile));
+
+    if (!files)         return NULL;
+    backup->files = files;
+    memset(&files[backup->count], 0, sizeof(TwCatalogFile));
+    snprintf(files[backup->count].name, sizeof(files[backup->count].name), "%s", name);
+    return &files[backup->count++];
+}
+
+static int load(TwCatalog* cat)
+{
+    char filename[PATH_MAX];
+    char line[512];
+    TwCatalogBackup* backup = NULL;
+    int version = 0, end = 0;
+    long long dir_mtime = 0;
+    FILE* fp;
+
+    snprintf(filename, sizeof(filename), "%s/%s", cat->dir, TW_CATALOG_FILE);
+    fp = fopen(filename, "r");
+    if (!fp)            return -1;
+    if (!fgets(line, sizeof(line), fp) || sscanf(line, "catalog\t%d\t%lld", &version, &dir_mtime) != 2 || version != CATALOG_VERSION)
+    {
+        fclose(fp);
+        return -1;
+    }
+
+    while (!end && fgets(line, sizeof(line), fp))
+    {
+        char name[256], kind[16], digest[16];
+        long long mtime, created;
+        unsigned long long size;
+        int partial;
+        TwCatalogFile* file;
+
+        if (strcmp(line, "end\n") == 0)
+            end = 1;
+        else if (sscanf(line, "backup\t%255[^\t]\t%lld\t%lld\t%d", name, &mtime, &created, &partial) == 4)
+        {
+            backup = add_backup(cat, name);
+            if (!backup)    break;
+            backup->mtime = (time_t) mtime;
+            backup->created = (time_t) created;
+            backup->partial = partial;
+        }
+        else if (backup && sscanf(line, "file\t%63[^\t]\t%llu\t%15[^\t]\t%15[^\t\n]", name, &size, kind, digest) == 4)
+        {
+            file = add_file(backup, name);
+            if (!file)      break;
+            file->size = size;
+            strcpy(file->kind, kind);
+            strcpy(file->digest, digest);
+        }
+        else
+            break;
+    }
+    fclose(fp);
+
+    if (!end)
+    {
+        LOGI("=> Making the backup catalog of %s again\n", cat->dir);
+        tw_catalog_free(cat);
+        return -1;
+    }
+    // Read to the end, so what it says about the device folder holds
+    cat->mtime = (time_t) dir_mtime;
+    return 0;
+}
+
+static int save(TwCatalog* cat)
+{
+    char filename[PATH_MAX];
+    int tries, i, j;
+
+    snprintf(filename, sizeof(filename), "%s/%s", cat->dir, TW_CATALOG_FILE);
+    // Making the file changes the mtime of the folder it's in, which the
+    // catalog has to have. Writing it over again doesn't change it.
+    for (tries = 0; tries < 2; tries++)
+    {
+        struct stat st;
+        FILE* fp = fopen(filename, "w");
+        int ret = 0;
+
+        if (!fp)
+        {
+            LOGI("=> Unable to write %s (errno=%d)\n", filename, errno);
+            return -1;
+        }
+        fprintf(fp, "catalog\t%d\t%lld\n", CATALOG_VERSION, (long long) cat->mtime);
+        for (i = 0; i < cat->count; i++)
+        {
+            const TwCatalogBackup* backup = &cat->backups[i];
+
+            fprintf(fp, "backup\t%s\t%lld\t%lld\t%d\n", backup->name, (long long) backup->mtime,
+                    (long long) backup->created, backup->partial);
+            for (j = 0; j < backup->count; j++)
+            {
+                const TwCatalogFile* file = &backup->files[j];
+                fprintf(fp, "file\t%s\t%llu\t%s\t%s\n", file->name, file->size, file->kind, file->digest);
+            }
+        }
+        fprintf(fp, "end\n");
+        if (ferror(fp))         ret = -1;
+        if (fclose(fp) != 0)    ret = -1;
+        if (ret != 0)
+        {
+            LOGI("=> Unable to write %s\n", filename);
+            unlink(filename);
+            return -1;
+        }
+
+        if (stat(cat->dir, &st) != 0 || st.st_mtime == cat->mtime)    break;
+        cat->mtime = st.st_mtime;
+    }
+    cat->changed = 0;
+    return 0;
+}
+
+// What the data of a backup file is, told by its first bytes
+static void detect_kind(const char* path, TwCatalogFile* file)
+{
+    unsigned char header[TW_DELTA_HEADER_SIZE];
+    const char* kind;
+    ssize_t len = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        len = read(fd, header, sizeof(header));
+        close(fd);
+    }
+    if (len < 0)    len = 0;
+
+    if (tw_chunk_check(header, len))            kind = "chunk";
+    else if (tw_delta_check(header, len))       kind = "delta";
+    else if (tw_sparse_check(header, len))      kind = "sparse";
+    else                                        kind = tw_codec_name(tw_codec_detect(header, len));
+    snprintf(file->kind, sizeof(file->kind), "%s", kind);
+}
+
+static int compare_file(const void* a, const void* b)
+{
+    return strcmp(((const TwCatalogFile*) a)->name, ((const TwCatalogFile*) b)->name);
+}
+
+static int is_backup_file(const char* name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, ".win") == 0;
+}
+
+// Reads a backup folder into backup, in place of what the catalog had
+static void scan_backup(TwCatalog* cat, TwCatalogBackup* backup, time_t mtime)
+{
+    char path[PATH_MAX];
+    struct dirent* de;
+    struct tm tm;
+    DIR* d;
+
+    free_backup(backup);
+    backup->mtime = mtime;
+
+    // Folders are named after the time they were made, anything else goes by its mtime
+    memset(&tm, 0, sizeof(tm));
+    backup->created = mtime;
+    if (sscanf(backup->name, "%4d-%2d-%2d--%2d-%2d-%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6)
+    {
+        tm.tm_year -= 1900;
+        tm.tm_mon--;
+        tm.tm_isdst = -1;
+        backup->created = mktime(&tm);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s/%s", cat->dir, backup->name, TW_CHECKPOINT_FILE);
+    backup->partial = access(path, F_OK) == 0;
+
+    snprintf(path, sizeof(path), "%s/%s", cat->dir, backup->name);
+    d = opendir(path);
+    if (!d)             return;
+    while ((de = readdir(d)) != NULL)
+    {
+        TwCatalogFile* file;
+        TwDigest digest;
+
+        if (!is_backup_file(de->d_name))    continue;
+        file = add_file(backup, de->d_name);
+        if (!file)      break;
+
+        snprintf(path, sizeof(path), "%s/%s/%s", cat->dir, backup->name, de->d_name);
+        file->size = tw_segments_total(path);
+        detect_kind(path, file);
+        switch (tw_digest_read(path, &digest))
+        {
+        case 0:     snprintf(file->digest, sizeof(file->digest), "%s", tw_digest_name(digest.type));   break;
+        case -1:    strcpy(file->digest, "none");   break;
+        default:    strcpy(file->digest, "bad");    break;
+        }
+    }
+    closedir(d);
+    qsort(backup->files, backup->count, sizeof(TwCatalogFile), compare_file);
+}
+
+static int compare_backup(const void* a, const void* b)
+{
+    return strcmp(((const TwCatalogBackup*) a)->name, ((const TwCatalogBackup*) b)->name);
+}
+
+// Lists the backup folders again, keeping what the catalog has for those still there
+static int list_backups(TwCatalog* cat)
+{
+    TwCatalog listed;
+    struct dirent* de;
+    DIR* d;
+    int i;
+
+    d = opendir(cat->dir);
+    if (!d)
+    {
+        LOGE("Unable to open %s (errno=%d)\n", cat->dir, errno);
+        return -1;
+    }
+
+    memset(&listed, 0, sizeof(listed));
+    while ((de = readdir(d)) != NULL)
+    {
+        char path[PATH_MAX];
+        TwCatalogBackup* backup;
+        struct stat st;
+
+        // Skips . and .. as well as the chunk store of incremental backups
+        if (de->d_name[0] == '.')   continue;
+        snprintf(path, sizeof(path), "%s/%s", cat->dir, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))   continue;
+
+        backup = add_backup(&listed, de->d_name);
+        if (!backup)    break;
+        for (i = 0; i < cat->count; i++)
+        {
+            if (strcmp(cat->backups[i].name, de->d_name) == 0)
+            {
+                // The files move over, a new folder is read when it's checked
+                *backup = cat->backups[i];
+                memset(&cat->backups[i], 0, sizeof(cat->backups[i]));
+                break;
+            }
+        }
+    }
+    closedir(d);
+
+    tw_catalog_free(cat);
+    cat->backups = listed.backups;
+    cat->count = listed.count;
+    qsort(cat->backups, cat->count, sizeof(TwCatalogBackup), compare_backup);
+    return 0;
+}
+
+int tw_catalog_open(const char* device_dir, TwCatalog* cat)
+{
+    struct stat st;
+    int i;
+
+    memset(cat, 0, sizeof(*cat));
+    snprintf(cat->dir, sizeof(cat->dir), "%s", device_dir);
+    if (cat->dir[0] && cat->dir[strlen(cat->dir) - 1] == '/')
+        cat->dir[strlen(cat->dir) - 1] = '\0';
+    if (stat(cat->dir, &st) != 0)
+    {
+        LOGE("Unable to open %s (errno=%d)\n", cat->dir, errno);
+        return -1;
+    }
+
+    // Folders come and go with the mtime of the device folder
+    if (load(cat) != 0 || cat->mtime != st.st_mtime)
+    {
+        if (list_backups(cat) != 0)
+        {
+            tw_catalog_free(cat);
+            return -1;
+        }
+        cat->mtime = st.st_mtime;
+        cat->changed = 1;
+    }
+
+    // and files with the mtime of the folder they're in
+    for (i = 0; i < cat->count; i++)
+    {
+        char path[PATH_MAX];
+        struct stat bst;
+
+        snprintf(path, sizeof(path), "%s/%s", cat->dir, cat->backups[i].name);
+        if (stat(path, &bst) != 0)
+        {
+            // Removed since the device folder was listed
+            free_backup(&cat->backups[i]);
+            memmove(&cat->backups[i], &cat->backups[i + 1], (cat->count - i - 1) * sizeof(TwCatalogBackup));
+            cat->count--;
+            i--;
+            cat->changed = 1;
+            continue;
+        }
+        if (bst.st_mtime == cat->backups[i].mtime)  continue;
+        scan_backup(cat, &cat->backups[i], bst.st_mtime);
+        cat->changed = 1;
+    }
+
+    // An sdcard that can't be written to still gets its catalog, it's just made again next time
+    if (cat->changed)   save(cat);
+    return 0;
+}
+
+const TwCatalogBackup* tw_catalog_find(const TwCatalog* cat, const char* name)
+{
+    TwCatalogBackup key;
+
+    snprintf(key.name, sizeof(key.name), "%s", name);
+    return (const TwCatalogBackup*) bsearch(&key, cat->backups, cat->count, sizeof(TwCatalogBackup), compare_backup);
+}
+
+unsigned long long tw_catalog_size(const TwCatalogBackup* backup)
+{
+    unsigned long long size = 0;
+    int i;
+
+    for (i = 0; i < backup->count; i++)
+        size += backup->files[i].size;
+    return size;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_CATALOG_HEADER
+#define _TW_CATALOG_HEADER
+
+#include <limits.h>
+#include <time.h>
+
+// Sits in the folder of a device, next to its backup folders
+#define TW_CATALOG_FILE     ".catalog"
+
+// One backup file, eg. "data.ext4.win" and its segments
+typedef struct {
+    char name[64];
+    unsigned long long size;        // of all its segments
+    char kind[16];                  // "gzip", "lz4", "sparse", "delta", "chunk", or "none"
+    char digest[16];                // the kind of sidecar it has, "none" or "bad" if there's none to go by
+} TwCatalogFile;
+
+// One backup folder, eg. "2012-06-01--12-00-00"
+typedef struct {
+    char name[256];
+    time_t mtime;                   // of the folder, when it was looked at
+    time_t created;
+    int partial;                    // interrupted, it still has a checkpoint
+    int count;
+    TwCatalogFile* files;           // sorted by name
+} TwCatalogBackup;
+
+typedef struct {
+    char dir[PATH_MAX];
+    time_t mtime;                   // of dir, when it was looked at
+    int count;
+    TwCatalogBackup* backups;       // sorted by name, so the oldest come first
+    int changed;
+} TwCatalog;
+
+// Reads the catalog of the backups in device_dir. Only folders that changed
+// since they were cataloged are read again, and only when device_dir itself
+// changed is it listed again. A catalog that changed is written back.
+// Returns 0 on success.
+int tw_catalog_open(const char* device_dir, TwCatalog* cat);
+void tw_catalog_free(TwCatalog* cat);
+
+// The backup folder called name, NULL if there's none
+const TwCatalogBackup* tw_catalog_find(const TwCatalog* cat, const char* name);
+
+// Size of all the files of a backup
+unsigned long long tw_catalog_size(const TwCatalogBackup* backup);
+
+#endif  // _TW_CATALOG_HEADER
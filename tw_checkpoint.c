@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Checkpoints of a backup run, so an interrupted one can be resumed.
+**
+** The checkpoint is a log of lines, each one synced to disk before the
+** backup moves on:
+**
+**   start <image> <mode>
+**   segment <image> <index> <size> <digest>
+**   done <image>
+**
+** A battery that gives out mid-line leaves a line that doesn't parse, which
+** is simply left out.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "tw_checkpoint.h"
+
+static TwCheckpointEntry* get_entry(TwCheckpoint* cp, const char* image)
+{
+    TwCheckpointEntry* entries;
+    int i;
+
+    for (i = 0; i < cp->count; i++)
+    {
+        if (strcmp(cp->entries[i].image, image) == 0)
+            return &cp->entries[i];
+    }
+
+    entries = (TwCheckpointEntry*) realloc(cp->entries, (cp->count + 1) * sizeof(TwCheckpointEntry));
+    if (!entries)       return NULL;
+    cp->entries = entries;
+    memset(&entries[cp->count], 0, sizeof(TwCheckpointEntry));
+    snprintf(entries[cp->count].image, sizeof(entries[cp->count].image), "%s", image);
+    return &entries[cp->count++];
+}
+
+static void add_segment(TwCheckpointEntry* entry, int index, const TwSegmentInfo* info)
+{
+    TwSegmentInfo* segments;
+
+    // Records come in order, anything out of it isn't to be trusted
+    if (index > entry->segments.count)  return;
+
+    segments = (TwSegmentInfo*) realloc(entry->segments.segments, (index + 1) * sizeof(TwSegmentInfo));
+    if (!segments)      return;
+    segments[index] = *info;
+    entry->segments.segments = segments;
+    entry->segments.count = index + 1;
+}
+
+static void load(TwCheckpoint* cp)
+{
+    char line[512];
+    FILE* fp = fopen(cp->filename, "r");
+
+    if (!fp)            return;
+    while (fgets(line, sizeof(line), fp))
+    {
+        char image[64], mode[64], hex[TW_DIGEST_MAX_SIZE * 2 + 1];
+        TwCheckpointEntry* entry;
+        TwSegmentInfo info;
+        int index;
+
+        if (!strchr(line, '\n'))    break;  // cut short
+
+        if (sscanf(line, "start %63s %63s", image, mode) == 2)
+        {
+            entry = get_entry(cp, image);
+            if (!entry)     continue;
+            free(entry->segments.segments);
+            memset(&entry->segments, 0, sizeof(entry->segments));
+            snprintf(entry->mode, sizeof(entry->mode), "%s", mode);
+            entry->done = 0;
+        }
+        else if (sscanf(line, "segment %63s %d %llu %32s", image, &index, &info.size, hex) == 4)
+        {
+            entry = get_entry(cp, image);
+            if (entry && index >= 0 && tw_digest_from_hex(hex, info.digest, TW_DIGEST_MAX_SIZE) == 0)
+                add_segment(entry, index, &info);
+        }
+        else if (sscanf(line, "done %63s", image) == 1)
+        {
+            entry = get_entry(cp, image);
+            if (entry)      entry->done = 1;
+        }
+    }
+    fclose(fp);
+}
+
+int tw_checkpoint_open(const char* dir, TwCheckpoint* cp)
+{
+    size_t len = strlen(dir);
+
+    memset(cp, 0, sizeof(*cp));
+    pthread_mutex_init(&cp->lock, NULL);
+    snprintf(cp->filename, sizeof(cp->filename), "%s%s%s", dir, len && dir[len - 1] == '/' ? "" : "/", TW_CHECKPOINT_FILE);
+    load(cp);
+
+    cp->fd = open(cp->filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (cp->fd < 0)
+    {
+        LOGE("Unable to create %s (errno=%d)\n", cp->filename, errno);
+        tw_checkpoint_close(cp, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void tw_checkpoint_close(TwCheckpoint* cp, int complete)
+{
+    int i;
+
+    if (cp->fd >= 0)
+    {
+        close(cp->fd);
+        if (complete)   unlink(cp->filename);
+    }
+    for (i = 0; i < cp->count; i++)
+        free(cp->entries[i].segments.segments);
+    free(cp->entries);
+    pthread_mutex_destroy(&cp->lock);
+    memset(cp, 0, sizeof(*cp));
+    cp->fd = -1;
+}
+
+const TwCheckpointEntry* tw_checkpoint_get(const TwCheckpoint* cp, const char* image)
+{
+    int i;
+
+    for (i = 0; i < cp->count; i++)
+    {
+        if (strcmp(cp->entries[i].image, image) == 0)
+            return &cp->entries[i];
+    }
+    return NULL;
+}
+
+static int add_record(TwCheckpoint* cp, const char* record)
+{
+    size_t len = strlen(record);
+    int ret = 0;
+
+    pthread_mutex_lock(&cp->lock);
+    if (write(cp->fd, record, len) != (ssize_t) len || fsync(cp->fd) != 0)
+    {
+        LOGW("Unable to write %s (errno=%d)\n", cp->filename, errno);
+        ret = -1;
+    }
+    pthread_mutex_unlock(&cp->lock);
+    return ret;
+}
+
+int tw_checkpoint_start(TwCheckpoint* cp, const char* image, const char* mode)
+{
+    char record[256];
+
+    snprintf(record, sizeof(record), "start %s %s\n", image, mode);
+    return add_record(cp, record);
+}
+
+int tw_checkpoint_segment(TwCheckpoint* cp, const char* image, int index, const TwSegmentInfo* info)
+{
+    char hex[TW_DIGEST_MAX_SIZE * 2 + 1];
+    char record[256];
+
+    tw_digest_to_hex(info->digest, TW_DIGEST_MAX_SIZE, hex);
+    snprintf(record, sizeof(record), "segment %s %d %llu %s\n", image, index, info->size, hex);
+    return add_record(cp, record);
+}
+
+int tw_checkpoint_done(TwCheckpoint* cp, const char* image)
+{
+    char record[256];
+
+    snprintf(record, sizeof(record), "done %s\n", image);
+    return add_record(cp, record);
+}
+
+int tw_checkpoint_find(const char* device_dir, char* dir, size_t len)
+{
+    char best[256] = "";
+    struct dirent* de;
+    DIR* d = opendir(device_dir);
+
+    if (!d)             return -1;
+    while ((de = readdir(d)) != NULL)
+    {
+        char path[PATH_MAX];
+        struct stat st;
+
+        if (de->d_name[0] == '.')   continue;
+        snprintf(path, sizeof(path), "%s/%s/%s", device_dir, de->d_name, TW_CHECKPOINT_FILE);
+        // Folders are named after the time they were made, so the newest sorts last
+        if (stat(path, &st) == 0 && strcmp(de->d_name, best) > 0 && strlen(de->d_name) < sizeof(best))
+            strcpy(best, de->d_name);
+    }
+    closedir(d);
+
+    if (!best[0])       return -1;
+    snprintf(dir, len, "%s/%s/", device_dir, best);
+    return 0;
+}
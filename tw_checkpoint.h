@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_CHECKPOINT_HEADER
+#define _TW_CHECKPOINT_HEADER
+
+#include <limits.h>
+#include <pthread.h>
+
+#include "tw_segment.h"
+
+// Sits in a backup folder for as long as the backup in it isn't complete
+#define TW_CHECKPOINT_FILE  ".checkpoint"
+
+// What the checkpoint says about one backup file
+typedef struct {
+    char image[64];                 // eg. "data.ext4.win"
+    char mode[64];                  // how it was being written, the same mode writes the same data
+    int done;                       // complete, with its digest
+    TwSegmentStats segments;        // the segments on disk for good, from the first on
+} TwCheckpointEntry;
+
+typedef struct {
+    char filename[PATH_MAX];
+    int fd;
+    int count;
+    TwCheckpointEntry* entries;
+    pthread_mutex_t lock;
+} TwCheckpoint;
+
+// Reads the checkpoint of the backup folder dir, if there is one, and opens
+// it for adding records. Returns 0 on success.
+int tw_checkpoint_open(const char* dir, TwCheckpoint* cp);
+
+// Closes the checkpoint. A complete backup has no more use for it, so then
+// it's removed.
+void tw_checkpoint_close(TwCheckpoint* cp, int complete);
+
+// The entry for image as it was when the checkpoint was opened, NULL if none
+const TwCheckpointEntry* tw_checkpoint_get(const TwCheckpoint* cp, const char* image);
+
+// Each record is on disk when these return, they are safe from any thread.
+// Starting an image drops what was recorded for it before.
+int tw_checkpoint_start(TwCheckpoint* cp, const char* image, const char* mode);
+int tw_checkpoint_segment(TwCheckpoint* cp, const char* image, int index, const TwSegmentInfo* info);
+int tw_checkpoint_done(TwCheckpoint* cp, const char* image);
+
+// Finds the newest backup folder in device_dir that has a checkpoint, and
+// puts its path, with a '/' at the end, in dir. Returns 0 if there is one.
+int tw_checkpoint_find(const char* device_dir, char* dir, size_t len);
+
+#endif  // _TW_CHECKPOINT_HEADER
@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Content defined chunking for incremental backups.
+**
+** The stream is cut where a rolling hash of the last 64 bytes hits a
+** pattern, so an insert or delete only moves the cut points around it and
+** the chunks after it come out the same as last time. File systems share
+** chunks only because tw_archive writes an unchanged tree the same way every
+** time, so nothing that goes into the stream may depend on the run. Each
+** chunk is stored once, as store/xx/<md5>, and the backup itself is a
+** manifest:
+**
+**   TWCHUNK1
+**   <md5> <length>
+**   ...
+**   end <total length>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "tw_chunk.h"
+#include "tw_digest.h"
+
+#define CHUNK_MAGIC         "TWCHUNK1"
+#define MIN_CHUNK           (16 * 1024)
+#define MAX_CHUNK           (256 * 1024)
+// 16 bits have to be zero, so chunks average 64K past the minimum
+#define CHUNK_MASK          (0xffffULL << 48)
+
+static unsigned long long gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// The table has to be the same on every run, so it comes from a fixed seed
+static void init_gear(void)
+{
+    unsigned long long seed = 0x5457525043444331ULL;
+    int i;
+
+    for (i = 0; i < 256; i++)
+    {
+        unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static void chunk_path(char* path, const char* store, const char* hex)
+{
+    sprintf(path, "%s/%.2s/%s", store, hex, hex);
+}
+
+int tw_chunk_check(const void* data, size_t len)
+{
+    return len >= 9 && memcmp(data, CHUNK_MAGIC "\n", 9) == 0;
+}
+
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    char store[256];
+    TwChunkStats* stats;
+    TwChunkStats counts;
+
+    unsigned char* buffer;
+    size_t used;
+    unsigned long long hash;
+    int error;
+} ChunkSink;
+
+static int write_file(const char* filename, const unsigned char* data, size_t len)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)     return -1;
+
+    while (len > 0)
+    {
+        ssize_t ret = write(fd, data, len);
+        if (ret < 0 && errno == EINTR)  continue;
+        if (ret <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return close(fd);
+}
+
+// Adds the chunk to the store unless it's there already
+static int store_chunk(ChunkSink* cs, const char* hex)
+{
+    char path[512];
+    char temp[512];
+    struct stat st;
+
+    chunk_path(path, cs->store, hex);
+    if (stat(path, &st) == 0 && (size_t) st.st_size == cs->used)
+        return 0;
+
+    // Written under a temporary name, so an interrupted backup never leaves a bad chunk
+    sprintf(temp, "%s/%.2s", cs->store, hex);
+    if (mkdir(temp, 0777) != 0 && errno != EEXIST)
+    {
+        LOGE("Unable to create %s (errno=%d)\n", temp, errno);
+        return -1;
+    }
+    sprintf(temp, "%s.tmp%lx", path, (unsigned long) pthread_self());
+    if (write_file(temp, cs->buffer, cs->used) != 0 || rename(temp, path) != 0)
+    {
+        LOGE("Unable to write chunk %s (errno=%d)\n", path, errno);
+        unlink(temp);
+        return -1;
+    }
+
+    cs->counts.new_chunks++;
+    cs->counts.new_bytes += cs->used;
+    return 0;
+}
+
+static int flush_chunk(ChunkSink* cs)
+{
+    unsigned char digest[MD5_DIGEST_SIZE];
+    char hex[MD5_DIGEST_SIZE * 2 + 1];
+    char line[64];
+    TwMd5Context ctx;
+
+    tw_md5_init(&ctx);
+    tw_md5_update(&ctx, cs->buffer, cs->used);
+    tw_md5_final(&ctx, digest);
+    tw_digest_to_hex(digest, MD5_DIGEST_SIZE, hex);
+
+    if (store_chunk(cs, hex) != 0)
+    {
+        cs->error = -1;
+        return -1;
+    }
+
+    sprintf(line, "%s %lu\n", hex, (unsigned long) cs->used);
+    if (tw_sink_write(cs->next, line, strlen(line)) != 0)
+    {
+        cs->error = -1;
+        return -1;
+    }
+
+    cs->counts.chunks++;
+    cs->counts.bytes += cs->used;
+    cs->used = 0;
+    cs->hash = 0;
+    return 0;
+}
+
+static int chunk_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    ChunkSink* cs = (ChunkSink*) sink;
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (cs->error)      return -1;
+    while (len > 0)
+    {
+        unsigned long long hash = cs->hash;
+        size_t limit, count;
+        int cut = 0;
+
+        // Nothing is cut before the minimum size, so don't bother hashing it
+        if (cs->used < MIN_CHUNK)
+        {
+            count = MIN_CHUNK - cs->used;
+            if (count > len)    count = len;
+            memcpy(cs->buffer + cs->used, ptr, count);
+            cs->used += count;
+            ptr += count;
+            len -= count;
+            continue;
+        }
+
+        limit = MAX_CHUNK - cs->used;
+        if (limit > len)    limit = len;
+        for (count = 0; count < limit; )
+        {
+            hash = (hash << 1) + gear[ptr[count++]];
+            if ((hash & CHUNK_MASK) == 0)
+            {
+                cut = 1;
+                break;
+            }
+        }
+
+        memcpy(cs->buffer + cs->used, ptr, count);
+        cs->used += count;
+        cs->hash = hash;
+        ptr += count;
+        len -= count;
+
+        if ((cut || cs->used == MAX_CHUNK) && flush_chunk(cs) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int chunk_sink_close(TwSink* sink)
+{
+    ChunkSink* cs = (ChunkSink*) sink;
+    char line[64];
+    int ret;
+
+    if (!cs->error && cs->used)
+        flush_chunk(cs);
+    if (!cs->error)
+    {
+        sprintf(line, "end %llu\n", cs->counts.bytes);
+        if (tw_sink_write(cs->next, line, strlen(line)) != 0)
+            cs->error = -1;
+    }
+
+    ret = cs->error;
+    if (tw_sink_close(cs->next) != 0)   ret = -1;
+    if (cs->stats)      *cs->stats = cs->counts;
+
+    free(cs->buffer);
+    free(cs);
+    return ret;
+}
+
+TwSink* tw_chunk_sink_open(TwSink* next, const char* store, TwChunkStats* stats)
+{
+    ChunkSink* cs = (ChunkSink*) calloc(1, sizeof(ChunkSink));
+    const char* magic = CHUNK_MAGIC "\n";
+
+    if (!cs)            return NULL;
+
+    pthread_once(&gear_once, init_gear);
+    if (mkdir(store, 0777) != 0 && errno != EEXIST)
+    {
+        LOGE("Unable to create %s (errno=%d)\n", store, errno);
+        free(cs);
+        return NULL;
+    }
+
+    cs->buffer = (unsigned char*) malloc(MAX_CHUNK);
+    if (!cs->buffer || tw_sink_write(next, magic, strlen(magic)) != 0)
+    {
+        free(cs->buffer);
+        free(cs);
+        return NULL;
+    }
+
+    strncpy(cs->store, store, sizeof(cs->store) - 1);
+    cs->next = next;
+    cs->stats = stats;
+    cs->sink.write = chunk_sink_write;
+    cs->sink.close = chunk_sink_close;
+    return &cs->sink;
+}
+
+// Reads a chunk and checks it still matches its name
+static int load_chunk(const char* store, const char* hex, unsigned char* buffer, size_t len)
+{
+    unsigned char digest[MD5_DIGEST_SIZE];
+    unsigned char expected[MD5_DIGEST_SIZE];
+    TwMd5Context ctx;
+    char path[512];
+    size_t done = 0;
+    int fd;
+
+    chunk_path(path, store, hex);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        LOGE("Missing chunk %s\n", path);
+        return 1;
+    }
+    while (done < len)
+    {
+        ssize_t ret = read(fd, buffer + done, len - done);
+        if (ret < 0 && errno == EINTR)  continue;
+        if (ret <= 0)   break;
+        done += ret;
+    }
+    close(fd);
+
+    tw_md5_init(&ctx);
+    tw_md5_update(&ctx, buffer, done);
+    tw_md5_final(&ctx, digest);
+    if (done != len || tw_digest_from_hex(hex, expected, MD5_DIGEST_SIZE) != 0 ||
+        memcmp(digest, expected, MD5_DIGEST_SIZE) != 0)
+    {
+        LOGE("Chunk %s is damaged\n", path);
+        return 2;
+    }
+    return 0;
+}
+
+int tw_chunk_restore(const char* store, const char* manifest, size_t len, TwSink* out)
+{
+    unsigned long long total = 0, end_total;
+    unsigned char* buffer;
+    const char* ptr = manifest;
+    const char* stop = manifest + len;
+    int ret = 2, first = 1, bad_chunk = 0;
+
+    buffer = (unsigned char*) malloc(MAX_CHUNK);
+    if (!buffer)        return 1;
+
+    while (ptr < stop)
+    {
+        const char* eol = memchr(ptr, '\n', stop - ptr);
+        char line[80];
+        char hex[MD5_DIGEST_SIZE * 2 + 1];
+        unsigned long size;
+
+        if (!eol || eol - ptr >= (int) sizeof(line))    break;
+        memcpy(line, ptr, eol - ptr);
+        line[eol - ptr] = '\0';
+        ptr = eol + 1;
+
+        if (first)
+        {
+            if (strcmp(line, CHUNK_MAGIC) != 0)     break;
+            first = 0;
+        }
+        else if (sscanf(line, "end %llu", &end_total) == 1)
+        {
+            // Anything but the full length means the manifest was cut short
+            if (end_total == total && ptr == stop)  ret = 0;
+            break;
+        }
+        else if (sscanf(line, "%32s %lu", hex, &size) == 2 && strlen(hex) == MD5_DIGEST_SIZE * 2 && size <= MAX_CHUNK)
+        {
+            int err = load_chunk(store, hex, buffer, size);
+            if (err)
+            {
+                ret = err;
+                bad_chunk = 1;
+                break;
+            }
+            if (out && tw_sink_write(out, buffer, size) != 0)
+            {
+                ret = 1;
+                break;
+            }
+            total += size;
+        }
+        else
+            break;
+    }
+
+    if (ret == 2 && !bad_chunk)
+        LOGE("Chunk manifest is damaged or incomplete\n");
+    free(buffer);
+    return ret;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_CHUNK_HEADER
+#define _TW_CHUNK_HEADER
+
+#include "tw_sink.h"
+
+// Folder in each device's backup folder holding the chunks
+#define TW_CHUNK_STORE      ".chunks"
+
+typedef struct {
+    unsigned long long chunks;
+    unsigned long long new_chunks;
+    unsigned long long bytes;
+    unsigned long long new_bytes;
+} TwChunkStats;
+
+// Cuts the stream into content defined chunks, adds the ones the store
+// doesn't have yet and writes the manifest listing them to next.
+// stats is filled in when the sink is closed.
+TwSink* tw_chunk_sink_open(TwSink* next, const char* store, TwChunkStats* stats);
+
+// Returns 1 if data starts with a chunk manifest
+int tw_chunk_check(const void* data, size_t len);
+
+// Rebuilds the stream described by a manifest and writes it to out. Every
+// chunk is checked against its name. With out NULL, the chunks are only
+// checked. Returns 0 on success, 1 on error and 2 if a chunk is damaged.
+int tw_chunk_restore(const char* store, const char* manifest, size_t len, TwSink* out);
+
+#endif  // _TW_CHUNK_HEADER
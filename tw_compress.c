@@ -0,0 +1,511 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Block parallel compression for backups.
+**
+** The input is cut into fixed size blocks that a pool of worker threads
+** compress independently. Blocks are kept in submission order and the
+** calling thread hands each one to the next sink as soon as it and all the
+** blocks before it are done, so downstream stages only ever see the calling
+** thread. The number of blocks in flight is capped to bound memory use.
+**
+** Each block becomes a complete gzip member or LZ4 frame of its own, so the
+** output is an ordinary stream for either format.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "tw_compress.h"
+#include "tw_archive.h"
+#include "tw_lz4.h"
+
+#define COMPRESS_BLOCK_SIZE     (512 * 1024)
+#define MAX_COMPRESS_THREADS    8
+#define DECOMPRESS_BUFFER_SIZE  (256 * 1024)
+
+typedef struct CompressBlock {
+    struct CompressBlock* next_work;
+    struct CompressBlock* next_order;
+    unsigned char* in;
+    size_t in_len;
+    unsigned char* out;
+    size_t out_len;
+    int done;
+    int error;
+} CompressBlock;
+
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    TwCodec codec;
+    int level;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    CompressBlock* work_head;
+    CompressBlock* work_tail;
+    CompressBlock* order_head;
+    CompressBlock* order_tail;
+    int in_flight;
+    int max_in_flight;
+    int shutdown;
+
+    pthread_t threads[MAX_COMPRESS_THREADS];
+    int thread_count;
+
+    CompressBlock* current;
+    struct timeval start;
+    TwCompressStats* stats;
+    unsigned long long bytes_in;        // Of the blocks written so far
+    unsigned long long bytes_out;
+    TwCompressBlockFn block_fn;
+    void* cookie;
+    int error;
+} ParallelSink;
+
+unsigned long tw_msec_since(const struct timeval* start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+static int compress_gzip_block(CompressBlock* block, int level)
+{
+    z_stream strm;
+    uLong bound;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    // deflateBound doesn't account for the gzip wrapper
+    bound = deflateBound(&strm, block->in_len) + 32;
+    block->out = (unsigned char*) malloc(bound);
+    if (!block->out)
+    {
+        deflateEnd(&strm);
+        return -1;
+    }
+
+    strm.next_in = block->in;
+    strm.avail_in = block->in_len;
+    strm.next_out = block->out;
+    strm.avail_out = bound;
+    if (deflate(&strm, Z_FINISH) != Z_STREAM_END)
+    {
+        deflateEnd(&strm);
+        return -1;
+    }
+
+    block->out_len = bound - strm.avail_out;
+    deflateEnd(&strm);
+    return 0;
+}
+
+static int compress_lz4_block(CompressBlock* block)
+{
+    block->out = (unsigned char*) malloc(TW_LZ4_FRAME_BOUND(block->in_len));
+    if (!block->out)    return -1;
+
+    block->out_len = tw_lz4_compress_frame(block->in, block->in_len, block->out);
+    return block->out_len ? 0 : -1;
+}
+
+size_t tw_compress_size(TwCodec codec, int level, const void* data, size_t len)
+{
+    CompressBlock block;
+    int ret;
+
+    if (codec == TW_CODEC_NONE)     return len;
+
+    memset(&block, 0, sizeof(block));
+    block.in = (unsigned char*) data;
+    block.in_len = len;
+    if (codec == TW_CODEC_LZ4)  ret = compress_lz4_block(&block);
+    else                        ret = compress_gzip_block(&block, level);
+    free(block.out);
+    return ret == 0 ? block.out_len : 0;
+}
+
+static void* compress_thread(void* cookie)
+{
+    ParallelSink* ps = (ParallelSink*) cookie;
+
+    pthread_mutex_lock(&ps->lock);
+    for (;;)
+    {
+        CompressBlock* block;
+
+        while (!ps->work_head && !ps->shutdown)
+            pthread_cond_wait(&ps->work_cond, &ps->lock);
+        if (!ps->work_head)
+            break;
+
+        block = ps->work_head;
+        ps->work_head = block->next_work;
+        if (!ps->work_head)     ps->work_tail = NULL;
+        pthread_mutex_unlock(&ps->lock);
+
+        if (ps->codec == TW_CODEC_LZ4)  block->error = compress_lz4_block(block);
+        else                            block->error = compress_gzip_block(block, ps->level);
+        free(block->in);
+        block->in = NULL;
+
+        pthread_mutex_lock(&ps->lock);
+        block->done = 1;
+        pthread_cond_broadcast(&ps->done_cond);
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
+static CompressBlock* new_block(void)
+{
+    CompressBlock* block = (CompressBlock*) calloc(1, sizeof(CompressBlock));
+    if (!block)     return NULL;
+
+    block->in = (unsigned char*) malloc(COMPRESS_BLOCK_SIZE);
+    if (!block->in)
+    {
+        free(block);
+        return NULL;
+    }
+    return block;
+}
+
+static void free_block(CompressBlock* block)
+{
+    free(block->in);
+    free(block->out);
+    free(block);
+}
+
+// Writes out finished blocks in order. With wait_all, waits for every block,
+// otherwise only waits while we're at the in-flight limit.
+static int drain_blocks(ParallelSink* ps, int wait_all)
+{
+    for (;;)
+    {
+        CompressBlock* block;
+
+        pthread_mutex_lock(&ps->lock);
+        block = ps->order_head;
+        if (!block || (!block->done && !wait_all && ps->in_flight < ps->max_in_flight))
+        {
+            pthread_mutex_unlock(&ps->lock);
+            return ps->error;
+        }
+        while (!block->done)
+            pthread_cond_wait(&ps->done_cond, &ps->lock);
+
+        ps->order_head = block->next_order;
+        if (!ps->order_head)    ps->order_tail = NULL;
+        ps->in_flight--;
+        pthread_mutex_unlock(&ps->lock);
+
+        if (block->error)
+        {
+            LOGE("Unable to compress backup data\n");
+            ps->error = -1;
+        }
+        else if (!ps->error)
+        {
+            if (ps->block_fn)   ps->block_fn(ps->bytes_in, ps->bytes_out, ps->cookie);
+            if (tw_sink_write(ps->next, block->out, block->out_len) != 0)
+                ps->error = -1;
+            ps->bytes_in += block->in_len;
+            ps->bytes_out += block->out_len;
+        }
+        free_block(block);
+    }
+}
+
+static int submit_block(ParallelSink* ps)
+{
+    CompressBlock* block = ps->current;
+
+    ps->current = NULL;
+    pthread_mutex_lock(&ps->lock);
+    if (ps->order_tail)     ps->order_tail->next_order = block;
+    else                    ps->order_head = block;
+    ps->order_tail = block;
+    if (ps->work_tail)      ps->work_tail->next_work = block;
+    else                    ps->work_head = block;
+    ps->work_tail = block;
+    ps->in_flight++;
+    pthread_cond_signal(&ps->work_cond);
+    pthread_mutex_unlock(&ps->lock);
+
+    return drain_blocks(ps, 0);
+}
+
+static int compress_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    ParallelSink* ps = (ParallelSink*) sink;
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (ps->error)      return -1;
+    while (len > 0)
+    {
+        size_t count;
+
+        if (!ps->current)
+        {
+            ps->current = new_block();
+            if (!ps->current)
+            {
+                LOGE("Out of memory while compressing\n");
+                ps->error = -1;
+                return -1;
+            }
+        }
+
+        count = COMPRESS_BLOCK_SIZE - ps->current->in_len;
+        if (count > len)    count = len;
+        memcpy(ps->current->in + ps->current->in_len, ptr, count);
+        ps->current->in_len += count;
+        ptr += count;
+        len -= count;
+
+        if (ps->current->in_len == COMPRESS_BLOCK_SIZE && submit_block(ps) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int compress_sink_close(TwSink* sink)
+{
+    ParallelSink* ps = (ParallelSink*) sink;
+    int i, ret;
+
+    // Even an empty stream needs one member to be a valid file
+    if (!ps->current && ps->sink.bytes == 0 && !ps->error)
+        ps->current = new_block();
+    if (ps->current && !ps->error)
+        submit_block(ps);
+    drain_blocks(ps, 1);
+
+    pthread_mutex_lock(&ps->lock);
+    ps->shutdown = 1;
+    pthread_cond_broadcast(&ps->work_cond);
+    pthread_mutex_unlock(&ps->lock);
+    for (i = 0; i < ps->thread_count; i++)
+        pthread_join(ps->threads[i], NULL);
+
+    ret = ps->error;
+    if (tw_sink_close(ps->next) != 0)   ret = -1;
+
+    if (ps->stats)
+    {
+        ps->stats->bytes_in = ps->sink.bytes;
+        ps->stats->bytes_out = ps->bytes_out;
+        ps->stats->msec = tw_msec_since(&ps->start);
+    }
+
+    if (ps->current)    free_block(ps->current);
+    pthread_cond_destroy(&ps->done_cond);
+    pthread_cond_destroy(&ps->work_cond);
+    pthread_mutex_destroy(&ps->lock);
+    free(ps);
+    return ret;
+}
+
+TwSink* tw_compress_sink_open(TwSink* next, TwCodec codec, int level, int threads, TwCompressStats* stats)
+{
+    return tw_compress_sink_open_indexed(next, codec, level, threads, stats, NULL, NULL);
+}
+
+TwSink* tw_compress_sink_open_indexed(TwSink* next, TwCodec codec, int level, int threads, TwCompressStats* stats,
+                                      TwCompressBlockFn block_fn, void* cookie)
+{
+    ParallelSink* ps = (ParallelSink*) calloc(1, sizeof(ParallelSink));
+    int i;
+
+    if (!ps)            return NULL;
+
+    if (threads <= 0)                       threads = tw_get_cpu_count();
+    if (threads > MAX_COMPRESS_THREADS)     threads = MAX_COMPRESS_THREADS;
+
+    ps->next = next;
+    ps->codec = codec;
+    ps->level = level;
+    ps->stats = stats;
+    ps->block_fn = block_fn;
+    ps->cookie = cookie;
+    // Two blocks per worker keeps everyone busy while the writer catches up
+    ps->max_in_flight = threads * 2;
+    gettimeofday(&ps->start, NULL);
+
+    pthread_mutex_init(&ps->lock, NULL);
+    pthread_cond_init(&ps->work_cond, NULL);
+    pthread_cond_init(&ps->done_cond, NULL);
+
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&ps->threads[i], NULL, compress_thread, ps) != 0)
+            break;
+        ps->thread_count++;
+    }
+
+    if (ps->thread_count == 0)
+    {
+        LOGE("Unable to start compression threads\n");
+        pthread_cond_destroy(&ps->done_cond);
+        pthread_cond_destroy(&ps->work_cond);
+        pthread_mutex_destroy(&ps->lock);
+        free(ps);
+        return NULL;
+    }
+
+    ps->sink.write = compress_sink_write;
+    ps->sink.close = compress_sink_close;
+    return &ps->sink;
+}
+
+int tw_codec_from_name(const char* name)
+{
+    if (strcmp(name, "none") == 0)      return TW_CODEC_NONE;
+    if (strcmp(name, "gzip") == 0)      return TW_CODEC_GZIP;
+    if (strcmp(name, "lz4") == 0)       return TW_CODEC_LZ4;
+    return -1;
+}
+
+const char* tw_codec_name(TwCodec codec)
+{
+    switch (codec)
+    {
+    case TW_CODEC_GZIP:     return "gzip";
+    case TW_CODEC_LZ4:      return "lz4";
+    default:                return "none";
+    }
+}
+
+TwCodec tw_codec_detect(const void* data, size_t len)
+{
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (len >= 2 && ptr[0] == 0x1f && ptr[1] == 0x8b)
+        return TW_CODEC_GZIP;
+    if (tw_lz4_check(data, len))
+        return TW_CODEC_LZ4;
+    return TW_CODEC_NONE;
+}
+
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    z_stream strm;
+    unsigned char* out;
+    int ended;              // at the end of a member, where the stream may stop
+    int error;
+} GunzipSink;
+
+static int gunzip_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    GunzipSink* gs = (GunzipSink*) sink;
+
+    if (gs->error)      return -1;
+    gs->strm.next_in = (Bytef*) data;
+    gs->strm.avail_in = len;
+    for (;;)
+    {
+        int ret;
+
+        // Parallel backups are a run of gzip members, each one starts over
+        if (gs->ended)
+        {
+            if (gs->strm.avail_in == 0)     break;
+            inflateReset(&gs->strm);
+            gs->ended = 0;
+        }
+
+        gs->strm.next_out = gs->out;
+        gs->strm.avail_out = DECOMPRESS_BUFFER_SIZE;
+        ret = inflate(&gs->strm, Z_NO_FLUSH);
+        if (ret == Z_BUF_ERROR)     break;      // needs more input
+        if (ret != Z_OK && ret != Z_STREAM_END)
+        {
+            LOGE("gzip data is damaged (%d)\n", ret);
+            gs->error = -1;
+            return -1;
+        }
+        if (tw_sink_write(gs->next, gs->out, DECOMPRESS_BUFFER_SIZE - gs->strm.avail_out) != 0)
+        {
+            gs->error = -1;
+            return -1;
+        }
+
+        if (ret == Z_STREAM_END)    gs->ended = 1;
+        // A full buffer may leave output behind even with all input taken
+        else if (gs->strm.avail_in == 0 && gs->strm.avail_out != 0)     break;
+    }
+    return 0;
+}
+
+static int gunzip_sink_close(TwSink* sink)
+{
+    GunzipSink* gs = (GunzipSink*) sink;
+    int ret = gs->error;
+
+    if (!ret && !gs->ended)
+    {
+        LOGE("gzip stream ended in the middle of a member\n");
+        ret = -1;
+    }
+    if (tw_sink_close(gs->next) != 0)   ret = -1;
+
+    inflateEnd(&gs->strm);
+    free(gs->out);
+    free(gs);
+    return ret;
+}
+
+static TwSink* gunzip_sink_open(TwSink* next)
+{
+    GunzipSink* gs = (GunzipSink*) calloc(1, sizeof(GunzipSink));
+
+    if (!gs)            return NULL;
+    gs->out = (unsigned char*) malloc(DECOMPRESS_BUFFER_SIZE);
+    if (!gs->out || inflateInit2(&gs->strm, 15 + 16) != Z_OK)
+    {
+        free(gs->out);
+        free(gs);
+        return NULL;
+    }
+
+    gs->next = next;
+    gs->sink.write = gunzip_sink_write;
+    gs->sink.close = gunzip_sink_close;
+    return &gs->sink;
+}
+
+TwSink* tw_decompress_sink_open(TwSink* next, TwCodec codec)
+{
+    switch (codec)
+    {
+    case TW_CODEC_GZIP:     return gunzip_sink_open(next);
+    case TW_CODEC_LZ4:      return tw_lz4_decode_sink_open(next);
+    default:                return NULL;
+    }
+}
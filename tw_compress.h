@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_COMPRESS_HEADER
+#define _TW_COMPRESS_HEADER
+
+#include <sys/time.h>
+
+#include "tw_sink.h"
+
+// Filled in when the sink is closed
+typedef struct {
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long msec;             // Wall time from open to close
+} TwCompressStats;
+
+// Codecs for .win archives. The codec isn't recorded anywhere but in the
+// data itself, restore tells them apart by their magic.
+typedef enum {
+    TW_CODEC_NONE = 0,
+    TW_CODEC_GZIP,
+    TW_CODEC_LZ4,
+} TwCodec;
+
+// "none", "gzip" or "lz4", returns -1 for anything else
+int tw_codec_from_name(const char* name);
+const char* tw_codec_name(TwCodec codec);
+
+// Works out the codec of a stream from its first bytes
+TwCodec tw_codec_detect(const void* data, size_t len);
+
+// Compresses fixed size blocks on all cores (threads 0 picks one per CPU)
+// and writes each as its own gzip member or LZ4 frame, in order, to next.
+// Concatenated members are a valid stream for gunzip, "tar -xz" and
+// "lz4 -d". level only applies to gzip, stats may be NULL.
+TwSink* tw_compress_sink_open(TwSink* next, TwCodec codec, int level, int threads, TwCompressStats* stats);
+
+// Called on the writing thread as each block goes out, with where it starts
+// in the uncompressed data and in the compressed stream. Every block decodes
+// on its own, so a reader can start at any of them.
+typedef void (*TwCompressBlockFn)(unsigned long long in_offset, unsigned long long out_offset, void* cookie);
+
+// The same, reporting every block boundary to block_fn
+TwSink* tw_compress_sink_open_indexed(TwSink* next, TwCodec codec, int level, int threads, TwCompressStats* stats,
+                                      TwCompressBlockFn block_fn, void* cookie);
+
+// Size data comes to as one block of the compressed stream, for
+// estimating what a backup will take. Returns 0 on error.
+size_t tw_compress_size(TwCodec codec, int level, const void* data, size_t len);
+
+// Decompresses a stream in either format and writes the data to next
+TwSink* tw_decompress_sink_open(TwSink* next, TwCodec codec);
+
+unsigned long tw_msec_since(const struct timeval* start);
+
+#endif  // _TW_COMPRESS_HEADER
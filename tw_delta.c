@@ -0,0 +1,488 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Differential partition images.
+**
+** Every image backup can keep a block map next to it, the MD5 of each 64K
+** block. The next backup of the partition hashes its blocks the same way and
+** only stores the ones whose hash changed, as a delta pointing back at the
+** earlier backup. All little endian:
+**
+**   map:    "TWBMAP01", u32 block size, u32 reserved, u64 image size, then 16 bytes per block
+**   delta:  "TWDELTA1", u32 block size, u32 chain depth, u64 image size,
+**           MD5 of the base backup, 256 bytes base name
+**   record: u32 type, u32 reserved, u64 block number, then the block for DATA
+**
+** The END record holds the image size instead of a block number, so a
+** truncated delta is caught. A delta's map describes the whole image it
+** restores to, so the next delta can build on it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tw_delta.h"
+
+#define MAP_MAGIC           "TWBMAP01"
+#define MAP_HEADER_SIZE     24
+#define DELTA_MAGIC         "TWDELTA1"
+#define RECORD_SIZE         16
+
+#define RECORD_DATA         1
+#define RECORD_END          3
+
+static void put_le32(unsigned char* ptr, unsigned int value)
+{
+    ptr[0] = value;
+    ptr[1] = value >> 8;
+    ptr[2] = value >> 16;
+    ptr[3] = value >> 24;
+}
+
+static void put_le64(unsigned char* ptr, unsigned long long value)
+{
+    put_le32(ptr, (unsigned int) value);
+    put_le32(ptr + 4, (unsigned int) (value >> 32));
+}
+
+static unsigned int get_le32(const unsigned char* ptr)
+{
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int) ptr[3] << 24);
+}
+
+static unsigned long long get_le64(const unsigned char* ptr)
+{
+    return get_le32(ptr) | ((unsigned long long) get_le32(ptr + 4) << 32);
+}
+
+int tw_blockmap_load(const char* filename, TwBlockMap* map)
+{
+    unsigned char header[MAP_HEADER_SIZE];
+    FILE* fp;
+
+    memset(map, 0, sizeof(*map));
+    fp = fopen(filename, "rb");
+    if (!fp)        return -1;
+
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+        memcmp(header, MAP_MAGIC, 8) != 0 || get_le32(header + 8) != TW_DELTA_BLOCK_SIZE)
+    {
+        LOGE("Invalid block map %s\n", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    map->total = get_le64(header + 16);
+    map->count = (map->total + TW_DELTA_BLOCK_SIZE - 1) / TW_DELTA_BLOCK_SIZE;
+    map->hashes = (unsigned char*) malloc(map->count * MD5_DIGEST_SIZE + 1);
+    if (!map->hashes || fread(map->hashes, MD5_DIGEST_SIZE, map->count, fp) != map->count)
+    {
+        LOGE("Unable to read block map %s\n", filename);
+        fclose(fp);
+        tw_blockmap_free(map);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+void tw_blockmap_free(TwBlockMap* map)
+{
+    free(map->hashes);
+    memset(map, 0, sizeof(*map));
+}
+
+int tw_delta_check(const void* data, size_t len)
+{
+    return len >= TW_DELTA_HEADER_SIZE && memcmp(data, DELTA_MAGIC, 8) == 0;
+}
+
+int tw_delta_read_info(const void* data, size_t len, TwDeltaInfo* info)
+{
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (!tw_delta_check(data, len) || get_le32(ptr + 8) != TW_DELTA_BLOCK_SIZE)
+        return -1;
+
+    memset(info, 0, sizeof(*info));
+    info->depth = get_le32(ptr + 12);
+    info->total = get_le64(ptr + 16);
+    memcpy(info->base_digest, ptr + 24, MD5_DIGEST_SIZE);
+    memcpy(info->base, ptr + 40, sizeof(info->base));
+    if (info->base[sizeof(info->base) - 1] != '\0' || info->base[0] == '\0')
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    char map_file[512];
+    const TwBlockMap* base;     // NULL when the whole image goes through
+    unsigned long long expected;
+    unsigned long long* changed;
+
+    TwMd5Context ctx;
+    unsigned char* block;
+    size_t used;
+    unsigned char* hashes;
+    unsigned long long count;
+    unsigned long long alloc;
+    unsigned long long total;
+    unsigned long long written;
+    int error;
+} MapSink;
+
+static int end_block(MapSink* ms)
+{
+    unsigned char* hash;
+
+    if (ms->count == ms->alloc)
+    {
+        unsigned long long alloc = ms->alloc ? ms->alloc * 2 : 256;
+        unsigned char* hashes = (unsigned char*) realloc(ms->hashes, alloc * MD5_DIGEST_SIZE);
+        if (!hashes)
+        {
+            ms->error = -1;
+            return -1;
+        }
+        ms->hashes = hashes;
+        ms->alloc = alloc;
+    }
+
+    hash = ms->hashes + ms->count * MD5_DIGEST_SIZE;
+    tw_md5_final(&ms->ctx, hash);
+
+    if (ms->base && (ms->count >= ms->base->count ||
+        memcmp(hash, ms->base->hashes + ms->count * MD5_DIGEST_SIZE, MD5_DIGEST_SIZE) != 0))
+    {
+        unsigned char record[RECORD_SIZE];
+
+        memset(record, 0, sizeof(record));
+        put_le32(record, RECORD_DATA);
+        put_le64(record + 8, ms->count);
+        if (tw_sink_write(ms->next, record, sizeof(record)) != 0 ||
+            tw_sink_write(ms->next, ms->block, ms->used) != 0)
+        {
+            ms->error = -1;
+            return -1;
+        }
+        ms->written++;
+    }
+
+    ms->count++;
+    ms->used = 0;
+    tw_md5_init(&ms->ctx);
+    return 0;
+}
+
+static int map_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    MapSink* ms = (MapSink*) sink;
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (ms->error)      return -1;
+
+    // A full image goes through as it is, the blocks are only hashed on the way
+    if (!ms->base && tw_sink_write(ms->next, data, len) != 0)
+    {
+        ms->error = -1;
+        return -1;
+    }
+
+    while (len > 0)
+    {
+        size_t count = TW_DELTA_BLOCK_SIZE - ms->used;
+        if (count > len)    count = len;
+
+        tw_md5_update(&ms->ctx, ptr, count);
+        if (ms->base)       memcpy(ms->block + ms->used, ptr, count);
+        ms->used += count;
+        ms->total += count;
+        ptr += count;
+        len -= count;
+
+        if (ms->used == TW_DELTA_BLOCK_SIZE && end_block(ms) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int write_map(MapSink* ms)
+{
+    unsigned char header[MAP_HEADER_SIZE];
+    FILE* fp;
+    int ret = 0;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, MAP_MAGIC, 8);
+    put_le32(header + 8, TW_DELTA_BLOCK_SIZE);
+    put_le64(header + 16, ms->total);
+
+    fp = fopen(ms->map_file, "wb");
+    if (!fp)        return -1;
+    if (fwrite(header, 1, sizeof(header), fp) != sizeof(header) ||
+        (ms->count && fwrite(ms->hashes, MD5_DIGEST_SIZE, ms->count, fp) != ms->count))
+        ret = -1;
+    if (fclose(fp) != 0)    ret = -1;
+    return ret;
+}
+
+static int map_sink_close(TwSink* sink)
+{
+    MapSink* ms = (MapSink*) sink;
+    int ret;
+
+    if (!ms->error && ms->used)
+        end_block(ms);
+    if (!ms->error && ms->base)
+    {
+        unsigned char record[RECORD_SIZE];
+
+        if (ms->total != ms->expected)
+        {
+            LOGE("Image size changed from %llu to %llu\n", ms->expected, ms->total);
+            ms->error = -1;
+        }
+        memset(record, 0, sizeof(record));
+        put_le32(record, RECORD_END);
+        put_le64(record + 8, ms->total);
+        if (!ms->error && tw_sink_write(ms->next, record, sizeof(record)) != 0)
+            ms->error = -1;
+    }
+    if (!ms->error && write_map(ms) != 0)
+    {
+        LOGE("Unable to write block map %s (errno=%d)\n", ms->map_file, errno);
+        ms->error = -1;
+    }
+
+    ret = ms->error;
+    if (tw_sink_close(ms->next) != 0)   ret = -1;
+    if (ms->changed)    *ms->changed = ms->written;
+
+    free(ms->block);
+    free(ms->hashes);
+    free(ms);
+    return ret;
+}
+
+static MapSink* map_sink_alloc(TwSink* next, const char* map_file)
+{
+    MapSink* ms = (MapSink*) calloc(1, sizeof(MapSink));
+
+    if (!ms)            return NULL;
+    strncpy(ms->map_file, map_file, sizeof(ms->map_file) - 1);
+    ms->next = next;
+    tw_md5_init(&ms->ctx);
+    ms->sink.write = map_sink_write;
+    ms->sink.close = map_sink_close;
+    return ms;
+}
+
+TwSink* tw_blockmap_sink_open(TwSink* next, const char* map_file)
+{
+    MapSink* ms = map_sink_alloc(next, map_file);
+
+    return ms ? &ms->sink : NULL;
+}
+
+TwSink* tw_delta_sink_open(TwSink* next, const char* map_file, const TwBlockMap* base,
+                           const TwDeltaInfo* info, unsigned long long* changed)
+{
+    unsigned char header[TW_DELTA_HEADER_SIZE];
+    MapSink* ms;
+
+    ms = map_sink_alloc(next, map_file);
+    if (!ms)            return NULL;
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, DELTA_MAGIC, 8);
+    put_le32(header + 8, TW_DELTA_BLOCK_SIZE);
+    put_le32(header + 12, info->depth);
+    put_le64(header + 16, info->total);
+    memcpy(header + 24, info->base_digest, MD5_DIGEST_SIZE);
+    strncpy((char*) header + 40, info->base, sizeof(info->base) - 1);
+
+    ms->block = (unsigned char*) malloc(TW_DELTA_BLOCK_SIZE);
+    if (!ms->block || tw_sink_write(next, header, sizeof(header)) != 0)
+    {
+        free(ms->block);
+        free(ms);
+        return NULL;
+    }
+
+    ms->base = base;
+    ms->expected = info->total;
+    ms->changed = changed;
+    return &ms->sink;
+}
+
+enum { UNDELTA_HEADER, UNDELTA_RECORD, UNDELTA_DATA, UNDELTA_DONE };
+
+typedef struct {
+    TwSink sink;
+    int fd;
+    int state;
+    unsigned long long total;
+
+    unsigned char header[TW_DELTA_HEADER_SIZE];
+    size_t have;
+    unsigned long long offset;
+    unsigned long long remaining;
+    int error;
+} UndeltaSink;
+
+static int parse_record(UndeltaSink* us)
+{
+    unsigned int type = get_le32(us->header);
+    unsigned long long value = get_le64(us->header + 8);
+
+    if (type == RECORD_END)
+    {
+        if (value != us->total)
+        {
+            LOGE("Delta is incomplete, %llu of %llu bytes\n", value, us->total);
+            return -1;
+        }
+        us->state = UNDELTA_DONE;
+        return 0;
+    }
+    if (type != RECORD_DATA || value >= (us->total + TW_DELTA_BLOCK_SIZE - 1) / TW_DELTA_BLOCK_SIZE)
+    {
+        LOGE("Delta is damaged\n");
+        return -1;
+    }
+
+    us->offset = value * TW_DELTA_BLOCK_SIZE;
+    us->remaining = us->total - us->offset;
+    if (us->remaining > TW_DELTA_BLOCK_SIZE)    us->remaining = TW_DELTA_BLOCK_SIZE;
+    us->state = UNDELTA_DATA;
+    return 0;
+}
+
+static int undelta_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    UndeltaSink* us = (UndeltaSink*) sink;
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (us->error)      return -1;
+    while (len > 0)
+    {
+        if (us->state == UNDELTA_DONE)
+        {
+            LOGE("Unexpected data after the end of the delta\n");
+            us->error = -1;
+            return -1;
+        }
+
+        if (us->state == UNDELTA_DATA)
+        {
+            size_t count = len;
+            ssize_t ret;
+
+            if (count > us->remaining)  count = us->remaining;
+            ret = us->fd >= 0 ? pwrite(us->fd, ptr, count, us->offset) : (ssize_t) count;
+            if (ret < 0 && errno == EINTR)  continue;
+            if (ret <= 0)
+            {
+                LOGE("Unable to write block at %llu (errno=%d)\n", us->offset, errno);
+                us->error = -1;
+                return -1;
+            }
+            us->offset += ret;
+            us->remaining -= ret;
+            ptr += ret;
+            len -= ret;
+            if (us->remaining == 0)     us->state = UNDELTA_RECORD;
+            continue;
+        }
+
+        {
+            size_t want = (us->state == UNDELTA_HEADER) ? TW_DELTA_HEADER_SIZE : RECORD_SIZE;
+            size_t count = want - us->have;
+            TwDeltaInfo info;
+
+            if (count > len)    count = len;
+            memcpy(us->header + us->have, ptr, count);
+            us->have += count;
+            ptr += count;
+            len -= count;
+            if (us->have < want)    break;
+            us->have = 0;
+
+            if (us->state == UNDELTA_HEADER)
+            {
+                if (tw_delta_read_info(us->header, want, &info) != 0)
+                {
+                    LOGE("Invalid delta header\n");
+                    us->error = -1;
+                    return -1;
+                }
+                us->total = info.total;
+                us->state = UNDELTA_RECORD;
+            }
+            else if (parse_record(us) != 0)
+            {
+                us->error = -1;
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int undelta_sink_close(TwSink* sink)
+{
+    UndeltaSink* us = (UndeltaSink*) sink;
+    int ret = us->error;
+
+    if (!ret && us->state != UNDELTA_DONE)
+    {
+        LOGE("Delta ended before its end record\n");
+        ret = -1;
+    }
+    if (us->fd >= 0 && fsync(us->fd) != 0 && !ret)
+    {
+        LOGE("Unable to sync delta writes (errno=%d)\n", errno);
+        ret = -1;
+    }
+    if (us->fd >= 0 && close(us->fd) != 0)  ret = -1;
+    free(us);
+    return ret;
+}
+
+TwSink* tw_undelta_sink_open(const char* device)
+{
+    UndeltaSink* us = (UndeltaSink*) calloc(1, sizeof(UndeltaSink));
+
+    if (!us)            return NULL;
+    us->fd = device ? open(device, O_WRONLY) : -1;
+    if (device && us->fd < 0)
+    {
+        LOGE("Unable to open %s (errno=%d)\n", device, errno);
+        free(us);
+        return NULL;
+    }
+    us->state = UNDELTA_HEADER;
+    us->sink.write = undelta_sink_write;
+    us->sink.close = undelta_sink_close;
+    return &us->sink;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_DELTA_HEADER
+#define _TW_DELTA_HEADER
+
+#include "tw_sink.h"
+#include "tw_digest.h"
+
+#define TW_DELTA_BLOCK_SIZE     (64 * 1024)
+
+// Longest chain of deltas on top of a full image, the next backup is a full one again
+#define TW_DELTA_MAX_CHAIN      8
+
+// Extension of the block map kept next to each image backup
+#define TW_BLOCKMAP_EXT         ".map"
+
+// MD5 of every block of an image, in order
+typedef struct {
+    unsigned long long total;
+    unsigned long long count;
+    unsigned char* hashes;
+} TwBlockMap;
+
+typedef struct {
+    char base[256];             // "<backup folder>/<file>", relative to the device's backup folder
+    unsigned char base_digest[MD5_DIGEST_SIZE];
+    unsigned int depth;         // number of deltas in the chain, this one included
+    unsigned long long total;
+} TwDeltaInfo;
+
+// Loads a block map, returns 0 on success
+int tw_blockmap_load(const char* filename, TwBlockMap* map);
+void tw_blockmap_free(TwBlockMap* map);
+
+// Passes an image through unchanged, recording the hash of every block in map_file on close
+TwSink* tw_blockmap_sink_open(TwSink* next, const char* map_file);
+
+// Writes only the blocks of an image that differ from base, as a delta
+// against the backup named in info. map_file receives the hashes of the
+// whole new image, changed the number of blocks written, both on close.
+TwSink* tw_delta_sink_open(TwSink* next, const char* map_file, const TwBlockMap* base,
+                           const TwDeltaInfo* info, unsigned long long* changed);
+
+// Returns 1 if data starts with a delta header
+int tw_delta_check(const void* data, size_t len);
+
+// Reads the header of a delta, returns 0 on success
+int tw_delta_read_info(const void* data, size_t len, TwDeltaInfo* info);
+
+// Size of the header, enough data for tw_delta_read_info
+#define TW_DELTA_HEADER_SIZE    296
+
+// Writes the blocks of a delta over the image already on a block device,
+// or with device NULL only checks the delta
+TwSink* tw_undelta_sink_open(const char* device);
+
+#endif  // _TW_DELTA_HEADER
@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "tw_digest.h"
+
+// Read at a time by tw_digest_file
+#define FILE_BUFFER         (1024 * 1024)
+
+/* MD5 as described in RFC 1321, compatible with the md5sum tool
+*/
+
+#define F(x, y, z)  ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z)  ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x, y, z)  ((x) ^ (y) ^ (z))
+#define I(x, y, z)  ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+    (a) += f((b), (c), (d)) + (x) + (t); \
+    (a) = (((a) << (s)) | ((a) >> (32 - (s)))); \
+    (a) += (b);
+
+static void md5_transform(uint32_t* state, const unsigned char* block)
+{
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t x[16];
+    int i;
+
+    for (i = 0; i < 16; i++)
+    {
+        x[i] = (uint32_t) block[i * 4] | ((uint32_t) block[i * 4 + 1] << 8) |
+               ((uint32_t) block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+    }
+
+    STEP(F, a, b, c, d, x[0], 0xd76aa478, 7)
+    STEP(F, d, a, b, c, x[1], 0xe8c7b756, 12)
+    STEP(F, c, d, a, b, x[2], 0x242070db, 17)
+    STEP(F, b, c, d, a, x[3], 0xc1bdceee, 22)
+    STEP(F, a, b, c, d, x[4], 0xf57c0faf, 7)
+    STEP(F, d, a, b, c, x[5], 0x4787c62a, 12)
+    STEP(F, c, d, a, b, x[6], 0xa8304613, 17)
+    STEP(F, b, c, d, a, x[7], 0xfd469501, 22)
+    STEP(F, a, b, c, d, x[8], 0x698098d8, 7)
+    STEP(F, d, a, b, c, x[9], 0x8b44f7af, 12)
+    STEP(F, c, d, a, b, x[10], 0xffff5bb1, 17)
+    STEP(F, b, c, d, a, x[11], 0x895cd7be, 22)
+    STEP(F, a, b, c, d, x[12], 0x6b901122, 7)
+    STEP(F, d, a, b, c, x[13], 0xfd987193, 12)
+    STEP(F, c, d, a, b, x[14], 0xa679438e, 17)
+    STEP(F, b, c, d, a, x[15], 0x49b40821, 22)
+
+    STEP(G, a, b, c, d, x[1], 0xf61e2562, 5)
+    STEP(G, d, a, b, c, x[6], 0xc040b340, 9)
+    STEP(G, c, d, a, b, x[11], 0x265e5a51, 14)
+    STEP(G, b, c, d, a, x[0], 0xe9b6c7aa, 20)
+    STEP(G, a, b, c, d, x[5], 0xd62f105d, 5)
+    STEP(G, d, a, b, c, x[10], 0x02441453, 9)
+    STEP(G, c, d, a, b, x[15], 0xd8a1e681, 14)
+    STEP(G, b, c, d, a, x[4], 0xe7d3fbc8, 20)
+    STEP(G, a, b, c, d, x[9], 0x21e1cde6, 5)
+    STEP(G, d, a, b, c, x[14], 0xc33707d6, 9)
+    STEP(G, c, d, a, b, x[3], 0xf4d50d87, 14)
+    STEP(G, b, c, d, a, x[8], 0x455a14ed, 20)
+    STEP(G, a, b, c, d, x[13], 0xa9e3e905, 5)
+    STEP(G, d, a, b, c, x[2], 0xfcefa3f8, 9)
+    STEP(G, c, d, a, b, x[7], 0x676f02d9, 14)
+    STEP(G, b, c, d, a, x[12], 0x8d2a4c8a, 20)
+
+    STEP(H, a, b, c, d, x[5], 0xfffa3942, 4)
+    STEP(H, d, a, b, c, x[8], 0x8771f681, 11)
+    STEP(H, c, d, a, b, x[11], 0x6d9d6122, 16)
+    STEP(H, b, c, d, a, x[14], 0xfde5380c, 23)
+    STEP(H, a, b, c, d, x[1], 0xa4beea44, 4)
+    STEP(H, d, a, b, c, x[4], 0x4bdecfa9, 11)
+    STEP(H, c, d, a, b, x[7], 0xf6bb4b60, 16)
+    STEP(H, b, c, d, a, x[10], 0xbebfbc70, 23)
+    STEP(H, a, b, c, d, x[13], 0x289b7ec6, 4)
+    STEP(H, d, a, b, c, x[0], 0xeaa127fa, 11)
+    STEP(H, c, d, a, b, x[3], 0xd4ef3085, 16)
+    STEP(H, b, c, d, a, x[6], 0x04881d05, 23)
+    STEP(H, a, b, c, d, x[9], 0xd9d4d039, 4)
+    STEP(H, d, a, b, c, x[12], 0xe6db99e5, 11)
+    STEP(H, c, d, a, b, x[15], 0x1fa27cf8, 16)
+    STEP(H, b, c, d, a, x[2], 0xc4ac5665, 23)
+
+    STEP(I, a, b, c, d, x[0], 0xf4292244, 6)
+    STEP(I, d, a, b, c, x[7], 0x432aff97, 10)
+    STEP(I, c, d, a, b, x[14], 0xab9423a7, 15)
+    STEP(I, b, c, d, a, x[5], 0xfc93a039, 21)
+    STEP(I, a, b, c, d, x[12], 0x655b59c3, 6)
+    STEP(I, d, a, b, c, x[3], 0x8f0ccc92, 10)
+    STEP(I, c, d, a, b, x[10], 0xffeff47d, 15)
+    STEP(I, b, c, d, a, x[1], 0x85845dd1, 21)
+    STEP(I, a, b, c, d, x[8], 0x6fa87e4f, 6)
+    STEP(I, d, a, b, c, x[15], 0xfe2ce6e0, 10)
+    STEP(I, c, d, a, b, x[6], 0xa3014314, 15)
+    STEP(I, b, c, d, a, x[13], 0x4e0811a1, 21)
+    STEP(I, a, b, c, d, x[4], 0xf7537e82, 6)
+    STEP(I, d, a, b, c, x[11], 0xbd3af235, 10)
+    STEP(I, c, d, a, b, x[2], 0x2ad7d2bb, 15)
+    STEP(I, b, c, d, a, x[9], 0xeb86d391, 21)
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+void tw_md5_init(TwMd5Context* ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+void tw_md5_update(TwMd5Context* ctx, const void* data, size_t len)
+{
+    const unsigned char* ptr = (const unsigned char*) data;
+    size_t used = (size_t) (ctx->count & 63);
+
+    ctx->count += len;
+    if (used)
+    {
+        size_t fill = 64 - used;
+        if (len < fill)
+        {
+            memcpy(ctx->buffer + used, ptr, len);
+            return;
+        }
+        memcpy(ctx->buffer + used, ptr, fill);
+        md5_transform(ctx->state, ctx->buffer);
+        ptr += fill;
+        len -= fill;
+    }
+
+    while (len >= 64)
+    {
+        md5_transform(ctx->state, ptr);
+        ptr += 64;
+        len -= 64;
+    }
+    memcpy(ctx->buffer, ptr, len);
+}
+
+void tw_md5_final(TwMd5Context* ctx, unsigned char* digest)
+{
+    static const unsigned char padding[64] = { 0x80 };
+    unsigned char bits[8];
+    uint64_t count = ctx->count << 3;
+    size_t used = (size_t) (ctx->count & 63);
+    int i;
+
+    for (i = 0; i < 8; i++)
+        bits[i] = (unsigned char) (count >> (i * 8));
+
+    tw_md5_update(ctx, padding, used < 56 ? 56 - used : 120 - used);
+    tw_md5_update(ctx, bits, 8);
+
+    for (i = 0; i < 16; i++)
+        digest[i] = (unsigned char) (ctx->state[i / 4] >> ((i % 4) * 8));
+}
+
+void tw_digest_to_hex(const unsigned char* digest, size_t len, char* hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0x0f];
+    }
+    hex[len * 2] = '\0';
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')   return c - '0';
+    if (c >= 'a' && c <= 'f')   return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')   return c - 'A' + 10;
+    return -1;
+}
+
+int tw_digest_from_hex(const char* hex, unsigned char* digest, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        int hi = hex_value(hex[i * 2]);
+        int lo = hi < 0 ? -1 : hex_value(hex[i * 2 + 1]);
+        if (lo < 0)     return -1;
+        digest[i] = (unsigned char) ((hi << 4) | lo);
+    }
+    return 0;
+}
+
+/* CRC32C (Castagnoli), the one iSCSI and ext4 use. ARMv8 and SSE 4.2 have
+** an instruction for it that takes eight bytes at a time, anything else goes
+** through tables, also eight bytes at a time.
+*/
+
+#define CRC32C_POLY         0x82f63b78
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* ptr, size_t len)
+{
+    while (len >= 8)
+    {
+        uint64_t value;
+
+        memcpy(&value, ptr, 8);
+        crc = __crc32cd(crc, value);
+        ptr += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *ptr++);
+    return crc;
+}
+#define CRC32C_HW
+#elif defined(__SSE4_2__)
+#include <nmmintrin.h>
+
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* ptr, size_t len)
+{
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+
+    while (len >= 8)
+    {
+        uint64_t value;
+
+        memcpy(&value, ptr, 8);
+        crc64 = _mm_crc32_u64(crc64, value);
+        ptr += 8;
+        len -= 8;
+    }
+    crc = (uint32_t) crc64;
+#endif
+    while (len >= 4)
+    {
+        uint32_t value;
+
+        memcpy(&value, ptr, 4);
+        crc = _mm_crc32_u32(crc, value);
+        ptr += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *ptr++);
+    return crc;
+}
+#define CRC32C_HW
+#else
+#include <pthread.h>
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void)
+{
+    uint32_t i, k, crc;
+
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        crc = crc32c_table[0][i];
+        for (k = 1; k < 8; k++)
+        {
+            crc = (crc >> 8) ^ crc32c_table[0][crc & 0xff];
+            crc32c_table[k][i] = crc;
+        }
+    }
+}
+
+// Eight bytes at a time, for little endian CPUs like every Android device
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* ptr, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init_table);
+    while (len >= 8)
+    {
+        uint32_t lo, hi;
+
+        memcpy(&lo, ptr, 4);
+        memcpy(&hi, ptr + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        ptr += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *ptr++) & 0xff];
+    return crc;
+}
+#endif
+
+uint32_t tw_crc32c(uint32_t crc, const void* data, size_t len)
+{
+#ifdef CRC32C_HW
+    return ~crc32c_hw(~crc, (const unsigned char*) data, len);
+#else
+    return ~crc32c_sw(~crc, (const unsigned char*) data, len);
+#endif
+}
+
+void tw_digest_init(TwDigestContext* ctx, TwDigestType type)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->type = type;
+    if (type == TW_DIGEST_MD5)  tw_md5_init(&ctx->u.md5);
+}
+
+void tw_digest_update(TwDigestContext* ctx, const void* data, size_t len)
+{
+    switch (ctx->type)
+    {
+    case TW_DIGEST_MD5:     tw_md5_update(&ctx->u.md5, data, len);          break;
+    case TW_DIGEST_CRC32C:  ctx->u.crc = tw_crc32c(ctx->u.crc, data, len);  break;
+    default:                break;
+    }
+}
+
+void tw_digest_final(TwDigestContext* ctx, unsigned char* digest)
+{
+    int i;
+
+    memset(digest, 0, TW_DIGEST_MAX_SIZE);
+    switch (ctx->type)
+    {
+    case TW_DIGEST_MD5:
+        tw_md5_final(&ctx->u.md5, digest);
+        break;
+    case TW_DIGEST_CRC32C:
+        // Most significant byte first, so the hex reads like the number
+        for (i = 0; i < CRC32C_DIGEST_SIZE; i++)
+            digest[i] = (unsigned char) (ctx->u.crc >> ((CRC32C_DIGEST_SIZE - 1 - i) * 8));
+        break;
+    default:
+        break;
+    }
+}
+
+size_t tw_digest_size(TwDigestType type)
+{
+    switch (type)
+    {
+    case TW_DIGEST_MD5:     return MD5_DIGEST_SIZE;
+    case TW_DIGEST_CRC32C:  return CRC32C_DIGEST_SIZE;
+    default:                return 0;
+    }
+}
+
+const char* tw_digest_name(TwDigestType type)
+{
+    switch (type)
+    {
+    case TW_DIGEST_MD5:     return "md5";
+    case TW_DIGEST_CRC32C:  return "crc32c";
+    default:                return "none";
+    }
+}
+
+TwDigestType tw_digest_type(const char* name)
+{
+    int type;
+
+    for (type = TW_DIGEST_MD5; type < TW_DIGEST_TYPES; type++)
+    {
+        if (name && strcmp(name, tw_digest_name((TwDigestType) type)) == 0)
+            return (TwDigestType) type;
+    }
+    return TW_DIGEST_NONE;
+}
+
+void tw_digest_sidecar(const char* path, TwDigestType type, char* name, size_t len)
+{
+    snprintf(name, len, "%s.%s", path, tw_digest_name(type));
+}
+
+int tw_digest_write(const char* path, const TwDigest* digest)
+{
+    char filename[PATH_MAX];
+    char hex[TW_DIGEST_MAX_SIZE * 2 + 1];
+    const char* base = strrchr(path, '/');
+    FILE* fp;
+    int ret;
+
+    tw_digest_sidecar(path, digest->type, filename, sizeof(filename));
+    fp = fopen(filename, "w");
+    if (!fp)            return -1;
+
+    tw_digest_to_hex(digest->digest, tw_digest_size(digest->type), hex);
+    ret = fprintf(fp, "%s  %s\n", hex, base ? base + 1 : path) < 0 ? -1 : 0;
+    if (fclose(fp) != 0)    ret = -1;
+    return ret;
+}
+
+int tw_digest_read(const char* path, TwDigest* digest)
+{
+    int type;
+
+    memset(digest, 0, sizeof(*digest));
+    for (type = TW_DIGEST_MD5; type < TW_DIGEST_TYPES; type++)
+    {
+        char filename[PATH_MAX];
+        char line[255];
+        size_t size = tw_digest_size((TwDigestType) type);
+        FILE* fp;
+        int ret = -2;
+
+        tw_digest_sidecar(path, (TwDigestType) type, filename, sizeof(filename));
+        fp = fopen(filename, "r");
+        if (!fp)        continue;
+        // The hex has to be all there is of the first word
+        if (fgets(line, sizeof(line), fp) && strlen(line) >= size * 2 && strchr(" \t\r\n", line[size * 2]) &&
+            tw_digest_from_hex(line, digest->digest, size) == 0)
+        {
+            digest->type = (TwDigestType) type;
+            ret = 0;
+        }
+        fclose(fp);
+        return ret;
+    }
+    return -1;
+}
+
+void tw_digest_remove(const char* path)
+{
+    int type;
+
+    for (type = TW_DIGEST_MD5; type < TW_DIGEST_TYPES; type++)
+    {
+        char filename[PATH_MAX];
+
+        tw_digest_sidecar(path, (TwDigestType) type, filename, sizeof(filename));
+        unlink(filename);
+    }
+}
+
+int tw_digest_file(const char* path, TwDigestType type, unsigned char* digest)
+{
+    TwDigestContext ctx;
+    char* buffer = (char*) malloc(FILE_BUFFER);
+    int fd = open(path, O_RDONLY);
+    int ret = 0;
+
+    if (fd < 0 || !buffer)
+    {
+        if (fd >= 0)    close(fd);
+        free(buffer);
+        return -1;
+    }
+
+    tw_digest_init(&ctx, type);
+    for (;;)
+    {
+        ssize_t len = read(fd, buffer, FILE_BUFFER);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len < 0)    ret = -1;
+        if (len <= 0)   break;
+        tw_digest_update(&ctx, buffer, len);
+    }
+    close(fd);
+    free(buffer);
+    tw_digest_final(&ctx, digest);
+    return ret;
+}
+
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    TwDigestContext ctx;
+    unsigned char* digest;
+} DigestSink;
+
+static int digest_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    DigestSink* ds = (DigestSink*) sink;
+
+    tw_digest_update(&ds->ctx, data, len);
+    return tw_sink_write(ds->next, data, len);
+}
+
+static int digest_sink_close(TwSink* sink)
+{
+    DigestSink* ds = (DigestSink*) sink;
+    int ret;
+
+    tw_digest_final(&ds->ctx, ds->digest);
+    ret = tw_sink_close(ds->next);
+    free(ds);
+    return ret;
+}
+
+TwSink* tw_digest_sink_open(TwSink* next, TwDigestType type, unsigned char* digest)
+{
+    DigestSink* ds = (DigestSink*) calloc(1, sizeof(DigestSink));
+    if (!ds)            return NULL;
+
+    tw_digest_init(&ds->ctx, type);
+    ds->next = next;
+    ds->digest = digest;
+    ds->sink.write = digest_sink_write;
+    ds->sink.close = digest_sink_close;
+    return &ds->sink;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_DIGEST_HEADER
+#define _TW_DIGEST_HEADER
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tw_sink.h"
+
+#define MD5_DIGEST_SIZE     16
+#define CRC32C_DIGEST_SIZE  4
+
+// Room for any digest, shorter ones are padded with zeros
+#define TW_DIGEST_MAX_SIZE  MD5_DIGEST_SIZE
+
+// What a backup is checked with. MD5 can still be checked with md5sum, CRC32C
+// is many times faster, using the CPU's CRC instructions where there are any.
+typedef enum {
+    TW_DIGEST_NONE = 0,
+    TW_DIGEST_MD5,
+    TW_DIGEST_CRC32C,
+    TW_DIGEST_TYPES
+} TwDigestType;
+
+// A digest and what it was made with
+typedef struct {
+    TwDigestType type;
+    unsigned char digest[TW_DIGEST_MAX_SIZE];
+} TwDigest;
+
+typedef struct {
+    uint32_t state[4];
+    uint64_t count;
+    unsigned char buffer[64];
+} TwMd5Context;
+
+void tw_md5_init(TwMd5Context* ctx);
+void tw_md5_update(TwMd5Context* ctx, const void* data, size_t len);
+void tw_md5_final(TwMd5Context* ctx, unsigned char* digest);
+
+// Continues a CRC32C, start from 0
+uint32_t tw_crc32c(uint32_t crc, const void* data, size_t len);
+
+typedef struct {
+    TwDigestType type;
+    union {
+        TwMd5Context md5;
+        uint32_t crc;
+    } u;
+} TwDigestContext;
+
+// A context of type TW_DIGEST_NONE takes updates and hashes nothing
+void tw_digest_init(TwDigestContext* ctx, TwDigestType type);
+void tw_digest_update(TwDigestContext* ctx, const void* data, size_t len);
+// digest must hold TW_DIGEST_MAX_SIZE bytes
+void tw_digest_final(TwDigestContext* ctx, unsigned char* digest);
+
+size_t tw_digest_size(TwDigestType type);
+
+// eg. "md5", which is also the extension of the sidecar file
+const char* tw_digest_name(TwDigestType type);
+
+// The type named name, TW_DIGEST_NONE if there's no such type
+TwDigestType tw_digest_type(const char* name);
+
+// hex must hold len * 2 + 1 characters
+void tw_digest_to_hex(const unsigned char* digest, size_t len, char* hex);
+
+// Parses len bytes of hex into digest, returns 0 on success
+int tw_digest_from_hex(const char* hex, unsigned char* digest, size_t len);
+
+// Name of the sidecar holding the digest of path, eg. "data.ext4.win.md5"
+void tw_digest_sidecar(const char* path, TwDigestType type, char* name, size_t len);
+
+// Writes the sidecar of path, in the format of md5sum. Returns 0 on success.
+int tw_digest_write(const char* path, const TwDigest* digest);
+
+// Reads the digest of path from whichever sidecar it has, so backups made
+// before there was a choice are checked like before. Returns 0 on success,
+// -1 if there's no sidecar and -2 if it can't be parsed.
+int tw_digest_read(const char* path, TwDigest* digest);
+
+// Removes every sidecar of path
+void tw_digest_remove(const char* path);
+
+// Hashes the whole file at path, returns 0 on success
+int tw_digest_file(const char* path, TwDigestType type, unsigned char* digest);
+
+// Passes everything through to next while hashing it. The digest of all the
+// data is stored in digest when the sink is closed.
+TwSink* tw_digest_sink_open(TwSink* next, TwDigestType type, unsigned char* digest);
+
+#endif  // _TW_DIGEST_HEADER
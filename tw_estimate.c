@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Compressed size of a backup, from a sample of its data.
+**
+** The tree is walked once. Each sample slot holds a random byte of the data
+** seen so far: a file of w bytes takes the slot over with a chance of
+** w / (bytes so far), which leaves every byte equally likely in the end. The
+** piece around that byte is then compressed on its own, the way the
+** compressor does each of its blocks. The mean ratio of the pieces estimates the ratio of
+** the whole, and their spread how far off it may be.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "tw_estimate.h"
+
+#define ESTIMATE_SAMPLES    256
+#define ESTIMATE_PIECE      (64 * 1024)     // many small pieces beat a few big ones for the same reading
+#define ESTIMATE_LEVEL      6               // what backups are compressed with
+#define ESTIMATE_Z          2.0             // standard errors for about 95%
+#define TAR_BLOCK_SIZE      512
+
+typedef struct {
+    char path[PATH_MAX];
+    unsigned long long offset;
+    size_t len;
+} Sample;
+
+typedef struct {
+    const char* root;
+    const char** excludes;
+    TwEstimate* est;
+    unsigned long long seed;
+    Sample samples[ESTIMATE_SAMPLES];
+} EstimateWalk;
+
+// xorshift64*, a fixed seed keeps the estimate the same for the same data
+static double next_random(EstimateWalk* walk)
+{
+    walk->seed ^= walk->seed >> 12;
+    walk->seed ^= walk->seed << 25;
+    walk->seed ^= walk->seed >> 27;
+    return ((walk->seed * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int is_excluded(const EstimateWalk* walk, const char* rel)
+{
+    const char** ex = walk->excludes;
+
+    if (!ex)    return 0;
+    for (; *ex; ex++)
+    {
+        if (strcmp(*ex, rel) == 0)  return 1;
+    }
+    return 0;
+}
+
+static void add_file(EstimateWalk* walk, const char* path, unsigned long long size)
+{
+    int i;
+
+    walk->est->bytes += size;
+    for (i = 0; i < ESTIMATE_SAMPLES; i++)
+    {
+        Sample* sample = &walk->samples[i];
+        unsigned long long offset;
+
+        if (next_random(walk) * walk->est->bytes >= size)   continue;
+
+        offset = (unsigned long long) (next_random(walk) * size);
+        if (offset >= size)     offset = size - 1;
+        offset -= offset % ESTIMATE_PIECE;
+        snprintf(sample->path, sizeof(sample->path), "%s", path);
+        sample->offset = offset;
+        sample->len = size - offset > ESTIMATE_PIECE ? ESTIMATE_PIECE : (size_t) (size - offset);
+    }
+}
+
+static void walk_folder(EstimateWalk* walk, const char* rel)
+{
+    char path[PATH_MAX];
+    struct dirent* de;
+    DIR* d;
+
+    if (*rel)   snprintf(path, sizeof(path), "%s/%s", walk->root, rel);
+    else        snprintf(path, sizeof(path), "%s", walk->root);
+    d = opendir(path);
+    if (!d)     return;
+
+    while ((de = readdir(d)) != NULL)
+    {
+        char child[PATH_MAX];
+        struct stat st;
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)     continue;
+        if (*rel)   snprintf(child, sizeof(child), "%s/%s", rel, de->d_name);
+        else        snprintf(child, sizeof(child), "%s", de->d_name);
+        if (is_excluded(walk, child))   continue;
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)  continue;
+
+        walk->est->entries++;
+        if (S_ISDIR(st.st_mode))
+            walk_folder(walk, child);
+        else if (S_ISREG(st.st_mode) && st.st_size > 0)
+        {
+            snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+            add_file(walk, child, st.st_size);
+        }
+    }
+    closedir(d);
+}
+
+// Compressed / original for one piece, or -1 if it can't be read any more
+static double sample_ratio(const Sample* sample, TwCodec codec, size_t framing, char* buffer)
+{
+    size_t done = 0, out;
+    int fd = open(sample->path, O_RDONLY);
+
+    if (fd < 0)         return -1;
+    while (done < sample->len)
+    {
+        ssize_t len = pread(fd, buffer + done, sample->len - done, sample->offset + done);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len <= 0)   break;
+        done += len;
+    }
+    close(fd);
+    if (done == 0)      return -1;
+
+    // Small files share blocks with others in the backup, so the framing of a block of their own doesn't count
+    out = tw_compress_size(codec, ESTIMATE_LEVEL, buffer, done);
+    if (!out)           return -1;
+    out -= framing < out ? framing : 0;
+    return out / (double) done;
+}
+
+int tw_estimate_archive(const char* root, const char** excludes, TwCodec codec, TwEstimate* est)
+{
+    EstimateWalk* walk;
+    unsigned long long overhead;
+    size_t framing;
+    double sum = 0, sum_sq = 0;
+    char* buffer;
+    struct stat st;
+    int i;
+
+    memset(est, 0, sizeof(*est));
+    if (stat(root, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        LOGE("Unable to read %s (errno=%d)\n", root, errno);
+        return -1;
+    }
+
+    walk = (EstimateWalk*) calloc(1, sizeof(EstimateWalk));
+    buffer = (char*) malloc(ESTIMATE_PIECE);
+    if (!walk || !buffer)
+    {
+        free(walk);
+        free(buffer);
+        return -1;
+    }
+    walk->root = root;
+    walk->excludes = excludes;
+    walk->est = est;
+    walk->seed = 0x9e3779b97f4a7c15ULL;
+    walk_folder(walk, "");
+    framing = tw_compress_size(codec, ESTIMATE_LEVEL, buffer, 0);
+
+    for (i = 0; codec != TW_CODEC_NONE && i < ESTIMATE_SAMPLES; i++)
+    {
+        double ratio;
+
+        if (!walk->samples[i].path[0])  continue;
+        ratio = sample_ratio(&walk->samples[i], codec, framing, buffer);
+        if (ratio < 0)      continue;
+        sum += ratio;
+        sum_sq += ratio * ratio;
+        est->sampled += walk->samples[i].len;
+        est->samples++;
+    }
+    free(buffer);
+    free(walk);
+
+    // Nothing to go by is taken as no compression at all
+    est->ratio = 1.0;
+    if (est->samples > 0)
+        est->ratio = sum / est->samples;
+    if (est->samples > 1)
+    {
+        double var = (sum_sq - sum * sum / est->samples) / (est->samples - 1);
+        est->margin = ESTIMATE_Z * sqrt(var > 0 ? var : 0) / sqrt(est->samples);
+    }
+
+    // A header for each entry, half a block of padding for each file on average, and the end blocks
+    overhead = (est->entries + 2) * TAR_BLOCK_SIZE + est->entries * TAR_BLOCK_SIZE / 2;
+    est->projected = (unsigned long long) ((est->bytes + overhead) * (est->ratio + est->margin));
+    LOGI("%s: %llu bytes in %llu entries, ratio %.3f +/- %.3f from %d samples, about %llu bytes\n",
+         root, est->bytes, est->entries, est->ratio, est->margin, est->samples, est->projected);
+    return 0;
+}
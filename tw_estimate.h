@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_ESTIMATE_HEADER
+#define _TW_ESTIMATE_HEADER
+
+#include "tw_compress.h"
+
+typedef struct {
+    unsigned long long entries;     // files, folders and links, each gets a tar header
+    unsigned long long bytes;       // data in the regular files
+    unsigned long long sampled;     // bytes compressed to work out the ratio
+    int samples;
+    double ratio;                   // compressed / original, mean over the samples
+    double margin;                  // how far off ratio may be, at about 95% confidence
+    unsigned long long projected;   // size of the .win, margin included
+} TwEstimate;
+
+// Projects the size of a .win of root (leaving out excludes, as in
+// TwArchiveOptions) compressed with codec. Pieces are taken at random
+// positions in the data, so every byte is as likely to be picked, and each
+// is compressed the way the backup would compress it. Returns 0 on success.
+int tw_estimate_archive(const char* root, const char** excludes, TwCodec codec, TwEstimate* est);
+
+#endif  // _TW_ESTIMATE_HEADER
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Progress events from the backup and restore engines to the screen.
+**
+** Showing every file as it went by redrew the whole screen for each one, so
+** a backup with tw_show_spam on ran at the speed of the display. Now the
+** engines queue events in a ring and a display thread shows the latest of
+** them a few times a second.
+**
+** The ring is a bounded multi producer queue: a producer claims a cell by
+** moving the head on with a compare and swap, fills it in, then publishes
+** it through the cell's sequence number. Producers never wait, a full ring
+** just drops the event. The sequence numbers are stored less the cell's
+** index, so the ring starts out ready without being set up.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tw_event.h"
+
+#define RING_SIZE           256     // a power of 2
+#define RING_MASK           (RING_SIZE - 1)
+
+typedef struct {
+    volatile unsigned long seq;     // less the index of the cell
+    TwEvent event;
+} Cell;
+
+static Cell ring[RING_SIZE];
+static volatile unsigned long ring_head;
+static unsigned long ring_tail;
+static volatile int listening;
+static volatile unsigned long dropped;
+
+static pthread_t display_thread;
+static volatile int display_stop;
+static int display_spam;
+
+int tw_event_publish(const char* name, unsigned long long bytes, unsigned long long files)
+{
+    unsigned long pos = ring_head;
+    Cell* cell;
+
+    if (!listening)     return -1;
+    for (;;)
+    {
+        long diff;
+
+        cell = &ring[pos & RING_MASK];
+        diff = (long) (cell->seq + (pos & RING_MASK)) - (long) pos;
+        if (diff == 0)
+        {
+            if (__sync_bool_compare_and_swap(&ring_head, pos, pos + 1))
+                break;
+            pos = ring_head;
+        }
+        else if (diff < 0)
+        {
+            // The oldest event is still there, the display is behind
+            __sync_fetch_and_add(&dropped, 1);
+            return -1;
+        }
+        else
+            pos = ring_head;
+    }
+
+    cell->event.bytes = bytes;
+    cell->event.files = files;
+    snprintf(cell->event.name, sizeof(cell->event.name), "%s", name ? name : "");
+    __sync_synchronize();
+    cell->seq = pos + 1 - (pos & RING_MASK);
+    return 0;
+}
+
+int tw_event_drain(TwEvent* events, int max)
+{
+    int count = 0;
+
+    while (count < max)
+    {
+        Cell* cell = &ring[ring_tail & RING_MASK];
+
+        if (cell->seq + (ring_tail & RING_MASK) != ring_tail + 1)
+            break;
+        __sync_synchronize();
+        events[count++] = cell->event;
+        __sync_synchronize();
+        cell->seq = ring_tail + RING_SIZE - (ring_tail & RING_MASK);
+        ring_tail++;
+    }
+    return count;
+}
+
+static void display_events(void)
+{
+    static TwEvent events[RING_SIZE];
+    int count = tw_event_drain(events, RING_SIZE);
+    int i;
+
+    if (count == 0)     return;
+    if (display_spam == 2)
+    {
+        // The ones that don't make it to the screen still make it to the log
+        for (i = 0; i < count - 1; i++)
+            printf("%s\n", events[i].name);
+        ui_print_overwrite("%s\n", events[count - 1].name);
+    }
+    else if (display_spam == 1)
+        ui_print_overwrite("%s", events[count - 1].name);
+}
+
+static void* display_loop(void* cookie)
+{
+    (void) cookie;
+
+    while (!display_stop)
+    {
+        usleep(1000000 / TW_EVENT_FPS);
+        display_events();
+    }
+    return NULL;
+}
+
+void tw_event_display_start(int spam)
+{
+    if (listening || spam == 0)     return;
+
+    display_spam = spam;
+    display_stop = 0;
+    dropped = 0;
+    listening = 1;
+    if (pthread_create(&display_thread, NULL, display_loop, NULL) != 0)
+        listening = 0;
+}
+
+void tw_event_display_stop(void)
+{
+    if (!listening)     return;
+
+    listening = 0;
+    display_stop = 1;
+    pthread_join(display_thread, NULL);
+
+    // Anything a producer was still filling in is dropped with the rest
+    display_events();
+    if (dropped)    LOGI("%lu progress events were dropped\n", dropped);
+}
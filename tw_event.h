@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_EVENT_HEADER
+#define _TW_EVENT_HEADER
+
+// How often the display thread redraws
+#define TW_EVENT_FPS        10
+
+typedef struct {
+    unsigned long long bytes;       // done so far by whoever sent it
+    unsigned long long files;
+    char name[112];                 // current file, cut short if it doesn't fit
+} TwEvent;
+
+// Queues a progress event. It never blocks or takes a lock, so it's safe
+// from any thread at any rate: while nothing drains the channel, or it's
+// full, the event is dropped. Returns 0 if it was queued.
+int tw_event_publish(const char* name, unsigned long long bytes, unsigned long long files);
+
+// Takes up to max queued events, oldest first. One thread drains at a time.
+int tw_event_drain(TwEvent* events, int max);
+
+// Starts a thread that shows the current file TW_EVENT_FPS times a second.
+// spam is tw_show_spam: 0 shows nothing, 1 keeps the name on one line, 2 gives
+// each name shown a line of its own and logs the ones in between too.
+void tw_event_display_start(int spam);
+
+// Shows what's still queued and stops the thread
+void tw_event_display_stop(void);
+
+#endif  // _TW_EVENT_HEADER
@@ -0,0 +1,966 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* In-process tar reader used by the nandroid restore.
+**
+** The thread feeding the sink parses the stream. Files up to INLINE_FILE_MAX
+** are collected in memory and handed to a pool of writer threads, so a
+** partition full of small app files isn't held up by one open/write/close
+** after another. Larger files are streamed by the parsing thread itself,
+** preallocated and written in big pieces. The queue between the two is
+** bounded by size, which keeps the decoder from running away.
+**
+** Directories are created as they come, but their owner, mode and time are
+** applied at the end, deepest first, once nothing is written into them any
+** more. Hard links wait for the writers as well, their target may still be
+** in the queue. Reads GNU, ustar and pax archives, busybox and tw_archive
+** output included.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "tw_extract.h"
+#include "tw_archive.h"
+#include "tw_usage.h"
+
+#define TAR_BLOCK_SIZE      512
+#define INLINE_FILE_MAX     (1024 * 1024)
+#define QUEUE_MAX_BYTES     (16 * 1024 * 1024)
+#define WRITE_BUFFER        (1024 * 1024)
+#define EXTRA_MAX           (64 * 1024)     // long names and pax headers
+#define PREALLOC_MIN        (64 * 1024)
+#define MAX_WRITERS         4
+
+enum { STATE_HEADER, STATE_EXTRA, STATE_DATA, STATE_END };
+
+typedef struct Meta {
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+} Meta;
+
+typedef struct WriteJob {
+    struct WriteJob* next;
+    char* path;
+    char* data;
+    size_t size;
+    Meta meta;
+} WriteJob;
+
+// Directory metadata and hard links, applied once the files are out
+typedef struct Deferred {
+    struct Deferred* next;
+    char* path;
+    char* target;
+    Meta meta;
+} Deferred;
+
+typedef struct {
+    TwSink sink;
+    char root[PATH_MAX];
+    const char* const* only;
+    TwExtractFileFn file_cb;
+    void* cookie;
+    TwExtractStats* stats;
+    TwExtractStats counts;
+
+    // Parser state, only touched by the thread writing to the sink
+    int state;
+    char header[TAR_BLOCK_SIZE];
+    size_t have;
+    char type;
+    char* extra;
+    size_t extra_len;
+    size_t extra_have;
+    char* long_name;
+    char* long_link;
+    char* pax_path;
+    char* pax_link;
+    unsigned long long remaining;
+    size_t padding;
+
+    // Current file member, either collected for a writer or streamed here
+    WriteJob* job;
+    int fd;
+    char* path;
+    Meta meta;
+    char* buffer;
+    size_t buffer_used;
+
+    Deferred* dirs;
+    Deferred* links;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t space_cond;
+    WriteJob* head;
+    WriteJob* tail;
+    size_t queued_bytes;
+    int shutdown;
+    unsigned int writer_errors;
+    pthread_t threads[MAX_WRITERS];
+    int thread_count;
+    int error;
+} ExtractSink;
+
+// Reads an octal field, or a GNU base-256 one
+static unsigned long long tar_number(const char* field, size_t len)
+{
+    unsigned long long value = 0;
+    size_t i = 0;
+
+    if ((unsigned char) field[0] & 0x80)
+    {
+        value = (unsigned char) field[0] & 0x7f;
+        for (i = 1; i < len; i++)
+            value = (value << 8) | (unsigned char) field[i];
+        return value;
+    }
+
+    while (i < len && (field[i] == ' ' || field[i] == '\0'))    i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+static int tar_checksum_ok(const char* block)
+{
+    unsigned int sum = 0;
+    int signed_sum = 0;
+    int i;
+
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+    {
+        char c = (i >= 148 && i < 156) ? ' ' : block[i];
+        sum += (unsigned char) c;
+        signed_sum += (signed char) c;
+    }
+    // Some old writers summed signed chars
+    return tar_number(block + 148, 8) == sum || (int) tar_number(block + 148, 8) == signed_sum;
+}
+
+static int is_zero_block(const char* block)
+{
+    return block[0] == 0 && memcmp(block, block + 1, TAR_BLOCK_SIZE - 1) == 0;
+}
+
+/* Turns an archive name into a path under root. Leading slashes and "./"
+** are dropped, anything with a ".." in it is refused. An empty name is the
+** root itself.
+*/
+static int build_path(const ExtractSink* es, const char* name, char* path)
+{
+    const char* ptr = name;
+    size_t len;
+
+    for (;;)
+    {
+        if (*ptr == '/')                            ptr++;
+        else if (ptr[0] == '.' && ptr[1] == '/')    ptr += 2;
+        else                                        break;
+    }
+    if (strcmp(ptr, ".") == 0)  ptr = "";
+
+    if (strcmp(ptr, "..") == 0 || strncmp(ptr, "../", 3) == 0 ||
+        strstr(ptr, "/../") || (strlen(ptr) >= 3 && strcmp(ptr + strlen(ptr) - 3, "/..") == 0))
+    {
+        LOGW("Skipping %s, it points outside of %s\n", name, es->root);
+        return -1;
+    }
+
+    len = strlen(es->root) + 1 + strlen(ptr);
+    if (len >= PATH_MAX)
+    {
+        LOGW("Skipping %s, the name is too long\n", name);
+        return -1;
+    }
+    sprintf(path, "%s/%s", es->root, ptr);
+
+    // No trailing slash, directories are named that way in the archive
+    len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')     path[--len] = '\0';
+    return 0;
+}
+
+// Creates the folders leading up to path, for archives that don't list them first
+static int make_parents(const char* path)
+{
+    char tmp[PATH_MAX];
+    char* ptr;
+
+    strcpy(tmp, path);
+    for (ptr = tmp + 1; (ptr = strchr(ptr, '/')) != NULL; ptr++)
+    {
+        *ptr = '\0';
+        if (mkdir(tmp, 0755) != 0 && errno != EEXIST)
+            return -1;
+        *ptr = '/';
+    }
+    return 0;
+}
+
+static void set_time(const char* path, time_t mtime)
+{
+    struct utimbuf times;
+
+    times.actime = mtime;
+    times.modtime = mtime;
+    utime(path, &times);
+}
+
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = write(fd, data, len);
+        if (ret < 0 && errno == EINTR)  continue;
+        if (ret <= 0)   return -1;
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+// Reserves the blocks of a file in one go. It's only a hint, so a file
+// system that can't is left to allocate as the data comes.
+static void preallocate(int fd, const char* path, unsigned long long size)
+{
+#ifdef __NR_fallocate
+    long ret;
+
+    // bionic has no fallocate() of its own. 32 bit ABIs take each offset as
+    // two words, the low one first on the little endian CPUs we run on.
+    if (sizeof(long) >= 8)
+        ret = syscall(__NR_fallocate, fd, 0, 0L, (long) size);
+    else
+        ret = syscall(__NR_fallocate, fd, 0, 0UL, 0UL, (unsigned long) size, (unsigned long) (size >> 32));
+    if (ret != 0 && errno != EOPNOTSUPP && errno != ENOSYS)
+        LOGI("Unable to preallocate %s (errno=%d)\n", path, errno);
+#endif
+}
+
+// Never writes through a link: one left at path, even by an entry restored
+// after clear_path ran, is replaced by the file
+static int open_file(const char* path, unsigned long long size)
+{
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+    int fd = open(path, flags, 0600);
+
+    if (fd < 0 && errno == ELOOP && unlink(path) == 0)
+        fd = open(path, flags, 0600);
+    if (fd < 0 && errno == ENOENT && make_parents(path) == 0)
+        fd = open(path, flags, 0600);
+    if (fd < 0)     return -1;
+
+    if (size >= PREALLOC_MIN)   preallocate(fd, path, size);
+    return fd;
+}
+
+// Owner before mode, a chown clears the setuid bits. vfat can't do either, so errors are ignored.
+static int finish_file(int fd, const char* path, const Meta* meta)
+{
+    int ret = 0;
+
+    if (fchown(fd, meta->uid, meta->gid) != 0) {}
+    if (fchmod(fd, meta->mode) != 0) {}
+    if (close(fd) != 0)     ret = -1;
+    set_time(path, meta->mtime);
+    return ret;
+}
+
+static int write_job(WriteJob* job)
+{
+    int fd = open_file(job->path, job->size);
+
+    if (fd < 0 || write_all(fd, job->data, job->size) != 0)
+    {
+        LOGE("Unable to restore %s (errno=%d)\n", job->path, errno);
+        if (fd >= 0)    close(fd);
+        return -1;
+    }
+    return finish_file(fd, job->path, &job->meta);
+}
+
+static void free_job(WriteJob* job)
+{
+    free(job->path);
+    free(job->data);
+    free(job);
+}
+
+static size_t job_cost(const WriteJob* job)
+{
+    return sizeof(WriteJob) + job->size;
+}
+
+static void* writer_thread(void* cookie)
+{
+    ExtractSink* es = (ExtractSink*) cookie;
+
+    pthread_mutex_lock(&es->lock);
+    for (;;)
+    {
+        WriteJob* job;
+        int ret;
+
+        while (!es->head && !es->shutdown)
+            pthread_cond_wait(&es->work_cond, &es->lock);
+        if (!es->head)
+            break;
+
+        job = es->head;
+        es->head = job->next;
+        if (!es->head)  es->tail = NULL;
+        pthread_mutex_unlock(&es->lock);
+
+        ret = write_job(job);
+
+        pthread_mutex_lock(&es->lock);
+        if (ret != 0)   es->writer_errors++;
+        es->queued_bytes -= job_cost(job);
+        pthread_cond_signal(&es->space_cond);
+        free_job(job);
+    }
+    pthread_mutex_unlock(&es->lock);
+    return NULL;
+}
+
+static void queue_job(ExtractSink* es, WriteJob* job)
+{
+    pthread_mutex_lock(&es->lock);
+    while (es->queued_bytes > QUEUE_MAX_BYTES)
+        pthread_cond_wait(&es->space_cond, &es->lock);
+
+    job->next = NULL;
+    if (es->tail)   es->tail->next = job;
+    else            es->head = job;
+    es->tail = job;
+    es->queued_bytes += job_cost(job);
+    pthread_cond_signal(&es->work_cond);
+    pthread_mutex_unlock(&es->lock);
+}
+
+static void note_error(ExtractSink* es)
+{
+    es->counts.errors++;
+}
+
+static int defer(Deferred** list, const char* path, const char* target, const Meta* meta)
+{
+    Deferred* item = (Deferred*) calloc(1, sizeof(Deferred));
+
+    if (!item)      return -1;
+    item->path = strdup(path);
+    item->target = target ? strdup(target) : NULL;
+    if (!item->path || (target && !item->target))
+    {
+        free(item->path);
+        free(item->target);
+        free(item);
+        return -1;
+    }
+    item->meta = *meta;
+    item->next = *list;
+    *list = item;
+    return 0;
+}
+
+// Makes room for an entry that replaces whatever is at path, except a folder
+static void clear_path(const char* path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == 0 && !S_ISDIR(st.st_mode))
+        unlink(path);
+}
+
+static void make_dir(ExtractSink* es, const char* path)
+{
+    struct stat st;
+
+    if (mkdir(path, 0700) != 0 && errno == ENOENT && make_parents(path) == 0)
+        mkdir(path, 0700);
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        LOGE("Unable to create folder %s (errno=%d)\n", path, errno);
+        note_error(es);
+        return;
+    }
+    if (defer(&es->dirs, path, NULL, &es->meta) != 0)
+        note_error(es);
+}
+
+static void make_special(ExtractSink* es, const char* path, const char* link)
+{
+    int ret;
+
+    clear_path(path);
+    if (es->type == '2')
+    {
+        ret = symlink(link, path);
+        if (ret != 0 && errno == ENOENT && make_parents(path) == 0)
+            ret = symlink(link, path);
+        if (ret == 0 && lchown(path, es->meta.uid, es->meta.gid) != 0) {}
+    }
+    else
+    {
+        mode_t mode = es->meta.mode;
+        dev_t dev = 0;
+
+        if (es->type == '3')        mode |= S_IFCHR;
+        else if (es->type == '4')   mode |= S_IFBLK;
+        else                        mode |= S_IFIFO;
+        if (es->type != '6')
+            dev = makedev(tar_number(es->header + 329, 8), tar_number(es->header + 337, 8));
+
+        ret = mknod(path, mode, dev);
+        if (ret != 0 && errno == ENOENT && make_parents(path) == 0)
+            ret = mknod(path, mode, dev);
+        if (ret == 0)
+        {
+            if (chown(path, es->meta.uid, es->meta.gid) != 0) {}
+            if (chmod(path, es->meta.mode) != 0) {}
+            set_time(path, es->meta.mtime);
+        }
+    }
+
+    if (ret != 0)
+    {
+        LOGE("Unable to create %s (errno=%d)\n", path, errno);
+        note_error(es);
+    }
+}
+
+static void clear_names(ExtractSink* es)
+{
+    free(es->long_name);
+    free(es->long_link);
+    free(es->pax_path);
+    free(es->pax_link);
+    es->long_name = es->long_link = es->pax_path = es->pax_link = NULL;
+}
+
+// Picks up path and linkpath from a pax header, everything else is ignored
+static void parse_pax(ExtractSink* es)
+{
+    char* ptr = es->extra;
+    char* end = es->extra + es->extra_have;
+
+    while (ptr < end)
+    {
+        char* space;
+        char* eq;
+        unsigned long len = strtoul(ptr, &space, 10);
+
+        if (len == 0 || *space != ' ' || len > (unsigned long) (end - ptr))     break;
+        ptr[len - 1] = '\0';
+        eq = strchr(space + 1, '=');
+        if (eq)
+        {
+            *eq = '\0';
+            if (strcmp(space + 1, "path") == 0)
+            {
+                free(es->pax_path);
+                es->pax_path = strdup(eq + 1);
+            }
+            else if (strcmp(space + 1, "linkpath") == 0)
+            {
+                free(es->pax_link);
+                es->pax_link = strdup(eq + 1);
+            }
+        }
+        ptr += len;
+    }
+}
+
+static void end_extra(ExtractSink* es)
+{
+    es->extra[es->extra_have] = '\0';
+    if (es->type == 'L')
+    {
+        free(es->long_name);
+        es->long_name = strdup(es->extra);
+    }
+    else if (es->type == 'K')
+    {
+        free(es->long_link);
+        es->long_link = strdup(es->extra);
+    }
+    else if (es->type == 'x')
+        parse_pax(es);
+    // 'g' global headers carry nothing we use
+}
+
+int tw_extract_selected(const char* name, const char* const* only)
+{
+    size_t len;
+
+    if (!only)      return 1;
+    while (name[0] == '.' && name[1] == '/')    name += 2;
+    while (*name == '/')                        name++;
+    len = strlen(name);
+    while (len > 0 && name[len - 1] == '/')     len--;
+
+    for (; *only; only++)
+    {
+        const char* path = *only;
+        size_t plen;
+
+        while (*path == '/')    path++;
+        plen = strlen(path);
+        while (plen > 0 && path[plen - 1] == '/')   plen--;
+
+        if (len >= plen && memcmp(name, path, plen) == 0 && (len == plen || name[plen] == '/'))
+            return 1;
+    }
+    return 0;
+}
+
+static void skip_data(ExtractSink* es, unsigned long long size)
+{
+    es->remaining = size;
+    es->state = STATE_DATA;
+}
+
+static int parse_header(ExtractSink* es)
+{
+    char name[PATH_MAX];
+    char link[PATH_MAX];
+    char path[PATH_MAX];
+    unsigned long long size;
+
+    if (is_zero_block(es->header))
+    {
+        // End of archive, whatever follows is padding
+        es->state = STATE_END;
+        return 0;
+    }
+    if (!tar_checksum_ok(es->header))
+    {
+        LOGE("Invalid tar header, the archive is damaged\n");
+        return -1;
+    }
+
+    es->type = es->header[156];
+    size = tar_number(es->header + 124, 12);
+    es->padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+
+    if (es->type == 'L' || es->type == 'K' || es->type == 'x' || es->type == 'g')
+    {
+        if (size > EXTRA_MAX)
+        {
+            LOGE("Tar extended header is too large\n");
+            return -1;
+        }
+        es->extra_len = size;
+        es->extra_have = 0;
+        es->remaining = size;
+        es->state = STATE_EXTRA;
+        if (size == 0)      end_extra(es);
+        return 0;
+    }
+
+    // The name comes from a long name record, a pax header or the header itself
+    if (es->pax_path)           snprintf(name, sizeof(name), "%s", es->pax_path);
+    else if (es->long_name)     snprintf(name, sizeof(name), "%s", es->long_name);
+    else if (memcmp(es->header + 257, "ustar\0", 6) == 0 && es->header[345])
+        snprintf(name, sizeof(name), "%.155s/%.100s", es->header + 345, es->header);
+    else
+        snprintf(name, sizeof(name), "%.100s", es->header);
+
+    if (es->pax_link)           snprintf(link, sizeof(link), "%s", es->pax_link);
+    else if (es->long_link)     snprintf(link, sizeof(link), "%s", es->long_link);
+    else                        snprintf(link, sizeof(link), "%.100s", es->header + 157);
+    clear_names(es);
+
+    if (!tw_extract_selected(name, es->only))
+    {
+        skip_data(es, size);
+        return 0;
+    }
+    if (es->file_cb)    es->file_cb(name, es->cookie);
+
+    es->meta.mode = tar_number(es->header + 100, 8) & 07777;
+    es->meta.uid = tar_number(es->header + 108, 8);
+    es->meta.gid = tar_number(es->header + 116, 8);
+    es->meta.mtime = tar_number(es->header + 136, 12);
+
+    if (build_path(es, name, path) != 0)
+    {
+        note_error(es);
+        skip_data(es, size);
+        return 0;
+    }
+
+    switch (es->type)
+    {
+    case '0':
+    case '\0':
+    case '7':
+        es->counts.files++;
+        es->counts.bytes += size;
+        // A file that's there already may be a link or read only, so start over
+        clear_path(path);
+        if (size <= INLINE_FILE_MAX)
+        {
+            es->job = (WriteJob*) calloc(1, sizeof(WriteJob));
+            if (es->job)
+            {
+                es->job->path = strdup(path);
+                es->job->data = (char*) malloc(size ? size : 1);
+                es->job->meta = es->meta;
+            }
+            if (!es->job || !es->job->path || !es->job->data)
+            {
+                LOGE("Out of memory while restoring %s\n", path);
+                return -1;
+            }
+        }
+        else
+        {
+            es->fd = open_file(path, size);
+            es->path = strdup(path);
+            es->buffer_used = 0;
+            if (es->fd < 0 || !es->path)
+            {
+                LOGE("Unable to restore %s (errno=%d)\n", path, errno);
+                note_error(es);
+                if (es->fd >= 0)    close(es->fd);
+                es->fd = -1;
+                free(es->path);
+                es->path = NULL;
+            }
+        }
+        skip_data(es, size);
+        break;
+
+    case '1':
+        {
+            char target[PATH_MAX];
+
+            if (build_path(es, link, target) != 0 || defer(&es->links, path, target, &es->meta) != 0)
+                note_error(es);
+            skip_data(es, size);
+        }
+        break;
+
+    case '2':
+    case '3':
+    case '4':
+    case '6':
+        make_special(es, path, link);
+        skip_data(es, size);
+        break;
+
+    case '5':
+        // The folder for the archive root is left as it is
+        if (strcmp(path, es->root) != 0)
+            make_dir(es, path);
+        skip_data(es, size);
+        break;
+
+    default:
+        LOGW("Skipping %s, unknown tar entry type '%c'\n", name, es->type);
+        skip_data(es, size);
+        break;
+    }
+    return 0;
+}
+
+static int flush_buffer(ExtractSink* es)
+{
+    if (es->fd >= 0 && es->buffer_used && write_all(es->fd, es->buffer, es->buffer_used) != 0)
+    {
+        LOGE("Unable to write %s (errno=%d)\n", es->path, errno);
+        note_error(es);
+        close(es->fd);
+        es->fd = -1;
+    }
+    es->buffer_used = 0;
+    return 0;
+}
+
+static void end_member(ExtractSink* es)
+{
+    if (es->job)
+    {
+        queue_job(es, es->job);
+        es->job = NULL;
+    }
+    if (es->path)
+    {
+        flush_buffer(es);
+        if (es->fd >= 0 && finish_file(es->fd, es->path, &es->meta) != 0)
+        {
+            LOGE("Unable to write %s (errno=%d)\n", es->path, errno);
+            note_error(es);
+        }
+        es->fd = -1;
+        free(es->path);
+        es->path = NULL;
+    }
+}
+
+static void file_data(ExtractSink* es, const char* data, size_t len)
+{
+    if (es->job)
+    {
+        memcpy(es->job->data + es->job->size, data, len);
+        es->job->size += len;
+        return;
+    }
+    if (es->fd < 0)     return;
+
+    // Collected into large writes, archive data arrives in whatever pieces the decoder makes
+    while (len > 0)
+    {
+        size_t count = WRITE_BUFFER - es->buffer_used;
+        if (count > len)    count = len;
+        memcpy(es->buffer + es->buffer_used, data, count);
+        es->buffer_used += count;
+        data += count;
+        len -= count;
+        if (es->buffer_used == WRITE_BUFFER)    flush_buffer(es);
+    }
+}
+
+static int extract_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    ExtractSink* es = (ExtractSink*) sink;
+    const char* ptr = (const char*) data;
+
+    if (es->error)      return -1;
+    while (len > 0)
+    {
+        size_t count;
+
+        switch (es->state)
+        {
+        case STATE_END:
+            return 0;
+
+        case STATE_HEADER:
+            count = TAR_BLOCK_SIZE - es->have;
+            if (count > len)    count = len;
+            memcpy(es->header + es->have, ptr, count);
+            es->have += count;
+            ptr += count;
+            len -= count;
+            if (es->have < TAR_BLOCK_SIZE)  break;
+
+            es->have = 0;
+            if (parse_header(es) != 0)
+            {
+                es->error = -1;
+                return -1;
+            }
+            if (es->state != STATE_HEADER && es->state != STATE_END &&
+                es->remaining == 0 && es->padding == 0)
+            {
+                end_member(es);
+                es->state = STATE_HEADER;
+            }
+            break;
+
+        case STATE_EXTRA:
+        case STATE_DATA:
+            // Member data first, then the padding up to the next block
+            if (es->remaining > 0)
+            {
+                count = len < es->remaining ? len : (size_t) es->remaining;
+                if (es->state == STATE_EXTRA)
+                {
+                    memcpy(es->extra + es->extra_have, ptr, count);
+                    es->extra_have += count;
+                }
+                else
+                    file_data(es, ptr, count);
+                es->remaining -= count;
+                if (es->remaining == 0)
+                {
+                    if (es->state == STATE_EXTRA)   end_extra(es);
+                    else                            end_member(es);
+                }
+            }
+            else
+            {
+                count = len < es->padding ? len : es->padding;
+                es->padding -= count;
+            }
+            ptr += count;
+            len -= count;
+            if (es->remaining == 0 && es->padding == 0)
+            {
+                if (es->state == STATE_DATA)    end_member(es);
+                es->state = STATE_HEADER;
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+static void free_deferred(Deferred* list)
+{
+    while (list)
+    {
+        Deferred* item = list;
+        list = item->next;
+        free(item->path);
+        free(item->target);
+        free(item);
+    }
+}
+
+static int extract_sink_close(TwSink* sink)
+{
+    ExtractSink* es = (ExtractSink*) sink;
+    Deferred* item;
+    int i, ret = es->error;
+
+    // A stream that stops between members is fine, tar pads the end anyway
+    if (!ret && es->state != STATE_HEADER && es->state != STATE_END)
+    {
+        LOGE("Archive ended in the middle of a file\n");
+        ret = -1;
+    }
+    if (!ret && es->have)
+    {
+        LOGE("Archive ended in the middle of a header\n");
+        ret = -1;
+    }
+
+    // A file cut short is still written out as far as it goes, like tar does
+    end_member(es);
+
+    pthread_mutex_lock(&es->lock);
+    es->shutdown = 1;
+    pthread_cond_broadcast(&es->work_cond);
+    pthread_mutex_unlock(&es->lock);
+    for (i = 0; i < es->thread_count; i++)
+        pthread_join(es->threads[i], NULL);
+    es->counts.errors += es->writer_errors;
+    tw_usage_invalidate(es->root);
+
+    for (item = es->links; item; item = item->next)
+    {
+        clear_path(item->path);
+        if (link(item->target, item->path) != 0)
+        {
+            LOGE("Unable to link %s to %s (errno=%d)\n", item->path, item->target, errno);
+            es->counts.errors++;
+        }
+    }
+
+    // Deepest first, the list is in reverse archive order
+    for (item = es->dirs; item; item = item->next)
+    {
+        if (chown(item->path, item->meta.uid, item->meta.gid) != 0) {}
+        if (chmod(item->path, item->meta.mode) != 0) {}
+        set_time(item->path, item->meta.mtime);
+    }
+
+    if (es->counts.errors)
+    {
+        LOGE("%u entries could not be restored to %s\n", es->counts.errors, es->root);
+        ret = -1;
+    }
+    if (es->stats)  *es->stats = es->counts;
+
+    free_deferred(es->links);
+    free_deferred(es->dirs);
+    clear_names(es);
+    pthread_cond_destroy(&es->space_cond);
+    pthread_cond_destroy(&es->work_cond);
+    pthread_mutex_destroy(&es->lock);
+    free(es->extra);
+    free(es->buffer);
+    free(es);
+    return ret;
+}
+
+TwSink* tw_extract_sink_open(const TwExtractOptions* opts, TwExtractStats* stats)
+{
+    ExtractSink* es = (ExtractSink*) calloc(1, sizeof(ExtractSink));
+    int threads, i;
+
+    if (!es)            return NULL;
+
+    es->buffer = (char*) malloc(WRITE_BUFFER);
+    es->extra = (char*) malloc(EXTRA_MAX + 1);
+    if (!es->buffer || !es->extra)
+    {
+        free(es->buffer);
+        free(es->extra);
+        free(es);
+        return NULL;
+    }
+
+    snprintf(es->root, sizeof(es->root), "%s", opts->root);
+    i = strlen(es->root);
+    while (i > 1 && es->root[i - 1] == '/')     es->root[--i] = '\0';
+    es->only = opts->only;
+    es->file_cb = opts->file_cb;
+    es->cookie = opts->cookie;
+    es->stats = stats;
+    es->fd = -1;
+    es->state = STATE_HEADER;
+
+    pthread_mutex_init(&es->lock, NULL);
+    pthread_cond_init(&es->work_cond, NULL);
+    pthread_cond_init(&es->space_cond, NULL);
+
+    threads = opts->threads > 0 ? opts->threads : tw_get_cpu_count();
+    // Creating files mostly waits on the flash, so always use at least two
+    if (threads < 2)                threads = 2;
+    if (threads > MAX_WRITERS)      threads = MAX_WRITERS;
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&es->threads[i], NULL, writer_thread, es) != 0)
+            break;
+        es->thread_count++;
+    }
+
+    if (es->thread_count == 0)
+    {
+        LOGE("Unable to start restore threads\n");
+        pthread_cond_destroy(&es->space_cond);
+        pthread_cond_destroy(&es->work_cond);
+        pthread_mutex_destroy(&es->lock);
+        free(es->buffer);
+        free(es->extra);
+        free(es);
+        return NULL;
+    }
+
+    es->sink.write = extract_sink_write;
+    es->sink.close = extract_sink_close;
+    return &es->sink;
+}
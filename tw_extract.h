@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_EXTRACT_HEADER
+#define _TW_EXTRACT_HEADER
+
+#include "tw_sink.h"
+
+// Called on the thread writing to the sink for each member restored, with its archive name
+typedef void (*TwExtractFileFn)(const char* name, void* cookie);
+
+typedef struct {
+    const char* root;               // Folder to extract into, eg. "/data"
+    int threads;                    // File writer threads, 0 for one per CPU
+    const char* const* only;        // NULL terminated paths to restore (eg. "data/com.foo"),
+                                    // relative to root, or NULL for everything
+    TwExtractFileFn file_cb;
+    void* cookie;
+} TwExtractOptions;
+
+// Filled in when the sink is closed
+typedef struct {
+    unsigned long long files;
+    unsigned long long bytes;
+    unsigned int errors;            // entries that couldn't be restored
+} TwExtractStats;
+
+// Returns a sink that takes a tar stream and extracts it under opts->root,
+// like "cd root && tar -x" would. Closing it waits for every file to be
+// written and returns -1 if the archive was damaged or an entry failed.
+// stats may be NULL.
+TwSink* tw_extract_sink_open(const TwExtractOptions* opts, TwExtractStats* stats);
+
+// Whether the member name (eg. "./data/com.foo/lib/") is one of the paths in
+// only or lies under one of them
+int tw_extract_selected(const char* name, const char* const* only);
+
+#endif  // _TW_EXTRACT_HEADER
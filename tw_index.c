@@ -0,0 +1,525 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Random access into .win archives.
+**
+** The index lists every member of an archive with its offset, size, mode and
+** the CRC-32 of its data, followed by where each compressed block starts. The
+** compressor emits blocks that decode on their own, so getting at a member
+** only takes reading from the block before it up to the end of its data.
+**
+** Layout, all numbers little endian:
+**   header   "TWINDEX1", codec (4), reserved (4), members (8), blocks (8)
+**   member   offset (8), size (8), header length (4), mode (4), mtime (4),
+**            crc (4), name length (2), reserved (4), name
+**   block    archive offset (8), file offset (8)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "tw_index.h"
+#include "tw_segment.h"
+
+#define INDEX_MAGIC         "TWINDEX1"
+#define INDEX_HEADER_SIZE   32
+#define MEMBER_SIZE         38
+#define BLOCK_SIZE          16
+#define TAR_BLOCK_SIZE      512
+#define READ_BUFFER         (256 * 1024)
+
+// Unselected members between two selected ones are read through rather than
+// decoding the same block again for the next one
+#define MERGE_GAP           (1024 * 1024)
+
+struct TwIndexWriter {
+    FILE* fp;
+    char* filename;
+    TwCodec codec;
+    unsigned long long member_count;
+    TwIndexBlock* blocks;
+    unsigned long long block_count;
+    unsigned long long block_alloc;
+    int error;
+};
+
+// Hands a range of the archive on to the extractor, dropping what's before and after it
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    unsigned long long skip;
+    unsigned long long left;
+} WindowSink;
+
+static void put_le32(unsigned char* ptr, unsigned int value)
+{
+    ptr[0] = value;
+    ptr[1] = value >> 8;
+    ptr[2] = value >> 16;
+    ptr[3] = value >> 24;
+}
+
+static void put_le64(unsigned char* ptr, unsigned long long value)
+{
+    put_le32(ptr, (unsigned int) value);
+    put_le32(ptr + 4, (unsigned int) (value >> 32));
+}
+
+static unsigned int get_le32(const unsigned char* ptr)
+{
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int) ptr[3] << 24);
+}
+
+static unsigned long long get_le64(const unsigned char* ptr)
+{
+    return get_le32(ptr) | ((unsigned long long) get_le32(ptr + 4) << 32);
+}
+
+static void fill_header(unsigned char* header, TwCodec codec, unsigned long long members, unsigned long long blocks)
+{
+    memset(header, 0, INDEX_HEADER_SIZE);
+    memcpy(header, INDEX_MAGIC, 8);
+    put_le32(header + 8, codec);
+    put_le64(header + 16, members);
+    put_le64(header + 24, blocks);
+}
+
+TwIndexWriter* tw_index_open(const char* filename, TwCodec codec)
+{
+    TwIndexWriter* iw = (TwIndexWriter*) calloc(1, sizeof(TwIndexWriter));
+    unsigned char header[INDEX_HEADER_SIZE];
+
+    if (!iw)            return NULL;
+    iw->filename = strdup(filename);
+    iw->codec = codec;
+    iw->fp = iw->filename ? fopen(filename, "wb") : NULL;
+    if (!iw->fp)
+    {
+        LOGE("Unable to create %s (errno=%d)\n", filename, errno);
+        free(iw->filename);
+        free(iw);
+        return NULL;
+    }
+
+    // The counts are filled in on close
+    fill_header(header, codec, 0, 0);
+    if (fwrite(header, 1, sizeof(header), iw->fp) != sizeof(header))
+        iw->error = -1;
+    return iw;
+}
+
+void tw_index_add_member(const TwArchiveMember* member, void* writer)
+{
+    TwIndexWriter* iw = (TwIndexWriter*) writer;
+    unsigned char record[MEMBER_SIZE];
+    size_t len = strlen(member->name);
+
+    if (iw->error)      return;
+    if (len > 0xffff)   len = 0xffff;
+
+    put_le64(record, member->offset);
+    put_le64(record + 8, member->size);
+    put_le32(record + 16, member->header_len);
+    put_le32(record + 20, member->mode);
+    put_le32(record + 24, (unsigned int) member->mtime);
+    put_le32(record + 28, member->crc);
+    record[32] = len;
+    record[33] = len >> 8;
+    memset(record + 34, 0, 4);
+    if (fwrite(record, 1, sizeof(record), iw->fp) != sizeof(record) ||
+        fwrite(member->name, 1, len, iw->fp) != len)
+        iw->error = -1;
+    iw->member_count++;
+}
+
+void tw_index_add_block(unsigned long long in_offset, unsigned long long out_offset, void* writer)
+{
+    TwIndexWriter* iw = (TwIndexWriter*) writer;
+
+    if (iw->error)      return;
+    if (iw->block_count == iw->block_alloc)
+    {
+        unsigned long long alloc = iw->block_alloc ? iw->block_alloc * 2 : 1024;
+        TwIndexBlock* blocks = (TwIndexBlock*) realloc(iw->blocks, alloc * sizeof(TwIndexBlock));
+        if (!blocks)
+        {
+            iw->error = -1;
+            return;
+        }
+        iw->blocks = blocks;
+        iw->block_alloc = alloc;
+    }
+    iw->blocks[iw->block_count].in_offset = in_offset;
+    iw->blocks[iw->block_count].out_offset = out_offset;
+    iw->block_count++;
+}
+
+int tw_index_close(TwIndexWriter* iw, int keep)
+{
+    unsigned char header[INDEX_HEADER_SIZE];
+    unsigned long long i;
+    int ret;
+
+    if (!iw)            return -1;
+    ret = iw->error;
+    for (i = 0; keep && !ret && i < iw->block_count; i++)
+    {
+        unsigned char record[BLOCK_SIZE];
+
+        put_le64(record, iw->blocks[i].in_offset);
+        put_le64(record + 8, iw->blocks[i].out_offset);
+        if (fwrite(record, 1, sizeof(record), iw->fp) != sizeof(record))
+            ret = -1;
+    }
+
+    if (keep && !ret)
+    {
+        fill_header(header, iw->codec, iw->member_count, iw->block_count);
+        if (fseek(iw->fp, 0, SEEK_SET) != 0 || fwrite(header, 1, sizeof(header), iw->fp) != sizeof(header))
+            ret = -1;
+    }
+    if (fclose(iw->fp) != 0)    ret = -1;
+
+    if (keep && ret)
+        LOGE("Unable to write %s\n", iw->filename);
+    if (!keep || ret)
+    {
+        unlink(iw->filename);
+        ret = -1;
+    }
+
+    free(iw->blocks);
+    free(iw->filename);
+    free(iw);
+    return ret;
+}
+
+int tw_index_load(const char* filename, TwIndex* index)
+{
+    unsigned char* data = NULL;
+    unsigned char* ptr;
+    unsigned char* end;
+    unsigned long long i;
+    size_t names_len;
+    struct stat st;
+    char* name;
+    int fd;
+
+    memset(index, 0, sizeof(*index));
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)         return -1;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= INDEX_HEADER_SIZE)
+        data = (unsigned char*) malloc(st.st_size);
+    if (!data || read(fd, data, st.st_size) != st.st_size || memcmp(data, INDEX_MAGIC, 8) != 0)
+    {
+        LOGE("Invalid index %s\n", filename);
+        free(data);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    index->codec = (TwCodec) get_le32(data + 8);
+    index->member_count = get_le64(data + 16);
+    index->block_count = get_le64(data + 24);
+    end = data + st.st_size;
+
+    // Names take at most what's left of the file, plus their terminators
+    names_len = st.st_size + index->member_count;
+    if (index->member_count > (unsigned long long) st.st_size / MEMBER_SIZE ||
+        index->block_count > (unsigned long long) st.st_size / BLOCK_SIZE)
+        goto invalid;
+
+    index->members = (TwIndexMember*) calloc(index->member_count + 1, sizeof(TwIndexMember));
+    index->blocks = (TwIndexBlock*) calloc(index->block_count + 1, sizeof(TwIndexBlock));
+    index->names = (char*) malloc(names_len);
+    if (!index->members || !index->blocks || !index->names)
+        goto invalid;
+
+    ptr = data + INDEX_HEADER_SIZE;
+    name = index->names;
+    for (i = 0; i < index->member_count; i++)
+    {
+        TwIndexMember* member = &index->members[i];
+        size_t len;
+
+        if (end - ptr < MEMBER_SIZE)    goto invalid;
+        len = ptr[32] | (ptr[33] << 8);
+        if ((size_t) (end - ptr) < MEMBER_SIZE + len)   goto invalid;
+
+        member->offset = get_le64(ptr);
+        member->size = get_le64(ptr + 8);
+        member->header_len = get_le32(ptr + 16);
+        member->mode = get_le32(ptr + 20);
+        member->mtime = get_le32(ptr + 24);
+        member->crc = get_le32(ptr + 28);
+        memcpy(name, ptr + MEMBER_SIZE, len);
+        name[len] = '\0';
+        member->name = name;
+        name += len + 1;
+        ptr += MEMBER_SIZE + len;
+    }
+
+    if ((unsigned long long) (end - ptr) != index->block_count * BLOCK_SIZE)
+        goto invalid;
+    for (i = 0; i < index->block_count; i++, ptr += BLOCK_SIZE)
+    {
+        index->blocks[i].in_offset = get_le64(ptr);
+        index->blocks[i].out_offset = get_le64(ptr + 8);
+    }
+    free(data);
+    return 0;
+
+invalid:
+    LOGE("Invalid index %s\n", filename);
+    free(data);
+    tw_index_free(index);
+    return -1;
+}
+
+void tw_index_free(TwIndex* index)
+{
+    free(index->members);
+    free(index->blocks);
+    free(index->names);
+    memset(index, 0, sizeof(*index));
+}
+
+static int window_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    WindowSink* ws = (WindowSink*) sink;
+    const char* ptr = (const char*) data;
+
+    if (ws->skip >= len)
+    {
+        ws->skip -= len;
+        return 0;
+    }
+    ptr += ws->skip;
+    len -= ws->skip;
+    ws->skip = 0;
+
+    if (len > ws->left)     len = ws->left;
+    ws->left -= len;
+    return len ? tw_sink_write(ws->next, ptr, len) : 0;
+}
+
+// The extractor carries on with the next range, so it stays open
+static int window_sink_close(TwSink* sink)
+{
+    WindowSink* ws = (WindowSink*) sink;
+    int ret = ws->left ? -1 : 0;
+
+    free(ws);
+    return ret;
+}
+
+static int read_range(const TwSegments* segs, unsigned long long start, unsigned long long end, char* buffer, TwSink* out)
+{
+    while (start < end)
+    {
+        size_t count = end - start > READ_BUFFER ? READ_BUFFER : (size_t) (end - start);
+        ssize_t len = tw_segments_pread(segs, buffer, count, start);
+
+        if (len <= 0)                   return -1;
+        if (tw_sink_write(out, buffer, len) != 0)
+            return -1;
+        start += len;
+    }
+    return 0;
+}
+
+// Feeds bytes [start, end) of the uncompressed archive into out
+static int copy_range(const TwIndex* index, const TwSegments* segs,
+                      unsigned long long start, unsigned long long end, char* buffer, TwSink* out)
+{
+    unsigned long long lo = 0, hi = index->block_count;
+    unsigned long long out_start, out_end;
+    WindowSink* ws;
+    TwSink* decoder;
+    int ret;
+
+    if (index->codec == TW_CODEC_NONE)
+        return read_range(segs, start, end, buffer, out);
+
+    // The last block starting at or before start, then on to the first one starting at or after end
+    while (hi - lo > 1)
+    {
+        unsigned long long mid = (lo + hi) / 2;
+        if (index->blocks[mid].in_offset <= start)  lo = mid;
+        else                                        hi = mid;
+    }
+    if (index->block_count == 0 || index->blocks[lo].in_offset > start)
+        return -1;
+    out_start = index->blocks[lo].out_offset;
+    for (hi = lo + 1; hi < index->block_count && index->blocks[hi].in_offset < end; hi++)
+        ;
+    out_end = hi < index->block_count ? index->blocks[hi].out_offset : tw_segments_size(segs);
+
+    ws = (WindowSink*) calloc(1, sizeof(WindowSink));
+    if (!ws)            return -1;
+    ws->next = out;
+    ws->skip = start - index->blocks[lo].in_offset;
+    ws->left = end - start;
+    ws->sink.write = window_sink_write;
+    ws->sink.close = window_sink_close;
+
+    decoder = tw_decompress_sink_open(&ws->sink, index->codec);
+    if (!decoder)
+    {
+        free(ws);
+        return -1;
+    }
+    ret = read_range(segs, out_start, out_end, buffer, decoder);
+    if (tw_sink_close(decoder) != 0)    ret = -1;
+    return ret;
+}
+
+// Checks a restored file against the CRC-32 taken when it was archived
+static int check_file(const char* root, const TwIndexMember* member, char* buffer)
+{
+    const char* name = member->name;
+    char path[PATH_MAX];
+    unsigned long long total = 0;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    int fd;
+
+    while (name[0] == '.' && name[1] == '/')    name += 2;
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        LOGE("Unable to open %s (errno=%d)\n", path, errno);
+        return -1;
+    }
+    for (;;)
+    {
+        ssize_t len = read(fd, buffer, READ_BUFFER);
+        if (len < 0 && errno == EINTR)  continue;
+        if (len <= 0)                   break;
+        crc = crc32(crc, (const Bytef*) buffer, len);
+        total += len;
+    }
+    close(fd);
+
+    if (total != member->size || (unsigned int) crc != member->crc)
+    {
+        LOGE("%s doesn't match the backup\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int tw_index_extract(const TwIndex* index, const char* archive, const char* root,
+                     const char* const* paths, TwExtractStats* stats)
+{
+    TwExtractOptions options;
+    unsigned char magic[16];
+    TwSegments segs;
+    TwSink* extract;
+    char* buffer;
+    unsigned long long i, found = 0;
+    int ret = 0;
+
+    // Offsets run across the segments of a split archive
+    if (tw_segments_open(archive, &segs) != 0)      return -1;
+
+    // An index left over from another backup would send us to the wrong places
+    memset(magic, 0, sizeof(magic));
+    if (tw_segments_pread(&segs, magic, sizeof(magic), 0) < 0)  memset(magic, 0, sizeof(magic));
+    if (tw_codec_detect(magic, sizeof(magic)) != index->codec)
+    {
+        LOGE("%s doesn't match its index\n", archive);
+        tw_segments_close(&segs);
+        return -1;
+    }
+
+    buffer = (char*) malloc(READ_BUFFER);
+    memset(&options, 0, sizeof(options));
+    options.root = root;
+    // Members in the gaps read through are dropped by the extractor
+    options.only = paths;
+    extract = buffer ? tw_extract_sink_open(&options, stats) : NULL;
+    if (!extract)
+    {
+        LOGE("Unable to start extracting %s\n", archive);
+        free(buffer);
+        tw_segments_close(&segs);
+        return -1;
+    }
+
+    for (i = 0; ret == 0 && i < index->member_count; )
+    {
+        const TwIndexMember* member = &index->members[i];
+        unsigned long long start, end, next;
+
+        if (!tw_extract_selected(member->name, paths))
+        {
+            i++;
+            continue;
+        }
+
+        start = member->offset;
+        end = start + member->header_len + ((member->size + TAR_BLOCK_SIZE - 1) & ~(unsigned long long) (TAR_BLOCK_SIZE - 1));
+        found++;
+        for (next = i + 1; next < index->member_count; next++)
+        {
+            const TwIndexMember* other = &index->members[next];
+
+            if (!tw_extract_selected(other->name, paths))   continue;
+            if (other->offset < end || other->offset - end > MERGE_GAP)    break;
+            end = other->offset + other->header_len +
+                  ((other->size + TAR_BLOCK_SIZE - 1) & ~(unsigned long long) (TAR_BLOCK_SIZE - 1));
+            found++;
+        }
+
+        if (copy_range(index, &segs, start, end, buffer, extract) != 0)
+        {
+            LOGE("Unable to read %s from %s\n", member->name, archive);
+            ret = -1;
+        }
+        i = next;
+    }
+
+    if (tw_sink_close(extract) != 0)    ret = -1;
+    tw_segments_close(&segs);
+
+    if (ret == 0 && found == 0)
+    {
+        LOGE("Nothing in %s matches what was asked for\n", archive);
+        ret = -1;
+    }
+    for (i = 0; ret == 0 && i < index->member_count; i++)
+    {
+        const TwIndexMember* member = &index->members[i];
+
+        if (S_ISREG(member->mode) && tw_extract_selected(member->name, paths) && check_file(root, member, buffer) != 0)
+            ret = -1;
+    }
+    free(buffer);
+    return ret;
+}
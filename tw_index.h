@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_INDEX_HEADER
+#define _TW_INDEX_HEADER
+
+#include "tw_archive.h"
+#include "tw_compress.h"
+#include "tw_extract.h"
+
+// Extension of the index kept next to each file system backup
+#define TW_INDEX_EXT            ".idx"
+
+typedef struct {
+    unsigned long long offset;      // First header block, in the uncompressed archive
+    unsigned long long size;
+    unsigned int header_len;
+    unsigned int mode;
+    unsigned long mtime;
+    unsigned int crc;               // CRC-32 of the file data
+    const char* name;               // As in the archive, eg. "./data/com.foo/"
+} TwIndexMember;
+
+// Where a compressed block starts, in the archive and in the .win file
+typedef struct {
+    unsigned long long in_offset;
+    unsigned long long out_offset;
+} TwIndexBlock;
+
+typedef struct {
+    TwCodec codec;
+    unsigned long long member_count;
+    TwIndexMember* members;         // In archive order
+    unsigned long long block_count;
+    TwIndexBlock* blocks;
+    char* names;
+} TwIndex;
+
+typedef struct TwIndexWriter TwIndexWriter;
+
+// Starts an index for an archive being written with codec. Feed it with
+// tw_index_add_member as the archive's member_cb and, for a compressed one,
+// tw_index_add_block as the compressor's block_fn.
+TwIndexWriter* tw_index_open(const char* filename, TwCodec codec);
+void tw_index_add_member(const TwArchiveMember* member, void* writer);
+void tw_index_add_block(unsigned long long in_offset, unsigned long long out_offset, void* writer);
+
+// Finishes the index, or removes it when the archive wasn't kept. Returns 0
+// once a complete index is on disk.
+int tw_index_close(TwIndexWriter* writer, int keep);
+
+// Loads an index, returns 0 on success
+int tw_index_load(const char* filename, TwIndex* index);
+void tw_index_free(TwIndex* index);
+
+// Extracts the members under paths (NULL terminated, relative to the archive
+// root, eg. "data/com.foo") from archive into root. Only the compressed blocks
+// holding them are read and the data of every file restored is checked
+// against the index. stats may be NULL, returns 0 on success.
+int tw_index_extract(const TwIndex* index, const char* archive, const char* root,
+                     const char* const* paths, TwExtractStats* stats);
+
+#endif  // _TW_INDEX_HEADER
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* I/O scheduling for the long running operations.
+**
+** Backups, restores, installs and formats went at the flash with the same
+** priority as the GUI, so browsing folders or loading a page crawled while
+** one ran. Now each operation is a job: its threads drop to a lower I/O
+** class, its streams can be held to a bandwidth cap, and it can be paused.
+** A paused stream waits in tw_io_throttle, a paused helper process is
+** stopped with SIGSTOP.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "tw_compress.h"
+#include "tw_progress.h"
+#include "tw_io.h"
+
+// From linux/ioprio.h, which isn't exported to userspace
+#define IOPRIO_CLASS_SHIFT  13
+#define IOPRIO_CLASS_BE     2
+#define IOPRIO_CLASS_IDLE   3
+#define IOPRIO_WHO_PROCESS  1
+
+#define IO_BURST_MSEC       1000    // how far a job that sat idle may run ahead of its cap
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static TwIoJob* io_jobs;
+
+static int ioprio_of(TwIoClass io_class)
+{
+    switch (io_class)
+    {
+    case TW_IO_LOW:     return (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7;
+    case TW_IO_IDLE:    return IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+    default:            return (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 4;
+    }
+}
+
+void tw_io_job_begin(TwIoJob* job, TwIoClass io_class, unsigned long bps)
+{
+    memset(job, 0, sizeof(*job));
+    job->io_class = io_class;
+    job->bps = bps;
+    gettimeofday(&job->start, NULL);
+
+    pthread_mutex_lock(&io_lock);
+    job->next = io_jobs;
+    io_jobs = job;
+    pthread_mutex_unlock(&io_lock);
+}
+
+void tw_io_job_end(TwIoJob* job)
+{
+    TwIoJob** ptr;
+
+    pthread_mutex_lock(&io_lock);
+    for (ptr = &io_jobs; *ptr; ptr = &(*ptr)->next)
+    {
+        if (*ptr == job)
+        {
+            *ptr = job->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&io_lock);
+}
+
+int tw_io_enter(const TwIoJob* job)
+{
+    int prio = syscall(__NR_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+
+    if (syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio_of(job->io_class)) != 0)
+        LOGW("Unable to set the I/O priority (errno=%d)\n", errno);
+    return prio;
+}
+
+void tw_io_leave(int prio)
+{
+    if (prio >= 0)      syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0, prio);
+}
+
+void tw_io_set_child(TwIoJob* job, pid_t pid)
+{
+    pthread_mutex_lock(&io_lock);
+    job->child = pid;
+    if (pid > 0 && job->paused)     kill(pid, SIGSTOP);
+    pthread_mutex_unlock(&io_lock);
+}
+
+void tw_io_throttle(TwIoJob* job, size_t len)
+{
+    if (!job)           return;
+
+    pthread_mutex_lock(&io_lock);
+    job->bytes += len;
+    for (;;)
+    {
+        unsigned long spent, want;
+        struct timespec ts;
+        struct timeval now;
+
+        if (job->paused)
+        {
+            while (job->paused)
+                pthread_cond_wait(&io_cond, &io_lock);
+
+            // The time spent paused is no credit for later
+            gettimeofday(&job->start, NULL);
+            job->bytes = len;
+        }
+        if (job->bps == 0)  break;
+
+        spent = tw_msec_since(&job->start);
+        want = tw_rate_msec(job->bytes, job->bps);
+        if (spent > want + IO_BURST_MSEC)
+        {
+            gettimeofday(&job->start, NULL);
+            job->bytes = len;
+            spent = 0;
+            want = tw_rate_msec(len, job->bps);
+        }
+        if (want <= spent)  break;
+
+        // Woken early by a pause, so it's noticed right away
+        gettimeofday(&now, NULL);
+        ts.tv_sec = now.tv_sec + (want - spent) / 1000;
+        ts.tv_nsec = (now.tv_usec + ((want - spent) % 1000) * 1000) * 1000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&io_cond, &io_lock, &ts);
+    }
+    pthread_mutex_unlock(&io_lock);
+}
+
+static void set_paused(TwIoJob* job, int paused)
+{
+    if (job->paused == paused)  return;
+
+    job->paused = paused;
+    if (job->child > 0)     kill(job->child, paused ? SIGSTOP : SIGCONT);
+}
+
+static void pause_jobs(TwIoJob* job, int paused)
+{
+    TwIoJob* ptr;
+
+    pthread_mutex_lock(&io_lock);
+    if (job)    set_paused(job, paused);
+    else
+    {
+        for (ptr = io_jobs; ptr; ptr = ptr->next)
+            set_paused(ptr, paused);
+    }
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_lock);
+}
+
+void tw_io_pause(TwIoJob* job)
+{
+    pause_jobs(job, 1);
+}
+
+void tw_io_resume(TwIoJob* job)
+{
+    pause_jobs(job, 0);
+}
+
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    TwIoJob* job;
+} IoSink;
+
+static int io_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    IoSink* is = (IoSink*) sink;
+
+    tw_io_throttle(is->job, len);
+    return tw_sink_write(is->next, data, len);
+}
+
+static int io_sink_close(TwSink* sink)
+{
+    IoSink* is = (IoSink*) sink;
+    int ret = tw_sink_close(is->next);
+
+    free(is);
+    return ret;
+}
+
+TwSink* tw_io_sink_open(TwSink* next, TwIoJob* job)
+{
+    IoSink* is = (IoSink*) calloc(1, sizeof(IoSink));
+    if (!is)            return NULL;
+
+    is->next = next;
+    is->job = job;
+    is->sink.write = io_sink_write;
+    is->sink.close = io_sink_close;
+    return &is->sink;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_IO_HEADER
+#define _TW_IO_HEADER
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "tw_sink.h"
+
+// The values of tw_io_priority
+typedef enum {
+    TW_IO_NORMAL = 0,               // best effort at the default level, same as the GUI
+    TW_IO_LOW,                      // best effort at the lowest level
+    TW_IO_IDLE,                     // only when nothing else wants the disk
+} TwIoClass;
+
+// One long running operation: a backup, a restore, a zip install or a
+// format. All of its threads share the cap and pause with it.
+typedef struct TwIoJob TwIoJob;
+
+struct TwIoJob {
+    TwIoClass io_class;
+    unsigned long bps;              // bandwidth cap, 0 for none
+    volatile int paused;
+    pid_t child;                    // a helper doing the I/O for the job, 0 for none
+
+    // Set up by tw_io_job_begin
+    struct timeval start;
+    unsigned long long bytes;       // since start, to hold to the cap
+    TwIoJob* next;
+};
+
+// Registers job, so tw_io_pause(NULL) reaches it. Nothing is throttled or
+// moved to io_class until a thread asks for it.
+void tw_io_job_begin(TwIoJob* job, TwIoClass io_class, unsigned long bps);
+
+// Forgets job, once its streams and helper are done
+void tw_io_job_end(TwIoJob* job);
+
+// Moves the calling thread, and anything it starts later, to the class of
+// job. Returns what it was before, to hand to tw_io_leave.
+int tw_io_enter(const TwIoJob* job);
+void tw_io_leave(int prio);
+
+// The child process doing the I/O of job, it's stopped with the job
+void tw_io_set_child(TwIoJob* job, pid_t pid);
+
+// Accounts for len bytes of job's I/O. Waits while the job is paused, and
+// for as long as it takes to keep the job under its cap.
+void tw_io_throttle(TwIoJob* job, size_t len);
+
+// Pauses or resumes job's streams, NULL for every job there is. Safe from
+// any thread.
+void tw_io_pause(TwIoJob* job);
+void tw_io_resume(TwIoJob* job);
+
+// Passes everything through to next, throttled as job
+TwSink* tw_io_sink_open(TwSink* next, TwIoJob* job);
+
+#endif  // _TW_IO_HEADER
@@ -0,0 +1,569 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* A small LZ4 codec, written against the published block and frame formats.
+**
+** The compressor is the plain greedy one: a hash of the next 4 bytes finds
+** the last place they were seen, and every match is taken as it comes. It
+** trades ratio for speed, which is the point of having it next to gzip.
+** Frames are written with independent blocks and no checksums, the backup
+** has its own MD5. The decoder reads any frame made that way, including
+** the ones from the lz4 tool with its default settings.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "tw_lz4.h"
+
+#define LZ4_MAGIC           0x184D2204U
+#define LZ4_SKIP_MAGIC      0x184D2A50U     // skippable frames, the low 4 bits are free
+
+#define FLG_VERSION         0x40
+#define FLG_BLOCK_INDEP     0x20
+#define FLG_BLOCK_CHECKSUM  0x10
+#define FLG_CONTENT_SIZE    0x08
+#define FLG_CONTENT_CHECKSUM 0x04
+#define FLG_DICT_ID         0x01
+
+#define MIN_MATCH           4
+// The format wants the last 5 bytes as literals and no match starting in the last 12
+#define LAST_LITERALS       5
+#define MF_LIMIT            12
+#define MAX_DISTANCE        65535
+
+#define HASH_LOG            14
+#define MAX_BLOCK_ID        7               // 4MB blocks
+
+static unsigned int read32(const unsigned char* ptr)
+{
+    unsigned int value;
+
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static void put_le32(unsigned char* ptr, unsigned int value)
+{
+    ptr[0] = value;
+    ptr[1] = value >> 8;
+    ptr[2] = value >> 16;
+    ptr[3] = value >> 24;
+}
+
+static unsigned int get_le32(const unsigned char* ptr)
+{
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int) ptr[3] << 24);
+}
+
+#define XXH_PRIME1          2654435761U
+#define XXH_PRIME2          2246822519U
+#define XXH_PRIME3          3266489917U
+#define XXH_PRIME4          668265263U
+#define XXH_PRIME5          374761393U
+
+static unsigned int rotl32(unsigned int value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+// xxHash32 with seed 0, only needed for the few bytes of a frame descriptor
+static unsigned int xxh32_small(const unsigned char* data, size_t len)
+{
+    unsigned int h = XXH_PRIME5 + (unsigned int) len;
+    size_t i = 0;
+
+    for (; i + 4 <= len; i += 4)
+    {
+        h += get_le32(data + i) * XXH_PRIME3;
+        h = rotl32(h, 17) * XXH_PRIME4;
+    }
+    for (; i < len; i++)
+    {
+        h += data[i] * XXH_PRIME5;
+        h = rotl32(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 15;
+    h *= XXH_PRIME2;
+    h ^= h >> 13;
+    h *= XXH_PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+
+int tw_lz4_check(const void* data, size_t len)
+{
+    return len >= 4 && get_le32((const unsigned char*) data) == LZ4_MAGIC;
+}
+
+static unsigned char* put_length(unsigned char* op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+static unsigned char* put_sequence(unsigned char* op, const unsigned char* literals, size_t lit_len,
+                                   unsigned int offset, size_t match_len)
+{
+    unsigned char* token = op++;
+
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15)  op = put_length(op, lit_len - 15);
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    // The last sequence has literals only
+    if (match_len == 0)     return op;
+
+    *op++ = offset;
+    *op++ = offset >> 8;
+    match_len -= MIN_MATCH;
+    *token |= match_len >= 15 ? 15 : match_len;
+    if (match_len >= 15)    op = put_length(op, match_len - 15);
+    return op;
+}
+
+static unsigned int hash4(unsigned int value)
+{
+    return (value * XXH_PRIME1) >> (32 - HASH_LOG);
+}
+
+// Compresses one block, the output is at most len + len / 255 + 16 bytes
+static size_t compress_block(const unsigned char* src, size_t len, unsigned char* dst, unsigned int* table)
+{
+    const unsigned char* ip = src;
+    const unsigned char* anchor = src;
+    const unsigned char* end = src + len;
+    unsigned char* op = dst;
+    unsigned int misses = 0;
+
+    memset(table, 0, sizeof(unsigned int) << HASH_LOG);
+    if (len > MF_LIMIT)
+    {
+        const unsigned char* mf_limit = end - MF_LIMIT;
+        const unsigned char* match_limit = end - LAST_LITERALS;
+
+        ip++;
+        while (ip < mf_limit)
+        {
+            unsigned int h = hash4(read32(ip));
+            const unsigned char* ref = src + table[h];
+            const unsigned char* mp;
+
+            table[h] = ip - src;
+            if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != read32(ip))
+            {
+                // Skip ahead faster the longer nothing matches, incompressible data goes by quickly
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            mp = ip + MIN_MATCH;
+            ref += MIN_MATCH;
+            while (mp < match_limit && *mp == *ref)
+            {
+                mp++;
+                ref++;
+            }
+
+            op = put_sequence(op, anchor, ip - anchor, (unsigned int) (mp - ref), mp - ip);
+            ip = mp;
+            anchor = ip;
+            if (ip < mf_limit)  table[hash4(read32(ip - 2))] = ip - 2 - src;
+        }
+    }
+    op = put_sequence(op, anchor, end - anchor, 0, 0);
+    return op - dst;
+}
+
+static int decompress_block(const unsigned char* src, size_t len, unsigned char* dst, size_t cap, size_t* out_len)
+{
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + len;
+    unsigned char* op = dst;
+    unsigned char* oend = dst + cap;
+
+    for (;;)
+    {
+        size_t lit_len, match_len, offset;
+        unsigned int token;
+
+        if (ip >= iend)     return -1;
+        token = *ip++;
+
+        lit_len = token >> 4;
+        if (lit_len == 15)
+        {
+            unsigned int b;
+            do {
+                if (ip >= iend)     return -1;
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (lit_len > (size_t) (iend - ip) || lit_len > (size_t) (oend - op))
+            return -1;
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend)     break;
+
+        if (iend - ip < 2)  return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - dst))
+            return -1;
+
+        match_len = token & 15;
+        if (match_len == 15)
+        {
+            unsigned int b;
+            do {
+                if (ip >= iend)     return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += MIN_MATCH;
+        if (match_len > (size_t) (oend - op))
+            return -1;
+
+        if (offset >= match_len)
+            memcpy(op, op - offset, match_len);
+        else
+        {
+            // Overlapping copies repeat the last offset bytes
+            const unsigned char* ref = op - offset;
+            size_t i;
+            for (i = 0; i < match_len; i++)     op[i] = ref[i];
+        }
+        op += match_len;
+    }
+
+    *out_len = op - dst;
+    return 0;
+}
+
+size_t tw_lz4_compress_frame(const unsigned char* src, size_t len, unsigned char* dst)
+{
+    unsigned int* table;
+    unsigned char* op = dst;
+    size_t max_block;
+    int block_id = 4;
+
+    table = (unsigned int*) malloc(sizeof(unsigned int) << HASH_LOG);
+    if (!table)     return 0;
+
+    // The smallest block size that holds the whole input, up to 4MB
+    while (block_id < MAX_BLOCK_ID && ((size_t) 1 << (8 + 2 * block_id)) < len)
+        block_id++;
+    max_block = (size_t) 1 << (8 + 2 * block_id);
+
+    put_le32(op, LZ4_MAGIC);
+    op[4] = FLG_VERSION | FLG_BLOCK_INDEP;
+    op[5] = block_id << 4;
+    op[6] = (xxh32_small(op + 4, 2) >> 8) & 0xff;
+    op += 7;
+
+    while (len > 0)
+    {
+        size_t count = len > max_block ? max_block : len;
+        size_t clen = compress_block(src, count, op + 4, table);
+
+        if (clen >= count)
+        {
+            // Didn't shrink, so it's stored as it is
+            put_le32(op, count | 0x80000000U);
+            memcpy(op + 4, src, count);
+            clen = count;
+        }
+        else
+            put_le32(op, clen);
+        op += 4 + clen;
+        src += count;
+        len -= count;
+    }
+    put_le32(op, 0);
+    op += 4;
+
+    free(table);
+    return op - dst;
+}
+
+enum {
+    LZ4D_MAGIC,
+    LZ4D_DESCRIPTOR,
+    LZ4D_HEADER_REST,
+    LZ4D_SKIP_SIZE,
+    LZ4D_SKIP,
+    LZ4D_BLOCK_SIZE,
+    LZ4D_BLOCK,
+    LZ4D_BLOCK_CHECKSUM,
+    LZ4D_CONTENT_CHECKSUM,
+};
+
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    int state;
+
+    unsigned char header[16];
+    unsigned char descriptor[16];
+    size_t have;
+    size_t want;
+    unsigned int flags;
+    int in_frame;
+    unsigned long long skip;
+
+    unsigned char* in;
+    unsigned char* out;
+    size_t max_block;
+    size_t block_len;
+    size_t block_have;
+    int block_raw;
+    int error;
+} Lz4DecodeSink;
+
+static int decode_block(Lz4DecodeSink* ds)
+{
+    size_t out_len;
+
+    if (ds->block_raw)
+        return tw_sink_write(ds->next, ds->in, ds->block_len);
+
+    if (decompress_block(ds->in, ds->block_len, ds->out, ds->max_block, &out_len) != 0)
+    {
+        LOGE("LZ4 data is damaged\n");
+        return -1;
+    }
+    return tw_sink_write(ds->next, ds->out, out_len);
+}
+
+static void expect(Lz4DecodeSink* ds, int state, size_t want)
+{
+    ds->state = state;
+    ds->want = want;
+    ds->have = 0;
+}
+
+static int parse_header(Lz4DecodeSink* ds)
+{
+    unsigned int value;
+    int block_id;
+
+    switch (ds->state)
+    {
+    case LZ4D_MAGIC:
+        value = get_le32(ds->header);
+        if (value == LZ4_MAGIC)
+        {
+            ds->in_frame = 1;
+            expect(ds, LZ4D_DESCRIPTOR, 2);
+        }
+        else if ((value & 0xfffffff0U) == LZ4_SKIP_MAGIC)
+            expect(ds, LZ4D_SKIP_SIZE, 4);
+        else
+        {
+            LOGE("Not an LZ4 frame\n");
+            return -1;
+        }
+        return 0;
+
+    case LZ4D_DESCRIPTOR:
+        ds->flags = ds->header[0];
+        block_id = (ds->header[1] >> 4) & 7;
+        if ((ds->flags & 0xc0) != FLG_VERSION || block_id < 4)
+        {
+            LOGE("Invalid LZ4 frame header\n");
+            return -1;
+        }
+        // Linked blocks and dictionaries are never written by the backup
+        if (!(ds->flags & FLG_BLOCK_INDEP) || (ds->flags & FLG_DICT_ID))
+        {
+            LOGE("Unsupported LZ4 frame options\n");
+            return -1;
+        }
+        memcpy(ds->descriptor, ds->header, 2);
+
+        if (ds->max_block < ((size_t) 1 << (8 + 2 * block_id)))
+        {
+            ds->max_block = (size_t) 1 << (8 + 2 * block_id);
+            free(ds->in);
+            free(ds->out);
+            ds->in = (unsigned char*) malloc(ds->max_block);
+            ds->out = (unsigned char*) malloc(ds->max_block);
+            if (!ds->in || !ds->out)
+            {
+                LOGE("Out of memory while decompressing\n");
+                return -1;
+            }
+        }
+        expect(ds, LZ4D_HEADER_REST, (ds->flags & FLG_CONTENT_SIZE ? 8 : 0) + 1);
+        return 0;
+
+    case LZ4D_HEADER_REST:
+        memcpy(ds->descriptor + 2, ds->header, ds->want - 1);
+        if (((xxh32_small(ds->descriptor, ds->want + 1) >> 8) & 0xff) != ds->header[ds->want - 1])
+        {
+            LOGE("LZ4 frame header is damaged\n");
+            return -1;
+        }
+        expect(ds, LZ4D_BLOCK_SIZE, 4);
+        return 0;
+
+    case LZ4D_SKIP_SIZE:
+        ds->skip = get_le32(ds->header);
+        expect(ds, ds->skip ? LZ4D_SKIP : LZ4D_MAGIC, ds->skip ? 0 : 4);
+        return 0;
+
+    case LZ4D_BLOCK_SIZE:
+        value = get_le32(ds->header);
+        if (value == 0)
+        {
+            if (ds->flags & FLG_CONTENT_CHECKSUM)
+                expect(ds, LZ4D_CONTENT_CHECKSUM, 4);
+            else
+            {
+                ds->in_frame = 0;
+                expect(ds, LZ4D_MAGIC, 4);
+            }
+            return 0;
+        }
+        ds->block_raw = (value & 0x80000000U) != 0;
+        ds->block_len = value & 0x7fffffffU;
+        ds->block_have = 0;
+        if (ds->block_len > ds->max_block)
+        {
+            LOGE("LZ4 block is too large\n");
+            return -1;
+        }
+        expect(ds, LZ4D_BLOCK, 0);
+        return 0;
+
+    case LZ4D_BLOCK_CHECKSUM:
+        // The backup's MD5 covers the data already
+        if (decode_block(ds) != 0)  return -1;
+        expect(ds, LZ4D_BLOCK_SIZE, 4);
+        return 0;
+
+    case LZ4D_CONTENT_CHECKSUM:
+        ds->in_frame = 0;
+        expect(ds, LZ4D_MAGIC, 4);
+        return 0;
+    }
+    return -1;
+}
+
+static int lz4_decode_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    Lz4DecodeSink* ds = (Lz4DecodeSink*) sink;
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (ds->error)      return -1;
+    while (len > 0)
+    {
+        size_t count;
+
+        if (ds->state == LZ4D_SKIP)
+        {
+            count = len < ds->skip ? len : (size_t) ds->skip;
+            ds->skip -= count;
+            ptr += count;
+            len -= count;
+            if (ds->skip == 0)  expect(ds, LZ4D_MAGIC, 4);
+            continue;
+        }
+
+        if (ds->state == LZ4D_BLOCK)
+        {
+            count = ds->block_len - ds->block_have;
+            if (count > len)    count = len;
+            memcpy(ds->in + ds->block_have, ptr, count);
+            ds->block_have += count;
+            ptr += count;
+            len -= count;
+            if (ds->block_have < ds->block_len)     break;
+
+            if (ds->flags & FLG_BLOCK_CHECKSUM)
+                expect(ds, LZ4D_BLOCK_CHECKSUM, 4);
+            else if (decode_block(ds) != 0)
+                ds->error = -1;
+            else
+                expect(ds, LZ4D_BLOCK_SIZE, 4);
+            if (ds->error)  return -1;
+            continue;
+        }
+
+        count = ds->want - ds->have;
+        if (count > len)    count = len;
+        memcpy(ds->header + ds->have, ptr, count);
+        ds->have += count;
+        ptr += count;
+        len -= count;
+        if (ds->have < ds->want)    break;
+
+        if (parse_header(ds) != 0)
+        {
+            ds->error = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int lz4_decode_sink_close(TwSink* sink)
+{
+    Lz4DecodeSink* ds = (Lz4DecodeSink*) sink;
+    int ret = ds->error;
+
+    if (!ret && (ds->in_frame || ds->have || ds->state != LZ4D_MAGIC))
+    {
+        LOGE("LZ4 stream ended in the middle of a frame\n");
+        ret = -1;
+    }
+    if (tw_sink_close(ds->next) != 0)   ret = -1;
+
+    free(ds->in);
+    free(ds->out);
+    free(ds);
+    return ret;
+}
+
+TwSink* tw_lz4_decode_sink_open(TwSink* next)
+{
+    Lz4DecodeSink* ds = (Lz4DecodeSink*) calloc(1, sizeof(Lz4DecodeSink));
+
+    if (!ds)            return NULL;
+    ds->next = next;
+    expect(ds, LZ4D_MAGIC, 4);
+    ds->sink.write = lz4_decode_sink_write;
+    ds->sink.close = lz4_decode_sink_close;
+    return &ds->sink;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_LZ4_HEADER
+#define _TW_LZ4_HEADER
+
+#include "tw_sink.h"
+
+// Room needed for tw_lz4_compress_frame's output
+#define TW_LZ4_FRAME_BOUND(len)     ((len) + (len) / 255 + ((len) >> 22) * 24 + 64)
+
+// Returns 1 if data starts with an LZ4 frame
+int tw_lz4_check(const void* data, size_t len);
+
+// Compresses src into one complete LZ4 frame at dst and returns its size.
+// Frames can be concatenated, "lz4 -d" reads them back as one stream.
+size_t tw_lz4_compress_frame(const unsigned char* src, size_t len, unsigned char* dst);
+
+// Decodes a stream of LZ4 frames and writes the data to next
+TwSink* tw_lz4_decode_sink_open(TwSink* next);
+
+#endif  // _TW_LZ4_HEADER
@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* MTD images read and written in-process through mtdutils, in place of
+** dump_image and flash_image.
+**
+** Reading NAND is slow and so is compressing, so the two overlap: a reader
+** thread fills a few erase block sized slots while the calling thread hands
+** the ones before to the sink chain.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "mtdutils/mtdutils.h"
+#include "tw_mtd.h"
+
+// Erase blocks read ahead of the sink chain
+#define MTD_READAHEAD       4
+
+// Bytes compared with the partition before anything is written, as flash_image did
+#define MTD_HEADER_SIZE     2048
+
+typedef struct {
+    MtdReadContext* in;
+    size_t block;
+    char* slots[MTD_READAHEAD];
+    ssize_t lens[MTD_READAHEAD];
+    int head;
+    int queued;
+    int done;                       // the reader is at the end, or failed
+    int stop;                       // the sink failed, the reader should give up
+    int error;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} MtdReader;
+
+static const MtdPartition* find_partition(const char* name)
+{
+    const MtdPartition* partition;
+
+    if (mtd_scan_partitions() <= 0)
+    {
+        LOGE("Unable to scan the MTD partitions\n");
+        return NULL;
+    }
+    partition = mtd_find_partition_by_name(name);
+    if (!partition)     LOGE("Unable to find MTD partition %s\n", name);
+    return partition;
+}
+
+static void* reader_thread(void* cookie)
+{
+    MtdReader* mr = (MtdReader*) cookie;
+
+    pthread_mutex_lock(&mr->lock);
+    for (;;)
+    {
+        int slot;
+        ssize_t len;
+
+        while (mr->queued == MTD_READAHEAD && !mr->stop)
+            pthread_cond_wait(&mr->cond, &mr->lock);
+        if (mr->stop)   break;
+
+        // The slot after the queued ones is ours until it's queued
+        slot = (mr->head + mr->queued) % MTD_READAHEAD;
+        pthread_mutex_unlock(&mr->lock);
+        len = mtd_read_data(mr->in, mr->slots[slot], mr->block);
+        pthread_mutex_lock(&mr->lock);
+
+        if (len <= 0)
+        {
+            // mtdutils runs out of good blocks at the end of the partition
+            if (len < 0 && errno != ENOSPC)
+            {
+                LOGE("Unable to read MTD partition (errno=%d)\n", errno);
+                mr->error = -1;
+            }
+            break;
+        }
+        mr->lens[slot] = len;
+        mr->queued++;
+        pthread_cond_broadcast(&mr->cond);
+    }
+    mr->done = 1;
+    pthread_cond_broadcast(&mr->cond);
+    pthread_mutex_unlock(&mr->lock);
+    return NULL;
+}
+
+int tw_mtd_read(const char* name, TwSink* out, TwMtdProgressFn progress, void* cookie)
+{
+    const MtdPartition* partition = find_partition(name);
+    unsigned long long bytes = 0;
+    MtdReader mr;
+    pthread_t thread;
+    size_t block;
+    int i, ret = 0;
+
+    if (!partition)     return -1;
+    if (mtd_partition_info(partition, NULL, &block, NULL) != 0)
+    {
+        LOGE("Unable to get the block size of %s\n", name);
+        return -1;
+    }
+
+    memset(&mr, 0, sizeof(mr));
+    mr.block = block;
+    for (i = 0; i < MTD_READAHEAD; i++)
+    {
+        mr.slots[i] = (char*) malloc(block);
+        if (!mr.slots[i])   ret = -1;
+    }
+    mr.in = ret == 0 ? mtd_read_partition(partition) : NULL;
+    if (!mr.in)
+    {
+        LOGE("Unable to open MTD partition %s (errno=%d)\n", name, errno);
+        for (i = 0; i < MTD_READAHEAD; i++)
+            free(mr.slots[i]);
+        return -1;
+    }
+    pthread_mutex_init(&mr.lock, NULL);
+    pthread_cond_init(&mr.cond, NULL);
+
+    if (pthread_create(&thread, NULL, reader_thread, &mr) != 0)
+    {
+        LOGE("Unable to start reading %s\n", name);
+        ret = -1;
+    }
+    else
+    {
+        pthread_mutex_lock(&mr.lock);
+        for (;;)
+        {
+            int slot;
+
+            while (!mr.queued && !mr.done)
+                pthread_cond_wait(&mr.cond, &mr.lock);
+            if (!mr.queued)     break;
+
+            slot = mr.head;
+            pthread_mutex_unlock(&mr.lock);
+            ret = tw_sink_write(out, mr.slots[slot], mr.lens[slot]);
+            bytes += mr.lens[slot];
+            if (ret == 0 && progress)   progress(bytes, cookie);
+            pthread_mutex_lock(&mr.lock);
+
+            if (ret != 0)
+            {
+                mr.stop = 1;
+                pthread_cond_broadcast(&mr.cond);
+                break;
+            }
+            mr.head = (mr.head + 1) % MTD_READAHEAD;
+            mr.queued--;
+            pthread_cond_broadcast(&mr.cond);
+        }
+        pthread_mutex_unlock(&mr.lock);
+        pthread_join(thread, NULL);
+        if (mr.error)   ret = -1;
+    }
+
+    mtd_read_close(mr.in);
+    for (i = 0; i < MTD_READAHEAD; i++)
+        free(mr.slots[i]);
+    pthread_cond_destroy(&mr.cond);
+    pthread_mutex_destroy(&mr.lock);
+    return ret;
+}
+
+typedef struct {
+    TwSink sink;
+    const MtdPartition* partition;
+    MtdWriteContext* out;
+    size_t block;
+    char* first;                    // the first erase block, held back until the rest is written
+    size_t first_len;
+    int same;                       // the header is there already, nothing gets written
+    int error;
+} MtdSink;
+
+// Checks whether the partition starts with the header of the image already
+static int same_header(MtdSink* ms)
+{
+    char check[MTD_HEADER_SIZE];
+    size_t len = ms->first_len < sizeof(check) ? ms->first_len : sizeof(check);
+    MtdReadContext* in = mtd_read_partition(ms->partition);
+    int same = 0;
+
+    // An unreadable partition just gets written
+    if (!in)            return 0;
+    if (mtd_read_data(in, check, len) == (ssize_t) len && memcmp(check, ms->first, len) == 0)
+        same = 1;
+    mtd_read_close(in);
+    return same;
+}
+
+// Writes a blank in place of the first block and opens the way for the rest
+static int start_writing(MtdSink* ms)
+{
+    char* blank;
+    int ret = 0;
+
+    if (same_header(ms))
+    {
+        LOGI("Header is the same, not flashing the partition\n");
+        ms->same = 1;
+        return 0;
+    }
+
+    ms->out = mtd_write_partition(ms->partition);
+    blank = (char*) calloc(1, ms->block);
+    if (!ms->out || !blank || mtd_write_data(ms->out, blank, ms->first_len) != (ssize_t) ms->first_len)
+    {
+        LOGE("Unable to write MTD partition (errno=%d)\n", errno);
+        ret = -1;
+    }
+    free(blank);
+    return ret;
+}
+
+static int mtd_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    MtdSink* ms = (MtdSink*) sink;
+    const char* ptr = (const char*) data;
+
+    if (ms->error)      return -1;
+    if (ms->first_len < ms->block)
+    {
+        size_t count = ms->block - ms->first_len;
+
+        if (count > len)    count = len;
+        memcpy(ms->first + ms->first_len, ptr, count);
+        ms->first_len += count;
+        ptr += count;
+        len -= count;
+        if (ms->first_len < ms->block)  return 0;
+        if (start_writing(ms) != 0)
+        {
+            ms->error = -1;
+            return -1;
+        }
+    }
+
+    if (ms->same || !len)   return 0;
+    if (mtd_write_data(ms->out, ptr, len) != (ssize_t) len)
+    {
+        LOGE("Unable to write MTD partition (errno=%d)\n", errno);
+        ms->error = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int mtd_sink_close(TwSink* sink)
+{
+    MtdSink* ms = (MtdSink*) sink;
+    int ret = ms->error;
+
+    // An image smaller than a block never got started
+    if (!ret && ms->first_len < ms->block && (!ms->first_len || start_writing(ms) != 0))
+        ret = -1;
+    if (ms->out && mtd_write_close(ms->out) != 0)    ret = -1;
+    ms->out = NULL;
+
+    // Now that the rest is there, the header makes the partition whole
+    if (!ret && !ms->same)
+    {
+        ms->out = mtd_write_partition(ms->partition);
+        if (!ms->out || mtd_write_data(ms->out, ms->first, ms->first_len) != (ssize_t) ms->first_len)
+            ret = -1;
+        if (ms->out && mtd_write_close(ms->out) != 0)    ret = -1;
+        if (ret != 0)   LOGE("Unable to write the first block of the MTD partition (errno=%d)\n", errno);
+    }
+
+    free(ms->first);
+    free(ms);
+    return ret;
+}
+
+void tw_mtd_sink_abort(TwSink* sink)
+{
+    MtdSink* ms = (MtdSink*) sink;
+
+    ms->error = -1;
+}
+
+TwSink* tw_mtd_sink_open(const char* name)
+{
+    const MtdPartition* partition = find_partition(name);
+    MtdSink* ms;
+    size_t block;
+
+    if (!partition)     return NULL;
+    if (mtd_partition_info(partition, NULL, &block, NULL) != 0)
+    {
+        LOGE("Unable to get the block size of %s\n", name);
+        return NULL;
+    }
+
+    ms = (MtdSink*) calloc(1, sizeof(MtdSink));
+    if (!ms)            return NULL;
+    ms->first = (char*) malloc(block);
+    if (!ms->first)
+    {
+        free(ms);
+        return NULL;
+    }
+    ms->partition = partition;
+    ms->block = block;
+    ms->sink.write = mtd_sink_write;
+    ms->sink.close = mtd_sink_close;
+    return &ms->sink;
+}
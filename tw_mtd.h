@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_MTD_HEADER
+#define _TW_MTD_HEADER
+
+#include "tw_sink.h"
+
+// Called on the calling thread with the bytes read so far
+typedef void (*TwMtdProgressFn)(unsigned long long bytes, void* cookie);
+
+// Reads the good blocks of the MTD partition name, eg. "boot", into out.
+// Bad blocks and blocks that fail ECC are left out, like dump_image did.
+// A thread keeps the next erase blocks coming while out works on the last
+// one. Returns 0 on success.
+int tw_mtd_read(const char* name, TwSink* out, TwMtdProgressFn progress, void* cookie);
+
+// Writes the stream to the MTD partition name, stepping over bad blocks.
+// Like flash_image, the first erase block is written last, so a partition
+// that's cut short doesn't look bootable, and nothing is written when the
+// header is the same already.
+TwSink* tw_mtd_sink_open(const char* name);
+
+// Keeps close from writing the first block, for a stream that didn't come
+// out whole. The partition is left without a valid header.
+void tw_mtd_sink_abort(TwSink* sink);
+
+#endif  // _TW_MTD_HEADER
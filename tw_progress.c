@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Throughput bookkeeping for the backup and restore progress bars. The
+** rates are measured per partition and per kind of work, so the first
+** estimate of a run is as good as the last one.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tw_progress.h"
+
+// Finds "key=" at the start of an entry, returns the start of the entry or NULL
+static const char* find_entry(const char* history, const char* key)
+{
+    size_t len = strlen(key);
+    const char* ptr = history;
+
+    while (ptr && *ptr)
+    {
+        if (strncmp(ptr, key, len) == 0 && ptr[len] == '=')
+            return ptr;
+        ptr = strchr(ptr, ';');
+        if (ptr)    ptr++;
+    }
+    return NULL;
+}
+
+unsigned long tw_rate_get(const char* history, const char* key)
+{
+    const char* entry = history ? find_entry(history, key) : NULL;
+
+    if (!entry)     return 0;
+    return strtoul(entry + strlen(key) + 1, NULL, 10);
+}
+
+void tw_rate_put(char* history, size_t size, const char* key, unsigned long bps)
+{
+    char* entry;
+    char add[128];
+    unsigned long old;
+
+    if (bps == 0 || strchr(key, ';') || strchr(key, '='))    return;
+
+    old = tw_rate_get(history, key);
+    if (old)    bps = (unsigned long) (((unsigned long long) old * 3 + bps) / 4);
+
+    // The entry moves to the end, so the ones dropped first are the ones used least recently
+    entry = (char*) find_entry(history, key);
+    if (entry)
+    {
+        char* next = strchr(entry, ';');
+
+        if (next)   memmove(entry, next + 1, strlen(next + 1) + 1);
+        else        *entry = '\0';
+    }
+
+    snprintf(add, sizeof(add), "%s=%lu", key, bps);
+    while (history[0] && strlen(history) + strlen(add) + 2 > size)
+    {
+        char* next = strchr(history, ';');
+
+        if (next)   memmove(history, next + 1, strlen(next + 1) + 1);
+        else        history[0] = '\0';
+    }
+    if (strlen(add) + 1 > size)     return;
+
+    // Drop a trailing separator left by the removals
+    if (history[0] && history[strlen(history) - 1] == ';')
+        history[strlen(history) - 1] = '\0';
+    if (history[0])     strcat(history, ";");
+    strcat(history, add);
+}
+
+unsigned long tw_rate_of(unsigned long long bytes, unsigned long msec)
+{
+    if (!bytes || !msec)    return 0;
+    return (unsigned long) (bytes * 1000 / msec);
+}
+
+unsigned long tw_rate_msec(unsigned long long bytes, unsigned long bps)
+{
+    return (unsigned long) (bytes * 1000 / bps);
+}
+
+void tw_eta_format(unsigned long seconds, char* out, size_t len)
+{
+    if (seconds >= 3600)
+        snprintf(out, len, "%lu:%02lu:%02lu", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+    else
+        snprintf(out, len, "%lu:%02lu", seconds / 60, seconds % 60);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_PROGRESS_HEADER
+#define _TW_PROGRESS_HEADER
+
+#include <stddef.h>
+
+// Room for a throughput history, DataManager keeps values of up to 511 bytes
+#define TW_RATE_HISTORY_SIZE    480
+
+// A throughput history is a string of "key=bytes per second" entries split
+// by ';', one per kind of work, eg. "data.lz4=5242880;boot.image=20971520".
+// It's kept in DataManager, so the estimates survive a reboot.
+
+// Returns the rate recorded for key, 0 if there is none
+unsigned long tw_rate_get(const char* history, const char* key);
+
+// Blends a new measurement into the rate for key, 3:1 in favour of the
+// history. The oldest entries are dropped when history would outgrow size.
+void tw_rate_put(char* history, size_t size, const char* key, unsigned long bps);
+
+// Bytes per second from a byte count and the milliseconds it took, 0 if either is 0
+unsigned long tw_rate_of(unsigned long long bytes, unsigned long msec);
+
+// Milliseconds bytes should take at bps, which must not be 0
+unsigned long tw_rate_msec(unsigned long long bytes, unsigned long bps);
+
+// Writes seconds as "m:ss", or "h:mm:ss" past an hour
+void tw_eta_format(unsigned long seconds, char* out, size_t len);
+
+#endif  // _TW_PROGRESS_HEADER
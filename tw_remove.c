@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Tree deletion for wipes.
+**
+** Every folder is a task. A worker lists it, unlinks the files with
+** unlinkat on the open folder and queues the subfolders for whichever
+** worker is free, so a wide tree like /data/data is emptied by several
+** threads at once. A folder is removed when the last of its subfolders is
+** done. One that holds an excluded folder is left in place, and so is
+** every folder above it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "tw_remove.h"
+#include "tw_archive.h"
+#include "tw_usage.h"
+
+#define MAX_WORKERS     8
+
+typedef struct Folder {
+    struct Folder* parent;
+    struct Folder* next;            // in the queue
+    char* path;
+    int pending;                    // the listing plus each subfolder not yet done
+    int keep;                       // holds something excluded
+} Folder;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Folder* queue;
+    Folder* root;
+    int remove_root;
+    int outstanding;                // folders not yet done
+    const char* const* excludes;
+    unsigned int errors;
+} RemoveJob;
+
+static int is_excluded(const RemoveJob* job, const char* path)
+{
+    const char* const* ex;
+
+    for (ex = job->excludes; ex && *ex; ex++)
+        if (strcmp(*ex, path) == 0)     return 1;
+    return 0;
+}
+
+static Folder* new_folder(Folder* parent, const char* path, const char* name)
+{
+    Folder* folder = (Folder*) calloc(1, sizeof(Folder));
+
+    if (!folder)    return NULL;
+    folder->path = (char*) malloc(strlen(path) + (name ? strlen(name) + 2 : 1));
+    if (!folder->path)
+    {
+        free(folder);
+        return NULL;
+    }
+    if (name)   sprintf(folder->path, "%s/%s", path, name);
+    else        strcpy(folder->path, path);
+    folder->parent = parent;
+    folder->pending = 1;
+    return folder;
+}
+
+/* Drops one reference to a folder. The last one removes it and passes the
+** same on to its parent. Called with the lock held.
+*/
+static void release(RemoveJob* job, Folder* folder)
+{
+    while (folder && --folder->pending == 0)
+    {
+        Folder* parent = folder->parent;
+
+        if (!folder->keep && (folder != job->root || job->remove_root))
+        {
+            pthread_mutex_unlock(&job->lock);
+            if (rmdir(folder->path) != 0 && errno != ENOENT)
+            {
+                LOGE("Unable to remove %s (errno=%d)\n", folder->path, errno);
+                pthread_mutex_lock(&job->lock);
+                job->errors++;
+            }
+            else
+                pthread_mutex_lock(&job->lock);
+        }
+        if (folder->keep && parent)     parent->keep = 1;
+
+        free(folder->path);
+        free(folder);
+        if (--job->outstanding == 0)
+            pthread_cond_broadcast(&job->cond);
+        folder = parent;
+    }
+}
+
+static void empty_folder(RemoveJob* job, Folder* folder)
+{
+    struct dirent* de;
+    unsigned int errors = 0;
+    DIR* d;
+    int fd;
+
+    fd = open(folder->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d)
+    {
+        LOGE("Unable to open %s (errno=%d)\n", folder->path, errno);
+        if (fd >= 0)    close(fd);
+        pthread_mutex_lock(&job->lock);
+        job->errors++;
+        folder->keep = 1;
+        release(job, folder);
+        pthread_mutex_unlock(&job->lock);
+        return;
+    }
+
+    while ((de = readdir(d)) != NULL)
+    {
+        Folder* sub;
+        int isdir;
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)     continue;
+
+        if (de->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            isdir = fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        else
+            isdir = de->d_type == DT_DIR;
+
+        if (!isdir)
+        {
+            if (unlinkat(fd, de->d_name, 0) != 0 && errno != ENOENT)
+            {
+                LOGE("Unable to remove %s/%s (errno=%d)\n", folder->path, de->d_name, errno);
+                errors++;
+            }
+            continue;
+        }
+
+        sub = new_folder(folder, folder->path, de->d_name);
+        pthread_mutex_lock(&job->lock);
+        if (!sub)
+        {
+            job->errors++;
+            folder->keep = 1;
+        }
+        else if (is_excluded(job, sub->path))
+        {
+            folder->keep = 1;
+            free(sub->path);
+            free(sub);
+        }
+        else
+        {
+            folder->pending++;
+            job->outstanding++;
+            sub->next = job->queue;
+            job->queue = sub;
+            pthread_cond_signal(&job->cond);
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+    closedir(d);
+
+    pthread_mutex_lock(&job->lock);
+    job->errors += errors;
+    release(job, folder);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void* remove_thread(void* cookie)
+{
+    RemoveJob* job = (RemoveJob*) cookie;
+
+    pthread_mutex_lock(&job->lock);
+    for (;;)
+    {
+        Folder* folder;
+
+        while (!job->queue && job->outstanding > 0)
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (!job->queue)
+            break;
+
+        // Newest first keeps the walk depth first and the queue short
+        folder = job->queue;
+        job->queue = folder->next;
+        pthread_mutex_unlock(&job->lock);
+
+        empty_folder(job, folder);
+
+        pthread_mutex_lock(&job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static int remove_folder(const char* path, int remove_root, const char* const* excludes)
+{
+    pthread_t threads[MAX_WORKERS];
+    RemoveJob job;
+    int count, i;
+
+    memset(&job, 0, sizeof(job));
+    job.root = new_folder(NULL, path, NULL);
+    if (!job.root)  return -1;
+    job.remove_root = remove_root;
+    job.excludes = excludes;
+    job.queue = job.root;
+    job.outstanding = 1;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    // Deleting mostly waits on the file system, so a few more than the CPUs
+    count = tw_get_cpu_count() * 2;
+    if (count > MAX_WORKERS)    count = MAX_WORKERS;
+    for (i = 0; i < count; i++)
+        if (pthread_create(&threads[i], NULL, remove_thread, &job) != 0)
+            break;
+    count = i;
+
+    // Without threads this one does all the work
+    if (count == 0)     remove_thread(&job);
+    for (i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    tw_usage_invalidate(path);
+    if (job.errors)
+        LOGE("%u entries could not be removed from %s\n", job.errors, path);
+    return job.errors ? -1 : 0;
+}
+
+int tw_remove_contents(const char* path, const char* const* excludes)
+{
+    struct stat st;
+
+    if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        LOGE("Unable to wipe %s, it isn't a folder\n", path);
+        return -1;
+    }
+    return remove_folder(path, 0, excludes);
+}
+
+int tw_remove_tree(const char* path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT ? 0 : -1;
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path) == 0 ? 0 : -1;
+    return remove_folder(path, 1, NULL);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_REMOVE_HEADER
+#define _TW_REMOVE_HEADER
+
+// Where the internal sdcard lives on devices without a separate one
+#define TW_DATA_MEDIA       "/data/media"
+
+// Deletes everything inside path, like "rm -rf path/* path/.*", leaving path
+// itself in place. Folders named in excludes (full paths, NULL terminated,
+// may be NULL) are kept along with everything in them. Returns 0 on success,
+// -1 if anything could not be removed.
+int tw_remove_contents(const char* path, const char* const* excludes);
+
+// Deletes path and everything below it, like "rm -rf path". A path that
+// doesn't exist is not an error.
+int tw_remove_tree(const char* path);
+
+#endif  // _TW_REMOVE_HEADER
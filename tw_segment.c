@@ -0,0 +1,546 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Backup files split in segments, so a backup fits on a vfat sdcard.
+**
+** Each segment has a writer thread that hashes and writes what the backup
+** thread queues for it. At a segment boundary the backup thread moves on to
+** a new segment right away, and the old one flushes and closes behind it.
+** At most two segments are open at a time. Every segment gets a digest of
+** its own, which lets each one be checked on its own (with md5sum, for MD5).
+**
+** A resumed backup has its first segments on disk already. The archive is
+** made again from the start, but up to the end of those segments it's only
+** hashed, and the digests have to match the ones recorded at the time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "tw_segment.h"
+
+#define SEGMENT_BUFFER      (1024 * 1024)
+#define SEGMENT_SLOTS       4
+
+typedef struct {
+    int index;
+    int fd;                         // -1 while checking a segment that's on disk
+    TwDigestType digest;
+    int sync;                       // on disk before it's reported
+    TwDigestContext ctx;
+    TwSegmentInfo info;
+    const TwSegmentInfo* expect;    // what's on disk, for a segment that's only checked
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char* slots[SEGMENT_SLOTS];
+    size_t lens[SEGMENT_SLOTS];
+    int head;
+    int queued;
+    size_t fill;                    // bytes in the slot after the queued ones
+    int closing;
+    int error;
+} Segment;
+
+typedef struct {
+    TwSink sink;
+    char filename[PATH_MAX];
+    unsigned long long limit;
+    TwDigestType digest;
+    TwSegmentStats* stats;
+    const TwSegmentStats* done;
+    TwSegmentFn cb;
+    void* cookie;
+    int changed;
+
+    Segment* current;
+    Segment* flushing;              // the one before, still being written
+    TwSegmentInfo* infos;
+    int count;
+    int alloc;
+    int error;
+} SegmentSink;
+
+void tw_segment_name(const char* filename, int index, char* name, size_t len)
+{
+    if (index == 0)     snprintf(name, len, "%s", filename);
+    else                snprintf(name, len, "%s%03d", filename, index);
+}
+
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = write(fd, data, len);
+        if (ret < 0)
+        {
+            if (errno == EINTR)     continue;
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void* segment_thread(void* cookie)
+{
+    Segment* seg = (Segment*) cookie;
+
+    pthread_mutex_lock(&seg->lock);
+    for (;;)
+    {
+        char* data;
+        size_t len;
+
+        while (!seg->queued && !seg->closing)
+            pthread_cond_wait(&seg->cond, &seg->lock);
+        if (!seg->queued)   break;
+
+        data = seg->slots[seg->head];
+        len = seg->lens[seg->head];
+        pthread_mutex_unlock(&seg->lock);
+
+        if (!seg->error)
+        {
+            if (seg->digest)    tw_digest_update(&seg->ctx, data, len);
+            if (seg->fd >= 0 && write_all(seg->fd, data, len) != 0)
+            {
+                LOGE("Unable to write backup data (errno=%d)\n", errno);
+                seg->error = -1;
+            }
+        }
+
+        pthread_mutex_lock(&seg->lock);
+        seg->head = (seg->head + 1) % SEGMENT_SLOTS;
+        seg->queued--;
+        pthread_cond_broadcast(&seg->cond);
+    }
+    pthread_mutex_unlock(&seg->lock);
+
+    if (seg->sync && fsync(seg->fd) != 0 && !seg->error)
+    {
+        LOGE("Unable to write backup data (errno=%d)\n", errno);
+        seg->error = -1;
+    }
+    if (seg->fd >= 0 && close(seg->fd) != 0 && !seg->error)
+    {
+        LOGE("Unable to write backup data (errno=%d)\n", errno);
+        seg->error = -1;
+    }
+    if (seg->digest)    tw_digest_final(&seg->ctx, seg->info.digest);
+    return NULL;
+}
+
+static void free_segment(Segment* seg)
+{
+    int i;
+
+    for (i = 0; i < SEGMENT_SLOTS; i++)
+        free(seg->slots[i]);
+    pthread_cond_destroy(&seg->cond);
+    pthread_mutex_destroy(&seg->lock);
+    free(seg);
+}
+
+static Segment* start_segment(SegmentSink* ss)
+{
+    Segment* seg;
+    char name[PATH_MAX];
+    int i, missing = 0;
+
+    if (ss->count > TW_SEGMENT_MAX)
+    {
+        LOGE("%s needs more than %d segments\n", ss->filename, TW_SEGMENT_MAX);
+        return NULL;
+    }
+    seg = (Segment*) calloc(1, sizeof(Segment));
+    if (!seg)           return NULL;
+
+    pthread_mutex_init(&seg->lock, NULL);
+    pthread_cond_init(&seg->cond, NULL);
+    for (i = 0; i < SEGMENT_SLOTS; i++)
+    {
+        seg->slots[i] = (char*) malloc(SEGMENT_BUFFER);
+        if (!seg->slots[i])     missing = 1;
+    }
+    if (missing)
+    {
+        LOGE("Out of memory for the segments of %s\n", ss->filename);
+        free_segment(seg);
+        return NULL;
+    }
+    seg->index = ss->count;
+    // Segments that are checked or reported need a digest, a fast one does if none was asked for
+    seg->digest = ss->digest;
+    if (ss->done && seg->index < ss->done->count)
+        seg->expect = &ss->done->segments[seg->index];
+    else if (ss->cb)
+        seg->sync = 1;
+    if (!seg->digest && (seg->expect || seg->sync))
+        seg->digest = TW_DIGEST_CRC32C;
+    if (seg->digest)    tw_digest_init(&seg->ctx, seg->digest);
+
+    tw_segment_name(ss->filename, seg->index, name, sizeof(name));
+    seg->fd = -1;
+    if (seg->expect)
+    {
+        struct stat st;
+
+        if (stat(name, &st) != 0 || (unsigned long long) st.st_size != seg->expect->size)
+        {
+            LOGE("%s isn't there the way the checkpoint has it\n", name);
+            ss->changed = 1;
+            free_segment(seg);
+            return NULL;
+        }
+    }
+    else
+    {
+        seg->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (seg->fd < 0)
+            LOGE("Unable to create %s (errno=%d)\n", name, errno);
+    }
+
+    if ((!seg->expect && seg->fd < 0) || pthread_create(&seg->thread, NULL, segment_thread, seg) != 0)
+    {
+        if (seg->fd >= 0)   close(seg->fd);
+        free_segment(seg);
+        return NULL;
+    }
+    ss->count++;
+    return seg;
+}
+
+// Hands the slot being filled to the writer
+static void submit_fill(Segment* seg)
+{
+    if (!seg->fill)     return;
+    pthread_mutex_lock(&seg->lock);
+    seg->lens[(seg->head + seg->queued) % SEGMENT_SLOTS] = seg->fill;
+    seg->queued++;
+    seg->fill = 0;
+    pthread_cond_broadcast(&seg->cond);
+    pthread_mutex_unlock(&seg->lock);
+}
+
+static int put_data(Segment* seg, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t count;
+        char* slot;
+
+        // The slot after the queued ones is ours as long as it isn't queued
+        pthread_mutex_lock(&seg->lock);
+        while (seg->queued == SEGMENT_SLOTS)
+            pthread_cond_wait(&seg->cond, &seg->lock);
+        slot = seg->slots[(seg->head + seg->queued) % SEGMENT_SLOTS];
+        pthread_mutex_unlock(&seg->lock);
+        if (seg->error)     return -1;
+
+        count = SEGMENT_BUFFER - seg->fill;
+        if (count > len)    count = len;
+        memcpy(slot + seg->fill, data, count);
+        seg->fill += count;
+        seg->info.size += count;
+        data += count;
+        len -= count;
+        if (seg->fill == SEGMENT_BUFFER)    submit_fill(seg);
+    }
+    return 0;
+}
+
+// Waits for a segment's writer and records the result
+static int finish_segment(SegmentSink* ss, Segment* seg)
+{
+    int ret;
+
+    if (!seg)           return 0;
+    pthread_join(seg->thread, NULL);
+    ret = seg->error;
+
+    if (ss->alloc <= seg->index)
+    {
+        int alloc = ss->alloc ? ss->alloc * 2 : 4;
+        TwSegmentInfo* infos;
+
+        while (alloc <= seg->index)     alloc *= 2;
+        infos = (TwSegmentInfo*) realloc(ss->infos, alloc * sizeof(TwSegmentInfo));
+        if (infos)
+        {
+            ss->infos = infos;
+            ss->alloc = alloc;
+        }
+        else
+            ret = -1;
+    }
+    if (ss->alloc > seg->index)     ss->infos[seg->index] = seg->info;
+
+    if (seg->expect && (seg->info.size != seg->expect->size || memcmp(seg->info.digest, seg->expect->digest, TW_DIGEST_MAX_SIZE) != 0))
+    {
+        char name[PATH_MAX];
+
+        tw_segment_name(ss->filename, seg->index, name, sizeof(name));
+        if (!ss->changed)   LOGE("%s doesn't match what the backup would write now\n", name);
+        ss->changed = 1;
+        ret = -1;
+    }
+    else if (ret == 0 && !seg->expect && !ss->changed && ss->cb)
+        ss->cb(seg->index, &seg->info, ss->cookie);
+    free_segment(seg);
+    return ret;
+}
+
+// Lets the current segment flush on its own, once the one before it is done
+static int end_segment(SegmentSink* ss)
+{
+    Segment* seg = ss->current;
+    int ret;
+
+    submit_fill(seg);
+    pthread_mutex_lock(&seg->lock);
+    seg->closing = 1;
+    pthread_cond_broadcast(&seg->cond);
+    pthread_mutex_unlock(&seg->lock);
+
+    ret = finish_segment(ss, ss->flushing);
+    ss->flushing = seg;
+    ss->current = NULL;
+    return ret;
+}
+
+static int segment_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    SegmentSink* ss = (SegmentSink*) sink;
+    const char* ptr = (const char*) data;
+
+    if (ss->error)      return -1;
+    while (len > 0)
+    {
+        size_t count = len;
+
+        if (!ss->current)
+        {
+            ss->current = start_segment(ss);
+            if (!ss->current)
+            {
+                ss->error = -1;
+                return -1;
+            }
+        }
+        if (ss->limit && ss->limit - ss->current->info.size < count)
+            count = (size_t) (ss->limit - ss->current->info.size);
+
+        if (put_data(ss->current, ptr, count) != 0)
+        {
+            ss->error = -1;
+            return -1;
+        }
+        ptr += count;
+        len -= count;
+
+        if (ss->limit && ss->current->info.size == ss->limit && end_segment(ss) != 0)
+        {
+            ss->error = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int segment_sink_close(TwSink* sink)
+{
+    SegmentSink* ss = (SegmentSink*) sink;
+    int ret = ss->error;
+    int i;
+
+    if (ss->current && end_segment(ss) != 0)    ret = -1;
+    if (finish_segment(ss, ss->flushing) != 0)  ret = -1;
+
+    // A file that used to have more segments mustn't keep the extra ones around.
+    // Left as they are on failure, a checkpoint may still count on them.
+    for (i = ss->count; ret == 0 && i <= TW_SEGMENT_MAX; i++)
+    {
+        char name[PATH_MAX];
+
+        tw_segment_name(ss->filename, i, name, sizeof(name));
+        if (unlink(name) != 0)  break;
+        tw_digest_remove(name);
+    }
+
+    if (ss->stats)
+    {
+        ss->stats->count = ss->count;
+        ss->stats->segments = ss->infos;
+        ss->stats->resumed = ss->done ? ss->done->count : 0;
+        ss->stats->changed = ss->changed;
+    }
+    else
+        free(ss->infos);
+    free(ss);
+    return ret;
+}
+
+TwSink* tw_segment_sink_open(const char* filename, unsigned long long limit, TwDigestType digest, TwSegmentStats* stats)
+{
+    return tw_segment_sink_resume(filename, limit, digest, NULL, NULL, NULL, stats);
+}
+
+TwSink* tw_segment_sink_resume(const char* filename, unsigned long long limit, TwDigestType digest, const TwSegmentStats* done,
+                               TwSegmentFn cb, void* cookie, TwSegmentStats* stats)
+{
+    SegmentSink* ss = (SegmentSink*) calloc(1, sizeof(SegmentSink));
+
+    if (!ss)            return NULL;
+    snprintf(ss->filename, sizeof(ss->filename), "%s", filename);
+    ss->limit = limit;
+    ss->digest = digest;
+    ss->stats = stats;
+    ss->done = done && done->count ? done : NULL;
+    ss->cb = cb;
+    ss->cookie = cookie;
+    if (stats)          memset(stats, 0, sizeof(*stats));
+
+    // The first segment is there even for an empty stream
+    ss->current = start_segment(ss);
+    if (!ss->current)
+    {
+        free(ss);
+        return NULL;
+    }
+
+    ss->sink.write = segment_sink_write;
+    ss->sink.close = segment_sink_close;
+    return &ss->sink;
+}
+
+int tw_segments_open(const char* filename, TwSegments* segs)
+{
+    int alloc = 4;
+
+    memset(segs, 0, sizeof(*segs));
+    segs->fds = (int*) malloc(alloc * sizeof(int));
+    segs->starts = (unsigned long long*) malloc((alloc + 1) * sizeof(unsigned long long));
+    if (!segs->fds || !segs->starts)
+    {
+        tw_segments_close(segs);
+        return -1;
+    }
+    segs->starts[0] = 0;
+
+    for (;;)
+    {
+        char name[PATH_MAX];
+        struct stat st;
+        int fd;
+
+        tw_segment_name(filename, segs->count, name, sizeof(name));
+        fd = open(name, O_RDONLY);
+        if (fd < 0 && segs->count > 0)  break;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            LOGE("Unable to open %s (errno=%d)\n", name, errno);
+            if (fd >= 0)    close(fd);
+            tw_segments_close(segs);
+            return -1;
+        }
+
+        if (segs->count == alloc)
+        {
+            int* fds = (int*) realloc(segs->fds, alloc * 2 * sizeof(int));
+            unsigned long long* starts = fds ? (unsigned long long*) realloc(segs->starts, (alloc * 2 + 1) * sizeof(unsigned long long)) : NULL;
+
+            if (fds)        segs->fds = fds;
+            if (starts)     segs->starts = starts;
+            if (!fds || !starts)
+            {
+                close(fd);
+                tw_segments_close(segs);
+                return -1;
+            }
+            alloc *= 2;
+        }
+        segs->fds[segs->count] = fd;
+        segs->starts[segs->count + 1] = segs->starts[segs->count] + st.st_size;
+        segs->count++;
+    }
+    return 0;
+}
+
+void tw_segments_close(TwSegments* segs)
+{
+    int i;
+
+    for (i = 0; i < segs->count; i++)
+        close(segs->fds[i]);
+    free(segs->fds);
+    free(segs->starts);
+    memset(segs, 0, sizeof(*segs));
+}
+
+ssize_t tw_segments_pread(const TwSegments* segs, void* buffer, size_t len, unsigned long long offset)
+{
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < segs->count && total < len; i++)
+    {
+        unsigned long long end = segs->starts[i + 1];
+
+        while (offset < end && total < len)
+        {
+            size_t count = len - total;
+            ssize_t ret;
+
+            if (count > end - offset)   count = (size_t) (end - offset);
+            ret = pread(segs->fds[i], (char*) buffer + total, count, offset - segs->starts[i]);
+            if (ret < 0 && errno == EINTR)  continue;
+            if (ret < 0)                    return -1;
+            if (ret == 0)                   return total;   // shrank since it was opened
+            total += ret;
+            offset += ret;
+        }
+    }
+    return total;
+}
+
+unsigned long long tw_segments_total(const char* filename)
+{
+    unsigned long long total = 0;
+    int i;
+
+    for (i = 0; i <= TW_SEGMENT_MAX; i++)
+    {
+        char name[PATH_MAX];
+        struct stat st;
+
+        tw_segment_name(filename, i, name, sizeof(name));
+        if (stat(name, &st) != 0)   break;
+        total += st.st_size;
+    }
+    return total;
+}
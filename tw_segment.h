@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_SEGMENT_HEADER
+#define _TW_SEGMENT_HEADER
+
+#include <sys/types.h>
+
+#include "tw_sink.h"
+#include "tw_digest.h"
+
+// Most segments a backup file is split into
+#define TW_SEGMENT_MAX      999
+
+// Largest file a vfat sdcard holds, in MB
+#define TW_SEGMENT_VFAT_MB  4095
+
+typedef struct {
+    unsigned long long size;
+    unsigned char digest[TW_DIGEST_MAX_SIZE];
+} TwSegmentInfo;
+
+// Filled in when the sink is closed, segments is malloc'ed
+typedef struct {
+    int count;
+    TwSegmentInfo* segments;
+    int resumed;                    // segments that were on disk already
+    int changed;                    // the data didn't match what was on disk
+} TwSegmentStats;
+
+// Told about each segment once it's on disk for good, on the thread writing the stream
+typedef void (*TwSegmentFn)(int index, const TwSegmentInfo* info, void* cookie);
+
+// A backup file split in segments, opened for reading
+typedef struct {
+    int count;
+    int* fds;
+    unsigned long long* starts;     // where each segment starts in the stream, count + 1 entries
+} TwSegments;
+
+// The first segment keeps the name of the backup, the ones after it get
+// "001", "002", ... appended (eg. "data.ext4.win001")
+void tw_segment_name(const char* filename, int index, char* name, size_t len);
+
+// Writes the stream into filename, going on with a new segment every limit
+// bytes (0 for no limit). Each segment is written, and unless digest is
+// TW_DIGEST_NONE also hashed, by a thread of its own, so the next segment is under way while the
+// last one is still being flushed. stats may be NULL.
+TwSink* tw_segment_sink_open(const char* filename, unsigned long long limit, TwDigestType digest, TwSegmentStats* stats);
+
+// Same, for going on with a backup that was cut short. The segments in done
+// are on disk already: the stream is only hashed until it's past them, and
+// fails if it doesn't come out the same. Each segment written after them is
+// synced and passed to cb, with a digest even if digest is TW_DIGEST_NONE.
+TwSink* tw_segment_sink_resume(const char* filename, unsigned long long limit, TwDigestType digest, const TwSegmentStats* done,
+                               TwSegmentFn cb, void* cookie, TwSegmentStats* stats);
+
+// Opens a backup file and all its segments, returns 0 on success
+int tw_segments_open(const char* filename, TwSegments* segs);
+void tw_segments_close(TwSegments* segs);
+
+// Reads from the segments as if they were one file
+ssize_t tw_segments_pread(const TwSegments* segs, void* buffer, size_t len, unsigned long long offset);
+
+#define tw_segments_size(segs)      ((segs)->starts[(segs)->count])
+
+// Size of a backup file and all its segments, 0 if it's missing
+unsigned long long tw_segments_total(const char* filename);
+
+#endif  // _TW_SEGMENT_HEADER
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "tw_sink.h"
+
+#define FILE_SINK_BUFFER    (256 * 1024)
+
+int tw_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    if (len == 0)       return 0;
+    if (sink->write(sink, data, len) != 0)
+        return -1;
+
+    sink->bytes += len;
+    return 0;
+}
+
+int tw_sink_close(TwSink* sink)
+{
+    if (!sink)          return 0;
+    return sink->close(sink);
+}
+
+static int write_all(int fd, const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = write(fd, data, len);
+        if (ret < 0)
+        {
+            if (errno == EINTR)     continue;
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+typedef struct {
+    TwSink sink;
+    int fd;
+    char* buffer;
+    size_t used;
+} FileSink;
+
+static int file_sink_flush(FileSink* fs)
+{
+    if (fs->used == 0)      return 0;
+    if (write_all(fs->fd, fs->buffer, fs->used) != 0)
+    {
+        LOGE("Unable to write backup data (errno=%d)\n", errno);
+        return -1;
+    }
+    fs->used = 0;
+    return 0;
+}
+
+static int file_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    FileSink* fs = (FileSink*) sink;
+    const char* ptr = (const char*) data;
+
+    // Large writes skip the buffer entirely
+    if (fs->used == 0 && len >= FILE_SINK_BUFFER)
+    {
+        if (write_all(fs->fd, ptr, len) != 0)
+        {
+            LOGE("Unable to write backup data (errno=%d)\n", errno);
+            return -1;
+        }
+        return 0;
+    }
+
+    while (len > 0)
+    {
+        size_t count = FILE_SINK_BUFFER - fs->used;
+        if (count > len)    count = len;
+
+        memcpy(fs->buffer + fs->used, ptr, count);
+        fs->used += count;
+        ptr += count;
+        len -= count;
+
+        if (fs->used == FILE_SINK_BUFFER && file_sink_flush(fs) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int file_sink_close(TwSink* sink)
+{
+    FileSink* fs = (FileSink*) sink;
+    int ret = file_sink_flush(fs);
+
+    if (close(fs->fd) != 0)     ret = -1;
+    free(fs->buffer);
+    free(fs);
+    return ret;
+}
+
+TwSink* tw_file_sink_open(const char* filename)
+{
+    FileSink* fs = (FileSink*) calloc(1, sizeof(FileSink));
+    if (!fs)            return NULL;
+
+    fs->buffer = (char*) malloc(FILE_SINK_BUFFER);
+    fs->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (!fs->buffer || fs->fd < 0)
+    {
+        LOGE("Unable to create %s (errno=%d)\n", filename, errno);
+        if (fs->fd >= 0)    close(fs->fd);
+        free(fs->buffer);
+        free(fs);
+        return NULL;
+    }
+
+    fs->sink.write = file_sink_write;
+    fs->sink.close = file_sink_close;
+    return &fs->sink;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_SINK_HEADER
+#define _TW_SINK_HEADER
+
+#include <sys/types.h>
+
+// A sink is one stage of a backup output pipeline. Stages are chained
+// (archive -> compressor -> file) and each one forwards to the next.
+typedef struct TwSink TwSink;
+
+struct TwSink {
+    // Both return 0 on success, -1 on error
+    int (*write)(TwSink* sink, const void* data, size_t len);
+    int (*close)(TwSink* sink);
+
+    // Bytes accepted by this stage so far
+    unsigned long long bytes;
+};
+
+int tw_sink_write(TwSink* sink, const void* data, size_t len);
+
+// Flushes and frees the sink, closing every stage after it as well
+int tw_sink_close(TwSink* sink);
+
+// Creates (or truncates) filename and writes everything into it
+TwSink* tw_file_sink_open(const char* filename);
+
+#endif  // _TW_SINK_HEADER
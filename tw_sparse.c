@@ -0,0 +1,604 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Sparse partition images.
+**
+** The format is written front to back in one pass, so it can sit in the
+** middle of a sink chain with the digest after it. It starts with a header
+** and is followed by chunks, all little endian:
+**
+**   header: "TWSPARS1", u32 block size, u32 reserved, u64 partition size
+**   chunk:  u32 type, u32 reserved, u64 length in bytes, then the data for RAW
+**
+** An END chunk closes the image, its length is the partition size again so
+** a truncated file is caught. Android's sparse format can't be used here,
+** its header holds the chunk count, which isn't known until the end.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "common.h"
+#include "tw_sparse.h"
+
+#ifndef BLKZEROOUT
+#define BLKZEROOUT          _IO(0x12, 127)
+#endif
+
+#define SPARSE_MAGIC        "TWSPARS1"
+#define SPARSE_HEADER_SIZE  24
+#define CHUNK_HEADER_SIZE   16
+
+#define CHUNK_RAW           1
+#define CHUNK_ZERO          2
+#define CHUNK_END           3
+
+// Largest RAW chunk, data is held back until its length is known
+#define MAX_RAW_CHUNK       (1024 * 1024)
+
+// Most of the partition read at once, when only changed blocks are written
+#define COMPARE_SIZE        (1024 * 1024)
+
+static void put_le32(unsigned char* ptr, unsigned int value)
+{
+    ptr[0] = value;
+    ptr[1] = value >> 8;
+    ptr[2] = value >> 16;
+    ptr[3] = value >> 24;
+}
+
+static void put_le64(unsigned char* ptr, unsigned long long value)
+{
+    put_le32(ptr, (unsigned int) value);
+    put_le32(ptr + 4, (unsigned int) (value >> 32));
+}
+
+static unsigned int get_le32(const unsigned char* ptr)
+{
+    return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((unsigned int) ptr[3] << 24);
+}
+
+static unsigned long long get_le64(const unsigned char* ptr)
+{
+    return get_le32(ptr) | ((unsigned long long) get_le32(ptr + 4) << 32);
+}
+
+int tw_sparse_check(const void* data, size_t len)
+{
+    return len >= SPARSE_HEADER_SIZE && memcmp(data, SPARSE_MAGIC, 8) == 0;
+}
+
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    unsigned long long total;
+    unsigned long long* skipped;
+
+    unsigned char* block;
+    size_t block_used;
+    unsigned char* raw;
+    size_t raw_used;
+    unsigned long long zero_run;
+    unsigned long long zero_total;
+    int error;
+} SparseSink;
+
+static int emit_chunk(SparseSink* ss, unsigned int type, unsigned long long len, const void* data)
+{
+    unsigned char header[CHUNK_HEADER_SIZE];
+
+    memset(header, 0, sizeof(header));
+    put_le32(header, type);
+    put_le64(header + 8, len);
+    if (tw_sink_write(ss->next, header, sizeof(header)) != 0 ||
+        (data && tw_sink_write(ss->next, data, len) != 0))
+    {
+        ss->error = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int flush_raw(SparseSink* ss)
+{
+    if (ss->raw_used == 0)      return 0;
+    if (emit_chunk(ss, CHUNK_RAW, ss->raw_used, ss->raw) != 0)
+        return -1;
+    ss->raw_used = 0;
+    return 0;
+}
+
+static int flush_zero(SparseSink* ss)
+{
+    if (ss->zero_run == 0)      return 0;
+    if (emit_chunk(ss, CHUNK_ZERO, ss->zero_run, NULL) != 0)
+        return -1;
+    ss->zero_total += ss->zero_run;
+    ss->zero_run = 0;
+    return 0;
+}
+
+static int is_zero(const unsigned char* data, size_t len)
+{
+    // If the first byte is zero and every byte equals the one after it, all are zero
+    return data[0] == 0 && memcmp(data, data + 1, len - 1) == 0;
+}
+
+static int add_block(SparseSink* ss, const unsigned char* data, size_t len)
+{
+    if (is_zero(data, len))
+    {
+        if (flush_raw(ss) != 0)     return -1;
+        ss->zero_run += len;
+        return 0;
+    }
+
+    if (flush_zero(ss) != 0)    return -1;
+    if (ss->raw_used + len > MAX_RAW_CHUNK && flush_raw(ss) != 0)
+        return -1;
+    memcpy(ss->raw + ss->raw_used, data, len);
+    ss->raw_used += len;
+    return 0;
+}
+
+static int sparse_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    SparseSink* ss = (SparseSink*) sink;
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (ss->error)      return -1;
+    while (len > 0)
+    {
+        size_t count;
+
+        // Whole blocks are classified straight from the caller's buffer
+        if (ss->block_used == 0 && len >= TW_SPARSE_BLOCK_SIZE)
+        {
+            if (add_block(ss, ptr, TW_SPARSE_BLOCK_SIZE) != 0)
+                return -1;
+            ptr += TW_SPARSE_BLOCK_SIZE;
+            len -= TW_SPARSE_BLOCK_SIZE;
+            continue;
+        }
+
+        count = TW_SPARSE_BLOCK_SIZE - ss->block_used;
+        if (count > len)    count = len;
+        memcpy(ss->block + ss->block_used, ptr, count);
+        ss->block_used += count;
+        ptr += count;
+        len -= count;
+
+        if (ss->block_used == TW_SPARSE_BLOCK_SIZE)
+        {
+            ss->block_used = 0;
+            if (add_block(ss, ss->block, TW_SPARSE_BLOCK_SIZE) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static int sparse_sink_close(TwSink* sink)
+{
+    SparseSink* ss = (SparseSink*) sink;
+    int ret;
+
+    // A partition that isn't a multiple of the block size ends in a short block
+    if (!ss->error && ss->block_used)
+        add_block(ss, ss->block, ss->block_used);
+    if (!ss->error && flush_raw(ss) == 0 && flush_zero(ss) == 0)
+    {
+        if (ss->sink.bytes != ss->total)
+        {
+            LOGE("Partition image is %llu bytes, expected %llu\n", ss->sink.bytes, ss->total);
+            ss->error = -1;
+        }
+        else
+            emit_chunk(ss, CHUNK_END, ss->total, NULL);
+    }
+
+    ret = ss->error;
+    if (tw_sink_close(ss->next) != 0)   ret = -1;
+    if (ss->skipped)    *ss->skipped = ss->zero_total;
+
+    free(ss->block);
+    free(ss->raw);
+    free(ss);
+    return ret;
+}
+
+TwSink* tw_sparse_sink_open(TwSink* next, unsigned long long total, unsigned long long* skipped)
+{
+    SparseSink* ss = (SparseSink*) calloc(1, sizeof(SparseSink));
+    unsigned char header[SPARSE_HEADER_SIZE];
+
+    if (!ss)            return NULL;
+
+    ss->block = (unsigned char*) malloc(TW_SPARSE_BLOCK_SIZE);
+    ss->raw = (unsigned char*) malloc(MAX_RAW_CHUNK);
+    if (!ss->block || !ss->raw)
+    {
+        free(ss->block);
+        free(ss->raw);
+        free(ss);
+        return NULL;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, SPARSE_MAGIC, 8);
+    put_le32(header + 8, TW_SPARSE_BLOCK_SIZE);
+    put_le64(header + 16, total);
+    if (tw_sink_write(next, header, sizeof(header)) != 0)
+    {
+        free(ss->block);
+        free(ss->raw);
+        free(ss);
+        return NULL;
+    }
+
+    ss->next = next;
+    ss->total = total;
+    ss->skipped = skipped;
+    ss->sink.write = sparse_sink_write;
+    ss->sink.close = sparse_sink_close;
+    return &ss->sink;
+}
+
+enum {
+    UNSPARSE_HEADER,
+    UNSPARSE_CHUNK,
+    UNSPARSE_DATA,
+    UNSPARSE_END,
+    UNSPARSE_RAW
+};
+
+typedef struct {
+    TwSink sink;
+    int fd;
+    const char* device;
+    unsigned long long* zeroed;
+    unsigned long long* unchanged;
+    unsigned char* current;         // what's on the partition, when only changed blocks are written
+    unsigned long long same_total;
+
+    int state;
+    unsigned char header[SPARSE_HEADER_SIZE];
+    size_t header_used;
+    unsigned long long total;
+    unsigned long long offset;
+    unsigned long long remaining;
+    unsigned long long zero_total;
+    int detect;
+    int error;
+} UnsparseSink;
+
+static int pwrite_all(int fd, const unsigned char* data, size_t len, unsigned long long offset)
+{
+    // Nothing to write to when only checking the image
+    if (fd < 0)     return 0;
+    while (len > 0)
+    {
+        ssize_t ret = pwrite(fd, data, len, offset);
+        if (ret < 0)
+        {
+            if (errno == EINTR)     continue;
+            return -1;
+        }
+        data += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/* Writes only the blocks that differ from what the partition holds. Reading
+** is cheaper than writing on flash and doesn't wear it, and a partition
+** restored over a backup of itself mostly matches.
+*/
+static int write_changed(UnsparseSink* us, const unsigned char* data, size_t len, unsigned long long offset)
+{
+    if (us->fd < 0)     return 0;
+    if (!us->current)   return pwrite_all(us->fd, data, len, offset);
+
+    while (len > 0)
+    {
+        size_t count = len > COMPARE_SIZE ? COMPARE_SIZE : len;
+        size_t pos = 0;
+        ssize_t got = pread(us->fd, us->current, count, offset);
+
+        if (got < 0 && errno == EINTR)  continue;
+        // Past the end of what can be read, it all gets written
+        if (got < 0)    got = 0;
+
+        while (pos < count)
+        {
+            size_t block = count - pos > TW_SPARSE_BLOCK_SIZE ? TW_SPARSE_BLOCK_SIZE : count - pos;
+            size_t run = 0;
+
+            if (pos + block <= (size_t) got && memcmp(data + pos, us->current + pos, block) == 0)
+            {
+                us->same_total += block;
+                pos += block;
+                continue;
+            }
+
+            // Blocks that differ in a row go out in one write
+            while (pos + run < count)
+            {
+                block = count - pos - run > TW_SPARSE_BLOCK_SIZE ? TW_SPARSE_BLOCK_SIZE : count - pos - run;
+                if (pos + run + block <= (size_t) got && memcmp(data + pos + run, us->current + pos + run, block) == 0)
+                    break;
+                run += block;
+            }
+            if (pwrite_all(us->fd, data + pos, run, offset + pos) != 0)
+                return -1;
+            pos += run;
+        }
+        data += count;
+        offset += count;
+        len -= count;
+    }
+    return 0;
+}
+
+static int zero_range(UnsparseSink* us, unsigned long long offset, unsigned long long len)
+{
+    static const unsigned char zeros[64 * 1024];
+    unsigned long long range[2];
+
+    if (us->fd < 0)     return 0;
+
+    // Blocks that are clear already are left alone, rather than cleared again
+    if (us->current)
+    {
+        while (len > 0)
+        {
+            size_t count = len > sizeof(zeros) ? sizeof(zeros) : (size_t) len;
+            if (write_changed(us, zeros, count, offset) != 0)
+                return -1;
+            offset += count;
+            len -= count;
+        }
+        return 0;
+    }
+
+    // Let the device clear the range itself, it only needs 512 byte alignment
+    range[0] = offset;
+    range[1] = len;
+    if ((offset & 511) == 0 && (len & 511) == 0 && ioctl(us->fd, BLKZEROOUT, range) == 0)
+    {
+        us->zero_total += len;
+        return 0;
+    }
+
+    while (len > 0)
+    {
+        size_t count = len > sizeof(zeros) ? sizeof(zeros) : (size_t) len;
+        if (pwrite_all(us->fd, zeros, count, offset) != 0)
+            return -1;
+        offset += count;
+        len -= count;
+    }
+    return 0;
+}
+
+// Collects a header of size bytes, returns the bytes consumed
+static size_t fill_header(UnsparseSink* us, const unsigned char* data, size_t len, size_t size)
+{
+    size_t count = size - us->header_used;
+
+    if (count > len)    count = len;
+    memcpy(us->header + us->header_used, data, count);
+    us->header_used += count;
+    return count;
+}
+
+static int unsparse_chunk(UnsparseSink* us)
+{
+    unsigned int type = get_le32(us->header);
+    unsigned long long len = get_le64(us->header + 8);
+
+    if (type == CHUNK_END)
+    {
+        if (len != us->total || us->offset != us->total)
+            return -1;
+        us->state = UNSPARSE_END;
+        return 0;
+    }
+    if (us->offset + len > us->total)
+        return -1;
+
+    if (type == CHUNK_RAW)
+    {
+        us->remaining = len;
+        us->state = len ? UNSPARSE_DATA : UNSPARSE_CHUNK;
+        return 0;
+    }
+    if (type == CHUNK_ZERO)
+    {
+        if (zero_range(us, us->offset, len) != 0)
+        {
+            LOGE("Unable to write %s (errno=%d)\n", us->device, errno);
+            return -1;
+        }
+        us->offset += len;
+        return 0;
+    }
+    return -1;
+}
+
+static int unsparse_sink_write(TwSink* sink, const void* data, size_t len)
+{
+    UnsparseSink* us = (UnsparseSink*) sink;
+    const unsigned char* ptr = (const unsigned char*) data;
+
+    if (us->error)      return -1;
+    while (len > 0)
+    {
+        size_t count;
+
+        switch (us->state)
+        {
+        case UNSPARSE_HEADER:
+            count = fill_header(us, ptr, len, SPARSE_HEADER_SIZE);
+            if (us->header_used == SPARSE_HEADER_SIZE && us->detect && !tw_sparse_check(us->header, SPARSE_HEADER_SIZE))
+            {
+                // Not sparse, the header was the start of a plain image
+                if (write_changed(us, us->header, SPARSE_HEADER_SIZE, 0) != 0)
+                {
+                    LOGE("Unable to write %s (errno=%d)\n", us->device, errno);
+                    us->error = -1;
+                    return -1;
+                }
+                us->offset = SPARSE_HEADER_SIZE;
+                us->state = UNSPARSE_RAW;
+            }
+            else if (us->header_used == SPARSE_HEADER_SIZE)
+            {
+                if (!tw_sparse_check(us->header, SPARSE_HEADER_SIZE) ||
+                    get_le32(us->header + 8) != TW_SPARSE_BLOCK_SIZE)
+                {
+                    LOGE("Invalid sparse image header\n");
+                    us->error = -1;
+                    return -1;
+                }
+                us->total = get_le64(us->header + 16);
+                us->header_used = 0;
+                us->state = UNSPARSE_CHUNK;
+            }
+            break;
+
+        case UNSPARSE_CHUNK:
+            count = fill_header(us, ptr, len, CHUNK_HEADER_SIZE);
+            if (us->header_used == CHUNK_HEADER_SIZE)
+            {
+                us->header_used = 0;
+                if (unsparse_chunk(us) != 0)
+                {
+                    LOGE("Invalid chunk in sparse image\n");
+                    us->error = -1;
+                    return -1;
+                }
+            }
+            break;
+
+        case UNSPARSE_DATA:
+        case UNSPARSE_RAW:
+            count = len;
+            if (us->state == UNSPARSE_DATA && count > us->remaining)
+                count = us->remaining;
+            if (write_changed(us, ptr, count, us->offset) != 0)
+            {
+                LOGE("Unable to write %s (errno=%d)\n", us->device, errno);
+                us->error = -1;
+                return -1;
+            }
+            us->offset += count;
+            if (us->state == UNSPARSE_RAW)  break;
+            us->remaining -= count;
+            if (us->remaining == 0)     us->state = UNSPARSE_CHUNK;
+            break;
+
+        default:
+            LOGE("Unexpected data after the end of the sparse image\n");
+            us->error = -1;
+            return -1;
+        }
+
+        ptr += count;
+        len -= count;
+    }
+    return 0;
+}
+
+static int unsparse_sink_close(TwSink* sink)
+{
+    UnsparseSink* us = (UnsparseSink*) sink;
+    int ret = us->error;
+
+    // A plain image shorter than a sparse header
+    if (!ret && us->detect && us->state == UNSPARSE_HEADER)
+    {
+        if (write_changed(us, us->header, us->header_used, 0) != 0)    ret = -1;
+        us->state = UNSPARSE_RAW;
+    }
+    if (!ret && us->state != UNSPARSE_END && us->state != UNSPARSE_RAW)
+    {
+        LOGE("Sparse image is truncated\n");
+        ret = -1;
+    }
+    if (us->fd >= 0 && fsync(us->fd) != 0)  ret = -1;
+    if (us->fd >= 0 && close(us->fd) != 0)  ret = -1;
+    if (us->zeroed)     *us->zeroed = us->zero_total;
+    if (us->unchanged)  *us->unchanged += us->same_total;
+    free(us->current);
+    free(us);
+    return ret;
+}
+
+static TwSink* open_device(const char* device, unsigned long long* zeroed, int detect, unsigned long long* unchanged)
+{
+    UnsparseSink* us = (UnsparseSink*) calloc(1, sizeof(UnsparseSink));
+    if (!us)            return NULL;
+
+    if (device && unchanged)
+    {
+        us->current = (unsigned char*) malloc(COMPARE_SIZE);
+        if (!us->current)
+        {
+            free(us);
+            return NULL;
+        }
+    }
+
+    us->fd = device ? open(device, us->current ? O_RDWR : O_WRONLY) : -1;
+    if (device && us->fd < 0)
+    {
+        LOGE("Unable to open %s (errno=%d)\n", device, errno);
+        free(us->current);
+        free(us);
+        return NULL;
+    }
+
+    us->device = device;
+    us->zeroed = zeroed;
+    us->unchanged = unchanged;
+    us->detect = detect;
+    us->sink.write = unsparse_sink_write;
+    us->sink.close = unsparse_sink_close;
+    return &us->sink;
+}
+
+TwSink* tw_unsparse_sink_open(const char* device, unsigned long long* zeroed)
+{
+    return open_device(device, zeroed, 0, NULL);
+}
+
+TwSink* tw_image_sink_open(const char* device, unsigned long long* zeroed)
+{
+    return open_device(device, zeroed, 1, NULL);
+}
+
+TwSink* tw_image_sink_open_changed(const char* device, unsigned long long* zeroed, unsigned long long* unchanged)
+{
+    return open_device(device, zeroed, 1, unchanged);
+}
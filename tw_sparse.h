@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_SPARSE_HEADER
+#define _TW_SPARSE_HEADER
+
+#include "tw_sink.h"
+
+#define TW_SPARSE_BLOCK_SIZE    4096
+
+// Turns a raw partition image into a sparse image, where all-zero blocks
+// are stored as runs instead of data. total is the size of the partition,
+// skipped receives the number of zero bytes left out when the sink is closed.
+TwSink* tw_sparse_sink_open(TwSink* next, unsigned long long total, unsigned long long* skipped);
+
+// Returns 1 if data starts with a sparse image header
+int tw_sparse_check(const void* data, size_t len);
+
+// Writes a sparse image back to a block device. Zero runs are cleared
+// without writing data where the device supports it, zeroed receives
+// the number of bytes handled that way when the sink is closed. With
+// device NULL the image is only checked.
+TwSink* tw_unsparse_sink_open(const char* device, unsigned long long* zeroed);
+
+// Same as above, but plain images are accepted as well and written as they are
+TwSink* tw_image_sink_open(const char* device, unsigned long long* zeroed);
+
+// Same again, but the partition is read ahead of each write and only the
+// blocks that differ from the image are written. unchanged is increased by
+// the bytes that matched and were left alone.
+TwSink* tw_image_sink_open_changed(const char* device, unsigned long long* zeroed, unsigned long long* unchanged);
+
+#endif  // _TW_SPARSE_HEADER
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Used space of folder trees, for partitions like .android_secure that
+** don't have a file system of their own to statfs.
+**
+** Folders are listed with getdents64 into a large buffer and their entries
+** sized with fstatat on the open folder. Subfolders go on a queue shared by
+** a few threads, the same way tw_remove walks a tree.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "tw_usage.h"
+#include "tw_archive.h"
+
+#define MAX_WORKERS     4
+#define DENTS_BUFFER    (32 * 1024)
+#define CACHE_SIZE      8
+
+// The kernel's record, bionic and glibc don't export it under one name
+struct dirent64_record {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct Folder {
+    struct Folder* next;
+    char* path;
+} Folder;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Folder* queue;
+    int busy;                       // workers listing a folder right now
+    unsigned long long bytes;
+} UsageWalk;
+
+// A cached result is only good for the same folder it was taken from
+typedef struct {
+    char path[256];
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    unsigned long long bytes;
+    int valid;
+} UsageEntry;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static UsageEntry cache[CACHE_SIZE];
+
+static void queue_folder(UsageWalk* walk, const char* parent, const char* name)
+{
+    Folder* folder = (Folder*) malloc(sizeof(Folder));
+
+    if (folder)
+        folder->path = (char*) malloc(strlen(parent) + (name ? strlen(name) + 2 : 1));
+    if (!folder || !folder->path)
+    {
+        free(folder);
+        return;
+    }
+    if (name)   sprintf(folder->path, "%s/%s", parent, name);
+    else        strcpy(folder->path, parent);
+
+    pthread_mutex_lock(&walk->lock);
+    folder->next = walk->queue;
+    walk->queue = folder;
+    pthread_cond_signal(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static unsigned long long size_folder(UsageWalk* walk, const char* path, char* buffer)
+{
+    unsigned long long bytes = 0;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+    if (fd < 0)     return 0;
+    for (;;)
+    {
+        long len = syscall(SYS_getdents64, fd, buffer, DENTS_BUFFER);
+        long pos;
+
+        if (len < 0 && errno == EINTR)  continue;
+        if (len <= 0)   break;
+
+        for (pos = 0; pos < len; )
+        {
+            struct dirent64_record* de = (struct dirent64_record*) (buffer + pos);
+            struct stat st;
+
+            pos += de->d_reclen;
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)     continue;
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)             continue;
+
+            // Allocated blocks, so sparse files and small files count like du counts them
+            bytes += (unsigned long long) st.st_blocks * 512;
+            if (S_ISDIR(st.st_mode))
+                queue_folder(walk, path, de->d_name);
+        }
+    }
+    close(fd);
+    return bytes;
+}
+
+static void* usage_thread(void* cookie)
+{
+    UsageWalk* walk = (UsageWalk*) cookie;
+    char* buffer = (char*) malloc(DENTS_BUFFER);
+
+    pthread_mutex_lock(&walk->lock);
+    for (;;)
+    {
+        Folder* folder;
+        unsigned long long bytes = 0;
+
+        // Done when nothing is queued and nobody can queue more
+        while (!walk->queue && walk->busy > 0)
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        if (!walk->queue)
+            break;
+
+        folder = walk->queue;
+        walk->queue = folder->next;
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        if (buffer)     bytes = size_folder(walk, folder->path, buffer);
+        free(folder->path);
+        free(folder);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->bytes += bytes;
+        if (--walk->busy == 0)
+            pthread_cond_broadcast(&walk->cond);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    free(buffer);
+    return NULL;
+}
+
+static unsigned long long walk_tree(const char* path)
+{
+    pthread_t threads[MAX_WORKERS];
+    UsageWalk walk;
+    int count, i;
+
+    memset(&walk, 0, sizeof(walk));
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    queue_folder(&walk, path, NULL);
+
+    count = tw_get_cpu_count();
+    if (count > MAX_WORKERS)    count = MAX_WORKERS;
+    for (i = 0; i < count; i++)
+        if (pthread_create(&threads[i], NULL, usage_thread, &walk) != 0)
+            break;
+    count = i;
+
+    if (count == 0)     usage_thread(&walk);
+    for (i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&walk.cond);
+    pthread_mutex_destroy(&walk.lock);
+    return walk.bytes;
+}
+
+// Returns 1 if one path is the other or a folder above it
+static int paths_overlap(const char* a, const char* b)
+{
+    size_t la = strlen(a), lb = strlen(b);
+    size_t len = la < lb ? la : lb;
+
+    if (strncmp(a, b, len) != 0)    return 0;
+    if (la == lb)                   return 1;
+    return (la > lb ? a[len] : b[len]) == '/';
+}
+
+unsigned long long tw_usage_tree(const char* path)
+{
+    unsigned long long bytes;
+    struct stat st;
+    int i, slot = 0;
+
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return 0;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < CACHE_SIZE; i++)
+    {
+        UsageEntry* e = &cache[i];
+
+        if (!e->valid || strcmp(e->path, path) != 0)    continue;
+        if (e->dev == st.st_dev && e->ino == st.st_ino && e->mtime == st.st_mtime)
+        {
+            bytes = e->bytes;
+            pthread_mutex_unlock(&cache_lock);
+            return bytes;
+        }
+        e->valid = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // The folder itself counts too, as it does for du
+    bytes = walk_tree(path) + (unsigned long long) st.st_blocks * 512;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < CACHE_SIZE; i++)
+    {
+        if (!cache[i].valid || strcmp(cache[i].path, path) == 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (strlen(path) < sizeof(cache[slot].path))
+    {
+        strcpy(cache[slot].path, path);
+        cache[slot].dev = st.st_dev;
+        cache[slot].ino = st.st_ino;
+        cache[slot].mtime = st.st_mtime;
+        cache[slot].bytes = bytes;
+        cache[slot].valid = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return bytes;
+}
+
+void tw_usage_invalidate(const char* path)
+{
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < CACHE_SIZE; i++)
+        if (!path || paths_overlap(cache[i].path, path))
+            cache[i].valid = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
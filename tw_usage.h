@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_USAGE_HEADER
+#define _TW_USAGE_HEADER
+
+// Bytes taken by everything under path, like "du -sl" but in bytes. The
+// result is cached until tw_usage_invalidate is called for the path, or the
+// folder is replaced (another sdcard, a format). A change deep in the tree
+// doesn't show on the folder itself, so a sizing pass forgets everything
+// before it starts. Returns 0 if path can't be read.
+unsigned long long tw_usage_tree(const char* path);
+
+// Forgets cached sizes for path, the folders above it and everything below
+// it. Call it after writing under path. NULL forgets everything.
+void tw_usage_invalidate(const char* path);
+
+#endif  // _TW_USAGE_HEADER
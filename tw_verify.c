@@ -0,0 +1,934 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Verification of a whole backup folder.
+**
+** Every .win gets a worker of its own, up to one per CPU, biggest files
+** first. A worker reads its file once, hashing it as it goes, and hands the
+** data through a small bounded queue to a second thread that checks the
+** framing, so the digest and the decoding run side by side. What the data is
+** gets worked out from its first bytes, the same way restore does it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "tw_verify.h"
+#include "tw_archive.h"
+#include "tw_compress.h"
+#include "tw_digest.h"
+#include "tw_sparse.h"
+#include "tw_chunk.h"
+#include "tw_delta.h"
+#include "tw_index.h"
+#include "tw_segment.h"
+
+#define TAR_BLOCK_SIZE      512
+#define EXTRA_MAX           (64 * 1024)
+#define READ_BUFFER         (512 * 1024)
+#define QUEUE_SLOTS         2
+#define PROGRESS_MSEC       250
+#define MAX_VERIFY_THREADS  8
+
+typedef struct {
+    TwVerifyResult* result;
+    char path[PATH_MAX];
+    volatile unsigned long long done;
+} VerifyJob;
+
+typedef struct {
+    const TwVerifyOptions* opts;
+    VerifyJob* jobs;
+    VerifyJob** order;              // files to check, biggest first
+    int count;
+    int next;
+    int finished;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} VerifyState;
+
+// Walks the headers of a tar stream, and the index written with it if there is one
+typedef struct {
+    TwSink sink;
+    VerifyJob* job;
+    TwIndex* index;
+    unsigned long long matched;
+    char header[TAR_BLOCK_SIZE];
+    size_t have;
+    unsigned long long offset;      // of the block being collected
+    unsigned long long member;      // offset of the member's first header, or -1
+    unsigned long long skip;        // data and padding left of the current member
+    int ended;
+    int error;
+} TarCheck;
+
+// Buffers the start of a stream until it's clear what it is
+typedef struct {
+    TwSink sink;
+    VerifyJob* job;
+    TwIndex* index;
+    TwSink* next;
+    char start[TW_DELTA_HEADER_SIZE > TAR_BLOCK_SIZE ? TW_DELTA_HEADER_SIZE : TAR_BLOCK_SIZE];
+    size_t have;
+    int decided;
+    int nested;                     // already below a decoder
+} DetectSink;
+
+// Moves data to a thread of its own, QUEUE_SLOTS buffers at most
+typedef struct {
+    TwSink sink;
+    TwSink* next;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char* slots[QUEUE_SLOTS];
+    size_t lens[QUEUE_SLOTS];
+    int head;
+    int queued;
+    int closing;
+    int error;
+} QueueSink;
+
+const char* tw_verify_status_name(TwVerifyStatus status)
+{
+    switch (status)
+    {
+    case TW_VERIFY_OK:          return "OK";
+    case TW_VERIFY_NO_DIGEST:   return "no digest";
+    case TW_VERIFY_DAMAGED:     return "damaged";
+    case TW_VERIFY_BAD_DIGEST:  return "digest mismatch";
+    default:                    return "unreadable";
+    }
+}
+
+static void set_status(VerifyJob* job, TwVerifyStatus status)
+{
+    if (status > job->result->status)   job->result->status = status;
+}
+
+static void add_kind(VerifyJob* job, const char* kind)
+{
+    size_t len = strlen(job->result->kind);
+
+    snprintf(job->result->kind + len, sizeof(job->result->kind) - len, "%s%s", len ? " " : "", kind);
+}
+
+static unsigned long long tar_number(const char* field, size_t len)
+{
+    unsigned long long value = 0;
+    size_t i;
+
+    if ((unsigned char) field[0] & 0x80)
+    {
+        for (i = 1; i < len; i++)
+            value = (value << 8) | (unsigned char) field[i];
+        return value;
+    }
+    for (i = 0; i < len && (field[i] == ' ' || field[i] == '\0'); i++)
+        ;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+static int tar_header_ok(const char* block)
+{
+    unsigned int sum = 0;
+    int i;
+
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) block[i];
+    return sum == tar_number(block + 148, 8);
+}
+
+static int is_zero_block(const char* block)
+{
+    int i;
+
+    for (i = 0; i < TAR_BLOCK_SIZE; i++)
+    {
+        if (block[i])   return 0;
+    }
+    return 1;
+}
+
+static int tar_check_header(TarCheck* tc)
+{
+    unsigned long long size;
+    char type;
+
+    if (tc->ended)
+    {
+        // Only zeros may follow the end of the archive
+        if (!is_zero_block(tc->header))
+        {
+            LOGE("%s: data after the end of the archive\n", tc->job->path);
+            return -1;
+        }
+        return 0;
+    }
+    if (is_zero_block(tc->header))
+    {
+        if (tc->member != (unsigned long long) -1)
+        {
+            LOGE("%s: archive ends inside a member\n", tc->job->path);
+            return -1;
+        }
+        tc->ended = 1;
+        return 0;
+    }
+    if (!tar_header_ok(tc->header))
+    {
+        LOGE("%s: invalid tar header at %llu\n", tc->job->path, tc->offset);
+        return -1;
+    }
+
+    type = tc->header[156];
+    size = tar_number(tc->header + 124, 12);
+    tc->skip = (size + TAR_BLOCK_SIZE - 1) & ~(unsigned long long) (TAR_BLOCK_SIZE - 1);
+    if (tc->member == (unsigned long long) -1)
+        tc->member = tc->offset;
+
+    // Long names and pax records belong to the member that follows them
+    if (type == 'L' || type == 'K' || type == 'x' || type == 'g')
+    {
+        if (size > EXTRA_MAX)
+        {
+            LOGE("%s: tar extended header is too large\n", tc->job->path);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (tc->index)
+    {
+        const TwIndexMember* entry = tc->matched < tc->index->member_count ? &tc->index->members[tc->matched] : NULL;
+
+        if (!entry || entry->offset != tc->member || entry->size != size)
+        {
+            LOGE("%s: member at %llu doesn't match the index\n", tc->job->path, tc->member);
+            return -1;
+        }
+        tc->matched++;
+    }
+    tc->job->result->members++;
+    tc->member = (unsigned long long) -1;
+    return 0;
+}
+
+static int tar_check_write(TwSink* sink, const void* data, size_t len)
+{
+    TarCheck* tc = (TarCheck*) sink;
+    const char* ptr = (const char*) data;
+
+    if (tc->error)      return -1;
+    while (len > 0)
+    {
+        size_t count;
+
+        if (tc->skip)
+        {
+            count = tc->skip > len ? len : (size_t) tc->skip;
+            tc->skip -= count;
+            tc->offset += count;
+        }
+        else
+        {
+            count = TAR_BLOCK_SIZE - tc->have;
+            if (count > len)    count = len;
+            memcpy(tc->header + tc->have, ptr, count);
+            tc->have += count;
+            if (tc->have == TAR_BLOCK_SIZE)
+            {
+                tc->have = 0;
+                if (tar_check_header(tc) != 0)
+                {
+                    tc->error = -1;
+                    return -1;
+                }
+                tc->offset += TAR_BLOCK_SIZE;
+            }
+        }
+        ptr += count;
+        len -= count;
+    }
+    return 0;
+}
+
+static int tar_check_close(TwSink* sink)
+{
+    TarCheck* tc = (TarCheck*) sink;
+    int ret = tc->error;
+
+    if (!ret && (!tc->ended || tc->have))
+    {
+        LOGE("%s: archive is cut short\n", tc->job->path);
+        ret = -1;
+    }
+    if (!ret && tc->index && tc->matched != tc->index->member_count)
+    {
+        LOGE("%s: index lists %llu members, the archive has %llu\n", tc->job->path,
+             tc->index->member_count, tc->matched);
+        ret = -1;
+    }
+    free(tc);
+    return ret;
+}
+
+static TwSink* tar_check_open(VerifyJob* job, TwIndex* index)
+{
+    TarCheck* tc = (TarCheck*) calloc(1, sizeof(TarCheck));
+
+    if (!tc)            return NULL;
+    tc->job = job;
+    tc->index = index;
+    tc->member = (unsigned long long) -1;
+    tc->sink.write = tar_check_write;
+    tc->sink.close = tar_check_close;
+    return &tc->sink;
+}
+
+static TwSink* detect_open(VerifyJob* job, TwIndex* index, int nested);
+
+// Picks the checker for the stream from what has been collected of its start
+static int detect_decide(DetectSink* ds)
+{
+    TwCodec codec = tw_codec_detect(ds->start, ds->have);
+
+    ds->decided = 1;
+    if (!ds->nested && codec != TW_CODEC_NONE)
+    {
+        TwSink* inner = detect_open(ds->job, ds->index, 1);
+
+        add_kind(ds->job, tw_codec_name(codec));
+        ds->next = inner ? tw_decompress_sink_open(inner, codec) : NULL;
+        if (!ds->next)  tw_sink_close(inner);
+    }
+    else if (tw_sparse_check(ds->start, ds->have))
+    {
+        add_kind(ds->job, "sparse");
+        ds->next = tw_unsparse_sink_open(NULL, NULL);
+    }
+    else if (!ds->nested && tw_delta_check(ds->start, ds->have))
+    {
+        add_kind(ds->job, "delta");
+        ds->next = tw_undelta_sink_open(NULL);
+    }
+    else if (ds->have == TAR_BLOCK_SIZE && memcmp(ds->start + 257, "ustar", 5) == 0 && tar_header_ok(ds->start))
+    {
+        add_kind(ds->job, "tar");
+        ds->next = tar_check_open(ds->job, ds->index);
+    }
+    else
+    {
+        // A plain image has no framing to check, the MD5 is all there is
+        add_kind(ds->job, "image");
+        return 0;
+    }
+
+    if (!ds->next)
+    {
+        LOGE("%s: unable to start checking\n", ds->job->path);
+        return -1;
+    }
+    return tw_sink_write(ds->next, ds->start, ds->have);
+}
+
+static int detect_write(TwSink* sink, const void* data, size_t len)
+{
+    DetectSink* ds = (DetectSink*) sink;
+
+    if (!ds->decided)
+    {
+        size_t count = sizeof(ds->start) - ds->have;
+
+        if (count > len)    count = len;
+        memcpy(ds->start + ds->have, data, count);
+        ds->have += count;
+        data = (const char*) data + count;
+        len -= count;
+        if (ds->have < sizeof(ds->start))   return 0;
+        if (detect_decide(ds) != 0)         return -1;
+    }
+    return (len && ds->next) ? tw_sink_write(ds->next, data, len) : 0;
+}
+
+static int detect_close(TwSink* sink)
+{
+    DetectSink* ds = (DetectSink*) sink;
+    int ret = 0;
+
+    if (!ds->decided)   ret = detect_decide(ds);
+    if (tw_sink_close(ds->next) != 0)   ret = -1;
+    free(ds);
+    return ret;
+}
+
+static TwSink* detect_open(VerifyJob* job, TwIndex* index, int nested)
+{
+    DetectSink* ds = (DetectSink*) calloc(1, sizeof(DetectSink));
+
+    if (!ds)            return NULL;
+    ds->job = job;
+    ds->index = index;
+    ds->nested = nested;
+    ds->sink.write = detect_write;
+    ds->sink.close = detect_close;
+    return &ds->sink;
+}
+
+static void* queue_thread(void* cookie)
+{
+    QueueSink* qs = (QueueSink*) cookie;
+
+    pthread_mutex_lock(&qs->lock);
+    for (;;)
+    {
+        char* data;
+        size_t len;
+
+        while (!qs->queued && !qs->closing)
+            pthread_cond_wait(&qs->cond, &qs->lock);
+        if (!qs->queued)    break;
+
+        data = qs->slots[qs->head];
+        len = qs->lens[qs->head];
+        pthread_mutex_unlock(&qs->lock);
+
+        // Once the checker failed the rest only needs to be taken off the queue
+        if (!qs->error && tw_sink_write(qs->next, data, len) != 0)
+            qs->error = -1;
+
+        pthread_mutex_lock(&qs->lock);
+        qs->head = (qs->head + 1) % QUEUE_SLOTS;
+        qs->queued--;
+        pthread_cond_broadcast(&qs->cond);
+    }
+    pthread_mutex_unlock(&qs->lock);
+    return NULL;
+}
+
+static int queue_write(TwSink* sink, const void* data, size_t len)
+{
+    QueueSink* qs = (QueueSink*) sink;
+    const char* ptr = (const char*) data;
+
+    while (len > 0)
+    {
+        size_t count = len > READ_BUFFER ? READ_BUFFER : len;
+        int slot;
+
+        pthread_mutex_lock(&qs->lock);
+        while (qs->queued == QUEUE_SLOTS)
+            pthread_cond_wait(&qs->cond, &qs->lock);
+        pthread_mutex_unlock(&qs->lock);
+        if (qs->error)      return -1;
+
+        // The slot is ours until it's queued, the thread only reads queued ones
+        slot = (qs->head + qs->queued) % QUEUE_SLOTS;
+        memcpy(qs->slots[slot], ptr, count);
+        qs->lens[slot] = count;
+
+        pthread_mutex_lock(&qs->lock);
+        qs->queued++;
+        pthread_cond_broadcast(&qs->cond);
+        pthread_mutex_unlock(&qs->lock);
+        ptr += count;
+        len -= count;
+    }
+    return 0;
+}
+
+static int queue_close(TwSink* sink)
+{
+    QueueSink* qs = (QueueSink*) sink;
+    int ret, i;
+
+    pthread_mutex_lock(&qs->lock);
+    qs->closing = 1;
+    pthread_cond_broadcast(&qs->cond);
+    pthread_mutex_unlock(&qs->lock);
+    pthread_join(qs->thread, NULL);
+
+    ret = qs->error;
+    if (tw_sink_close(qs->next) != 0)   ret = -1;
+    for (i = 0; i < QUEUE_SLOTS; i++)
+        free(qs->slots[i]);
+    pthread_cond_destroy(&qs->cond);
+    pthread_mutex_destroy(&qs->lock);
+    free(qs);
+    return ret;
+}
+
+// Returns a sink feeding next from a thread of its own. next is closed along
+// with it, or right away if the thread can't be started.
+static TwSink* queue_open(TwSink* next)
+{
+    QueueSink* qs = (QueueSink*) calloc(1, sizeof(QueueSink));
+    int i;
+
+    if (!qs)
+    {
+        tw_sink_close(next);
+        return NULL;
+    }
+    for (i = 0; i < QUEUE_SLOTS; i++)
+        qs->slots[i] = (char*) malloc(READ_BUFFER);
+    pthread_mutex_init(&qs->lock, NULL);
+    pthread_cond_init(&qs->cond, NULL);
+    qs->next = next;
+
+    if (!qs->slots[QUEUE_SLOTS - 1] || !qs->slots[0] ||
+        pthread_create(&qs->thread, NULL, queue_thread, qs) != 0)
+    {
+        for (i = 0; i < QUEUE_SLOTS; i++)
+            free(qs->slots[i]);
+        pthread_cond_destroy(&qs->cond);
+        pthread_mutex_destroy(&qs->lock);
+        free(qs);
+        tw_sink_close(next);
+        return NULL;
+    }
+    qs->sink.write = queue_write;
+    qs->sink.close = queue_close;
+    return &qs->sink;
+}
+
+// A delta is only as good as its base, which has to be there and unchanged
+static int check_delta_base(VerifyJob* job, const char* header)
+{
+    char filename[PATH_MAX];
+    TwDigest digest;
+    TwDeltaInfo info;
+    struct stat st;
+    int i;
+
+    if (tw_delta_read_info(header, TW_DELTA_HEADER_SIZE, &info) != 0)
+        return -1;
+
+    // Base names are relative to the device folder, the one holding this backup's folder
+    snprintf(filename, sizeof(filename), "%s", job->path);
+    for (i = 0; i < 2; i++)
+    {
+        char* slash = strrchr(filename, '/');
+        if (slash)  *slash = '\0';
+    }
+    snprintf(filename + strlen(filename), sizeof(filename) - strlen(filename), "/%s", info.base);
+
+    if (stat(filename, &st) != 0)
+    {
+        LOGE("%s: base backup %s is missing\n", job->path, info.base);
+        return -1;
+    }
+    if (tw_digest_read(filename, &digest) == 0 && memcmp(digest.digest, info.base_digest, MD5_DIGEST_SIZE) != 0)
+    {
+        LOGE("%s: base backup %s changed since the delta was made\n", job->path, info.base);
+        return -1;
+    }
+    return 0;
+}
+
+// Starts hashing a segment (the whole file if it isn't split) the way its sidecar was made
+static int start_digest(const char* path, TwDigestContext* ctx, TwDigest* expected)
+{
+    int ret = tw_digest_read(path, expected);
+
+    tw_digest_init(ctx, ret == 0 ? expected->type : TW_DIGEST_NONE);
+    return ret;
+}
+
+static void check_digest(VerifyJob* job, const char* path, TwDigestContext* ctx, const TwDigest* expected)
+{
+    unsigned char digest[TW_DIGEST_MAX_SIZE];
+
+    tw_digest_final(ctx, digest);
+    if (ctx->type == TW_DIGEST_NONE)
+        set_status(job, TW_VERIFY_NO_DIGEST);
+    else if (memcmp(digest, expected->digest, TW_DIGEST_MAX_SIZE) != 0)
+    {
+        LOGE("%s: %s doesn't match\n", path, tw_digest_name(expected->type));
+        set_status(job, TW_VERIFY_BAD_DIGEST);
+    }
+}
+
+static void verify_file(VerifyState* vs, VerifyJob* job, char* buffer)
+{
+    char header[TW_DELTA_HEADER_SIZE];
+    char indexname[PATH_MAX];
+    char segname[PATH_MAX];
+    TwSegments segs;
+    TwIndex index;
+    TwIndex* pindex = NULL;
+    TwDigestContext ctx;
+    TwDigest expected;
+    TwSink* check;
+    int i, ret = 0;
+    ssize_t len;
+
+    if (tw_segments_open(job->path, &segs) != 0)
+    {
+        set_status(job, TW_VERIFY_UNREADABLE);
+        return;
+    }
+    if (job->result->size == 0)
+    {
+        LOGE("%s is empty\n", job->path);
+        set_status(job, TW_VERIFY_DAMAGED);
+    }
+    if (segs.count > 1)     add_kind(job, "split");
+
+    // A segment gone from the end leaves its digest behind
+    tw_segment_name(job->path, segs.count, segname, sizeof(segname));
+    if (tw_digest_read(segname, &expected) != -1)
+    {
+        LOGE("%s: segment %d is missing\n", job->path, segs.count);
+        set_status(job, TW_VERIFY_UNREADABLE);
+    }
+
+    memset(header, 0, sizeof(header));
+    len = tw_segments_pread(&segs, header, sizeof(header), 0);
+    if (len < 0)    len = 0;
+
+    snprintf(indexname, sizeof(indexname), "%s%s", job->path, TW_INDEX_EXT);
+    if (access(indexname, F_OK) == 0)
+    {
+        if (tw_index_load(indexname, &index) == 0)
+        {
+            pindex = &index;
+            add_kind(job, "indexed");
+        }
+        else
+            set_status(job, TW_VERIFY_DAMAGED);
+    }
+
+    if (tw_chunk_check(header, len))
+    {
+        // The manifest itself is small, the chunks it lists come from the store
+        char* manifest = (char*) malloc(job->result->size + 1);
+        size_t have = 0;
+
+        start_digest(job->path, &ctx, &expected);
+        add_kind(job, "chunked");
+        while (manifest && have < job->result->size)
+        {
+            len = tw_segments_pread(&segs, manifest + have, job->result->size - have, have);
+            if (len <= 0)   break;
+            have += len;
+        }
+        if (!manifest || have != job->result->size)
+        {
+            set_status(job, TW_VERIFY_UNREADABLE);
+            free(manifest);
+            tw_segments_close(&segs);
+            if (pindex)     tw_index_free(pindex);
+            return;
+        }
+        tw_digest_update(&ctx, manifest, have);
+        job->done = have;
+        check_digest(job, job->path, &ctx, &expected);
+
+        check = detect_open(job, pindex, 0);
+        ret = check ? tw_chunk_restore(vs->opts->store, manifest, have, check) : 1;
+        if (check && tw_sink_close(check) != 0 && ret == 0)
+            ret = 1;
+        if (ret)    set_status(job, TW_VERIFY_DAMAGED);
+        free(manifest);
+    }
+    else
+    {
+        TwSink* detect = detect_open(job, pindex, 0);
+
+        check = detect ? queue_open(detect) : NULL;
+        // The segments of a split file are one stream to the checker, each with a digest of its own
+        for (i = 0; i < segs.count; i++)
+        {
+            tw_segment_name(job->path, i, segname, sizeof(segname));
+            start_digest(segname, &ctx, &expected);
+            for (;;)
+            {
+                len = read(segs.fds[i], buffer, READ_BUFFER);
+                if (len < 0 && errno == EINTR)  continue;
+                if (len < 0)
+                {
+                    LOGE("Unable to read %s (errno=%d)\n", segname, errno);
+                    set_status(job, TW_VERIFY_UNREADABLE);
+                    break;
+                }
+                if (len == 0)   break;
+
+                tw_digest_update(&ctx, buffer, len);
+                // A failed checker keeps failing, the digest is still worth having
+                if (check && !ret && tw_sink_write(check, buffer, len) != 0)
+                    ret = -1;
+                job->done += len;
+            }
+            check_digest(job, segname, &ctx, &expected);
+        }
+        if (!check || tw_sink_close(check) != 0)
+            ret = -1;
+        if (ret)    set_status(job, TW_VERIFY_DAMAGED);
+
+        if (tw_delta_check(header, sizeof(header)) && check_delta_base(job, header) != 0)
+            set_status(job, TW_VERIFY_DAMAGED);
+    }
+    tw_segments_close(&segs);
+    if (pindex)     tw_index_free(pindex);
+}
+
+static void* verify_thread(void* cookie)
+{
+    VerifyState* vs = (VerifyState*) cookie;
+    char* buffer = (char*) malloc(READ_BUFFER);
+
+    for (;;)
+    {
+        VerifyJob* job;
+
+        pthread_mutex_lock(&vs->lock);
+        job = vs->next < vs->count ? vs->order[vs->next++] : NULL;
+        pthread_mutex_unlock(&vs->lock);
+        if (!job)       break;
+
+        if (buffer)     verify_file(vs, job, buffer);
+        else            set_status(job, TW_VERIFY_UNREADABLE);
+
+        pthread_mutex_lock(&vs->lock);
+        vs->finished++;
+        pthread_cond_broadcast(&vs->cond);
+        pthread_mutex_unlock(&vs->lock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int compare_size(const void* a, const void* b)
+{
+    const VerifyJob* ja = *(const VerifyJob* const*) a;
+    const VerifyJob* jb = *(const VerifyJob* const*) b;
+
+    if (ja->result->size == jb->result->size)   return 0;
+    return ja->result->size < jb->result->size ? 1 : -1;
+}
+
+static int compare_name(const void* a, const void* b)
+{
+    return strcmp(((const TwVerifyResult*) a)->name, ((const TwVerifyResult*) b)->name);
+}
+
+static int is_suffix(const char* name, const char* suffix)
+{
+    size_t len = strlen(name), slen = strlen(suffix);
+    return len > slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+// Length of the name of the .win that name is the sidecar of, 0 if it isn't one
+static size_t sidecar_of(const char* name)
+{
+    int type;
+
+    for (type = TW_DIGEST_MD5; type < TW_DIGEST_TYPES; type++)
+    {
+        char suffix[32];
+
+        snprintf(suffix, sizeof(suffix), ".win.%s", tw_digest_name((TwDigestType) type));
+        if (is_suffix(name, suffix))
+            return strlen(name) - strlen(suffix) + 4;
+    }
+    return 0;
+}
+
+static int is_listed(const char* const* only, const char* name)
+{
+    if (!only)          return 1;
+    for (; *only; only++)
+    {
+        if (strcmp(*only, name) == 0)   return 1;
+    }
+    return 0;
+}
+
+// Lists the .win files of dir, plus those only their digest is left of
+static int list_folder(const char* dir, const char* const* only, TwVerifyResult** results)
+{
+    TwVerifyResult* list = NULL;
+    struct dirent* de;
+    int count = 0, alloc = 0, i;
+    DIR* d;
+
+    d = opendir(dir);
+    if (!d)
+    {
+        LOGE("Unable to open %s (errno=%d)\n", dir, errno);
+        return -1;
+    }
+    while ((de = readdir(d)) != NULL)
+    {
+        char name[256];
+        int missing = 0;
+
+        if (is_suffix(de->d_name, ".win"))
+            snprintf(name, sizeof(name), "%s", de->d_name);
+        else if (sidecar_of(de->d_name))
+        {
+            char path[PATH_MAX];
+
+            snprintf(name, sizeof(name), "%.*s", (int) sidecar_of(de->d_name), de->d_name);
+            snprintf(path, sizeof(path), "%s/%s", dir, name);
+            if (access(path, F_OK) == 0)    continue;
+            // Listed already for another of its sidecars
+            for (i = 0; i < count && strcmp(list[i].name, name) != 0; i++);
+            if (i < count)  continue;
+            missing = 1;
+        }
+        else
+            continue;
+        if (!is_listed(only, name))     continue;
+
+        if (count == alloc)
+        {
+            TwVerifyResult* grown;
+
+            alloc = alloc ? alloc * 2 : 16;
+            grown = (TwVerifyResult*) realloc(list, alloc * sizeof(TwVerifyResult));
+            if (!grown)
+            {
+                free(list);
+                closedir(d);
+                return -1;
+            }
+            list = grown;
+        }
+        memset(&list[count], 0, sizeof(list[count]));
+        snprintf(list[count].name, sizeof(list[count].name), "%s", name);
+        if (missing)
+        {
+            LOGE("%s/%s is missing\n", dir, name);
+            list[count].status = TW_VERIFY_UNREADABLE;
+        }
+        count++;
+    }
+    closedir(d);
+
+    for (i = 0; i < count; i++)
+    {
+        char path[PATH_MAX];
+
+        snprintf(path, sizeof(path), "%s/%s", dir, list[i].name);
+        if (list[i].status == TW_VERIFY_OK)
+            list[i].size = tw_segments_total(path);
+    }
+    *results = list;
+    return count;
+}
+
+int tw_verify_folder(const TwVerifyOptions* opts, TwVerifyResult** results)
+{
+    pthread_t threads[MAX_VERIFY_THREADS];
+    VerifyState vs;
+    unsigned long long total = 0;
+    int i, count, started = 0, threads_wanted;
+
+    *results = NULL;
+    memset(&vs, 0, sizeof(vs));
+    vs.opts = opts;
+    count = list_folder(opts->dir, opts->only, results);
+    if (count < 0)      return -1;
+
+    vs.jobs = (VerifyJob*) calloc(count + 1, sizeof(VerifyJob));
+    vs.order = (VerifyJob**) calloc(count + 1, sizeof(VerifyJob*));
+    if (!vs.jobs || !vs.order)
+    {
+        free(vs.jobs);
+        free(vs.order);
+        free(*results);
+        *results = NULL;
+        return -1;
+    }
+
+    // Files that are already known bad aren't handed out
+    for (i = 0; i < count; i++)
+    {
+        VerifyJob* job = &vs.jobs[i];
+
+        job->result = &(*results)[i];
+        snprintf(job->path, sizeof(job->path), "%s/%s", opts->dir, job->result->name);
+        total += job->result->size;
+        if (job->result->status == TW_VERIFY_OK)    vs.order[vs.count++] = job;
+    }
+    qsort(vs.order, vs.count, sizeof(VerifyJob*), compare_size);
+
+    pthread_mutex_init(&vs.lock, NULL);
+    pthread_cond_init(&vs.cond, NULL);
+
+    threads_wanted = opts->threads > 0 ? opts->threads : tw_get_cpu_count();
+    if (threads_wanted > MAX_VERIFY_THREADS)    threads_wanted = MAX_VERIFY_THREADS;
+    if (threads_wanted > vs.count)              threads_wanted = vs.count;
+    for (i = 0; i < threads_wanted; i++)
+    {
+        if (pthread_create(&threads[i], NULL, verify_thread, &vs) != 0)
+            break;
+        started++;
+    }
+    // Without any thread the calling one does the work
+    if (started == 0)   verify_thread(&vs);
+
+    pthread_mutex_lock(&vs.lock);
+    while (vs.finished < vs.count)
+    {
+        struct timespec ts;
+        struct timeval now;
+        unsigned long long done = 0;
+
+        // Only the counters are read here, the results belong to the workers until they're done
+        for (i = 0; i < vs.count; i++)
+            done += vs.order[i]->done;
+        pthread_mutex_unlock(&vs.lock);
+        if (opts->progress)     opts->progress(done, total, opts->cookie);
+        pthread_mutex_lock(&vs.lock);
+
+        gettimeofday(&now, NULL);
+        now.tv_usec += PROGRESS_MSEC * 1000;
+        ts.tv_sec = now.tv_sec + now.tv_usec / 1000000;
+        ts.tv_nsec = (now.tv_usec % 1000000) * 1000;
+        if (vs.finished < vs.count)
+            pthread_cond_timedwait(&vs.cond, &vs.lock, &ts);
+    }
+    pthread_mutex_unlock(&vs.lock);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (opts->progress)     opts->progress(total, total, opts->cookie);
+
+    pthread_cond_destroy(&vs.cond);
+    pthread_mutex_destroy(&vs.lock);
+    free(vs.jobs);
+    free(vs.order);
+
+    qsort(*results, count, sizeof(TwVerifyResult), compare_name);
+    return count;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2011 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TW_VERIFY_HEADER
+#define _TW_VERIFY_HEADER
+
+// From best to worst, a file gets the worst status that applies
+typedef enum {
+    TW_VERIFY_OK = 0,
+    TW_VERIFY_NO_DIGEST,            // framing is fine, but there's no .md5 to check against
+    TW_VERIFY_DAMAGED,              // the data doesn't parse as what it claims to be
+    TW_VERIFY_BAD_DIGEST,
+    TW_VERIFY_UNREADABLE,           // missing, or can't be read to the end
+} TwVerifyStatus;
+
+typedef struct {
+    char name[256];                 // eg. "data.ext4.win"
+    char kind[32];                  // what was found, eg. "lz4 tar" or "sparse"
+    unsigned long long size;
+    unsigned long long members;     // tar members seen
+    TwVerifyStatus status;
+} TwVerifyResult;
+
+// Called on the calling thread now and then with the bytes read so far
+typedef void (*TwVerifyProgressFn)(unsigned long long done, unsigned long long total, void* cookie);
+
+typedef struct {
+    const char* dir;                // Backup folder, eg. "/sdcard/TWRP/BACKUPS/<id>/<name>"
+    const char* store;              // Chunk store for incremental backups
+    int threads;                    // Files checked at once, 0 for one per CPU
+    const char* const* only;        // Names of the files to check, NULL terminated, NULL for all of them
+    TwVerifyProgressFn progress;
+    void* cookie;
+} TwVerifyOptions;
+
+// Checks every .win in opts->dir concurrently: the MD5 against the .md5
+// next to it and the framing of the data (tar headers and the index, the
+// compressed blocks, sparse and delta records, the chunks of a manifest).
+// Results are sorted by name in a malloc'ed array the caller frees.
+// Returns the number of results, or -1 if the folder can't be read.
+int tw_verify_folder(const TwVerifyOptions* opts, TwVerifyResult** results);
+
+const char* tw_verify_status_name(TwVerifyStatus status);
+
+#endif  // _TW_VERIFY_HEADER
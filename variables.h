@@ -20,6 +20,11 @@
 #define TW_VERSION_STR              "2.0.1"
 
 #define TW_USE_COMPRESSION_VAR      "tw_use_compression"
+#define TW_COMPRESSION_CODEC_VAR    "tw_compression_codec"
+#define TW_COMPRESSION_POLICY_VAR   "tw_compression_policy"
+#define TW_USE_SPARSE_IMAGES_VAR    "tw_use_sparse_images"
+#define TW_USE_INCREMENTAL_VAR      "tw_use_incremental"
+#define TW_USE_DIFFERENTIAL_VAR     "tw_use_differential"
 
 #define TW_BACKUP_SYSTEM_VAR        "tw_backup_system"
 #define TW_BACKUP_DATA_VAR          "tw_backup_data"
@@ -34,6 +39,11 @@
 #define TW_BACKUP_AVG_IMG_RATE      "tw_backup_avg_img_rate"
 #define TW_BACKUP_AVG_FILE_RATE     "tw_backup_avg_file_rate"
 #define TW_BACKUP_AVG_FILE_COMP_RATE    "tw_backup_avg_file_comp_rate"
+#define TW_BACKUP_JOBS_VAR          "tw_backup_jobs"
+#define TW_BACKUP_RATES_VAR         "tw_backup_rates"
+#define TW_BACKUP_SEGMENT_SIZE_VAR  "tw_backup_segment_size"
+#define TW_BACKUP_RESUME_VAR        "tw_backup_resume"
+#define TW_BACKUP_DIGEST_VAR        "tw_backup_digest"
 
 #define TW_RESTORE_SYSTEM_VAR       "tw_restore_system"
 #define TW_RESTORE_DATA_VAR         "tw_restore_data"
@@ -48,6 +58,13 @@
 #define TW_RESTORE_AVG_IMG_RATE     "tw_restore_avg_img_rate"
 #define TW_RESTORE_AVG_FILE_RATE    "tw_restore_avg_file_rate"
 #define TW_RESTORE_AVG_FILE_COMP_RATE    "tw_restore_avg_file_comp_rate"
+#define TW_RESTORE_RATES_VAR        "tw_restore_rates"
+#define TW_RESTORE_PATHS_VAR        "tw_restore_paths"
+#define TW_RESTORE_CHANGED_ONLY_VAR "tw_restore_changed_only"
+#define TW_OPERATION_ETA_VAR        "tw_operation_eta"
+#define TW_OPERATION_PAUSED_VAR     "tw_operation_paused"
+#define TW_IO_PRIORITY_VAR          "tw_io_priority"
+#define TW_IO_LIMIT_VAR             "tw_io_limit"
 
 #define TW_SHOW_SPAM_VAR            "tw_show_spam"
 #define TW_COLOR_THEME_VAR          "tw_color_theme"